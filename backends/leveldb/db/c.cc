@@ -5,14 +5,18 @@
 #include "leveldb/c.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "leveldb/cache.h"
 #include "leveldb/comparator.h"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
+#include "leveldb/env_latency.h"
 #include "leveldb/filter_policy.h"
 #include "leveldb/iterator.h"
+#include "leveldb/merge_operator.h"
 #include "leveldb/options.h"
+#include "leveldb/persistent_cache.h"
 #include "leveldb/status.h"
 #include "leveldb/write_batch.h"
 #include "leveldb/table_builder.h"
@@ -20,6 +24,7 @@
 #include "db/dbformat.h"
 #include "db/column_db.h"
 
+using leveldb::BytewiseComparator;
 using leveldb::Cache;
 using leveldb::Comparator;
 using leveldb::CompressionType;
@@ -28,11 +33,20 @@ using leveldb::DB;
 using leveldb::Env;
 using leveldb::FileLock;
 using leveldb::FilterPolicy;
+using leveldb::FixedWidthComparator;
+using leveldb::InternalFilterPolicy;
+using leveldb::InternalKeyComparator;
 using leveldb::Iterator;
+using leveldb::LatencyOptions;
 using leveldb::Logger;
+using leveldb::MergeOperator;
 using leveldb::NewBloomFilterPolicy;
 using leveldb::NewLRUCache;
+using leveldb::NewLatencyEnv;
+using leveldb::NewLocalPersistentCache;
 using leveldb::Options;
+using leveldb::ParseLatencyOptions;
+using leveldb::PersistentCache;
 using leveldb::RandomAccessFile;
 using leveldb::Range;
 using leveldb::ReadOptions;
@@ -56,13 +70,18 @@ struct leveldb_readoptions_t  { ReadOptions       rep; };
 struct leveldb_writeoptions_t { WriteOptions      rep; };
 struct leveldb_options_t      { Options           rep; };
 struct leveldb_cache_t        { Cache*            rep; };
+struct leveldb_pcache_t       { PersistentCache*  rep; };
 struct leveldb_seqfile_t      { SequentialFile*   rep; };
 struct leveldb_randomfile_t   { RandomAccessFile* rep; };
 struct leveldb_writablefile_t { WritableFile*     rep; };
 struct leveldb_logger_t       { Logger*           rep; };
 struct leveldb_filelock_t     { FileLock*         rep; };
 struct leveldb_tablebuilder_t { WritableFile*     file;
-                                TableBuilder*     rep; };
+                                TableBuilder*     rep;
+                                bool              finished;
+                                bool              closed;
+                                InternalKeyComparator* icmp;
+                                InternalFilterPolicy* ipolicy; };
 struct leveldb_table_t        { RandomAccessFile* file;
                                 Table*            rep; };
 
@@ -136,6 +155,53 @@ struct leveldb_filterpolicy_t : public FilterPolicy {
   }
 };
 
+struct leveldb_mergeoperator_t : public MergeOperator {
+  void* state_;
+  void (*destructor_)(void*);
+  const char* (*name_)(void*);
+  char* (*full_merge_)(
+      void*,
+      const char* key, size_t key_length,
+      const char* existing_value, size_t existing_value_length,
+      const char* const* operands_list, const size_t* operands_list_length,
+      int num_operands,
+      unsigned char* success, size_t* new_value_length);
+
+  virtual ~leveldb_mergeoperator_t() {
+    (*destructor_)(state_);
+  }
+
+  virtual const char* Name() const {
+    return (*name_)(state_);
+  }
+
+  virtual bool FullMerge(const Slice& key, const Slice* existing_value,
+                         const std::vector<Slice>& operands,
+                         std::string* new_value) const {
+    const int n = operands.size();
+    std::vector<const char*> operand_pointers(n);
+    std::vector<size_t> operand_sizes(n);
+    for (int i = 0; i < n; i++) {
+      operand_pointers[i] = operands[i].data();
+      operand_sizes[i] = operands[i].size();
+    }
+    unsigned char success = 0;
+    size_t len = 0;
+    char* result = (*full_merge_)(
+        state_, key.data(), key.size(),
+        existing_value != NULL ? existing_value->data() : NULL,
+        existing_value != NULL ? existing_value->size() : 0,
+        n > 0 ? &operand_pointers[0] : NULL,
+        n > 0 ? &operand_sizes[0] : NULL, n,
+        &success, &len);
+    if (success) {
+      new_value->assign(result, len);
+    }
+    free(result);
+    return success;
+  }
+};
+
 struct leveldb_env_t {
   Env* rep;
   bool is_default;
@@ -205,6 +271,17 @@ void leveldb_delete(
   SaveError(errptr, db->rep->Delete(options->rep, Slice(key, keylen)));
 }
 
+void leveldb_merge(
+    leveldb_t* db,
+    const leveldb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    const char* val, size_t vallen,
+    char** errptr) {
+  SaveError(errptr,
+            db->rep->Merge(options->rep, Slice(key, keylen),
+                           Slice(val, vallen)));
+}
+
 
 void leveldb_write(
     leveldb_t* db,
@@ -251,6 +328,30 @@ int leveldb_exists(
   }
 }
 
+int leveldb_put_if_absent(
+    leveldb_t* db,
+    const leveldb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    const char* val, size_t vallen,
+    char** errptr) {
+  bool inserted;
+  SaveError(errptr, db->rep->PutIfAbsent(options->rep, Slice(key, keylen),
+                                         Slice(val, vallen), &inserted));
+  return inserted ? 1 : 0;
+}
+
+int leveldb_write_if_absent(
+    leveldb_t* db,
+    const leveldb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    leveldb_writebatch_t* batch,
+    char** errptr) {
+  bool applied;
+  SaveError(errptr, db->rep->WriteIfAbsent(options->rep, Slice(key, keylen),
+                                           &batch->rep, &applied));
+  return applied ? 1 : 0;
+}
+
 leveldb_iterator_t* leveldb_create_iterator(
     leveldb_t* db,
     const leveldb_readoptions_t* options) {
@@ -430,6 +531,13 @@ void leveldb_writebatch_delete(
   b->rep.Delete(Slice(key, klen));
 }
 
+void leveldb_writebatch_merge(
+    leveldb_writebatch_t* b,
+    const char* key, size_t klen,
+    const char* val, size_t vlen) {
+  b->rep.Merge(Slice(key, klen), Slice(val, vlen));
+}
+
 void leveldb_writebatch_iterate(
     leveldb_writebatch_t* b,
     void* state,
@@ -481,6 +589,12 @@ void leveldb_options_set_filter_policy(
   opt->rep.filter_policy = policy;
 }
 
+void leveldb_options_set_merge_operator(
+    leveldb_options_t* opt,
+    leveldb_mergeoperator_t* merge_operator) {
+  opt->rep.merge_operator = merge_operator;
+}
+
 void leveldb_options_set_create_if_missing(
     leveldb_options_t* opt, unsigned char v) {
   opt->rep.create_if_missing = v;
@@ -516,6 +630,11 @@ void leveldb_options_set_cache(leveldb_options_t* opt, leveldb_cache_t* c) {
   opt->rep.block_cache = c->rep;
 }
 
+void leveldb_options_set_persistent_cache(leveldb_options_t* opt,
+                                          leveldb_pcache_t* c) {
+  opt->rep.persistent_cache = c->rep;
+}
+
 void leveldb_options_set_block_size(leveldb_options_t* opt, size_t s) {
   opt->rep.block_size = s;
 }
@@ -524,6 +643,14 @@ void leveldb_options_set_block_restart_interval(leveldb_options_t* opt, int n) {
   opt->rep.block_restart_interval = n;
 }
 
+void leveldb_options_set_recovery_threads(leveldb_options_t* opt, int n) {
+  opt->rep.recovery_threads = n;
+}
+
+void leveldb_options_set_recycle_log_file_num(leveldb_options_t* opt, int n) {
+  opt->rep.recycle_log_file_num = n;
+}
+
 void leveldb_options_set_compression(leveldb_options_t* opt, int t) {
   opt->rep.compression = static_cast<CompressionType>(t);
 }
@@ -544,6 +671,42 @@ leveldb_comparator_t* leveldb_comparator_create(
   return result;
 }
 
+leveldb_comparator_t* leveldb_comparator_create_builtin(
+    const char* builtin_name, const char* name) {
+  // Make a leveldb_comparator_t, but override all of its methods so
+  // they delegate to a builtin comparator instead of user supplied C
+  // functions.
+  struct Wrapper : public leveldb_comparator_t {
+    const Comparator* rep_;
+    std::string name_;
+    const char* Name() const { return name_.c_str(); }
+    int Compare(const Slice& a, const Slice& b) const {
+      return rep_->Compare(a, b);
+    }
+    void FindShortestSeparator(std::string* start, const Slice& limit) const {
+      rep_->FindShortestSeparator(start, limit);
+    }
+    void FindShortSuccessor(std::string* key) const {
+      rep_->FindShortSuccessor(key);
+    }
+    static void DoNothing(void*) { }
+  };
+  const Comparator* rep;
+  if (strcmp(builtin_name, BytewiseComparator()->Name()) == 0) {
+    rep = BytewiseComparator();
+  } else if (strcmp(builtin_name, FixedWidthComparator()->Name()) == 0) {
+    rep = FixedWidthComparator();
+  } else {
+    return NULL;
+  }
+  Wrapper* wrapper = new Wrapper;
+  wrapper->rep_ = rep;
+  wrapper->name_ = (name != NULL) ? name : rep->Name();
+  wrapper->state_ = NULL;
+  wrapper->destructor_ = &Wrapper::DoNothing;
+  return wrapper;
+}
+
 void leveldb_comparator_destroy(leveldb_comparator_t* cmp) {
   delete cmp;
 }
@@ -574,6 +737,29 @@ void leveldb_filterpolicy_destroy(leveldb_filterpolicy_t* filter) {
   delete filter;
 }
 
+leveldb_mergeoperator_t* leveldb_mergeoperator_create(
+    void* state,
+    void (*destructor)(void*),
+    char* (*full_merge)(
+        void*,
+        const char* key, size_t key_length,
+        const char* existing_value, size_t existing_value_length,
+        const char* const* operands_list, const size_t* operands_list_length,
+        int num_operands,
+        unsigned char* success, size_t* new_value_length),
+    const char* (*name)(void*)) {
+  leveldb_mergeoperator_t* result = new leveldb_mergeoperator_t;
+  result->state_ = state;
+  result->destructor_ = destructor;
+  result->full_merge_ = full_merge;
+  result->name_ = name;
+  return result;
+}
+
+void leveldb_mergeoperator_destroy(leveldb_mergeoperator_t* merge_operator) {
+  delete merge_operator;
+}
+
 leveldb_filterpolicy_t* leveldb_filterpolicy_create_bloom(int bits_per_key) {
   // Make a leveldb_filterpolicy_t, but override all of its methods so
   // they delegate to a NewBloomFilterPolicy() instead of user
@@ -647,6 +833,23 @@ void leveldb_cache_destroy(leveldb_cache_t* cache) {
   delete cache;
 }
 
+leveldb_pcache_t* leveldb_pcache_create_local(
+    const char* dirname, uint64_t capacity, char** errptr) {
+  PersistentCache* cache;
+  if (SaveError(errptr, NewLocalPersistentCache(Env::Default(), dirname,
+                                                capacity, &cache))) {
+    return NULL;
+  }
+  leveldb_pcache_t* c = new leveldb_pcache_t;
+  c->rep = cache;
+  return c;
+}
+
+void leveldb_pcache_destroy(leveldb_pcache_t* cache) {
+  delete cache->rep;
+  delete cache;
+}
+
 leveldb_env_t* leveldb_create_default_env() {
   leveldb_env_t* result = new leveldb_env_t;
   result->rep = Env::Default();
@@ -661,6 +864,17 @@ leveldb_env_t* leveldb_create_hdfs_env(const char* serverIP,
   result->is_default = false;
   return result;
 }
+leveldb_env_t* leveldb_create_latency_env(const char* spec,
+                                          char** errptr) {
+  LatencyOptions latency;
+  if (SaveError(errptr, ParseLatencyOptions(spec, &latency))) {
+    return NULL;
+  }
+  leveldb_env_t* result = new leveldb_env_t;
+  result->rep = NewLatencyEnv(Env::Default(), latency);
+  result->is_default = false;
+  return result;
+}
 void leveldb_env_destroy(leveldb_env_t* env) {
   if (!env->is_default) delete env->rep;
   delete env;
@@ -672,10 +886,23 @@ leveldb_tablebuilder_t* leveldb_tablebuilder_create(
     leveldb_env_t* env,
     char** errptr) {
   leveldb_tablebuilder_t* result = new leveldb_tablebuilder_t;
+  result->finished = false;
+  result->closed = false;
   Status s = env->rep->NewWritableFile(std::string(name),
                                        &result->file);
   if (s.ok()) {
-    result->rep = new TableBuilder(options->rep, result->file, false);
+    // The table is bulk inserted into a DB, so its internal keys have to
+    // be ordered and shortened for the index, and filtered by their user
+    // keys, like those of the DB's own tables.
+    result->icmp = new InternalKeyComparator(options->rep.comparator);
+    result->ipolicy = NULL;
+    Options table_options = options->rep;
+    table_options.comparator = result->icmp;
+    if (options->rep.filter_policy != NULL) {
+      result->ipolicy = new InternalFilterPolicy(options->rep.filter_policy);
+      table_options.filter_policy = result->ipolicy;
+    }
+    result->rep = new TableBuilder(table_options, result->file, false);
   } else {
     SaveError(errptr, s);
     delete result;
@@ -684,18 +911,54 @@ leveldb_tablebuilder_t* leveldb_tablebuilder_create(
   return result;
 }
 
-void leveldb_tablebuilder_destroy(leveldb_tablebuilder_t* builder) {
-  if (builder->rep->NumEntries() >  0) {
-    builder->rep->Finish();
-    builder->file->Sync();
-    builder->file->Close();
+void leveldb_tablebuilder_finish(leveldb_tablebuilder_t* builder,
+                                 char** errptr) {
+  if (!builder->finished && builder->rep->NumEntries() > 0) {
+    builder->finished = true;
+    SaveError(errptr, builder->rep->Finish());
+  }
+}
+
+void leveldb_tablebuilder_close(leveldb_tablebuilder_t* builder,
+                                char** errptr) {
+  if (builder->closed) {
+    return;
+  }
+  builder->closed = true;
+  Status s;
+  if (!builder->finished && builder->rep->NumEntries() > 0) {
+    builder->finished = true;
+    s = builder->rep->Finish();
+  }
+  if (builder->finished) {
+    if (s.ok()) {
+      s = builder->file->Sync();
+    }
+    Status close_status = builder->file->Close();
+    if (s.ok()) {
+      s = close_status;
+    }
   } else {
     builder->rep->Abandon();
   }
+  SaveError(errptr, s);
+}
+
+void leveldb_tablebuilder_destroy(leveldb_tablebuilder_t* builder) {
+  if (!builder->closed) {
+    char* err = NULL;
+    leveldb_tablebuilder_close(builder, &err);
+    free(err);
+  }
   delete builder->rep;
   builder->rep = NULL;
   delete builder->file;
   builder->file = NULL;
+  delete builder->icmp;
+  builder->icmp = NULL;
+  delete builder->ipolicy;
+  builder->ipolicy = NULL;
+  delete builder;
 }
 
 void leveldb_tablebuilder_put(
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -147,6 +148,37 @@ unsigned char FilterKeyMatch(
   return fake_filter_result;
 }
 
+// Merge operator that concatenates the operands onto the value
+static void MergeDestroy(void* arg) { }
+static const char* MergeName(void* arg) {
+  return "TestMerge";
+}
+static char* MergeFull(
+    void* arg,
+    const char* key, size_t key_length,
+    const char* existing_value, size_t existing_value_length,
+    const char* const* operands_list, const size_t* operands_list_length,
+    int num_operands,
+    unsigned char* success, size_t* new_value_length) {
+  size_t len = existing_value_length;
+  int i;
+  for (i = 0; i < num_operands; i++) {
+    len += operands_list_length[i];
+  }
+  char* result = malloc(len > 0 ? len : 1);
+  if (existing_value != NULL) {
+    memcpy(result, existing_value, existing_value_length);
+  }
+  len = existing_value_length;
+  for (i = 0; i < num_operands; i++) {
+    memcpy(result + len, operands_list[i], operands_list_length[i]);
+    len += operands_list_length[i];
+  }
+  *new_value_length = len;
+  *success = 1;
+  return result;
+}
+
 int main(int argc, char** argv) {
   leveldb_t* db;
   leveldb_comparator_t* cmp;
@@ -233,6 +265,44 @@ int main(int argc, char** argv) {
     leveldb_writebatch_destroy(wb);
   }
 
+  StartPhase("put_if_absent");
+  {
+    // "foo" is in a table, "bar" has a deletion in the memtable
+    CheckCondition(!leveldb_put_if_absent(db, woptions, "foo", 3, "x", 1,
+                                          &err));
+    CheckNoError(err);
+    CheckGet(db, roptions, "foo", "hello");
+    CheckCondition(leveldb_put_if_absent(db, woptions, "bar", 3, "y", 1,
+                                         &err));
+    CheckNoError(err);
+    CheckGet(db, roptions, "bar", "y");
+    CheckCondition(!leveldb_put_if_absent(db, woptions, "bar", 3, "z", 1,
+                                          &err));
+    CheckNoError(err);
+    CheckGet(db, roptions, "bar", "y");
+    leveldb_delete(db, woptions, "bar", 3, &err);
+    CheckNoError(err);
+
+    leveldb_writebatch_t* wb = leveldb_writebatch_create();
+    leveldb_writebatch_put(wb, "bar", 3, "b", 1);
+    leveldb_writebatch_put(wb, "qux", 3, "q", 1);
+    CheckCondition(!leveldb_write_if_absent(db, woptions, "foo", 3, wb,
+                                            &err));
+    CheckNoError(err);
+    CheckGet(db, roptions, "bar", NULL);
+    CheckGet(db, roptions, "qux", NULL);
+    CheckCondition(leveldb_write_if_absent(db, woptions, "bar", 3, wb,
+                                           &err));
+    CheckNoError(err);
+    CheckGet(db, roptions, "bar", "b");
+    CheckGet(db, roptions, "qux", "q");
+    leveldb_writebatch_destroy(wb);
+    leveldb_delete(db, woptions, "bar", 3, &err);
+    CheckNoError(err);
+    leveldb_delete(db, woptions, "qux", 3, &err);
+    CheckNoError(err);
+  }
+
   StartPhase("iter");
   {
     leveldb_iterator_t* iter = leveldb_create_iterator(db, roptions);
@@ -358,6 +428,125 @@ int main(int argc, char** argv) {
     leveldb_filterpolicy_destroy(policy);
   }
 
+  StartPhase("builtin_comparator");
+  {
+    // Same order as CmpCompare, so it can take over the database
+    leveldb_comparator_t* builtin;
+    CheckCondition(leveldb_comparator_create_builtin("nosuch", NULL) == NULL);
+    builtin = leveldb_comparator_create_builtin(
+        "leveldb.FixedWidthComparator", NULL);
+    leveldb_close(db);
+    leveldb_options_set_create_if_missing(options, 0);
+    leveldb_options_set_error_if_exists(options, 0);
+    leveldb_options_set_comparator(options, builtin);
+    db = leveldb_open(options, dbname, &err);
+    CheckCondition(err != NULL);  // Name mismatch
+    Free(&err);
+    leveldb_comparator_destroy(builtin);
+
+    builtin = leveldb_comparator_create_builtin(
+        "leveldb.FixedWidthComparator", "foo");
+    leveldb_options_set_comparator(options, builtin);
+    db = leveldb_open(options, dbname, &err);
+    CheckNoError(err);
+    leveldb_put(db, woptions, "foo2", 4, "foo2value", 9, &err);
+    CheckNoError(err);
+    leveldb_compact_range(db, NULL, 0, NULL, 0);
+    CheckGet(db, roptions, "foo", "foovalue");
+    CheckGet(db, roptions, "foo2", "foo2value");
+    leveldb_iterator_t* iter = leveldb_create_iterator(db, roptions);
+    leveldb_iter_seek_to_first(iter);
+    CheckIter(iter, "bar", "barvalue");
+    leveldb_iter_next(iter);
+    CheckIter(iter, "foo", "foovalue");
+    leveldb_iter_next(iter);
+    CheckIter(iter, "foo2", "foo2value");
+    leveldb_iter_next(iter);
+    CheckCondition(!leveldb_iter_valid(iter));
+    leveldb_iter_destroy(iter);
+    leveldb_close(db);
+    leveldb_options_set_comparator(options, cmp);
+    leveldb_comparator_destroy(builtin);
+    db = leveldb_open(options, dbname, &err);
+    CheckNoError(err);
+  }
+
+  StartPhase("merge");
+  {
+    leveldb_mergeoperator_t* merge_op = leveldb_mergeoperator_create(
+        NULL, MergeDestroy, MergeFull, MergeName);
+    leveldb_close(db);
+    leveldb_options_set_merge_operator(options, merge_op);
+    db = leveldb_open(options, dbname, &err);
+    CheckNoError(err);
+    leveldb_merge(db, woptions, "foo", 3, "+1", 2, &err);
+    CheckNoError(err);
+    leveldb_merge(db, woptions, "new", 3, "a", 1, &err);
+    CheckNoError(err);
+    leveldb_writebatch_t* wb = leveldb_writebatch_create();
+    leveldb_writebatch_merge(wb, "foo", 3, "+2", 2);
+    leveldb_writebatch_merge(wb, "new", 3, "b", 1);
+    leveldb_write(db, woptions, wb, &err);
+    CheckNoError(err);
+    leveldb_writebatch_destroy(wb);
+    CheckGet(db, roptions, "foo", "foovalue+1+2");
+    CheckGet(db, roptions, "new", "ab");
+    leveldb_compact_range(db, NULL, 0, NULL, 0);
+    CheckGet(db, roptions, "foo", "foovalue+1+2");
+    CheckGet(db, roptions, "new", "ab");
+    leveldb_close(db);
+    leveldb_options_set_merge_operator(options, NULL);
+    leveldb_mergeoperator_destroy(merge_op);
+    db = leveldb_open(options, dbname, &err);
+    CheckNoError(err);
+  }
+
+  StartPhase("tablebuilder");
+  {
+    // Bulk inserted tables must be filtered like the DB's own tables
+    leveldb_filterpolicy_t* policy = leveldb_filterpolicy_create_bloom(10);
+    leveldb_close(db);
+    leveldb_options_set_filter_policy(options, policy);
+    db = leveldb_open(options, dbname, &err);
+    CheckNoError(err);
+
+    char dirname[200];
+    char fname[200];
+    snprintf(dirname, sizeof(dirname), "%s-table", dbname);
+    snprintf(fname, sizeof(fname), "%s/000001.sst", dirname);
+    mkdir(dirname, 0755);
+    leveldb_tablebuilder_t* builder =
+        leveldb_tablebuilder_create(options, fname, env, &err);
+    CheckNoError(err);
+    // Internal key: user key followed by sequence number and type
+    leveldb_tablebuilder_put(builder, "tbl\x01\x01\0\0\0\0\0\0", 11,
+                             "v", 1);
+    leveldb_tablebuilder_finish(builder, &err);
+    CheckNoError(err);
+    leveldb_tablebuilder_close(builder, &err);
+    CheckNoError(err);
+    leveldb_tablebuilder_close(builder, &err);
+    CheckNoError(err);
+    leveldb_tablebuilder_destroy(builder);
+    FILE* f = fopen(fname, "rb");
+    CheckCondition(f != NULL);
+    fseek(f, 0, SEEK_END);
+    CheckCondition(ftell(f) > 0);
+    fclose(f);
+
+    leveldb_bulkinsert(db, woptions, dirname, 1, 1, &err);
+    CheckNoError(err);
+    CheckGet(db, roptions, "tbl", "v");
+    CheckGet(db, roptions, "foo", "foovalue+1+2");
+    rmdir(dirname);
+
+    leveldb_close(db);
+    leveldb_options_set_filter_policy(options, NULL);
+    leveldb_filterpolicy_destroy(policy);
+    db = leveldb_open(options, dbname, &err);
+    CheckNoError(err);
+  }
+
   StartPhase("cleanup");
   leveldb_close(db);
   leveldb_options_destroy(options);
@@ -6,35 +6,91 @@
  ************************************************************************/
 
 #include "db/cdb_iter.h"
+
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include "db/dbformat.h"
 
 namespace leveldb {
 
+namespace {
+
+// Nearby records are read together if the gap between them is at most
+// kMaxPrefetchGap, up to kMaxPrefetchRead bytes per read.
+static const uint64_t kMaxPrefetchGap = 4096;
+static const uint64_t kMaxPrefetchRead = 1 << 20;
+
+// A value to prefetch, and where it goes in the window
+struct Fetch {
+  uint64_t file_number;
+  uint64_t offset;
+  uint64_t size;
+  int format;
+  size_t entry;
+
+  bool operator<(const Fetch& other) const {
+    if (file_number != other.file_number) {
+      return file_number < other.file_number;
+    }
+    return offset < other.offset;
+  }
+};
+
+// Fetches [first, last) are covered by a read of "size" bytes at the
+// offset of fetch "first"
+struct Read {
+  size_t first;
+  size_t last;
+  uint64_t size;
+};
+
+}  // namespace
+
 class ColumnDBIter: public Iterator {
  public:
   ColumnDBIter(const ReadOptions& options, ColumnDB* db, Iterator* iter)
       : options_(options),
         db_(db),
         iter_(iter),
-        is_result_loaded_(false) {
+        is_result_loaded_(false),
+        prefetching_(false),
+        pos_(0) {
       buf_ = new char[config::kBufSize];
       current_buf_size_ = config::kBufSize;
+      db_->AddIterator();
   }
   virtual ~ColumnDBIter() {
     delete iter_;
     delete [] buf_;
+    db_->RemoveIterator();
+  }
+  virtual bool Valid() const {
+    if (prefetching_) {
+      return pos_ < window_.size();
+    }
+    return iter_->Valid();
   }
-  virtual bool Valid() const { return iter_->Valid(); }
   virtual Slice internalkey() const {
+    if (prefetching_) {
+      return window_[pos_].internal_key;
+    }
     return iter_->internalkey();
   }
   virtual Slice key() const {
-    assert(iter_->Valid());
+    assert(Valid());
+    if (prefetching_) {
+      return window_[pos_].key;
+    }
     return iter_->key();
   }
 
   virtual Slice value() {
-    assert(iter_->Valid());
+    assert(Valid());
+    if (prefetching_) {
+      return window_[pos_].value;
+    }
     if (!is_result_loaded_)
       LoadResult();
     return saved_result_;
@@ -44,31 +100,49 @@ class ColumnDBIter: public Iterator {
   }
 
   virtual void Next() {
+    if (prefetching_) {
+      assert(Valid());
+      if (++pos_ == window_.size()) {
+        FillWindow();
+      }
+      return;
+    }
     iter_->Next();
     is_result_loaded_ = false;
   }
 
   virtual void Prev() {
+    StopPrefetching();
     iter_->Prev();
     is_result_loaded_ = false;
   }
 
   virtual void Seek(const Slice& target) {
     iter_->Seek(target);
-    is_result_loaded_ = false;
+    StartPrefetching();
   }
 
   virtual void SeekToFirst() {
     iter_->SeekToFirst();
-    is_result_loaded_ = false;
+    StartPrefetching();
   }
 
   virtual void SeekToLast() {
+    window_.clear();
+    prefetching_ = false;
     iter_->SeekToLast();
     is_result_loaded_ = false;
   }
 
  private:
+  // An index entry read ahead, with its value once loaded
+  struct Entry {
+    std::string key;
+    std::string internal_key;
+    std::string index_value;
+    Slice value;
+  };
+
   ColumnDB* const db_;
   Iterator* const iter_;
   char* buf_;
@@ -77,18 +151,31 @@ class ColumnDBIter: public Iterator {
   Slice saved_result_;
   bool is_result_loaded_;
 
+  // If prefetching_, iter_ is positioned after the entries in window_,
+  // and the current entry is window_[pos_].
+  bool prefetching_;
+  std::vector<Entry> window_;
+  size_t pos_;
+  std::string staged_;   // Holds the prefetched records
+
 
   void LoadResult() {
-    uint64_t file_loc_val = DecodeFixed64(iter_->value().data());
-    uint64_t file_number, offset, buf_size;
-    db_->DecodeFileLoc(file_loc_val, &file_number, &offset, &buf_size);
-    Reallocate(buf_size);
-    Status s = db_->InternalGet(options_, file_number, offset, buf_size, buf_,
-                                &saved_result_);
+    bool is_inline;
+    datafile::Location location;
+    is_result_loaded_ = true;
+    if (!ColumnDB::ParseIndexEntry(iter_->value(), &is_inline,
+                                   &saved_result_, &location)) {
+      saved_result_ = Slice(NULL, 0);
+      return;
+    }
+    if (is_inline) {
+      return;
+    }
+    Reallocate(location.size);
+    Status s = db_->InternalGet(options_, location, buf_, &saved_result_);
     if (!s.ok()) {
       saved_result_ = Slice(NULL, 0);
     }
-    is_result_loaded_ = true;
   }
 
   void Reallocate(uint64_t buf_size) {
@@ -99,6 +186,123 @@ class ColumnDBIter: public Iterator {
     }
   }
 
+  void StartPrefetching() {
+    is_result_loaded_ = false;
+    prefetching_ = (options_.prefetch_entries > 0);
+    if (prefetching_) {
+      FillWindow();
+    }
+  }
+
+  // Move iter_ back to the current entry
+  void StopPrefetching() {
+    if (prefetching_) {
+      prefetching_ = false;
+      if (pos_ < window_.size()) {
+        iter_->Seek(window_[pos_].key);
+      }
+      window_.clear();
+    }
+  }
+
+  // Read the next prefetch_entries entries of iter_ and their values
+  void FillWindow() {
+    window_.clear();
+    pos_ = 0;
+    while (iter_->Valid() &&
+           window_.size() < static_cast<size_t>(options_.prefetch_entries)) {
+      window_.push_back(Entry());
+      Entry& e = window_.back();
+      e.key = iter_->key().ToString();
+      e.internal_key = iter_->internalkey().ToString();
+      Slice v = iter_->value();
+      e.index_value.assign(v.data(), v.size());
+      iter_->Next();
+    }
+
+    std::vector<Fetch> fetches;
+    for (size_t i = 0; i < window_.size(); i++) {
+      bool is_inline;
+      datafile::Location location;
+      if (!ColumnDB::ParseIndexEntry(window_[i].index_value, &is_inline,
+                                     &window_[i].value, &location)) {
+        window_[i].value = Slice(NULL, 0);
+      } else if (!is_inline) {
+        Fetch f;
+        f.file_number = location.file_number;
+        f.offset = location.offset;
+        f.size = location.size;
+        f.format = location.format;
+        f.entry = i;
+        fetches.push_back(f);
+      }
+    }
+    LoadValues(&fetches);
+  }
+
+  // Read the records of "fetches" in location order, merging reads of
+  // nearby records, and point the values of their entries at them.
+  void LoadValues(std::vector<Fetch>* fetches) {
+    std::sort(fetches->begin(), fetches->end());
+
+    // Plan the reads
+    std::vector<Read> reads;
+    uint64_t total = 0;
+    for (size_t i = 0; i < fetches->size(); i++) {
+      const Fetch& f = (*fetches)[i];
+      if (!reads.empty()) {
+        Read& r = reads.back();
+        const Fetch& first = (*fetches)[r.first];
+        const uint64_t end = first.offset + r.size;
+        if (f.file_number == first.file_number &&
+            f.offset <= end + kMaxPrefetchGap &&
+            f.offset + f.size - first.offset <= kMaxPrefetchRead) {
+          const uint64_t new_size =
+              std::max(end, f.offset + f.size) - first.offset;
+          total += new_size - r.size;
+          r.size = new_size;
+          r.last = i + 1;
+          continue;
+        }
+      }
+      Read r = { i, i + 1, f.size };
+      reads.push_back(r);
+      total += f.size;
+    }
+
+    // Staged records stay put until the next window is read
+    staged_.resize(total);
+    size_t pos = 0;
+    for (size_t i = 0; i < reads.size(); i++) {
+      const Read& r = reads[i];
+      const Fetch& first = (*fetches)[r.first];
+      char* scratch = &staged_[pos];
+      pos += r.size;
+      Slice data;
+      // Only cache reads of single records, which Get() may look up
+      ReadOptions options = options_;
+      options.fill_cache = options_.fill_cache && (r.last == r.first + 1);
+      Status s = db_->ReadData(options, first.file_number, first.offset,
+                               r.size, scratch, &data);
+      if (s.ok() && data.data() != scratch) {
+        memcpy(scratch, data.data(), data.size());
+        data = Slice(scratch, data.size());
+      }
+      for (size_t j = r.first; j < r.last; j++) {
+        const Fetch& f = (*fetches)[j];
+        Slice* value = &window_[f.entry].value;
+        const uint64_t skip = f.offset - first.offset;
+        if (!s.ok() || skip >= data.size() ||
+            !ColumnDB::ParseRecord(f.format,
+                                   Slice(data.data() + skip,
+                                         data.size() - skip),
+                                   value).ok()) {
+          *value = Slice(NULL, 0);
+        }
+      }
+    }
+  }
+
   // No copying allowed
   ColumnDBIter(const ColumnDBIter&);
   void operator=(const ColumnDBIter&);
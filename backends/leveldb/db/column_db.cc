@@ -9,179 +9,1208 @@
 
 #include "leveldb/db.h"
 #include "leveldb/env.h"
+#include "leveldb/write_batch.h"
 #include "util/coding.h"
 #include "db/filename.h"
 #include "db/dbformat.h"
 #include "db/cdb_iter.h"
+#include "db/write_batch_internal.h"
+#include "leveldb/table.h"
+#include "leveldb/table_builder.h"
 #include "util/mutexlock.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <set>
 
 namespace leveldb {
 
-static const uint64_t kColumnMagicNumber = 0x18ca;
+extern Status WriteStringToFileSync(Env* env, const Slice& data,
+                                    const std::string& fname);
+
+// Size of the membuf, and so of each data file
+static const size_t kDataFileSize = 63 << 20;
+
+// Garbage collection moves live records in batches of about this many
+// bytes.
+static const size_t kGCBatchBytes = 1 << 20;
+
+// Format of the index entries, kept in the INDEXFORMAT file.  Databases
+// without it hold the untagged fixed64 locations of the first release.
+static const int kIndexFormat = 1;
+
+static Options SanitizeColumnOptions(const Options& src,
+                                     CompactionListener* listener) {
+  Options result = src;
+  result.compaction_listener = listener;
+  return result;
+}
+
+// Sleep as needed so that "bytes" of I/O since "start_micros" do not
+// exceed "bytes_per_second".
+static void Throttle(Env* env, size_t bytes_per_second,
+                     uint64_t start_micros, uint64_t bytes) {
+  if (bytes_per_second == 0) {
+    return;
+  }
+  const uint64_t due = start_micros + bytes * 1000000 / bytes_per_second;
+  const uint64_t now = env->NowMicros();
+  if (due > now) {
+    env->SleepForMicroseconds(static_cast<int>(
+        std::min<uint64_t>(due - now, 1000000)));
+  }
+}
 
 ColumnDB::ColumnDB(const Options& options, const std::string& dbname,
                    Status &s) :
-  dbname_(dbname), env_(options.env), datafile_(NULL), indexdb_(NULL),
-  membuf_(NULL), log_number_(0), current_log_number_(0) {
-  MutexLock mutex_lock(&mutex_);
-  s = DB::Open(options, dbname, &indexdb_);
+  env_(options.env), listener_(this),
+  options_(SanitizeColumnOptions(options, &listener_)),
+  dbname_(dbname), indexdb_(NULL), datafile_(NULL),
+  datafile_broken_(false), membuf_(NULL),
+  prev_datafile_(NULL), prev_membuf_(NULL), prev_log_number_(0),
+  next_datafile_(NULL), next_log_number_(0), bg_file_running_(false),
+  bg_file_cv_(&mutex_),
+  data_cache_(NULL), log_number_(0), current_log_number_(0),
+  live_iterators_(0), shutting_down_(NULL), bg_gc_running_(false),
+  bg_gc_collecting_(false), gc_pauses_(0), bg_gc_cv_(&mutex_) {
+  // Find the data files first, so that values dropped by the first
+  // compactions of the index are accounted to them.
+  const bool existed = env_->FileExists(CurrentFileName(dbname));
+  s = RecoverDataFiles();
+  if (s.ok()) {
+    s = DB::Open(options_, dbname, &indexdb_);
+  }
+  if (s.ok()) {
+    s = UpgradeIndexEntries(existed);
+  }
+  if (s.ok()) {
+    s = RecoverUnsealedFiles();
+  }
   if (!s.ok()) {
     printf("%s\n", s.ToString().c_str());
     return;
   }
-  s = NewDataFile();
+  MutexLock mutex_lock(&mutex_);
+  membuf_ = new MemBuffer(kDataFileSize);
+  prev_membuf_ = new MemBuffer(kDataFileSize);
+  next_log_number_ = NewLogNumber();
+  s = CreateDataFile(next_log_number_, &next_datafile_);
+  if (s.ok()) {
+    s = NewDataFile();
+  }
   if (!s.ok()) {
     printf("%s\n", s.ToString().c_str());
     return;
   }
-  membuf_ = new MemBuffer(63 << 20);
-  data_cache_ = new DataCache(dbname, &options, options.max_open_files);
+  data_cache_ = new DataCache(dbname, &options_, options.max_open_files);
+  bg_file_running_ = true;
+  env_->StartThread(&ColumnDB::BGFileWork, this);
+  if (options_.value_gc_live_ratio > 0) {
+    bg_gc_running_ = true;
+    env_->StartThread(&ColumnDB::BGGCWork, this);
+  }
 }
 
 ColumnDB::~ColumnDB() {
+  mutex_.Lock();
+  shutting_down_.Release_Store(this);  // Any non-NULL value is ok
+  bg_gc_cv_.SignalAll();
+  while (bg_gc_running_) {
+    bg_gc_cv_.Wait();
+  }
+  bg_file_cv_.SignalAll();
+  while (bg_file_running_) {
+    bg_file_cv_.Wait();
+  }
+  mutex_.Unlock();
+
+  // Not under mutex_: compactions of the index report to ValueDropped()
+  const bool opened = (indexdb_ != NULL);
+  delete indexdb_;
+
   MutexLock mutex_lock(&mutex_);
   if (datafile_ != NULL) {
-    datafile_->Close();
-    delete datafile_;
+    SealDataFile(datafile_, footer_);
+    datafile_ = NULL;
+    if (files_[GetLogNumber()].size == 0) {
+      env_->DeleteFile(DataFileName(dbname_, GetLogNumber()));
+      files_.erase(GetLogNumber());
+    }
+  }
+  if (next_datafile_ != NULL) {
+    next_datafile_->Close();
+    delete next_datafile_;
+    env_->DeleteFile(DataFileName(dbname_, next_log_number_));
   }
-  if (membuf_ != NULL) {
-    delete membuf_;
+  if (opened) {
+    SaveDataStats();
   }
   if (data_cache_ != NULL) {
+    DeleteObsoleteDataFiles();
     delete data_cache_;
   }
-  if (indexdb_ != NULL) {
-    delete indexdb_;
+  delete membuf_;
+  delete prev_membuf_;
+}
+
+Status ColumnDB::RecoverDataFiles() {
+  MutexLock mutex_lock(&mutex_);
+  std::vector<std::string> filenames;
+  env_->GetChildren(dbname_, &filenames);  // Ignore error: DB may be new
+  uint64_t number;
+  FileType type;
+  for (size_t i = 0; i < filenames.size(); i++) {
+    if (!ParseFileName(filenames[i], &number, &type) || type != kDataFile) {
+      continue;
+    }
+    if (number > log_number_) {
+      log_number_ = number;
+    }
+    const std::string fname = DataFileName(dbname_, number);
+    uint64_t size;
+    Status s = env_->GetFileSize(fname, &size);
+    if (!s.ok()) {
+      return s;
+    }
+    if (size <= datafile::kHeaderSize) {
+      env_->DeleteFile(fname);  // Created ahead, but never used
+    } else {
+      files_[number].size = size;
+    }
   }
+  LoadDataStats();
+  return Status::OK();
 }
 
-Status ColumnDB::NewDataFile() {
-  uint64_t new_log_number = NewLogNumber();
-  WritableFile* lfile;
-  Status s = env_->NewWritableFile(DataFileName(dbname_, new_log_number),
-                                   &lfile);
+// DATASTATS holds a varint64 file number, record count and count of dead
+// bytes for each data file.  It only holds estimates, so it is written
+// without a checksum and entries for unknown files are ignored.
+void ColumnDB::LoadDataStats() {
+  mutex_.AssertHeld();
+  std::string contents;
+  if (!ReadFileToString(env_, DataStatsFileName(dbname_), &contents).ok()) {
+    return;
+  }
+  Slice input(contents);
+  uint64_t number, records, dead;
+  while (GetVarint64(&input, &number) && GetVarint64(&input, &records) &&
+         GetVarint64(&input, &dead)) {
+    std::map<uint64_t, DataFileInfo>::iterator it = files_.find(number);
+    if (it != files_.end()) {
+      it->second.records = records;
+      it->second.dead = std::min(dead, it->second.size);
+    }
+  }
+}
+
+void ColumnDB::SaveDataStats() {
+  mutex_.AssertHeld();
+  std::string contents;
+  for (std::map<uint64_t, DataFileInfo>::iterator it = files_.begin();
+       it != files_.end(); ++it) {
+    PutVarint64(&contents, it->first);
+    PutVarint64(&contents, it->second.records);
+    PutVarint64(&contents, it->second.dead);
+  }
+  const std::string fname = DataStatsFileName(dbname_);
+  const std::string tmp = fname + ".tmp";
+  Status s = WriteStringToFile(env_, contents, tmp);
   if (s.ok()) {
-    SetLogNumber(new_log_number);
-    if (datafile_ != NULL) {
-      datafile_->Close();
-      delete datafile_;
+    s = env_->RenameFile(tmp, fname);
+  }
+  if (!s.ok()) {
+    env_->DeleteFile(tmp);
+  }
+}
+
+// A new database is marked with the current format before it has any
+// entries.  Entries of a database without the mark are the bare fixed64
+// locations of kFormat1 records, which get the kValueLocation tag.  Only
+// those 8-byte entries are rewritten, so a conversion cut short by a
+// crash is simply resumed.
+Status ColumnDB::UpgradeIndexEntries(bool existed) {
+  const std::string fname = IndexFormatFileName(dbname_);
+  std::string contents;
+  if (ReadFileToString(env_, fname, &contents).ok()) {
+    if (atoi(contents.c_str()) != kIndexFormat) {
+      return Status::NotSupported("unknown ColumnDB index format", fname);
     }
-    datafile_ = lfile;
-  } else {
+    return Status::OK();
+  }
+
+  Status s;
+  if (existed) {
+    Iterator* iter = indexdb_->NewIterator(ReadOptions());
+    WriteBatch batch;
+    std::string entry;
+    for (iter->SeekToFirst(); s.ok() && iter->Valid(); iter->Next()) {
+      const Slice value = iter->value();
+      if (value.size() == sizeof(uint64_t)) {
+        entry.assign(1, static_cast<char>(kValueLocation));
+        entry.append(value.data(), value.size());
+        batch.Put(iter->key(), entry);
+      } else if (value.size() != 1 + sizeof(uint64_t) ||
+                 value[0] != kValueLocation) {
+        s = Status::Corruption("bad index entry in old ColumnDB",
+                               iter->key());
+      }
+      if (s.ok() && WriteBatchInternal::ByteSize(&batch) >= kGCBatchBytes) {
+        s = indexdb_->Write(WriteOptions(), &batch);
+        batch.Clear();
+      }
+    }
+    if (s.ok()) {
+      s = iter->status();
+    }
+    delete iter;
+    if (s.ok()) {
+      WriteOptions options;
+      options.sync = true;
+      s = indexdb_->Write(options, &batch);
+    }
+  }
+  if (s.ok()) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d\n", kIndexFormat);
+    const std::string tmp = fname + ".tmp";
+    s = WriteStringToFileSync(env_, buf, tmp);
+    if (s.ok()) {
+      s = env_->RenameFile(tmp, fname);
+    }
+    if (!s.ok()) {
+      env_->DeleteFile(tmp);
+    }
+  }
+  return s;
+}
+
+struct ColumnDB::FileRecovery {
+  ColumnDB* db;
+  uint64_t file_number;
+  FileRecovery* newer;  // Of the next newer unsealed file, if any
+  port::CondVar* cv;
+  bool scanned;         // keys is complete
+  std::set<std::string> keys;  // With records in the file
+  bool done;
+  Status status;
+};
+
+// Files are sealed in the order they were written, but files adopted by
+// BulkInsert() are sealed already and numbered above the file being
+// written then, so every file is checked.  kFormat1 files are never
+// sealed, and are left as they are.
+Status ColumnDB::RecoverUnsealedFiles() {
+  std::vector<uint64_t> numbers;
+  {
+    MutexLock mutex_lock(&mutex_);
+    for (std::map<uint64_t, DataFileInfo>::reverse_iterator it =
+             files_.rbegin();
+         it != files_.rend(); ++it) {
+      numbers.push_back(it->first);
+    }
+  }
+  std::vector<uint64_t> unsealed;
+  Status s;
+  for (size_t i = 0; i < numbers.size(); i++) {
+    const std::string fname = DataFileName(dbname_, numbers[i]);
+    uint64_t file_size;
+    RandomAccessFile* file = NULL;
+    s = env_->GetFileSize(fname, &file_size);
+    if (s.ok()) {
+      s = env_->NewRandomAccessFile(fname, &file);
+    }
+    if (!s.ok()) {
+      return s;
+    }
+    datafile::Reader reader(file, file_size);
+    s = reader.Open();
+    const bool sealed = reader.sealed();
+    const int format = reader.format();
+    delete file;
+    if (!s.ok()) {
+      return s;
+    }
+    if (!sealed && format == datafile::kFormat2) {
+      unsealed.push_back(numbers[i]);
+    }
+  }
+  if (unsealed.empty()) {
     return s;
   }
+
+  MutexLock mutex_lock(&mutex_);
+  port::CondVar cv(&mutex_);
+  std::vector<FileRecovery> recoveries(unsealed.size());
+  for (size_t i = 0; i < unsealed.size(); i++) {
+    FileRecovery* r = &recoveries[i];
+    r->db = this;
+    r->file_number = unsealed[i];
+    r->newer = (i > 0) ? &recoveries[i - 1] : NULL;
+    r->cv = &cv;
+    r->scanned = false;
+    r->done = false;
+    env_->StartThread(&ColumnDB::BGRecoverWork, r);
+  }
+  for (size_t i = 0; i < recoveries.size(); i++) {
+    while (!recoveries[i].done) {
+      cv.Wait();
+    }
+    if (s.ok()) {
+      s = recoveries[i].status;
+    }
+  }
+  recovery_stats_.files += recoveries.size();
+  SaveDataStats();
+  return s;
 }
 
-Status ColumnDB::Put(const WriteOptions& opt, const Slice& key,
-                     const Slice& value) {
+void ColumnDB::BGRecoverWork(void* arg) {
+  FileRecovery* r = reinterpret_cast<FileRecovery*>(arg);
+  Status s = r->db->RecoverDataFile(r);
+  MutexLock mutex_lock(&r->db->mutex_);
+  r->status = s;
+  r->scanned = true;  // Even if it failed before, not to block older files
+  r->done = true;
+  r->cv->SignalAll();
+}
+
+// Records are indexed in the order they were appended, so the index
+// updates of the records after the last one the index refers to may have
+// been lost.  For each key, the newest of those records is replayed,
+// a deletion as well as a value, unless the index has a newer value for
+// the key, or a newer unsealed file has records of the key.  The file is
+// then rewritten without its damaged tail, and sealed, so that entries
+// pointing past its records can be told apart from damage later (see
+// IsDangling()).
+Status ColumnDB::RecoverDataFile(FileRecovery* r) {
+  const uint64_t file_number = r->file_number;
+  const std::string fname = DataFileName(dbname_, file_number);
+  uint64_t file_size;
+  Status s = env_->GetFileSize(fname, &file_size);
+  RandomAccessFile* file = NULL;
+  if (s.ok()) {
+    s = env_->NewRandomAccessFile(fname, &file);
+  }
+  if (!s.ok()) {
+    return s;
+  }
+
+  datafile::Reader reader(file, file_size);
+  std::vector<std::string> keys;
+  std::vector<datafile::Location> locations;
+  std::vector<bool> deletions;
+  Slice key, value;
+  uint64_t offset, record_size;
+  while (reader.ReadRecord(&key, &value, &offset, &record_size)) {
+    const datafile::Location location = { file_number, offset, record_size,
+                                          datafile::kFormat2 };
+    keys.push_back(key.ToString());
+    locations.push_back(location);
+    deletions.push_back(reader.deletion());
+  }
+  s = reader.status();
+  const uint64_t end = reader.records_end();
+  {
+    MutexLock mutex_lock(&mutex_);
+    r->keys.insert(keys.begin(), keys.end());
+    r->scanned = true;
+    r->cv->SignalAll();
+  }
+
+  // Whether the record may be replayed as far as the index can tell
+  std::vector<bool> unindexed(keys.size(), false);
+  size_t replay_start = 0;
+  uint64_t live_bytes = 0;
+  std::string entry;
+  for (size_t i = 0; i < keys.size() && s.ok(); i++) {
+    Status g = indexdb_->Get(ReadOptions(), keys[i], &entry);
+    bool is_inline;
+    Slice inline_value;
+    datafile::Location current;
+    if (g.IsNotFound()) {
+      unindexed[i] = !deletions[i];
+    } else if (!g.ok()) {
+      s = g;
+    } else if (entry == LocationEntry(locations[i])) {
+      replay_start = i + 1;
+      live_bytes += locations[i].size;
+    } else if (ParseIndexEntry(entry, &is_inline, &inline_value, &current) &&
+               !is_inline &&
+               (current.file_number < file_number ||
+                (current.file_number == file_number &&
+                 current.offset < locations[i].offset))) {
+      unindexed[i] = true;  // The entry still refers to an older record
+    }
+  }
+
+  // Records of newer files are replayed by their own threads
+  {
+    MutexLock mutex_lock(&mutex_);
+    for (FileRecovery* n = r->newer; n != NULL; n = n->newer) {
+      while (!n->scanned) {
+        r->cv->Wait();
+      }
+    }
+  }
+
+  // Only the newest record of each key is replayed
+  WriteBatch index;
+  std::set<std::string> seen;
+  int replayed = 0;
+  for (size_t i = keys.size(); i > replay_start && s.ok(); i--) {
+    const std::string& k = keys[i - 1];
+    if (!seen.insert(k).second || !unindexed[i - 1]) {
+      continue;
+    }
+    bool in_newer_file = false;
+    for (FileRecovery* n = r->newer; n != NULL; n = n->newer) {
+      in_newer_file = in_newer_file || n->keys.count(k) > 0;
+    }
+    if (in_newer_file) {
+      continue;
+    }
+    if (deletions[i - 1]) {
+      index.Delete(k);
+    } else {
+      index.Put(k, LocationEntry(locations[i - 1]));
+      live_bytes += locations[i - 1].size;
+    }
+    replayed++;
+  }
+  if (s.ok() && replayed > 0) {
+    WriteOptions options;
+    options.sync = true;
+    s = indexdb_->Write(options, &index);
+  }
+
+  // Record offsets are kept, so the index entries stay valid
+  const std::string tmp = fname + ".tmp";
+  WritableFile* out = NULL;
+  if (s.ok()) {
+    s = env_->NewWritableFile(tmp, &out);
+  }
+  if (s.ok()) {
+    std::string header;
+    PutFixed64(&header, datafile::kHeaderMagic);
+    s = out->Append(header);
+  }
+  std::string buffer;
+  for (uint64_t pos = datafile::kHeaderSize; s.ok() && pos < end; ) {
+    const size_t n = std::min<uint64_t>(end - pos, kGCBatchBytes);
+    buffer.resize(n);
+    Slice result;
+    s = file->Read(pos, n, &result, &buffer[0]);
+    if (s.ok() && result.size() != n) {
+      s = Status::Corruption("data file shrank during recovery", fname);
+    }
+    if (s.ok()) {
+      s = out->Append(result);
+    }
+    pos += n;
+  }
+  delete file;
+  if (out != NULL) {
+    datafile::FooterBuilder footer;
+    for (size_t i = 0; i < locations.size(); i++) {
+      footer.AddRecord(locations[i].offset, locations[i].size);
+    }
+    if (s.ok()) {
+      s = SealDataFile(out, footer);
+    } else {
+      out->Close();
+      delete out;
+    }
+  }
+  if (s.ok()) {
+    s = env_->RenameFile(tmp, fname);
+  }
+  if (!s.ok()) {
+    env_->DeleteFile(tmp);
+    return s;
+  }
+
+  uint64_t new_size;
+  s = env_->GetFileSize(fname, &new_size);
+  if (s.ok()) {
+    MutexLock mutex_lock(&mutex_);
+    DataFileInfo& info = files_[file_number];
+    info.size = new_size;
+    info.records = keys.size();
+    info.dead = new_size - std::min(live_bytes, new_size);
+    recovery_stats_.replayed += replayed;
+    recovery_stats_.discarded_bytes += file_size - end;
+  }
+  return s;
+}
+
+bool ColumnDB::IsDangling(const datafile::Location& location) {
+  if (location.format != datafile::kFormat2) {
+    return false;
+  }
+  const std::string fname = DataFileName(dbname_, location.file_number);
+  uint64_t file_size;
+  RandomAccessFile* file;
+  if (!env_->GetFileSize(fname, &file_size).ok() ||
+      !env_->NewRandomAccessFile(fname, &file).ok()) {
+    return false;
+  }
+  datafile::Reader reader(file, file_size);
+  const bool dangling = reader.Open().ok() && reader.sealed() &&
+      location.offset + location.size > reader.records_end();
+  delete file;
+  return dangling;
+}
+
+Status ColumnDB::CreateDataFile(uint64_t number, WritableFile** result) {
+  const std::string fname = DataFileName(dbname_, number);
+  WritableFile* file;
+  Status s = env_->NewWritableFile(fname, &file);
+  if (!s.ok()) {
+    return s;
+  }
+  std::string header;
+  PutFixed64(&header, datafile::kHeaderMagic);
+  s = file->Append(header);
+  if (!s.ok()) {
+    delete file;
+    env_->DeleteFile(fname);
+    return s;
+  }
+  *result = file;
+  return s;
+}
+
+// Switching files only swaps in the file created ahead by the background
+// thread, and the buffer of the previous file.  That file keeps serving
+// reads from its buffer until the background thread has sealed it.
+Status ColumnDB::NewDataFile() {
+  mutex_.AssertHeld();
+  while (prev_datafile_ != NULL || next_datafile_ == NULL) {
+    if (next_datafile_ == NULL && !next_status_.ok()) {
+      Status s = next_status_;
+      next_status_ = Status::OK();  // Let the background thread retry
+      bg_file_cv_.SignalAll();
+      return s;
+    }
+    bg_file_cv_.SignalAll();
+    bg_file_cv_.Wait();
+  }
+  if (datafile_ != NULL) {
+    prev_datafile_ = datafile_;
+    prev_footer_ = footer_;
+    prev_log_number_ = GetLogNumber();
+    std::swap(membuf_, prev_membuf_);
+  }
+  datafile_ = next_datafile_;
+  next_datafile_ = NULL;
+  SetLogNumber(next_log_number_);
+  footer_.Reset();
+  membuf_->Truncate();
+  std::string header;
+  PutFixed64(&header, datafile::kHeaderMagic);
+  size_t location;
+  memcpy(membuf_->Reserve(header.size(), location), header.data(),
+         header.size());
+  files_[GetLogNumber()] = DataFileInfo();
+  datafile_broken_ = false;
+  bg_file_cv_.SignalAll();
+  return Status::OK();
+}
+
+Status ColumnDB::SealDataFile(WritableFile* file,
+                              const datafile::FooterBuilder& footer) {
+  std::string contents;
+  footer.EncodeTo(&contents);
+  Status s = file->Append(contents);
+  if (s.ok()) {
+    // Garbage collection relies on moved records being durable
+    s = file->Sync();
+  }
+  if (s.ok()) {
+    s = file->Close();
+  }
+  delete file;
+  return s;
+}
+
+void ColumnDB::BGFileWork(void* db) {
+  reinterpret_cast<ColumnDB*>(db)->BackgroundFileWork();
+}
+
+// Seal the previous data file, and create the next one ahead of time.
+void ColumnDB::BackgroundFileWork() {
+  MutexLock mutex_lock(&mutex_);
+  while (true) {
+    if (prev_datafile_ != NULL) {
+      WritableFile* file = prev_datafile_;
+      const datafile::FooterBuilder footer = prev_footer_;
+      mutex_.Unlock();
+      Status s = SealDataFile(file, footer);
+      mutex_.Lock();
+      if (!s.ok() && bg_error_.ok()) {
+        bg_error_ = s;
+      }
+      prev_datafile_ = NULL;
+      prev_log_number_ = 0;  // Now read from disk
+      bg_file_cv_.SignalAll();
+      // The previous data file may now be collected
+      bg_gc_cv_.SignalAll();
+    } else if (shutting_down_.Acquire_Load()) {
+      break;
+    } else if (next_datafile_ == NULL && next_status_.ok()) {
+      const uint64_t number = NewLogNumber();
+      WritableFile* file = NULL;
+      mutex_.Unlock();
+      Status s = CreateDataFile(number, &file);
+      mutex_.Lock();
+      if (s.ok()) {
+        next_datafile_ = file;
+        next_log_number_ = number;
+      } else {
+        next_status_ = s;
+      }
+      bg_file_cv_.SignalAll();
+    } else {
+      bg_file_cv_.Wait();
+    }
+  }
+  bg_file_running_ = false;
+  bg_file_cv_.SignalAll();
+}
+
+namespace {
+// Encodes the records of the Put()s and Delete()s of a batch back to back,
+// and keeps their order for the index batch.
+class RecordEncoder : public WriteBatch::Handler {
+ public:
+  struct Update {
+    Slice key;
+    bool is_put;
+    bool is_inline;  // Put() whose value stays in the index, without record
+    Slice value;     // Value of an inline Put()
+  };
+  std::string records;
+  std::vector<size_t> sizes;    // Of each record in "records"
+  std::vector<Update> updates;
+  Status status;
+  size_t inline_threshold;      // Smaller values stay in the index
+
+  RecordEncoder() : inline_threshold(0) { }
+
+  virtual void Put(const Slice& key, const Slice& value) {
+    if (value.size() < inline_threshold) {
+      Update update = { key, true, true, value };
+      updates.push_back(update);
+      return;
+    }
+    const uint64_t total_size =
+        datafile::RecordSize(key.size(), value.size());
+    if (key.size() > kDataFileSize || value.size() > kDataFileSize ||
+        total_size > kDataFileSize - datafile::kHeaderSize) {
+      if (status.ok()) {
+        status = Status::InvalidArgument("Value too large for ColumnDB");
+      }
+      return;
+    }
+    datafile::AppendRecord(&records, key, value);
+    sizes.push_back(total_size);
+    Update update = { key, true, false, Slice() };
+    updates.push_back(update);
+  }
+  virtual void Delete(const Slice& key) {
+    const uint64_t total_size = datafile::DeletionSize(key.size());
+    if (key.size() > kDataFileSize ||
+        total_size > kDataFileSize - datafile::kHeaderSize) {
+      if (status.ok()) {
+        status = Status::InvalidArgument("Key too large for ColumnDB");
+      }
+      return;
+    }
+    datafile::AppendDeletion(&records, key);
+    sizes.push_back(total_size);
+    Update update = { key, false, false, Slice() };
+    updates.push_back(update);
+  }
+  virtual void Merge(const Slice& key, const Slice& operand) {
+    if (status.ok()) {
+      status = Status::NotSupported("ColumnDB does not support merges");
+    }
+  }
+};
+}  // namespace
+
+struct ColumnDB::Writer {
+  RecordEncoder encoder;
+  std::vector<datafile::Location> locations;  // Of the records of encoder
+  // If non-NULL, the Put()s of encoder are only applied to keys whose
+  // index entries are still the corresponding ones of *expected
+  const std::vector<std::string>* expected;
+  bool sync;
+  bool new_file;      // Only switch to a new data file
+  bool done;
+  Status status;
+  port::CondVar cv;
+
+  explicit Writer(port::Mutex* mu)
+      : expected(NULL), sync(false), new_file(false), done(false), cv(mu) { }
+};
+
+namespace {
+struct PendingCopy {
+  char* dst;
+  const char* src;
+  size_t size;
+};
+
+void CopyRecords(std::vector<PendingCopy>* copies) {
+  for (size_t i = 0; i < copies->size(); i++) {
+    const PendingCopy& c = (*copies)[i];
+    memcpy(c.dst, c.src, c.size);
+  }
+  copies->clear();
+}
+}  // namespace
+
+// Like DBImpl::Write, writers queue up and the one at the front commits
+// the records of the writers behind it as a group: it reserves their space
+// in the membuf, copies them in and appends them to the data file without
+// holding mutex_, and publishes their locations with a single write to
+// indexdb_.
+Status ColumnDB::WriteRecords(Writer* w) {
+  MutexLock mutex_lock(&mutex_);
+  writers_.push_back(w);
+  while (!w->done && w != writers_.front()) {
+    w->cv.Wait();
+  }
+  if (w->done) {
+    return w->status;
+  }
+
+  // Pick the group.  Like BuildBatchGroup, do not let a small write wait
+  // for a lot of others, nor a non-sync leader commit a sync write.
+  const size_t size = w->encoder.records.size();
+  size_t max_size = 1 << 20;
+  if (size <= (128<<10)) {
+    max_size = size + (128<<10);
+  }
+  Writer* last_writer = w;
+  size_t group_size = size;
+  std::deque<Writer*>::iterator iter = writers_.begin();
+  ++iter;
+  for (; iter != writers_.end(); ++iter) {
+    Writer* next = *iter;
+    if (w->new_file || next->new_file || next->expected != NULL) {
+      break;
+    }
+    if (next->sync && !w->sync) {
+      break;
+    }
+    group_size += next->encoder.records.size();
+    if (group_size > max_size) {
+      break;
+    }
+    last_writer = next;
+  }
+
+  Status s = bg_error_;
+  if (s.ok() && w->expected != NULL) {
+    mutex_.Unlock();
+    s = DropChangedUpdates(w);
+    mutex_.Lock();
+  }
+  if (s.ok() && w->new_file) {
+    s = NewDataFile();
+    while (s.ok() && prev_datafile_ != NULL) {
+      bg_file_cv_.Wait();  // Until the closed file is complete on disk
+    }
+    if (s.ok()) {
+      s = bg_error_;
+    }
+  } else if (s.ok()) {
+    s = AppendGroup(last_writer);
+  }
+  if (s.ok()) {
+    WriteBatch index;
+    std::string entry;
+    for (iter = writers_.begin(); ; ++iter) {
+      Writer* writer = *iter;
+      size_t next = 0;
+      for (size_t i = 0; i < writer->encoder.updates.size(); i++) {
+        const RecordEncoder::Update& update = writer->encoder.updates[i];
+        if (update.is_inline) {
+          entry.assign(1, static_cast<char>(kInlineValue));
+          entry.append(update.value.data(), update.value.size());
+          index.Put(update.key, entry);
+        } else if (update.is_put) {
+          index.Put(update.key, LocationEntry(writer->locations[next++]));
+        } else {
+          // Deletion records are only read by recovery
+          const datafile::Location& location = writer->locations[next++];
+          DataFileInfo& info = files_[location.file_number];
+          info.dead = std::min(info.size, info.dead + location.size);
+          index.Delete(update.key);
+        }
+      }
+      if (writer == last_writer) {
+        break;
+      }
+    }
+    if (WriteBatchInternal::Count(&index) > 0) {
+      mutex_.Unlock();
+      WriteOptions options;
+      options.sync = w->sync;
+      s = indexdb_->Write(options, &index);
+      mutex_.Lock();
+    }
+  }
+
+  while (true) {
+    Writer* ready = writers_.front();
+    writers_.pop_front();
+    if (ready != w) {
+      ready->status = s;
+      ready->done = true;
+      ready->cv.Signal();
+    }
+    if (ready == last_writer) break;
+  }
+
+  // Notify new head of write queue
+  if (!writers_.empty()) {
+    writers_.front()->cv.Signal();
+  }
+  return s;
+}
+
+// Append the records of the writers from the front of writers_ up to
+// "last_writer" to the data files, and store their locations.
+// REQUIRES: mutex_ held, and the calling writer at the front of writers_.
+Status ColumnDB::AppendGroup(Writer* last_writer) {
+  mutex_.AssertHeld();
   Status s;
-  mutex_.Lock();
-  uint64_t total_size = sizeof(uint64_t)+key.size()+value.size();
-  if (!membuf_->HasEnough(total_size)) {
+  if (datafile_broken_) {
     s = NewDataFile();
-    if (!s.ok())
+    if (!s.ok()) {
       return s;
-    membuf_->Truncate();
+    }
   }
+  std::vector<PendingCopy> copies;
+  size_t region = 0;       // Membuf offset of the records not yet written
+  size_t region_size = 0;
+  uint64_t region_records = 0;
+  // Bytes of the group written to each data file so far
+  std::vector<std::pair<uint64_t, uint64_t> > written;
+  for (std::deque<Writer*>::iterator iter = writers_.begin(); s.ok();
+       ++iter) {
+    Writer* writer = *iter;
+    const std::vector<size_t>& sizes = writer->encoder.sizes;
+    const char* src = writer->encoder.records.data();
+    for (size_t i = 0; i < sizes.size(); i++) {
+      if (!membuf_->HasEnough(sizes[i])) {
+        CopyRecords(&copies);
+        s = WriteRegion(region, region_size);
+        if (!s.ok()) {
+          break;
+        }
+        written.push_back(std::make_pair(GetLogNumber(), region_size));
+        region_size = 0;
+        region_records = 0;
+        s = NewDataFile();
+        if (!s.ok()) {
+          break;
+        }
+      }
+      size_t location;
+      char* dst = membuf_->Reserve(sizes[i], location);
+      if (region_size == 0) {
+        region = location;
+      }
+      region_size += sizes[i];
+      region_records++;
+      if (!copies.empty() &&
+          copies.back().dst + copies.back().size == dst &&
+          copies.back().src + copies.back().size == src) {
+        copies.back().size += sizes[i];
+      } else {
+        PendingCopy copy = { dst, src, sizes[i] };
+        copies.push_back(copy);
+      }
+      src += sizes[i];
 
-  //Put header
-  size_t location;
-  char buf[sizeof(uint64_t)];
-  // magic number--16b key size--28b  value size--20b
-  EncodeFixed64(buf, (kColumnMagicNumber<<48)+(key.size()<<20)+(value.size()));
-  membuf_->Append(Slice(buf, sizeof(buf)), location);
-  datafile_->Append(Slice(buf, sizeof(buf)));
-
-  //Put Key Value
-  size_t tmp;
-  membuf_->Append(key, tmp);
-  membuf_->Append(value, tmp);
-  s = datafile_->Append(key);
-  if (!s.ok()) return s;
-  s = datafile_->Append(value);
-  if (!s.ok()) return s;
-  if (opt.sync)
-    datafile_->Flush();
-  mutex_.Unlock();
+      DataFileInfo& info = files_[GetLogNumber()];
+      info.size += sizes[i];
+      info.records++;
+      footer_.AddRecord(location, sizes[i]);
+      datafile::Location loc = { GetLogNumber(), location, sizes[i],
+                                 datafile::kFormat2 };
+      writer->locations.push_back(loc);
+    }
+    if (writer == last_writer) {
+      break;
+    }
+  }
+
+  if (s.ok()) {
+    // Only this writer changes datafile_ and the reserved part of membuf_,
+    // and readers only look at records after they are published.
+    mutex_.Unlock();
+    CopyRecords(&copies);
+    mutex_.Lock();
+    s = WriteRegion(region, region_size);
+    if (s.ok()) {
+      written.push_back(std::make_pair(GetLogNumber(), region_size));
+      region_size = 0;
+      region_records = 0;
+    }
+  }
+  if (s.ok() && writers_.front()->sync) {
+    mutex_.Unlock();
+    s = datafile_->Sync();
+    mutex_.Lock();
+    while (prev_datafile_ != NULL) {
+      bg_file_cv_.Wait();  // Earlier records must be durable too
+    }
+  }
+  if (!s.ok()) {
+    // The group is not published, so what it wrote is dead, and what it
+    // did not write is forgotten.  The data file may end in a partial
+    // record now, so the next group starts a new one.
+    DataFileInfo& info = files_[GetLogNumber()];
+    info.size -= region_size;
+    info.records -= region_records;
+    footer_.RemoveRecords(region, region_records);
+    for (size_t i = 0; i < written.size(); i++) {
+      std::map<uint64_t, DataFileInfo>::iterator it =
+          files_.find(written[i].first);
+      if (it != files_.end()) {
+        it->second.dead = std::min(it->second.size,
+                                   it->second.dead + written[i].second);
+      }
+    }
+    datafile_broken_ = true;
+  }
+  return s;
+}
 
-  // lognumber--22b location--32b  value size/1KB--10b
-  EncodeFixed64(buf, (GetLogNumber()<<42)+(location<<10)+
-                     ((total_size+1023)/1024));
-  indexdb_->Put(opt, key, Slice(buf, sizeof(buf)));
+// Keep only the Put()s of w whose keys still have the index entries
+// of w->expected.  Other writers wait while w is at the front of writers_,
+// so the entries cannot change before w's updates are applied.
+// REQUIRES: w at the front of writers_, and mutex_ not held.
+Status ColumnDB::DropChangedUpdates(Writer* w) {
+  const RecordEncoder& all = w->encoder;
+  RecordEncoder kept;
+  kept.inline_threshold = all.inline_threshold;
+  const char* record = all.records.data();
+  size_t next = 0;
+  std::string current;
+  for (size_t i = 0; i < all.updates.size(); i++) {
+    const RecordEncoder::Update& update = all.updates[i];
+    Slice value = update.value;
+    if (!update.is_inline) {
+      Slice key;
+      size_t record_size;
+      Status s = datafile::ParseRecord(datafile::kFormat2,
+                                       Slice(record, all.sizes[next]),
+                                       &key, &value, &record_size);
+      if (!s.ok()) {
+        return s;
+      }
+      record += all.sizes[next++];
+    }
+    Status s = indexdb_->Get(ReadOptions(), update.key, &current);
+    if (s.ok() && current == (*w->expected)[i]) {
+      kept.Put(update.key, value);
+    } else if (!s.ok() && !s.IsNotFound()) {
+      return s;
+    }
+  }
+  w->encoder = kept;
+  return kept.status;
+}
 
-  return Status::OK();
+// Append a region of membuf_ to the data file.
+// REQUIRES: mutex_ held.
+Status ColumnDB::WriteRegion(size_t offset, size_t size) {
+  mutex_.AssertHeld();
+  if (size == 0) {
+    return Status::OK();
+  }
+  mutex_.Unlock();
+  Status s = datafile_->Append(membuf_->Region(offset, size));
+  mutex_.Lock();
+  return s;
+}
+
+Status ColumnDB::Put(const WriteOptions& opt, const Slice& key,
+                     const Slice& value) {
+  WriteBatch batch;
+  batch.Put(key, value);
+  return Write(opt, &batch);
 }
 
 Status ColumnDB::Delete(const WriteOptions& opt, const Slice& key) {
-  return indexdb_->Delete(opt, key);
+  WriteBatch batch;
+  batch.Delete(key);
+  return Write(opt, &batch);
 }
 
 Status ColumnDB::Write(const WriteOptions& options, WriteBatch* updates) {
-  return indexdb_->Write(options, updates);
+  Writer w(&mutex_);
+  w.sync = options.sync;
+  w.encoder.inline_threshold = options_.value_inline_threshold;
+  Status s = updates->Iterate(&w.encoder);
+  if (s.ok())
+    s = w.encoder.status;
+  if (!s.ok())
+    return s;
+  return WriteRecords(&w);
 }
 
-Status ColumnDB::InternalGet(const ReadOptions& options,
-                             uint64_t file_number, uint64_t offset,
-                             uint64_t buf_size, char* buf,
-                             Slice* result) {
+Status ColumnDB::ReadData(const ReadOptions& options,
+                          uint64_t file_number, uint64_t offset,
+                          uint64_t size, char* buf,
+                          Slice* result) {
   Status s;
 
-  if (file_number == GetLogNumber()) {
+  if (file_number == GetLogNumber() || file_number == prev_log_number_) {
     mutex_.Lock();
     if (file_number == GetLogNumber()) {
-      s = membuf_->Get(offset, buf_size, result, buf);
+      s = membuf_->Get(offset, size, result, buf);
+      mutex_.Unlock();
+    } else if (file_number == prev_log_number_) {
+      s = prev_membuf_->Get(offset, size, result, buf);
       mutex_.Unlock();
     } else {
       mutex_.Unlock();
-      s = data_cache_->Get(options, file_number, offset, buf_size,
+      s = data_cache_->Get(options, file_number, offset, size,
                            result, buf);
     }
   } else {
-    s = data_cache_->Get(options, file_number, offset, buf_size,
+    s = data_cache_->Get(options, file_number, offset, size,
                          result, buf);
   }
+  return s;
+}
+
+Status ColumnDB::ParseRecord(int format, const Slice& input, Slice* value) {
+  Slice key;
+  size_t record_size;
+  return datafile::ParseRecord(format, input, &key, value, &record_size);
+}
+
+Status ColumnDB::InternalGet(const ReadOptions& options,
+                             const datafile::Location& location,
+                             char* buf, Slice* result) {
+  Status s = ReadData(options, location.file_number, location.offset,
+                      location.size, buf, result);
   if (!s.ok())
     return s;
-
-  uint64_t header = DecodeFixed64(result->data());
-  uint64_t magic_number = header >> 48;
-  if (magic_number != kColumnMagicNumber) {
-    return Status::IOError("Magic Number Not Match");
-  }
-  header = header & ((1L<<48)-1);
-  uint64_t key_size = header >> 20;
-  uint64_t val_size = header & ((1L<<20)-1);
-  if (key_size + val_size + sizeof(header) > result->size()) {
-    return Status::IOError("Failed to read a full key value pair.");
-  }
-  *result = Slice(result->data()+sizeof(uint64_t)+key_size, val_size);
-  return s;
+  return ParseRecord(location.format, *result, result);
 }
 
 Status ColumnDB::Get(const ReadOptions& options,
                      const Slice& key,
                      std::string* value) {
-  std::string location_val;
-  Status s = indexdb_->Get(options, key, &location_val);
-  if (!s.ok()) return s;
+  Status s;
+  // Garbage collection may move the value and delete its old data file
+  // between the two reads below, so retry once with a fresh location.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    std::string entry;
+    s = indexdb_->Get(options, key, &entry);
+    if (!s.ok()) return s;
 
-  uint64_t file_loc = DecodeFixed64(location_val.c_str());
-  uint64_t file_number, offset, buf_size;
-  DecodeFileLoc(file_loc, &file_number, &offset, &buf_size);
-  char buf[buf_size];
-  Slice result;
-  s = InternalGet(options, file_number, offset, buf_size, buf, &result);
+    bool is_inline;
+    Slice result;
+    datafile::Location location;
+    if (!ParseIndexEntry(entry, &is_inline, &result, &location)) {
+      return Status::Corruption("bad ColumnDB index entry");
+    }
+    if (is_inline) {
+      value->assign(result.data(), result.size());
+      break;
+    }
+    char space[8192];
+    std::string heap;
+    char* buf = space;
+    if (location.size > sizeof(space)) {
+      heap.resize(location.size);
+      buf = &heap[0];
+    }
+    s = InternalGet(options, location, buf, &result);
 
-  if (s.ok()) {
-    value->assign(result.data(), result.size());
+    if (s.ok()) {
+      value->assign(result.data(), result.size());
+      break;
+    }
+    if (s.IsCorruption() && IsDangling(location)) {
+      // The record was lost in a crash; drop the entry unless it changed
+      WriteBatch index;
+      index.Delete(key);
+      std::vector<std::string> expected(1, entry);
+      int applied = 0;
+      static_cast<DBImpl*>(indexdb_)->WriteIfUnchanged(
+          WriteOptions(), &index, expected, &applied);
+      if (applied > 0) {
+        MutexLock mutex_lock(&mutex_);
+        recovery_stats_.dropped++;
+      }
+      return Status::NotFound(Slice());
+    }
   }
 
   return s;
 }
 
+std::string ColumnDB::LocationEntry(const datafile::Location& location) {
+  std::string entry;
+  if (location.format == datafile::kFormat1) {
+    entry.assign(1, static_cast<char>(kValueLocation));
+    PutFixed64(&entry, EncodeFileLoc(location.file_number, location.offset,
+                                     location.size));
+  } else {
+    entry.assign(1, static_cast<char>(kValueLocation2));
+    PutVarint64(&entry, location.file_number);
+    PutVarint64(&entry, location.offset);
+    PutVarint64(&entry, location.size);
+  }
+  return entry;
+}
+
+bool ColumnDB::ParseIndexEntry(const Slice& entry, bool* is_inline,
+                               Slice* value, datafile::Location* location) {
+  if (entry.empty()) {
+    return false;
+  }
+  Slice input(entry.data() + 1, entry.size() - 1);
+  switch (entry[0]) {
+    case kInlineValue:
+      *is_inline = true;
+      *value = input;
+      return true;
+    case kValueLocation:
+      if (input.size() != sizeof(uint64_t)) {
+        return false;
+      }
+      *is_inline = false;
+      DecodeFileLoc(DecodeFixed64(input.data()), &location->file_number,
+                    &location->offset, &location->size);
+      location->format = datafile::kFormat1;
+      return true;
+    case kValueLocation2:
+      if (!GetVarint64(&input, &location->file_number) ||
+          !GetVarint64(&input, &location->offset) ||
+          !GetVarint64(&input, &location->size) || !input.empty()) {
+        return false;
+      }
+      *is_inline = false;
+      location->format = datafile::kFormat2;
+      return true;
+  }
+  return false;
+}
+
 Status ColumnDB::Exists(const ReadOptions& options,
                         const Slice& key) {
   std::string location_val;
@@ -201,6 +1230,51 @@ void ColumnDB::ReleaseSnapshot(const Snapshot* snapshot) {
 }
 
 bool ColumnDB::GetProperty(const Slice& property, std::string* value) {
+  if (property == Slice("leveldb.value-cache")) {
+    uint64_t hits, misses;
+    data_cache_->GetStats(&hits, &misses);
+    char buf[100];
+    snprintf(buf, sizeof(buf), "hits %llu misses %llu hit-rate %.3f",
+             static_cast<unsigned long long>(hits),
+             static_cast<unsigned long long>(misses),
+             (hits + misses > 0) ?
+                 static_cast<double>(hits) / (hits + misses) : 0.0);
+    value->assign(buf);
+    return true;
+  }
+  if (property == Slice("leveldb.value-gc")) {
+    MutexLock mutex_lock(&mutex_);
+    uint64_t size = 0, dead = 0;
+    for (std::map<uint64_t, DataFileInfo>::iterator it = files_.begin();
+         it != files_.end(); ++it) {
+      size += it->second.size;
+      dead += it->second.dead;
+    }
+    char buf[200];
+    snprintf(buf, sizeof(buf),
+             "data-files %d bytes %llu dead %llu collected %d failed %d "
+             "read %llu moved %llu",
+             static_cast<int>(files_.size()),
+             static_cast<unsigned long long>(size),
+             static_cast<unsigned long long>(dead),
+             gc_stats_.files, gc_stats_.failures,
+             static_cast<unsigned long long>(gc_stats_.bytes_read),
+             static_cast<unsigned long long>(gc_stats_.bytes_moved));
+    value->assign(buf);
+    return true;
+  }
+  if (property == Slice("leveldb.value-recovery")) {
+    MutexLock mutex_lock(&mutex_);
+    char buf[200];
+    snprintf(buf, sizeof(buf),
+             "unsealed-files %d replayed %d dropped %d discarded-bytes %llu",
+             recovery_stats_.files, recovery_stats_.replayed,
+             recovery_stats_.dropped,
+             static_cast<unsigned long long>(
+                 recovery_stats_.discarded_bytes));
+    value->assign(buf);
+    return true;
+  }
   return indexdb_->GetProperty(property, value);
 }
 
@@ -212,18 +1286,552 @@ void ColumnDB::CompactRange(const Slice* begin, const Slice* end) {
   indexdb_->CompactRange(begin, end);
 }
 
+// Make "target" share the contents of "src": a hard link if both are on
+// the same file system, else a copy.
+static Status ShareFile(Env* env, const std::string& src,
+                        const std::string& target) {
+  // A copy must not truncate an existing link to "src"
+  env->DeleteFile(target);
+  Status s = env->LinkFile(src, target);
+  if (!s.ok()) {
+    s = env->CopyFile(src, target);
+  }
+  return s;
+}
+
+// The index entries of the range are moved into tables in "dname" by
+// indexdb_.  Their values stay in the data files, which are hard linked
+// into "dname" under their own numbers, so no value is copied.  Each
+// database later collects its share of a linked file on its own, and the
+// file is gone once both have.
 Status ColumnDB::BulkSplit(const WriteOptions& options, uint64_t sequence,
                            const Slice* begin, const Slice* end,
                            const std::string& dname) {
-  return Status::OK();
+  PauseGC();
+  Status s = indexdb_->BulkSplit(options, sequence, begin, end, dname);
+  std::map<uint64_t, uint64_t> live;
+  if (s.ok()) {
+    s = ScanSplitTables(dname, NULL, &live);
+  }
+  bool referenced_current = false;
+  if (s.ok()) {
+    MutexLock mutex_lock(&mutex_);
+    referenced_current = (live.count(GetLogNumber()) > 0);
+  }
+  if (referenced_current) {
+    // Close the current data file, so that the linked file is complete
+    Writer w(&mutex_);
+    w.new_file = true;
+    s = WriteRecords(&w);
+  }
+  if (s.ok()) {
+    // A file switched out just before is complete once it is sealed
+    MutexLock mutex_lock(&mutex_);
+    while (prev_datafile_ != NULL && live.count(prev_log_number_) > 0) {
+      bg_file_cv_.Wait();
+    }
+  }
+  for (std::map<uint64_t, uint64_t>::iterator it = live.begin();
+       s.ok() && it != live.end(); ++it) {
+    s = ShareFile(env_, DataFileName(dbname_, it->first),
+                  DataFileName(dname, it->first));
+  }
+  ResumeGC();
+  return s;
 }
 
+// Adopt the data files left in "dirname" by BulkSplit() under new numbers,
+// point the index entries of its tables at them, and add the tables to
+// indexdb_.
 Status ColumnDB::BulkInsert(const WriteOptions& options,
-                  const std::string& fname,
-                  uint64_t min_sequence_number,
-                  uint64_t max_sequence_number) {
-  return indexdb_->BulkInsert(options, fname,
-                              min_sequence_number, max_sequence_number);;
+                            const std::string& dirname,
+                            uint64_t min_sequence_number,
+                            uint64_t max_sequence_number) {
+  std::vector<std::string> filenames;
+  Status s = env_->GetChildren(dirname, &filenames);
+  if (!s.ok()) {
+    return s;
+  }
+  PauseGC();
+  std::map<uint64_t, uint64_t> renumber;
+  {
+    MutexLock mutex_lock(&mutex_);
+    uint64_t number;
+    FileType type;
+    for (size_t i = 0; i < filenames.size(); i++) {
+      if (ParseFileName(filenames[i], &number, &type) &&
+          type == kDataFile) {
+        renumber[number] = NewLogNumber();
+      }
+    }
+  }
+  std::map<uint64_t, uint64_t> live;
+  if (!renumber.empty()) {
+    s = ScanSplitTables(dirname, &renumber, &live);
+  }
+
+  std::vector<uint64_t> adopted;
+  for (std::map<uint64_t, uint64_t>::iterator it = renumber.begin();
+       s.ok() && it != renumber.end(); ++it) {
+    const std::string src = DataFileName(dirname, it->first);
+    const std::string target = DataFileName(dbname_, it->second);
+    s = env_->RenameFile(src, target);
+    if (!s.ok()) {
+      s = ShareFile(env_, src, target);
+    }
+    uint64_t size = 0;
+    if (s.ok()) {
+      s = env_->GetFileSize(target, &size);
+    }
+    if (s.ok()) {
+      MutexLock mutex_lock(&mutex_);
+      DataFileInfo& info = files_[it->second];
+      info.size = size;
+      info.dead = size - std::min(size, live[it->first]);
+      adopted.push_back(it->second);
+    }
+  }
+  if (s.ok()) {
+    s = indexdb_->BulkInsert(options, dirname,
+                             min_sequence_number, max_sequence_number);
+  }
+
+  {
+    MutexLock mutex_lock(&mutex_);
+    if (!s.ok()) {
+      // Let collection find out what, if anything, is still referenced
+      for (size_t i = 0; i < adopted.size(); i++) {
+        DataFileInfo& info = files_[adopted[i]];
+        info.dead = info.size;
+      }
+    }
+    SaveDataStats();
+  }
+  ResumeGC();
+  return s;
+}
+
+// Scan the tables in the split directory "dir", and add to (*live)[n] the
+// estimated bytes of the records their index entries refer to in data
+// file n.  If "renumber" is non-NULL, also rewrite the tables so that
+// entries refer to data file (*renumber)[n] instead.
+Status ColumnDB::ScanSplitTables(const std::string& dir,
+                                 const std::map<uint64_t, uint64_t>* renumber,
+                                 std::map<uint64_t, uint64_t>* live) {
+  std::vector<std::string> filenames;
+  Status s = env_->GetChildren(dir, &filenames);
+  if (!s.ok()) {
+    return s;
+  }
+  // indexdb_ stores internal keys in its tables
+  InternalKeyComparator icmp(options_.comparator);
+  InternalFilterPolicy ipolicy(options_.filter_policy);
+  Options table_options = options_;
+  table_options.comparator = &icmp;
+  table_options.filter_policy =
+      (options_.filter_policy != NULL) ? &ipolicy : NULL;
+  table_options.block_cache = NULL;
+  table_options.persistent_cache = NULL;
+
+  uint64_t number;
+  FileType type;
+  for (size_t i = 0; s.ok() && i < filenames.size(); i++) {
+    if (ParseFileName(filenames[i], &number, &type) && type == kTableFile) {
+      s = ScanSplitTable(dir + "/" + filenames[i], table_options,
+                         renumber, live);
+    }
+  }
+  return s;
+}
+
+Status ColumnDB::ScanSplitTable(const std::string& fname,
+                                const Options& options,
+                                const std::map<uint64_t, uint64_t>* renumber,
+                                std::map<uint64_t, uint64_t>* live) {
+  uint64_t file_size;
+  Status s = env_->GetFileSize(fname, &file_size);
+  if (!s.ok()) {
+    return s;
+  }
+  RandomAccessFile* file = NULL;
+  Table* table = NULL;
+  s = env_->NewRandomAccessFile(fname, &file);
+  if (s.ok()) {
+    s = Table::Open(options, file, file_size, &table);
+  }
+
+  // The rewritten table keeps the ".sst" suffix, which tells HDFSEnv
+  // where it lives.
+  const std::string tmp = fname.substr(0, fname.size() - 4) + ".tmp.sst";
+  WritableFile* outfile = NULL;
+  TableBuilder* builder = NULL;
+  if (s.ok() && renumber != NULL) {
+    s = env_->NewWritableFile(tmp, &outfile);
+    if (s.ok()) {
+      builder = new TableBuilder(options, outfile, true);
+    }
+  }
+
+  if (s.ok()) {
+    ReadOptions read_options;
+    read_options.fill_cache = false;
+    Iterator* iter = table->NewIterator(read_options);
+    std::string entry;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      Slice value = iter->value();
+      bool is_inline;
+      Slice inline_value;
+      datafile::Location location;
+      if (!ParseIndexEntry(value, &is_inline, &inline_value, &location)) {
+        s = Status::Corruption("bad ColumnDB index entry", fname);
+        break;
+      }
+      if (!is_inline) {
+        // As in ValueDropped(), kFormat1 locations only bound the size
+        (*live)[location.file_number] +=
+            (location.format == datafile::kFormat1) ? location.size - 512
+                                                    : location.size;
+        if (renumber != NULL) {
+          std::map<uint64_t, uint64_t>::const_iterator it =
+              renumber->find(location.file_number);
+          if (it == renumber->end()) {
+            s = Status::Corruption("split refers to a missing data file",
+                                   fname);
+            break;
+          }
+          location.file_number = it->second;
+          entry = LocationEntry(location);
+          value = entry;
+        }
+      }
+      if (builder != NULL) {
+        builder->Add(iter->key(), value);
+      }
+    }
+    if (s.ok()) {
+      s = iter->status();
+    }
+    delete iter;
+  }
+  delete table;
+  delete file;
+
+  if (builder != NULL) {
+    if (s.ok()) {
+      s = builder->Finish();
+    } else {
+      builder->Abandon();
+    }
+    delete builder;
+  }
+  if (outfile != NULL) {
+    if (s.ok()) {
+      s = outfile->Sync();
+    }
+    if (s.ok()) {
+      s = outfile->Close();
+    }
+    delete outfile;
+    if (s.ok()) {
+      s = env_->DeleteFile(fname);
+    }
+    if (s.ok()) {
+      s = env_->RenameFile(tmp, fname);
+    }
+    if (!s.ok()) {
+      env_->DeleteFile(tmp);
+    }
+  }
+  return s;
+}
+
+void ColumnDB::ValueDropped(const Slice& key, const Slice& value) {
+  bool is_inline;
+  Slice inline_value;
+  datafile::Location location;
+  if (!ParseIndexEntry(value, &is_inline, &inline_value, &location) ||
+      is_inline) {
+    return;  // Not a location
+  }
+  const uint64_t file_number = location.file_number;
+  MutexLock mutex_lock(&mutex_);
+  std::map<uint64_t, DataFileInfo>::iterator it = files_.find(file_number);
+  if (it == files_.end()) {
+    return;
+  }
+  DataFileInfo& info = it->second;
+  uint64_t record_size = location.size;
+  if (location.format == datafile::kFormat1) {
+    // The location only tells the record size rounded up to 1KB, so count
+    // the average record of the file if it is in that range, else the
+    // middle of the range.  Collection works out exact sizes.
+    const uint64_t buf_size = location.size;
+    record_size = buf_size - 512;
+    if (info.records > 0) {
+      const uint64_t average = info.size / info.records;
+      if (average + 1024 > buf_size && average <= buf_size) {
+        record_size = average;
+      }
+    }
+    record_size = std::max<uint64_t>(record_size,
+                                     sizeof(uint64_t) + key.size() + 1);
+  }
+  info.dead = std::min(info.size, info.dead + record_size);
+  if (NeedsGC(file_number, info)) {
+    bg_gc_cv_.SignalAll();
+  }
+}
+
+bool ColumnDB::NeedsGC(uint64_t file_number,
+                       const DataFileInfo& info) const {
+  return (file_number != current_log_number_ &&
+          file_number != prev_log_number_ &&
+          !info.gc_failed &&
+          info.size - info.dead <
+              options_.value_gc_live_ratio * info.size);
+}
+
+// Pick the data file with the smallest share of live bytes among those
+// that need collection.
+bool ColumnDB::PickGCFile(uint64_t* file_number) {
+  mutex_.AssertHeld();
+  bool found = false;
+  double best_ratio = 0;
+  for (std::map<uint64_t, DataFileInfo>::iterator it = files_.begin();
+       it != files_.end(); ++it) {
+    const DataFileInfo& info = it->second;
+    if (!NeedsGC(it->first, info)) {
+      continue;
+    }
+    const double ratio = static_cast<double>(info.size - info.dead) /
+                         info.size;
+    if (!found || ratio < best_ratio) {
+      found = true;
+      best_ratio = ratio;
+      *file_number = it->first;
+    }
+  }
+  return found;
+}
+
+void ColumnDB::BGGCWork(void* db) {
+  reinterpret_cast<ColumnDB*>(db)->BackgroundGC();
+}
+
+void ColumnDB::BackgroundGC() {
+  MutexLock mutex_lock(&mutex_);
+  while (!shutting_down_.Acquire_Load()) {
+    uint64_t file_number;
+    if (gc_pauses_ > 0 || !PickGCFile(&file_number)) {
+      bg_gc_cv_.Wait();
+      continue;
+    }
+    bg_gc_collecting_ = true;
+    mutex_.Unlock();
+    Status s = CollectDataFile(file_number);
+    mutex_.Lock();
+    bg_gc_collecting_ = false;
+    bg_gc_cv_.SignalAll();
+    if (!s.ok()) {
+      std::map<uint64_t, DataFileInfo>::iterator it = files_.find(file_number);
+      if (it != files_.end()) {
+        it->second.gc_failed = true;
+      }
+      gc_stats_.failures++;
+    }
+  }
+  bg_gc_running_ = false;
+  bg_gc_cv_.SignalAll();
+}
+
+// Move the live records of a data file to the current data file, swap
+// their index entries, and delete the file.  The file is first scanned to
+// find the exact live records, since the dead bytes are only estimated.
+Status ColumnDB::CollectDataFile(uint64_t file_number) {
+  const uint64_t start_micros = env_->NowMicros();
+  uint64_t io_bytes = 0;
+
+  const std::string fname = DataFileName(dbname_, file_number);
+  uint64_t file_size;
+  Status s = env_->GetFileSize(fname, &file_size);
+  RandomAccessFile* file = NULL;
+  if (s.ok()) {
+    s = env_->NewRandomAccessFile(fname, &file);
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  datafile::Reader reader(file, file_size);
+  std::vector<std::string> live_keys;
+  std::vector<uint64_t> live_offsets;
+  std::vector<uint64_t> live_sizes;
+  uint64_t live_bytes = 0;
+  Slice key, value;
+  uint64_t offset, record_size;
+  while (!shutting_down_.Acquire_Load() &&
+         reader.ReadRecord(&key, &value, &offset, &record_size)) {
+    if (reader.deletion()) {
+      continue;
+    }
+    const datafile::Location location = { file_number, offset, record_size,
+                                          reader.format() };
+    std::string current;
+    if (indexdb_->Get(ReadOptions(), key, &current).ok() &&
+        current == LocationEntry(location)) {
+      live_keys.push_back(key.ToString());
+      live_offsets.push_back(offset);
+      live_sizes.push_back(record_size);
+      live_bytes += record_size;
+    }
+    Throttle(env_, options_.value_gc_bytes_per_second, start_micros,
+             reader.bytes_read());
+  }
+  s = reader.status();
+  if (s.ok() && reader.sealed() && reader.dropped_bytes() > 0) {
+    // Damaged records may still be referenced; keep the file as it is
+    s = Status::Corruption("damaged records in data file", fname);
+  }
+  const int format = reader.format();
+  io_bytes = reader.bytes_read();
+  delete file;
+  if (!s.ok() || shutting_down_.Acquire_Load()) {
+    return s;
+  }
+
+  {
+    MutexLock mutex_lock(&mutex_);
+    gc_stats_.bytes_read += io_bytes;
+    std::map<uint64_t, DataFileInfo>::iterator it = files_.find(file_number);
+    if (it == files_.end()) {
+      return s;
+    }
+    it->second.dead = it->second.size - std::min(live_bytes,
+                                                 it->second.size);
+    if (!NeedsGC(file_number, it->second)) {
+      return s;  // The estimate was too pessimistic
+    }
+  }
+
+  std::vector<std::string> keys, values, locations;
+  ReadOptions read_options;
+  read_options.fill_cache = false;  // The file is going away
+  size_t batch_bytes = 0;
+  uint64_t moved_bytes = 0;
+  std::string record;
+  for (size_t i = 0; i < live_keys.size() && s.ok(); i++) {
+    if (shutting_down_.Acquire_Load()) {
+      return s;
+    }
+    record.resize(live_sizes[i]);
+    Slice result;
+    s = data_cache_->Get(read_options, file_number, live_offsets[i],
+                         live_sizes[i], &result, &record[0]);
+    if (s.ok() && result.size() != live_sizes[i]) {
+      s = Status::Corruption("truncated record in data file");
+    }
+    if (!s.ok()) {
+      break;
+    }
+    Slice value;
+    s = ParseRecord(format, result, &value);
+    if (!s.ok()) {
+      break;
+    }
+    keys.push_back(live_keys[i]);
+    values.push_back(value.ToString());
+    const datafile::Location location = { file_number, live_offsets[i],
+                                          live_sizes[i], format };
+    locations.push_back(LocationEntry(location));
+    batch_bytes += live_sizes[i];
+    if (batch_bytes >= kGCBatchBytes || i + 1 == live_keys.size()) {
+      s = RelocateRecords(keys, values, locations, &moved_bytes);
+      keys.clear();
+      values.clear();
+      locations.clear();
+      batch_bytes = 0;
+    }
+    io_bytes += 2 * live_sizes[i];
+    Throttle(env_, options_.value_gc_bytes_per_second, start_micros,
+             io_bytes);
+  }
+  if (!s.ok()) {
+    return s;
+  }
+
+  MutexLock mutex_lock(&mutex_);
+  files_.erase(file_number);
+  obsolete_files_.push_back(file_number);
+  gc_stats_.files++;
+  gc_stats_.bytes_moved += moved_bytes;
+  DeleteObsoleteDataFiles();
+  SaveDataStats();
+  return s;
+}
+
+// Append copies of the records to the current data file, and point the
+// index at them, except for keys updated since "locations" were read.
+// Copies of those are not written at all, since recovery would take them
+// for lost updates of their keys.
+Status ColumnDB::RelocateRecords(const std::vector<std::string>& keys,
+                                 const std::vector<std::string>& values,
+                                 const std::vector<std::string>& locations,
+                                 uint64_t* bytes_moved) {
+  Writer w(&mutex_);
+  w.expected = &locations;
+  w.sync = true;  // The copies must be durable before the old file is gone
+  w.encoder.inline_threshold = options_.value_inline_threshold;
+  for (size_t i = 0; i < keys.size(); i++) {
+    w.encoder.Put(keys[i], values[i]);
+  }
+  Status s = w.encoder.status;
+  if (s.ok()) {
+    s = WriteRecords(&w);
+  }
+  if (s.ok()) {
+    for (size_t i = 0; i < w.encoder.sizes.size(); i++) {
+      *bytes_moved += w.encoder.sizes[i];
+    }
+  }
+  return s;
+}
+
+// Delete the collected data files once no iterator can read them.
+void ColumnDB::DeleteObsoleteDataFiles() {
+  mutex_.AssertHeld();
+  if (live_iterators_ > 0) {
+    return;
+  }
+  for (size_t i = 0; i < obsolete_files_.size(); i++) {
+    data_cache_->Evict(obsolete_files_[i]);
+    env_->DeleteFile(DataFileName(dbname_, obsolete_files_[i]));
+  }
+  obsolete_files_.clear();
+}
+
+void ColumnDB::PauseGC() {
+  MutexLock mutex_lock(&mutex_);
+  gc_pauses_++;
+  while (bg_gc_collecting_) {
+    bg_gc_cv_.Wait();
+  }
+}
+
+void ColumnDB::ResumeGC() {
+  MutexLock mutex_lock(&mutex_);
+  gc_pauses_--;
+  bg_gc_cv_.SignalAll();
+}
+
+void ColumnDB::AddIterator() {
+  MutexLock mutex_lock(&mutex_);
+  live_iterators_++;
+}
+
+void ColumnDB::RemoveIterator() {
+  MutexLock mutex_lock(&mutex_);
+  if (--live_iterators_ == 0) {
+    DeleteObsoleteDataFiles();
+  }
 }
 
 } // namespace leveldb
@@ -8,9 +8,14 @@
 #ifndef STORAGE_LEVELDB_DB_COLUMN_DB_H_
 #define STORAGE_LEVELDB_DB_COLUMN_DB_H_
 
+#include <deque>
+#include <map>
+#include <vector>
 #include "db/db_impl.h"
 #include "db/membuf.h"
 #include "db/data_cache.h"
+#include "db/data_file.h"
+#include "leveldb/compaction_listener.h"
 
 namespace leveldb {
 
@@ -47,9 +52,48 @@ class ColumnDB : public DB {
   friend class ColumnDBIter;
 
  private:
+  // Forwards the values dropped by compactions of indexdb_
+  class DropListener : public CompactionListener {
+   public:
+    explicit DropListener(ColumnDB* db) : db_(db) { }
+    virtual void ValueDropped(const Slice& key, const Slice& value) {
+      db_->ValueDropped(key, value);
+    }
+   private:
+    ColumnDB* db_;
+  };
+
+  struct DataFileInfo {
+    uint64_t size;      // Bytes of records in the file
+    uint64_t records;   // Number of records, or 0 if unknown
+    uint64_t dead;      // Estimated bytes of records no longer referenced
+    bool gc_failed;     // Do not try to collect it again
+    DataFileInfo() : size(0), records(0), dead(0), gc_failed(false) { }
+  };
+
+  struct GCStats {
+    int files;          // Data files collected
+    int failures;
+    uint64_t bytes_read;
+    uint64_t bytes_moved;
+    GCStats() : files(0), failures(0), bytes_read(0), bytes_moved(0) { }
+  };
+
+  struct RecoveryStats {
+    int files;          // Unsealed data files checked at open
+    int replayed;       // Records whose lost index entries were restored
+    int dropped;        // Stale index entries dropped since open
+    uint64_t discarded_bytes;  // Past the intact records of unsealed files
+    RecoveryStats()
+        : files(0), replayed(0), dropped(0), discarded_bytes(0) { }
+  };
+
+  struct Writer;
+  struct FileRecovery;
 
   Env* const env_;
-  const Options options_;  // options_.comparator == &internal_comparator_
+  DropListener listener_;
+  const Options options_;  // options_.compaction_listener == &listener_
   const std::string dbname_;
 
   DB* indexdb_;
@@ -57,11 +101,46 @@ class ColumnDB : public DB {
   // State below is protected by mutex_
   port::Mutex mutex_;
   WritableFile* datafile_;
+  bool datafile_broken_;  // A failed append left it behind membuf_
+  datafile::FooterBuilder footer_;  // Of datafile_
   MemBuffer* membuf_;
+
+  // The previous data file while the background thread seals it.  Its
+  // records are read from prev_membuf_ until then.
+  WritableFile* prev_datafile_;
+  datafile::FooterBuilder prev_footer_;
+  MemBuffer* prev_membuf_;
+  uint64_t prev_log_number_;  // 0 if none
+
+  // The next data file, created ahead by the background thread
+  WritableFile* next_datafile_;
+  uint64_t next_log_number_;
+  Status next_status_;        // Error creating it, if any
+
+  bool bg_file_running_;
+  port::CondVar bg_file_cv_;  // Signalled when any of the above changes
+
+  // Error sealing a data file, which may have lost records whose index
+  // entries are published.  Later writes fail with it.
+  Status bg_error_;
+
   DataCache* data_cache_;
   uint64_t log_number_;
   uint64_t current_log_number_;
 
+  std::deque<Writer*> writers_;
+
+  std::map<uint64_t, DataFileInfo> files_;
+  std::vector<uint64_t> obsolete_files_;  // Collected, waiting for iterators
+  int live_iterators_;
+  port::AtomicPointer shutting_down_;
+  bool bg_gc_running_;
+  bool bg_gc_collecting_;   // A data file is being collected
+  int gc_pauses_;           // Splits and bulk inserts in progress
+  port::CondVar bg_gc_cv_;  // Signalled when GC may have work or finishes
+  GCStats gc_stats_;
+  RecoveryStats recovery_stats_;
+
   uint64_t NewLogNumber() {
     return ++log_number_;
   }
@@ -72,21 +151,113 @@ class ColumnDB : public DB {
     return current_log_number_;
   }
 
+  // Create data file "number" and write its header.
+  Status CreateDataFile(uint64_t number, WritableFile** result);
+  // Switch to the next data file, and reset membuf_ for it.
   Status NewDataFile();
+  // Write the footer of a data file and close it.
+  static Status SealDataFile(WritableFile* file,
+                             const datafile::FooterBuilder& footer);
+  static void BGFileWork(void* db);
+  void BackgroundFileWork();
   Status InternalGet(const ReadOptions& options,
-                     uint64_t file_number,
-                     uint64_t offset,
-                     uint64_t buf_size,
+                     const datafile::Location& location,
                      char* scratch, Slice* result);
+  // Read "size" bytes at "offset" of a data file, which may be short at
+  // the end of the file.
+  Status ReadData(const ReadOptions& options, uint64_t file_number,
+                  uint64_t offset, uint64_t size,
+                  char* scratch, Slice* result);
+  // Store in *value the value of the record of the given format that
+  // "input" starts with.
+  static Status ParseRecord(int format, const Slice& input, Slice* value);
 
-  void DecodeFileLoc(uint64_t file_loc, uint64_t* file_number,
-                     uint64_t* offset, uint64_t* buf_size) {
+  // Queue of writers, as in DBImpl.  The front writer appends the records
+  // of a group of writers and publishes their locations.
+  Status WriteRecords(Writer* w);
+  Status AppendGroup(Writer* last_writer);
+  Status DropChangedUpdates(Writer* w);
+  Status WriteRegion(size_t offset, size_t size);
+
+  // Find the data files left by earlier incarnations and their dead bytes.
+  Status RecoverDataFiles();
+  void LoadDataStats();
+  void SaveDataStats();
+  // Mark a new database with the format of its index entries, or convert
+  // those of a database from before the entries were tagged.
+  Status UpgradeIndexEntries(bool existed);
+
+  // Crash recovery.  Only the data files written last can be unsealed, and
+  // those may end in damaged records whose index entries must go, or in
+  // records whose index entries were lost.  Each is checked and sealed by
+  // its own thread.
+  Status RecoverUnsealedFiles();
+  static void BGRecoverWork(void* arg);
+  Status RecoverDataFile(FileRecovery* r);
+  // Whether "location" lies past the records of its sealed file, which
+  // only entries whose records were lost in a crash do.
+  bool IsDangling(const datafile::Location& location);
+
+  // Value garbage collection
+  void ValueDropped(const Slice& key, const Slice& value);
+  bool NeedsGC(uint64_t file_number, const DataFileInfo& info) const;
+  bool PickGCFile(uint64_t* file_number);
+  static void BGGCWork(void* db);
+  void BackgroundGC();
+  Status CollectDataFile(uint64_t file_number);
+  Status RelocateRecords(const std::vector<std::string>& keys,
+                         const std::vector<std::string>& values,
+                         const std::vector<std::string>& locations,
+                         uint64_t* bytes_moved);
+  void DeleteObsoleteDataFiles();
+
+  // Keep collection from moving values or deleting data files while
+  // index entries are moved between databases.
+  void PauseGC();
+  void ResumeGC();
+
+  // Split support.  Index entries are moved in tables, and the data files
+  // they refer to are shared by hard links rather than copied.
+  Status ScanSplitTables(const std::string& dir,
+                         const std::map<uint64_t, uint64_t>* renumber,
+                         std::map<uint64_t, uint64_t>* live);
+  Status ScanSplitTable(const std::string& fname, const Options& options,
+                        const std::map<uint64_t, uint64_t>* renumber,
+                        std::map<uint64_t, uint64_t>* live);
+
+  // Iterators that may still read collected files
+  void AddIterator();
+  void RemoveIterator();
+
+  // Each value in indexdb_ starts with a tag telling its form: either
+  // the value itself, or the location of its record in a data file.
+  // Records of kFormat1 files are located by a fixed64, those of
+  // kFormat2 files by their varint64 file number, offset and size.
+  enum IndexEntryType {
+    kInlineValue = 0x1,
+    kValueLocation = 0x2,
+    kValueLocation2 = 0x3
+  };
+  static std::string LocationEntry(const datafile::Location& location);
+  // Parse an index entry into either *value or *location, and set
+  // *is_inline accordingly.  Returns false if the entry is malformed.
+  static bool ParseIndexEntry(const Slice& entry, bool* is_inline,
+                              Slice* value, datafile::Location* location);
+
+  static void DecodeFileLoc(uint64_t file_loc, uint64_t* file_number,
+                            uint64_t* offset, uint64_t* buf_size) {
     *file_number = file_loc >> 42;
     file_loc = file_loc & ((1L<<42)-1);
     *offset = file_loc >> 10;
     *buf_size = (file_loc & 1023) * 1024;
   }
 
+  // lognumber--22b location--32b  value size/1KB--10b
+  static uint64_t EncodeFileLoc(uint64_t file_number, uint64_t offset,
+                                uint64_t record_size) {
+    return (file_number<<42)+(offset<<10)+((record_size+1023)/1024);
+  }
+
   // No copying allowed
   ColumnDB(const ColumnDB&);
   void operator=(const ColumnDB&);
@@ -0,0 +1,918 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/column_db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include "db/filename.h"
+#include "leveldb/env.h"
+#include "leveldb/iterator.h"
+#include "leveldb/write_batch.h"
+#include "port/port.h"
+#include "util/coding.h"
+#include "util/mutexlock.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static std::string Key(int i) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return std::string(buf);
+}
+
+static std::string Value(int i, int version) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "%d.%d.", i, version);
+  std::string result(buf);
+  result.append(1000, 'a' + (i % 26));
+  return result;
+}
+
+// Env whose data file appends fail while fail_appends_ is non-NULL
+class FailingEnv : public EnvWrapper {
+ public:
+  port::AtomicPointer fail_appends_;
+
+  explicit FailingEnv(Env* base) : EnvWrapper(base) {
+    fail_appends_.Release_Store(NULL);
+  }
+
+  Status NewWritableFile(const std::string& f, WritableFile** r) {
+    class DataFile : public WritableFile {
+     private:
+      FailingEnv* env_;
+      WritableFile* base_;
+
+     public:
+      DataFile(FailingEnv* env, WritableFile* base)
+          : env_(env),
+            base_(base) {
+      }
+      ~DataFile() { delete base_; }
+      Status Append(const Slice& data) {
+        if (env_->fail_appends_.Acquire_Load() != NULL) {
+          return Status::IOError("simulated append error");
+        }
+        return base_->Append(data);
+      }
+      Status Close() { return base_->Close(); }
+      Status Flush() { return base_->Flush(); }
+      Status Sync() { return base_->Sync(); }
+    };
+
+    Status s = target()->NewWritableFile(f, r);
+    if (s.ok() && strstr(f.c_str(), ".dat") != NULL) {
+      *r = new DataFile(this, *r);
+    }
+    return s;
+  }
+};
+
+class ColumnDBTest {
+ public:
+  std::string dbname_;
+  Env* env_;
+  Options options_;
+  ColumnDB* db_;
+
+  ColumnDBTest() : env_(Env::Default()), db_(NULL) {
+    dbname_ = test::TmpDir() + "/column_db_test";
+    options_.create_if_missing = true;
+    options_.value_gc_bytes_per_second = 0;
+    DestroyDB(dbname_, options_);
+  }
+
+  ~ColumnDBTest() {
+    delete db_;
+    DestroyDB(dbname_, options_);
+  }
+
+  Status TryReopen() {
+    delete db_;
+    db_ = NULL;
+    Status s;
+    db_ = new ColumnDB(options_, dbname_, s);
+    return s;
+  }
+
+  void Reopen() {
+    ASSERT_OK(TryReopen());
+  }
+
+  std::string Get(const std::string& k) {
+    return Get(db_, k);
+  }
+
+  std::string Get(DB* db, const std::string& k) {
+    std::string result;
+    Status s = db->Get(ReadOptions(), k, &result);
+    if (s.IsNotFound()) {
+      result = "NOT_FOUND";
+    } else if (!s.ok()) {
+      result = s.ToString();
+    }
+    return result;
+  }
+
+  // Return the named counter of the "leveldb.value-cache" property
+  int CacheStat(const char* name) {
+    std::string stats;
+    ASSERT_TRUE(db_->GetProperty("leveldb.value-cache", &stats));
+    const char* p = strstr(stats.c_str(), name);
+    ASSERT_TRUE(p != NULL);
+    return atoi(p + strlen(name) + 1);
+  }
+
+  std::vector<uint64_t> DataFiles() {
+    return DataFiles(dbname_);
+  }
+
+  std::vector<uint64_t> DataFiles(const std::string& dir) {
+    std::vector<std::string> filenames;
+    env_->GetChildren(dir, &filenames);
+    std::vector<uint64_t> result;
+    uint64_t number;
+    FileType type;
+    for (size_t i = 0; i < filenames.size(); i++) {
+      if (ParseFileName(filenames[i], &number, &type) && type == kDataFile) {
+        result.push_back(number);
+      }
+    }
+    return result;
+  }
+
+  // Wait until the background collector has collected "n" files.
+  bool WaitForCollected(int n) {
+    return WaitForCollected(db_, n);
+  }
+
+  bool WaitForCollected(DB* db, int n) {
+    for (int i = 0; i < 1000; i++) {
+      std::string stats;
+      ASSERT_TRUE(db->GetProperty("leveldb.value-gc", &stats));
+      int collected = 0;
+      const char* p = strstr(stats.c_str(), "collected ");
+      if (p != NULL && sscanf(p, "collected %d", &collected) == 1 &&
+          collected >= n) {
+        return true;
+      }
+      env_->SleepForMicroseconds(10000);
+    }
+    return false;
+  }
+
+  // Copy the files of the open database to "dir", as a crash would leave
+  // them, and return the name of its data file with records.
+  std::string CrashCopy(const std::string& dir) {
+    DestroyDB(dir, options_);
+    env_->CreateDir(dir);
+    std::vector<std::string> filenames;
+    ASSERT_OK(env_->GetChildren(dbname_, &filenames));
+    for (size_t i = 0; i < filenames.size(); i++) {
+      std::string contents;
+      if (ReadFileToString(env_, dbname_ + "/" + filenames[i],
+                           &contents).ok()) {
+        ASSERT_OK(WriteStringToFile(env_, contents,
+                                    dir + "/" + filenames[i]));
+      }
+    }
+    // The newer data file is the one created ahead
+    std::vector<uint64_t> files = DataFiles(dir);
+    return DataFileName(dir, *std::min_element(files.begin(), files.end()));
+  }
+
+  // Return the contents of data file "fname" up to the end of its records,
+  // without the space an unclosed file may have preallocated.
+  std::string ReadRecords(const std::string& fname) {
+    uint64_t file_size;
+    RandomAccessFile* file;
+    ASSERT_OK(env_->GetFileSize(fname, &file_size));
+    ASSERT_OK(env_->NewRandomAccessFile(fname, &file));
+    datafile::Reader reader(file, file_size);
+    Slice key, value;
+    uint64_t offset, size;
+    while (reader.ReadRecord(&key, &value, &offset, &size)) { }
+    delete file;
+    std::string contents;
+    ASSERT_OK(ReadFileToString(env_, fname, &contents));
+    contents.resize(reader.records_end());
+    return contents;
+  }
+
+  // Return the named counter of the "leveldb.value-recovery" property
+  int RecoveryStat(DB* db, const char* name) {
+    std::string stats;
+    ASSERT_TRUE(db->GetProperty("leveldb.value-recovery", &stats));
+    const char* p = strstr(stats.c_str(), name);
+    ASSERT_TRUE(p != NULL);
+    return atoi(p + strlen(name) + 1);
+  }
+
+  int LinkCount(const std::string& fname) {
+    struct stat sbuf;
+    ASSERT_EQ(0, stat(fname.c_str(), &sbuf));
+    return sbuf.st_nlink;
+  }
+};
+
+TEST(ColumnDBTest, Empty) {
+  Reopen();
+  ASSERT_EQ("NOT_FOUND", Get("foo"));
+}
+
+TEST(ColumnDBTest, ReadWrite) {
+  Reopen();
+  ASSERT_OK(db_->Put(WriteOptions(), "foo", "v1"));
+  ASSERT_EQ("v1", Get("foo"));
+  ASSERT_OK(db_->Put(WriteOptions(), "bar", "v2"));
+  ASSERT_OK(db_->Put(WriteOptions(), "foo", "v3"));
+  ASSERT_EQ("v3", Get("foo"));
+  ASSERT_EQ("v2", Get("bar"));
+}
+
+TEST(ColumnDBTest, InlineValues) {
+  options_.value_inline_threshold = 100;
+  Reopen();
+  const std::string small(99, 's');
+  const std::string large(100, 'l');
+  ASSERT_OK(db_->Put(WriteOptions(), "a", small));
+  ASSERT_OK(db_->Put(WriteOptions(), "b", large));
+  ASSERT_OK(db_->Put(WriteOptions(), "c", ""));
+  ASSERT_EQ(small, Get("a"));
+  ASSERT_EQ(large, Get("b"));
+  ASSERT_EQ("", Get("c"));
+
+  // Only the large value went to the data file
+  std::string stats;
+  ASSERT_TRUE(db_->GetProperty("leveldb.value-gc", &stats));
+  ASSERT_TRUE(strstr(stats.c_str(), " bytes 107 ") != NULL);
+
+  // A key can switch between the two forms
+  ASSERT_OK(db_->Put(WriteOptions(), "a", large));
+  ASSERT_OK(db_->Put(WriteOptions(), "b", small));
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  iter->SeekToFirst();
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ(large, iter->value().ToString());
+  iter->Next();
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ(small, iter->value().ToString());
+  iter->Next();
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ("", iter->value().ToString());
+  iter->Next();
+  ASSERT_TRUE(!iter->Valid());
+  delete iter;
+
+  Reopen();
+  ASSERT_EQ(large, Get("a"));
+  ASSERT_EQ(small, Get("b"));
+}
+
+TEST(ColumnDBTest, WriteBatch) {
+  Reopen();
+  ASSERT_OK(db_->Put(WriteOptions(), "a", "va"));
+  WriteBatch batch;
+  batch.Put("b", "vb");
+  batch.Delete("a");
+  batch.Put("c", "vc1");
+  batch.Put("c", "vc2");
+  batch.Put("a", "va2");
+  batch.Delete("b");
+  ASSERT_OK(db_->Write(WriteOptions(), &batch));
+  ASSERT_EQ("va2", Get("a"));
+  ASSERT_EQ("NOT_FOUND", Get("b"));
+  ASSERT_EQ("vc2", Get("c"));
+
+  // Values live in the data file, so they survive a reopen
+  Reopen();
+  ASSERT_EQ("va2", Get("a"));
+  ASSERT_EQ("vc2", Get("c"));
+}
+
+TEST(ColumnDBTest, WriteLargeBatches) {
+  const int N = 20000;
+  Reopen();
+  WriteBatch batch;
+  for (int i = 0; i < N; i++) {
+    batch.Put(Key(i), Value(i, 0));
+    if (i % 1000 == 999) {
+      ASSERT_OK(db_->Write(WriteOptions(), &batch));
+      batch.Clear();
+    }
+  }
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, 0), Get(Key(i)));
+  }
+  int count = 0;
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    ASSERT_EQ(Key(count), iter->key().ToString());
+    ASSERT_EQ(Value(count, 0), iter->value().ToString());
+    count++;
+  }
+  delete iter;
+  ASSERT_EQ(N, count);
+}
+
+namespace {
+struct WriterState {
+  ColumnDB* db;
+  int id;
+  int count;
+  port::Mutex* mu;
+  int* done;
+};
+
+void WriterThread(void* arg) {
+  WriterState* state = reinterpret_cast<WriterState*>(arg);
+  WriteOptions options;
+  options.sync = (state->id == 0);
+  for (int i = 0; i < state->count; i++) {
+    const int k = i * 4 + state->id;
+    if (i % 3 == 0) {
+      WriteBatch batch;
+      batch.Put(Key(k), Value(k, 0));
+      batch.Put(Key(k) + ".b", Value(k, 1));
+      ASSERT_OK(state->db->Write(options, &batch));
+    } else {
+      ASSERT_OK(state->db->Put(options, Key(k), Value(k, 0)));
+    }
+  }
+  MutexLock l(state->mu);
+  (*state->done)++;
+}
+}  // namespace
+
+TEST(ColumnDBTest, ConcurrentWriters) {
+  const int kThreads = 4;
+  const int kCount = 2000;
+  Reopen();
+  port::Mutex mu;
+  int done = 0;
+  WriterState state[kThreads];
+  for (int id = 0; id < kThreads; id++) {
+    state[id].db = db_;
+    state[id].id = id;
+    state[id].count = kCount;
+    state[id].mu = &mu;
+    state[id].done = &done;
+    env_->StartThread(&WriterThread, &state[id]);
+  }
+  while (true) {
+    {
+      MutexLock l(&mu);
+      if (done == kThreads) break;
+    }
+    env_->SleepForMicroseconds(10000);
+  }
+  for (int k = 0; k < kThreads * kCount; k++) {
+    ASSERT_EQ(Value(k, 0), Get(Key(k)));
+    if ((k / 4) % 3 == 0) {
+      ASSERT_EQ(Value(k, 1), Get(Key(k) + ".b"));
+    }
+  }
+}
+
+// Compare a prefetching iterator with a plain one
+static void CheckPrefetch(ColumnDB* db, int prefetch_entries) {
+  ReadOptions options;
+  options.prefetch_entries = prefetch_entries;
+  Iterator* iter = db->NewIterator(options);
+  Iterator* plain = db->NewIterator(ReadOptions());
+  int count = 0;
+  for (iter->SeekToFirst(), plain->SeekToFirst();
+       plain->Valid();
+       iter->Next(), plain->Next()) {
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(plain->key().ToString(), iter->key().ToString());
+    ASSERT_EQ(plain->value().ToString(), iter->value().ToString());
+    count++;
+  }
+  ASSERT_TRUE(!iter->Valid());
+
+  // Change of direction and seeks
+  iter->Seek(Key(100));
+  plain->Seek(Key(100));
+  for (int i = 0; i < 10; i++) {
+    iter->Next();
+    plain->Next();
+  }
+  ASSERT_EQ(plain->key().ToString(), iter->key().ToString());
+  iter->Prev();
+  plain->Prev();
+  ASSERT_EQ(plain->key().ToString(), iter->key().ToString());
+  ASSERT_EQ(plain->value().ToString(), iter->value().ToString());
+  iter->Next();
+  ASSERT_EQ(Key(110), iter->key().ToString());
+  iter->SeekToLast();
+  plain->SeekToLast();
+  ASSERT_EQ(plain->value().ToString(), iter->value().ToString());
+  delete iter;
+  delete plain;
+}
+
+TEST(ColumnDBTest, Prefetch) {
+  options_.value_inline_threshold = 500;
+  const int N = 2000;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    // Mix of inline values and values of different sizes spread over
+    // two data files, not in key order
+    const int k = (i * 7) % N;
+    std::string value = Value(k, 0);
+    value.resize(k % 2000);
+    ASSERT_OK(db_->Put(WriteOptions(), Key(k), value));
+    if (i == N / 2) {
+      Reopen();
+    }
+  }
+  CheckPrefetch(db_, 1);
+  CheckPrefetch(db_, 16);
+  CheckPrefetch(db_, 1000);
+}
+
+TEST(ColumnDBTest, ValueCache) {
+  const int N = 100;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  // Values of the current data file are read from memory
+  ASSERT_EQ(Value(0, 0), Get(Key(0)));
+  ASSERT_EQ(0, CacheStat("misses"));
+
+  Reopen();
+  ReadOptions no_fill;
+  no_fill.fill_cache = false;
+  std::string value;
+  for (int pass = 0; pass < 2; pass++) {
+    ASSERT_OK(db_->Get(no_fill, Key(0), &value));
+  }
+  ASSERT_EQ(0, CacheStat("hits"));
+  ASSERT_EQ(2, CacheStat("misses"));
+
+  for (int pass = 0; pass < 3; pass++) {
+    for (int i = 0; i < N; i++) {
+      ASSERT_EQ(Value(i, 0), Get(Key(i)));
+    }
+  }
+  ASSERT_EQ(2 * N, CacheStat("hits"));
+  ASSERT_EQ(N + 2, CacheStat("misses"));
+}
+
+TEST(ColumnDBTest, ValueTooLarge) {
+  Reopen();
+  // Values are only limited by the size of a data file
+  const std::string large(4 << 20, 'l');
+  ASSERT_OK(db_->Put(WriteOptions(), "large", large));
+  ASSERT_EQ(large, Get("large"));
+  const std::string too_large(63 << 20, 'x');
+  Status s = db_->Put(WriteOptions(), "foo", too_large);
+  ASSERT_TRUE(!s.ok());
+  ASSERT_EQ("NOT_FOUND", Get("foo"));
+
+  // Nothing of a batch is applied if one of its values is too large
+  WriteBatch batch;
+  batch.Put("bar", "v");
+  batch.Put("foo", too_large);
+  ASSERT_TRUE(!db_->Write(WriteOptions(), &batch).ok());
+  ASSERT_EQ("NOT_FOUND", Get("bar"));
+}
+
+// Values stay readable while their data file is switched out and sealed
+TEST(ColumnDBTest, ReadAcrossRotation) {
+  const int N = 40;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    const std::string value(4 << 20, 'a' + (i % 26));
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), value));
+    ASSERT_EQ(value, Get(Key(i)));
+    if (i > 0) {
+      ASSERT_EQ(std::string(4 << 20, 'a' + ((i - 1) % 26)), Get(Key(i - 1)));
+    }
+  }
+  ASSERT_GE(static_cast<int>(DataFiles().size()), 3);
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(std::string(4 << 20, 'a' + (i % 26)), Get(Key(i)));
+  }
+}
+
+// Values must not be overwritten by the data files of a later incarnation
+TEST(ColumnDBTest, ReopenKeepsValues) {
+  const int N = 100;
+  for (int pass = 0; pass < 3; pass++) {
+    Reopen();
+    for (int i = 0; i < N; i++) {
+      ASSERT_OK(db_->Put(WriteOptions(), Key(pass * N + i), Value(i, pass)));
+    }
+  }
+  Reopen();
+  for (int pass = 0; pass < 3; pass++) {
+    for (int i = 0; i < N; i++) {
+      ASSERT_EQ(Value(i, pass), Get(Key(pass * N + i)));
+    }
+  }
+}
+
+TEST(ColumnDBTest, CollectOverwrittenValues) {
+  const int N = 2000;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  // The next data file is already created, but only the first one is used
+  std::vector<uint64_t> first_files = DataFiles();
+  const uint64_t first_file = *std::min_element(first_files.begin(),
+                                                first_files.end());
+
+  // Overwrite 90% of the keys from a new data file, and let compactions
+  // drop the old values.
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    if (i % 10 != 0) {
+      ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 1)));
+    }
+  }
+  db_->CompactRange(NULL, NULL);
+  ASSERT_TRUE(WaitForCollected(1));
+
+  std::vector<uint64_t> files = DataFiles();
+  for (size_t i = 0; i < files.size(); i++) {
+    ASSERT_NE(first_file, files[i]);
+  }
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, (i % 10 == 0) ? 0 : 1), Get(Key(i)));
+  }
+
+  // The moved values and the dead-byte estimates survive a reopen
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, (i % 10 == 0) ? 0 : 1), Get(Key(i)));
+  }
+}
+
+// A collected file stays readable until the last iterator is gone
+TEST(ColumnDBTest, CollectWhileIterating) {
+  const int N = 500;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  Reopen();
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  for (int i = 0; i < N; i++) {
+    if (i % 10 != 0) {
+      ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 1)));
+    }
+  }
+  db_->CompactRange(NULL, NULL);
+  ASSERT_TRUE(WaitForCollected(1));
+  const size_t files_with_iterator = DataFiles().size();
+
+  int count = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    ASSERT_EQ(Value(count, 0), iter->value().ToString());
+    count++;
+  }
+  ASSERT_EQ(N, count);
+  delete iter;
+  ASSERT_EQ(files_with_iterator - 1, DataFiles().size());
+}
+
+// Values of a split range are shared with the receiver through hard links
+// to the data files, and each side collects its own share of them.
+TEST(ColumnDBTest, BulkSplit) {
+  options_.value_gc_live_ratio = 0;
+  Reopen();
+  const int N = 200;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+
+  // The receiver has data files of its own, numbered like the source's
+  const std::string receiver_name = dbname_ + "_receiver";
+  const std::string split_dir = dbname_ + "_split";
+  DestroyDB(receiver_name, options_);
+  DestroyDB(split_dir, options_);
+  Status s;
+  ColumnDB* receiver = new ColumnDB(options_, receiver_name, s);
+  ASSERT_OK(s);
+  ASSERT_OK(receiver->Put(WriteOptions(), "other", Value(N, 0)));
+
+  const int M = 3 * N / 4;  // First key that moves
+  const std::string begin = Key(M);
+  const std::string end = Key(N - 1);
+  const Slice begin_slice(begin), end_slice(end);
+  ASSERT_OK(db_->BulkSplit(WriteOptions(), 1, &begin_slice, &end_slice,
+                           split_dir));
+  std::vector<uint64_t> linked = DataFiles(split_dir);
+  ASSERT_EQ(1, static_cast<int>(linked.size()));
+  ASSERT_EQ(2, LinkCount(DataFileName(dbname_, linked[0])));
+
+  ASSERT_OK(receiver->BulkInsert(WriteOptions(), split_dir, 1, 1));
+  ASSERT_TRUE(DataFiles(split_dir).empty());
+  ASSERT_EQ(2, LinkCount(DataFileName(dbname_, linked[0])));
+  for (int i = 0; i < N; i++) {
+    if (i < M) {
+      ASSERT_EQ(Value(i, 0), Get(Key(i)));
+      ASSERT_EQ("NOT_FOUND", Get(receiver, Key(i)));
+    } else {
+      ASSERT_EQ("NOT_FOUND", Get(Key(i)));
+      ASSERT_EQ(Value(i, 0), Get(receiver, Key(i)));
+    }
+  }
+  ASSERT_EQ(Value(N, 0), Get(receiver, "other"));
+
+  // Most of the adopted file is dead to the receiver, so collection moves
+  // out its share and drops its link.
+  options_.value_gc_live_ratio = 0.5;
+  delete receiver;
+  receiver = new ColumnDB(options_, receiver_name, s);
+  ASSERT_OK(s);
+  ASSERT_TRUE(WaitForCollected(receiver, 1));
+  ASSERT_EQ(1, LinkCount(DataFileName(dbname_, linked[0])));
+  for (int i = M; i < N; i++) {
+    ASSERT_EQ(Value(i, 0), Get(receiver, Key(i)));
+  }
+  for (int i = 0; i < M; i++) {
+    ASSERT_EQ(Value(i, 0), Get(Key(i)));
+  }
+  ASSERT_EQ(Value(N, 0), Get(receiver, "other"));
+
+  delete receiver;
+  DestroyDB(receiver_name, options_);
+  DestroyDB(split_dir, options_);
+}
+
+// Records appended to a data file whose index entries were lost in a
+// crash get their entries back, unless the index has newer values.
+TEST(ColumnDBTest, RecoverLostIndexEntries) {
+  const int N = 100;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  const std::string crashed = test::TmpDir() + "/column_db_test_crashed";
+  const std::string fname = CrashCopy(crashed);
+  std::string contents = ReadRecords(fname);
+  datafile::AppendRecord(&contents, Key(N), Value(N, 0));
+  datafile::AppendRecord(&contents, Key(0), Value(0, 1));
+  datafile::AppendRecord(&contents, Key(N), Value(N, 1));
+  ASSERT_OK(WriteStringToFile(env_, contents, fname));
+
+  Status s;
+  ColumnDB* db = new ColumnDB(options_, crashed, s);
+  ASSERT_OK(s);
+  ASSERT_GE(RecoveryStat(db, "unsealed-files"), 1);
+  ASSERT_EQ(2, RecoveryStat(db, "replayed"));
+  ASSERT_EQ(Value(0, 1), Get(db, Key(0)));
+  ASSERT_EQ(Value(1, 0), Get(db, Key(1)));
+  ASSERT_EQ(Value(N, 1), Get(db, Key(N)));
+
+  // The file is sealed now, and not checked again
+  delete db;
+  db = new ColumnDB(options_, crashed, s);
+  ASSERT_OK(s);
+  ASSERT_EQ(0, RecoveryStat(db, "unsealed-files"));
+  ASSERT_EQ(Value(0, 1), Get(db, Key(0)));
+  ASSERT_EQ(Value(N, 1), Get(db, Key(N)));
+  delete db;
+  DestroyDB(crashed, options_);
+}
+
+// Index entries of records lost at the tail of a data file are dropped
+TEST(ColumnDBTest, RecoverLostRecords) {
+  const int N = 100;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  const std::string crashed = test::TmpDir() + "/column_db_test_crashed";
+  const std::string fname = CrashCopy(crashed);
+  std::string contents = ReadRecords(fname);
+  contents.resize(contents.size() - 10);
+  ASSERT_OK(WriteStringToFile(env_, contents, fname));
+
+  Status s;
+  ColumnDB* db = new ColumnDB(options_, crashed, s);
+  ASSERT_OK(s);
+  ASSERT_GE(RecoveryStat(db, "unsealed-files"), 1);
+  ASSERT_EQ(0, RecoveryStat(db, "replayed"));
+  ASSERT_GT(RecoveryStat(db, "discarded-bytes"), 0);
+  ASSERT_EQ(Value(N - 2, 0), Get(db, Key(N - 2)));
+  ASSERT_EQ("NOT_FOUND", Get(db, Key(N - 1)));
+  ASSERT_EQ(1, RecoveryStat(db, "dropped"));
+  ASSERT_EQ("NOT_FOUND", Get(db, Key(N - 1)));
+  ASSERT_EQ(1, RecoveryStat(db, "dropped"));
+
+  // New values of the key are not mistaken for lost ones
+  ASSERT_OK(db->Put(WriteOptions(), Key(N - 1), Value(N - 1, 1)));
+  ASSERT_EQ(Value(N - 1, 1), Get(db, Key(N - 1)));
+  delete db;
+  DestroyDB(crashed, options_);
+}
+
+// Deleted keys stay deleted, and deletions whose index updates were lost
+// are replayed.
+TEST(ColumnDBTest, RecoverDeletions) {
+  const int N = 100;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  ASSERT_OK(db_->Delete(WriteOptions(), Key(0)));
+  ASSERT_OK(db_->Delete(WriteOptions(), Key(N - 1)));
+  const std::string crashed = test::TmpDir() + "/column_db_test_crashed";
+  const std::string fname = CrashCopy(crashed);
+  std::string contents = ReadRecords(fname);
+  datafile::AppendDeletion(&contents, Key(1));
+  ASSERT_OK(WriteStringToFile(env_, contents, fname));
+
+  Status s;
+  ColumnDB* db = new ColumnDB(options_, crashed, s);
+  ASSERT_OK(s);
+  ASSERT_GE(RecoveryStat(db, "unsealed-files"), 1);
+  ASSERT_EQ(1, RecoveryStat(db, "replayed"));
+  ASSERT_EQ("NOT_FOUND", Get(db, Key(0)));
+  ASSERT_EQ("NOT_FOUND", Get(db, Key(1)));
+  ASSERT_EQ(Value(2, 0), Get(db, Key(2)));
+  ASSERT_EQ("NOT_FOUND", Get(db, Key(N - 1)));
+  delete db;
+  DestroyDB(crashed, options_);
+}
+
+// Files adopted by BulkInsert() are numbered above the current data file,
+// which must still be recovered after a crash.
+TEST(ColumnDBTest, RecoverAfterBulkInsert) {
+  const int N = 100;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+
+  const std::string source_name = dbname_ + "_source";
+  const std::string split_dir = dbname_ + "_split";
+  DestroyDB(source_name, options_);
+  DestroyDB(split_dir, options_);
+  Status s;
+  ColumnDB* source = new ColumnDB(options_, source_name, s);
+  ASSERT_OK(s);
+  ASSERT_OK(source->Put(WriteOptions(), "moved", Value(N, 0)));
+  const Slice begin("moved"), end("moved");
+  ASSERT_OK(source->BulkSplit(WriteOptions(), 1, &begin, &end, split_dir));
+  ASSERT_OK(db_->BulkInsert(WriteOptions(), split_dir, 1, 1));
+  delete source;
+
+  const std::string crashed = test::TmpDir() + "/column_db_test_crashed";
+  const std::string fname = CrashCopy(crashed);
+  std::string contents = ReadRecords(fname);
+  datafile::AppendRecord(&contents, Key(0), Value(0, 1));
+  ASSERT_OK(WriteStringToFile(env_, contents, fname));
+
+  ColumnDB* db = new ColumnDB(options_, crashed, s);
+  ASSERT_OK(s);
+  ASSERT_GE(RecoveryStat(db, "unsealed-files"), 1);
+  ASSERT_EQ(1, RecoveryStat(db, "replayed"));
+  ASSERT_EQ(Value(0, 1), Get(db, Key(0)));
+  ASSERT_EQ(Value(1, 0), Get(db, Key(1)));
+  ASSERT_EQ(Value(N, 0), Get(db, "moved"));
+  delete db;
+  DestroyDB(crashed, options_);
+  DestroyDB(source_name, options_);
+  DestroyDB(split_dir, options_);
+}
+
+// The untagged index entries of a database from the first release are
+// converted on open.
+TEST(ColumnDBTest, UpgradeLegacyEntries) {
+  const int N = 10;
+  DB* legacy;
+  ASSERT_OK(DB::Open(options_, dbname_, &legacy));
+  std::string contents;
+  for (int i = 0; i < N; i++) {
+    const std::string key = Key(i), value = Value(i, 0);
+    const uint64_t offset = contents.size();
+    PutFixed64(&contents, (0x18caull << 48) + (key.size() << 20) +
+                          value.size());
+    contents.append(key);
+    contents.append(value);
+    const uint64_t size = contents.size() - offset;
+    std::string entry;
+    PutFixed64(&entry, (1ull << 42) + (offset << 10) + (size + 1023) / 1024);
+    ASSERT_OK(legacy->Put(WriteOptions(), key, entry));
+  }
+  delete legacy;
+  ASSERT_OK(WriteStringToFile(env_, contents, DataFileName(dbname_, 1)));
+
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, 0), Get(Key(i)));
+  }
+  ASSERT_OK(db_->Put(WriteOptions(), Key(0), Value(0, 1)));
+  Reopen();
+  ASSERT_EQ(Value(0, 1), Get(Key(0)));
+  ASSERT_EQ(Value(1, 0), Get(Key(1)));
+
+  // Formats from the future are refused
+  delete db_;
+  db_ = NULL;
+  ASSERT_OK(WriteStringToFile(env_, "99\n", IndexFormatFileName(dbname_)));
+  const std::string error = TryReopen().ToString();
+  ASSERT_TRUE(error.find("Not implemented") == 0) << error;
+}
+
+// A failed append is forgotten by the data file, which ends up sealed
+// with only the records that reached it.
+TEST(ColumnDBTest, FailedAppend) {
+  FailingEnv env(env_);
+  options_.env = &env;
+  const int N = 10;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  env.fail_appends_.Release_Store(&env);
+  ASSERT_TRUE(!db_->Put(WriteOptions(), Key(N), Value(N, 0)).ok());
+  env.fail_appends_.Release_Store(NULL);
+
+  // Later writes go to a new data file
+  ASSERT_OK(db_->Put(WriteOptions(), Key(N + 1), Value(N + 1, 0)));
+  ASSERT_EQ("NOT_FOUND", Get(Key(N)));
+  ASSERT_EQ(Value(N + 1, 0), Get(Key(N + 1)));
+
+  Reopen();
+  ASSERT_EQ(0, RecoveryStat(db_, "unsealed-files"));
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, 0), Get(Key(i)));
+  }
+  ASSERT_EQ("NOT_FOUND", Get(Key(N)));
+  ASSERT_EQ(Value(N + 1, 0), Get(Key(N + 1)));
+  delete db_;
+  db_ = NULL;
+  options_.env = env_;
+}
+
+// A data file that fails to seal may have lost records, so later writes
+// fail rather than publish more entries.
+TEST(ColumnDBTest, FailedSeal) {
+  FailingEnv env(env_);
+  options_.env = &env;
+  const int N = 10;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+
+  // Splitting a range of the current file switches to the one created
+  // ahead, and only sealing the current one appends to a data file.
+  for (int i = 0; i < 1000 && DataFiles().size() < 2; i++) {
+    env_->SleepForMicroseconds(10000);
+  }
+  const std::string split_dir = dbname_ + "_split";
+  DestroyDB(split_dir, options_);
+  const std::string begin = Key(N - 1);
+  const Slice begin_slice(begin);
+  env.fail_appends_.Release_Store(&env);
+  ASSERT_TRUE(!db_->BulkSplit(WriteOptions(), 1, &begin_slice, &begin_slice,
+                              split_dir).ok());
+  env.fail_appends_.Release_Store(NULL);
+
+  ASSERT_TRUE(!db_->Put(WriteOptions(), Key(N), Value(N, 0)).ok());
+  ASSERT_EQ(Value(0, 0), Get(Key(0)));
+  delete db_;
+  db_ = NULL;
+  options_.env = env_;
+  DestroyDB(split_dir, options_);
+}
+
+TEST(ColumnDBTest, Disabled) {
+  options_.value_gc_live_ratio = 0;
+  const int N = 500;
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+  }
+  Reopen();
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 1)));
+  }
+  db_->CompactRange(NULL, NULL);
+  env_->SleepForMicroseconds(100000);
+  // Both used files, and the one created ahead
+  ASSERT_EQ(3, static_cast<int>(DataFiles().size()));
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
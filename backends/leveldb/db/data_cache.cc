@@ -4,9 +4,12 @@
 
 #include "db/data_cache.h"
 
+#include <string.h>
+
 #include "db/filename.h"
 #include "leveldb/env.h"
 #include "util/coding.h"
+#include "util/mutexlock.h"
 
 namespace leveldb {
 
@@ -16,6 +19,10 @@ static void DeleteEntry(const Slice& key, void* value) {
     delete tf;
 }
 
+static void DeleteCachedData(const Slice& key, void* value) {
+  delete reinterpret_cast<std::string*>(value);
+}
+
 static void UnrefEntry(void* arg1, void* arg2) {
   Cache* cache = reinterpret_cast<Cache*>(arg1);
   Cache::Handle* h = reinterpret_cast<Cache::Handle*>(arg2);
@@ -29,12 +36,23 @@ DataCache::DataCache(const std::string& dbname,
     : env_(options->env),
       dbname_(dbname),
       options_(options),
-      cache_(NewLRUCache(entries)) {
+      cache_(NewLRUCache(entries)),
+      value_cache_(options->value_cache),
+      owns_value_cache_(false),
+      hits_(0),
+      misses_(0) {
+  if (value_cache_ == NULL) {
+    value_cache_ = NewLRUCache(32 << 20);
+    owns_value_cache_ = true;
+  }
+  cache_id_ = value_cache_->NewId();
 }
 
 DataCache::~DataCache() {
   if (cache_ != NULL)
     delete cache_;
+  if (owns_value_cache_)
+    delete value_cache_;
 }
 
 Status DataCache::FindTable(uint64_t file_number, Cache::Handle** handle) {
@@ -88,6 +106,30 @@ Status DataCache::Get(const ReadOptions& options,
                       uint64_t size,
                       Slice* result,
                       char* scratch) {
+  char key_buf[4 * sizeof(uint64_t)];
+  EncodeFixed64(key_buf, cache_id_);
+  EncodeFixed64(key_buf + 8, file_number);
+  EncodeFixed64(key_buf + 16, offset);
+  EncodeFixed64(key_buf + 24, size);
+  const Slice key(key_buf, sizeof(key_buf));
+  Cache::Handle* cached = value_cache_->Lookup(key);
+  {
+    MutexLock l(&stats_mutex_);
+    if (cached != NULL) {
+      hits_++;
+    } else {
+      misses_++;
+    }
+  }
+  if (cached != NULL) {
+    const std::string* data =
+        reinterpret_cast<std::string*>(value_cache_->Value(cached));
+    memcpy(scratch, data->data(), data->size());
+    *result = Slice(scratch, data->size());
+    value_cache_->Release(cached);
+    return Status::OK();
+  }
+
   Cache::Handle* handle = NULL;
   Status s = FindTable(file_number, &handle);
   if (s.ok()) {
@@ -96,9 +138,20 @@ Status DataCache::Get(const ReadOptions& options,
     s = t->Read(offset, size, result, scratch);
     cache_->Release(handle);
   }
+  if (s.ok() && options.fill_cache) {
+    std::string* data = new std::string(result->data(), result->size());
+    value_cache_->Release(value_cache_->Insert(key, data, data->size(),
+                                               &DeleteCachedData));
+  }
   return s;
 }
 
+void DataCache::GetStats(uint64_t* hits, uint64_t* misses) {
+  MutexLock l(&stats_mutex_);
+  *hits = hits_;
+  *misses = misses_;
+}
+
 void DataCache::Evict(uint64_t file_number) {
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
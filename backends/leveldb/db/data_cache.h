@@ -23,8 +23,9 @@ class DataCache {
   DataCache(const std::string& dbname, const Options* options, int entries);
   ~DataCache();
 
-  // If a seek to internal key "k" in specified file finds an entry,
-  // call (*handle_result)(arg, found_key, found_value).
+  // Read "size" bytes at "offset" of the specified data file.  Reads are
+  // served from options->value_cache when possible, and added to it if
+  // options.fill_cache is set.
   Status Get(const ReadOptions& options,
              uint64_t file_number,
              uint64_t offset,
@@ -32,14 +33,25 @@ class DataCache {
              Slice* result,
              char* scratch);
 
-  // Evict any entry for the specified file number
+  // Evict any entry for the specified file number.  Cached reads of the
+  // file are left to age out of the value cache.
   void Evict(uint64_t file_number);
 
+  // Number of reads served from and missing in the value cache
+  void GetStats(uint64_t* hits, uint64_t* misses);
+
  private:
   Env* const env_;
   const std::string dbname_;
   const Options* options_;
-  Cache* cache_;
+  Cache* cache_;          // Open files
+  Cache* value_cache_;
+  bool owns_value_cache_;
+  uint64_t cache_id_;     // Prefix of our keys in value_cache_
+
+  port::Mutex stats_mutex_;
+  uint64_t hits_;
+  uint64_t misses_;
 
   Status FindTable(uint64_t file_number, Cache::Handle**);
 
@@ -0,0 +1,351 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/data_file.h"
+
+#include <string.h>
+#include <algorithm>
+#include "leveldb/env.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
+
+namespace leveldb {
+namespace datafile {
+
+// Magic number in the header of kFormat1 records
+static const uint64_t kFormat1Magic = 0x18ca;
+
+// Records are read in chunks of at least this size
+static const size_t kReadSize = 1 << 20;
+
+static int VarintLength(uint64_t v) {
+  int len = 1;
+  while (v >= 128) {
+    v >>= 7;
+    len++;
+  }
+  return len;
+}
+
+size_t RecordSize(size_t key_size, size_t value_size) {
+  return VarintLength(key_size) + VarintLength(value_size) +
+         key_size + value_size + 4;
+}
+
+void AppendRecord(std::string* dst, const Slice& key, const Slice& value) {
+  const size_t start = dst->size();
+  PutVarint32(dst, key.size());
+  PutVarint32(dst, value.size());
+  dst->append(key.data(), key.size());
+  dst->append(value.data(), value.size());
+  PutFixed32(dst, crc32c::Mask(crc32c::Value(dst->data() + start,
+                                             dst->size() - start)));
+}
+
+void AppendDeletion(std::string* dst, const Slice& key) {
+  const size_t start = dst->size();
+  PutVarint32(dst, key.size());
+  PutVarint32(dst, kDeletion);
+  dst->append(key.data(), key.size());
+  PutFixed32(dst, crc32c::Mask(crc32c::Value(dst->data() + start,
+                                             dst->size() - start)));
+}
+
+size_t DeletionSize(size_t key_size) {
+  return VarintLength(key_size) + VarintLength(kDeletion) + key_size + 4;
+}
+
+namespace {
+enum DecodeResult {
+  kOk,
+  kIncomplete,  // "input" ends before the record does
+  kBad
+};
+
+DecodeResult DecodeRecord(int format, const Slice& input, Slice* key,
+                          Slice* value, size_t* record_size,
+                          bool* deletion) {
+  *deletion = false;
+  if (format == kFormat1) {
+    if (input.size() < sizeof(uint64_t)) {
+      return kIncomplete;
+    }
+    uint64_t header = DecodeFixed64(input.data());
+    if ((header >> 48) != kFormat1Magic) {
+      return kBad;
+    }
+    header = header & ((1ull << 48) - 1);
+    const uint64_t key_size = header >> 20;
+    const uint64_t value_size = header & ((1ull << 20) - 1);
+    const uint64_t size = sizeof(uint64_t) + key_size + value_size;
+    if (size > input.size()) {
+      return kIncomplete;
+    }
+    *key = Slice(input.data() + sizeof(uint64_t), key_size);
+    *value = Slice(key->data() + key_size, value_size);
+    *record_size = size;
+    return kOk;
+  }
+
+  Slice in = input;
+  uint32_t key_size, value_size;
+  if (!GetVarint32(&in, &key_size) || !GetVarint32(&in, &value_size)) {
+    return (input.size() >= 10) ? kBad : kIncomplete;
+  }
+  if (value_size == kDeletion) {
+    *deletion = true;
+    value_size = 0;
+  }
+  const size_t header_size = input.size() - in.size();
+  const uint64_t size = header_size + static_cast<uint64_t>(key_size) +
+                        value_size + 4;
+  if (size > input.size()) {
+    return kIncomplete;
+  }
+  const size_t n = size - 4;
+  const uint32_t crc = crc32c::Unmask(DecodeFixed32(input.data() + n));
+  if (crc32c::Value(input.data(), n) != crc) {
+    return kBad;
+  }
+  *key = Slice(in.data(), key_size);
+  *value = Slice(in.data() + key_size, value_size);
+  *record_size = size;
+  return kOk;
+}
+}  // namespace
+
+Status ParseRecord(int format, const Slice& input, Slice* key, Slice* value,
+                   size_t* record_size) {
+  bool deletion;
+  switch (DecodeRecord(format, input, key, value, record_size, &deletion)) {
+    case kOk:
+      return Status::OK();
+    case kIncomplete:
+      return Status::Corruption("truncated record in data file");
+    default:
+      return Status::Corruption("bad record in data file");
+  }
+}
+
+void FooterBuilder::Reset() {
+  data_size_ = kHeaderSize;
+  records_ = 0;
+  offsets_.clear();
+}
+
+void FooterBuilder::AddRecord(uint64_t offset, uint64_t size) {
+  if (offsets_.empty() ||
+      offset / kBlockSize != offsets_.back() / kBlockSize) {
+    offsets_.push_back(offset);
+  }
+  data_size_ = std::max(data_size_, offset + size);
+  records_++;
+}
+
+void FooterBuilder::RemoveRecords(uint64_t offset, uint64_t n) {
+  if (n == 0) {
+    return;
+  }
+  while (!offsets_.empty() && offsets_.back() >= offset) {
+    offsets_.pop_back();
+  }
+  data_size_ = offset;
+  records_ -= n;
+}
+
+void FooterBuilder::EncodeTo(std::string* dst) const {
+  const size_t start = dst->size();
+  PutVarint64(dst, data_size_);
+  PutVarint64(dst, records_);
+  PutVarint64(dst, offsets_.size());
+  uint64_t last = 0;
+  for (size_t i = 0; i < offsets_.size(); i++) {
+    PutVarint64(dst, offsets_[i] - last);
+    last = offsets_[i];
+  }
+  const size_t n = dst->size() - start;
+  PutFixed32(dst, crc32c::Mask(crc32c::Value(dst->data() + start, n)));
+  PutFixed32(dst, n);
+  PutFixed64(dst, kFooterMagic);
+}
+
+Reader::Reader(RandomAccessFile* file, uint64_t file_size)
+    : file_(file),
+      file_size_(file_size),
+      started_(false),
+      format_(kFormat1),
+      sealed_(false),
+      end_(file_size),
+      deletion_(false),
+      buffer_offset_(0),
+      pos_(0),
+      dropped_bytes_(0),
+      bytes_read_(0) {
+}
+
+Reader::~Reader() {
+}
+
+void Reader::Start() {
+  started_ = true;
+  if (file_size_ < kHeaderSize) {
+    return;
+  }
+  char header[kHeaderSize];
+  Slice result;
+  status_ = file_->Read(0, kHeaderSize, &result, header);
+  if (!status_.ok()) {
+    return;
+  }
+  bytes_read_ += result.size();
+  if (result.size() == kHeaderSize &&
+      DecodeFixed64(result.data()) == kHeaderMagic) {
+    format_ = kFormat2;
+    buffer_offset_ = kHeaderSize;
+    sealed_ = ReadFooter();
+  }
+}
+
+// Find the end of the records and the offsets to resume at from the
+// footer.  Returns false if the file has no valid footer.
+bool Reader::ReadFooter() {
+  if (file_size_ < kHeaderSize + kTrailerSize) {
+    return false;
+  }
+  char trailer[kTrailerSize];
+  Slice result;
+  if (!file_->Read(file_size_ - kTrailerSize, kTrailerSize, &result,
+                   trailer).ok() ||
+      result.size() != kTrailerSize ||
+      DecodeFixed64(result.data() + 8) != kFooterMagic) {
+    return false;
+  }
+  const uint32_t crc = crc32c::Unmask(DecodeFixed32(result.data()));
+  const uint64_t footer_size = DecodeFixed32(result.data() + 4);
+  if (footer_size > file_size_ - kHeaderSize - kTrailerSize) {
+    return false;
+  }
+  const uint64_t footer_offset = file_size_ - kTrailerSize - footer_size;
+  std::string footer(footer_size, '\0');
+  if (!file_->Read(footer_offset, footer_size, &result, &footer[0]).ok() ||
+      result.size() != footer_size ||
+      crc32c::Value(result.data(), result.size()) != crc) {
+    return false;
+  }
+  bytes_read_ += kTrailerSize + footer_size;
+
+  Slice input = result;
+  uint64_t data_size, records, count;
+  if (!GetVarint64(&input, &data_size) || !GetVarint64(&input, &records) ||
+      !GetVarint64(&input, &count) || data_size != footer_offset) {
+    return false;
+  }
+  std::vector<uint64_t> offsets;
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t delta;
+    if (!GetVarint64(&input, &delta)) {
+      return false;
+    }
+    offset += delta;
+    offsets.push_back(offset);
+  }
+  end_ = data_size;
+  resume_.swap(offsets);
+  return true;
+}
+
+// Make at least "n" bytes available after pos_, if the records have them.
+bool Reader::Fill(size_t n) {
+  buffer_.erase(0, pos_);
+  buffer_offset_ += pos_;
+  pos_ = 0;
+  while (buffer_.size() < n) {
+    const uint64_t offset = buffer_offset_ + buffer_.size();
+    if (offset >= end_) {
+      return false;
+    }
+    const size_t want = std::min<uint64_t>(
+        std::max(n - buffer_.size(), kReadSize), end_ - offset);
+    const size_t old_size = buffer_.size();
+    buffer_.resize(old_size + want);
+    char* scratch = &buffer_[old_size];
+    Slice result;
+    status_ = file_->Read(offset, want, &result, scratch);
+    if (!status_.ok()) {
+      buffer_.resize(old_size);
+      return false;
+    }
+    if (result.data() != scratch) {
+      memcpy(scratch, result.data(), result.size());
+    }
+    buffer_.resize(old_size + result.size());
+    bytes_read_ += result.size();
+    if (result.empty()) {
+      end_ = offset;  // The file is shorter than it claimed
+      return false;
+    }
+  }
+  return true;
+}
+
+// Skip a damaged record.  Returns false if no more records can be read.
+bool Reader::Resume() {
+  const uint64_t offset = buffer_offset_ + pos_;
+  std::vector<uint64_t>::const_iterator next =
+      std::upper_bound(resume_.begin(), resume_.end(), offset);
+  const uint64_t target = (next == resume_.end()) ? end_ : *next;
+  dropped_bytes_ += target - offset;
+  if (target >= end_) {
+    end_ = offset;
+    return false;
+  }
+  if (target < buffer_offset_ + buffer_.size()) {
+    pos_ = target - buffer_offset_;
+  } else {
+    buffer_.clear();
+    buffer_offset_ = target;
+    pos_ = 0;
+  }
+  return true;
+}
+
+bool Reader::ReadRecord(Slice* key, Slice* value, uint64_t* offset,
+                        uint64_t* size) {
+  if (!started_) {
+    Start();
+  }
+  while (status_.ok() && buffer_offset_ + pos_ < end_) {
+    const Slice input(buffer_.data() + pos_, buffer_.size() - pos_);
+    size_t record_size;
+    const DecodeResult r = DecodeRecord(format_, input, key, value,
+                                        &record_size, &deletion_);
+    if (r == kOk) {
+      *offset = buffer_offset_ + pos_;
+      *size = record_size;
+      pos_ += record_size;
+      return true;
+    }
+    if (r == kIncomplete && Fill(input.size() + 1)) {
+      continue;
+    }
+    if (!status_.ok()) {
+      break;
+    }
+    // Damaged or truncated record.  Only sealed files tell where the
+    // next intact records start.
+    if (!sealed_) {
+      dropped_bytes_ += end_ - (buffer_offset_ + pos_);
+      end_ = buffer_offset_ + pos_;
+      break;
+    }
+    if (!Resume()) {
+      break;
+    }
+  }
+  return false;
+}
+
+}  // namespace datafile
+}  // namespace leveldb
@@ -0,0 +1,185 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// Format of the data files that hold ColumnDB values.
+//
+// Format 1 files are a plain sequence of records:
+//    header: fixed64 (magic 0x18ca: 16 bits, key size: 28, value size: 20)
+//    key: uint8[key size]
+//    value: uint8[value size]
+// and are located by a fixed64 that only gives the record size rounded up
+// to 1KB (see ColumnDB::EncodeFileLoc).
+//
+// Format 2 files start with a fixed64 kHeaderMagic, followed by records
+//    key_size: varint32
+//    value_size: varint32
+//    key: uint8[key_size]
+//    value: uint8[value_size]
+//    crc: fixed32 (masked crc32c of all of the above)
+// which are located by their exact offset and size.  A record whose
+// value_size is kDeletion has no value, and records the deletion of its
+// key, so that crash recovery does not bring back older records of the
+// key.  Once the file is complete it ends with a footer
+//    data_size: varint64 (offset of the footer)
+//    records: varint64
+//    count: varint64
+//    offsets: varint64[count] (delta encoded)
+//    crc: fixed32 (masked crc32c of the above)
+//    footer_size: fixed32 (size of all of the above, without crc)
+//    magic: fixed64 kFooterMagic
+// where "offsets" are those of the first record starting in each
+// kBlockSize block of the file.  A reader that meets a damaged record
+// resumes at the next of them, so a corruption only loses the records of
+// a block.  Files without a (valid) footer were not closed cleanly, and
+// are only read up to their first damaged record.
+
+#ifndef STORAGE_LEVELDB_DB_DATA_FILE_H_
+#define STORAGE_LEVELDB_DB_DATA_FILE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+
+namespace leveldb {
+
+class RandomAccessFile;
+
+namespace datafile {
+
+enum Format {
+  kFormat1 = 1,
+  kFormat2 = 2
+};
+
+static const uint64_t kHeaderMagic = 0x32766c6f63626466ull;
+static const uint64_t kFooterMagic = 0x66746f6f63626466ull;
+static const size_t kHeaderSize = 8;
+static const size_t kTrailerSize = 4 + 4 + 8;  // crc, footer_size, magic
+static const uint64_t kBlockSize = 32768;
+static const uint32_t kDeletion = 0xffffffffu;  // value_size of deletions
+
+// Where the record of a value lives
+struct Location {
+  uint64_t file_number;
+  uint64_t offset;
+  uint64_t size;    // Exact for kFormat2, rounded up to 1KB for kFormat1
+  int format;
+};
+
+// Append a kFormat2 record to *dst.
+extern void AppendRecord(std::string* dst, const Slice& key,
+                         const Slice& value);
+
+// Size of the kFormat2 record of "key" and "value".
+extern size_t RecordSize(size_t key_size, size_t value_size);
+
+// Append a kFormat2 record of the deletion of "key" to *dst.
+extern void AppendDeletion(std::string* dst, const Slice& key);
+
+// Size of the kFormat2 deletion record of a key.
+extern size_t DeletionSize(size_t key_size);
+
+// Parse the record of the given format that "input" starts with.
+// "input" may extend past the record.  The value of a deletion is empty.
+extern Status ParseRecord(int format, const Slice& input, Slice* key,
+                          Slice* value, size_t* record_size);
+
+// Collects the footer of a kFormat2 file while records are appended.
+class FooterBuilder {
+ public:
+  FooterBuilder() { Reset(); }
+
+  // Start over for a new file
+  void Reset();
+
+  void AddRecord(uint64_t offset, uint64_t size);
+
+  // Forget the last "n" records added, the first of which is at "offset".
+  void RemoveRecords(uint64_t offset, uint64_t n);
+
+  // Append the footer to *dst.
+  void EncodeTo(std::string* dst) const;
+
+ private:
+  uint64_t data_size_;
+  uint64_t records_;
+  std::vector<uint64_t> offsets_;
+};
+
+// Reads the records of a data file of either format in order.
+class Reader {
+ public:
+  // "*file" must remain live while this Reader is in use.
+  Reader(RandomAccessFile* file, uint64_t file_size);
+  ~Reader();
+
+  // Read the header and footer of the file, which the first ReadRecord()
+  // does otherwise.
+  Status Open() {
+    if (!started_) {
+      Start();
+    }
+    return status_;
+  }
+
+  // Read the next record.  Returns false at the end of the records.
+  // *key and *value stay valid until the next call.
+  bool ReadRecord(Slice* key, Slice* value, uint64_t* offset,
+                  uint64_t* size);
+
+  // Whether the record last read is a deletion
+  bool deletion() const { return deletion_; }
+
+  // Format of the file.  Valid after Open() or the first ReadRecord().
+  int format() const { return format_; }
+
+  // Whether the file was closed cleanly.  Valid after Open() or the first
+  // ReadRecord().
+  bool sealed() const { return sealed_; }
+
+  // Offset where the records of a sealed file end.  For other files, the
+  // end of the intact records once ReadRecord() has returned false.
+  uint64_t records_end() const { return end_; }
+
+  // Bytes of records skipped because they were damaged
+  uint64_t dropped_bytes() const { return dropped_bytes_; }
+
+  // Bytes read from the file so far
+  uint64_t bytes_read() const { return bytes_read_; }
+
+  // Error reading the file, if any
+  Status status() const { return status_; }
+
+ private:
+  RandomAccessFile* const file_;
+  const uint64_t file_size_;
+  bool started_;
+  int format_;
+  bool sealed_;
+  uint64_t end_;                  // End of the records
+  bool deletion_;
+  std::vector<uint64_t> resume_;  // Offsets to resume at after damage
+  std::string buffer_;            // Read, but not yet returned
+  uint64_t buffer_offset_;        // File offset of buffer_[0]
+  size_t pos_;                    // Start of the unreturned part of buffer_
+  uint64_t dropped_bytes_;
+  uint64_t bytes_read_;
+  Status status_;
+
+  void Start();
+  bool ReadFooter();
+  bool Fill(size_t n);
+  bool Resume();
+
+  // No copying allowed
+  Reader(const Reader&);
+  void operator=(const Reader&);
+};
+
+}  // namespace datafile
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_DATA_FILE_H_
@@ -0,0 +1,220 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/data_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "leveldb/env.h"
+#include "util/coding.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+namespace datafile {
+
+static std::string Key(int i) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return std::string(buf);
+}
+
+static std::string Value(int i) {
+  return std::string(100 + (i % 7) * 300, 'a' + (i % 26));
+}
+
+class DataFileTest {
+ public:
+  Env* env_;
+  std::string fname_;
+  std::string contents_;
+  std::vector<uint64_t> offsets_;
+
+  DataFileTest() : env_(Env::Default()) {
+    fname_ = test::TmpDir() + "/data_file_test.dat";
+  }
+
+  ~DataFileTest() {
+    env_->DeleteFile(fname_);
+  }
+
+  // Build a kFormat2 file of "n" records, with a footer if "seal"
+  void Build(int n, bool seal) {
+    FooterBuilder footer;
+    contents_.clear();
+    offsets_.clear();
+    PutFixed64(&contents_, kHeaderMagic);
+    for (int i = 0; i < n; i++) {
+      const uint64_t offset = contents_.size();
+      AppendRecord(&contents_, Key(i), Value(i));
+      offsets_.push_back(offset);
+      footer.AddRecord(offset, contents_.size() - offset);
+    }
+    if (seal) {
+      footer.EncodeTo(&contents_);
+    }
+  }
+
+  // Return the keys of the records read from contents_.  If "reader_out"
+  // is non-NULL, it gets the reader, whose file is closed already.
+  std::vector<std::string> ReadAll(Reader** reader_out = NULL) {
+    ASSERT_OK(WriteStringToFile(env_, contents_, fname_));
+    RandomAccessFile* file;
+    ASSERT_OK(env_->NewRandomAccessFile(fname_, &file));
+    Reader* reader = new Reader(file, contents_.size());
+    std::vector<std::string> keys;
+    Slice key, value;
+    uint64_t offset, size;
+    while (reader->ReadRecord(&key, &value, &offset, &size)) {
+      const int i = atoi(key.data() + 3);
+      ASSERT_EQ(Key(i), key.ToString());
+      ASSERT_EQ(Value(i), value.ToString());
+      ASSERT_EQ(RecordSize(key.size(), value.size()), size);
+      keys.push_back(key.ToString());
+    }
+    ASSERT_OK(reader->status());
+    if (reader_out != NULL) {
+      *reader_out = reader;
+      reader = NULL;
+    }
+    delete reader;
+    delete file;
+    return keys;
+  }
+};
+
+TEST(DataFileTest, Record) {
+  std::string record;
+  AppendRecord(&record, "key", "value");
+  ASSERT_EQ(RecordSize(3, 5), record.size());
+  record.append("trailing");
+
+  Slice key, value;
+  size_t size;
+  ASSERT_OK(ParseRecord(kFormat2, record, &key, &value, &size));
+  ASSERT_EQ("key", key.ToString());
+  ASSERT_EQ("value", value.ToString());
+  ASSERT_EQ(RecordSize(3, 5), size);
+
+  ASSERT_TRUE(!ParseRecord(kFormat2, Slice(record.data(), 8), &key, &value,
+                           &size).ok());
+  record[4] ^= 1;
+  ASSERT_TRUE(!ParseRecord(kFormat2, record, &key, &value, &size).ok());
+}
+
+TEST(DataFileTest, Deletion) {
+  std::string record;
+  AppendDeletion(&record, "key");
+  ASSERT_EQ(DeletionSize(3), record.size());
+  Slice key, value;
+  size_t size;
+  ASSERT_OK(ParseRecord(kFormat2, record, &key, &value, &size));
+  ASSERT_EQ("key", key.ToString());
+  ASSERT_EQ("", value.ToString());
+  ASSERT_EQ(DeletionSize(3), size);
+
+  contents_.clear();
+  PutFixed64(&contents_, kHeaderMagic);
+  AppendRecord(&contents_, Key(0), Value(0));
+  AppendDeletion(&contents_, Key(0));
+  AppendRecord(&contents_, Key(1), Value(1));
+  ASSERT_OK(WriteStringToFile(env_, contents_, fname_));
+  RandomAccessFile* file;
+  ASSERT_OK(env_->NewRandomAccessFile(fname_, &file));
+  Reader reader(file, contents_.size());
+  uint64_t offset, record_size;
+  ASSERT_TRUE(reader.ReadRecord(&key, &value, &offset, &record_size));
+  ASSERT_TRUE(!reader.deletion());
+  ASSERT_TRUE(reader.ReadRecord(&key, &value, &offset, &record_size));
+  ASSERT_TRUE(reader.deletion());
+  ASSERT_EQ(Key(0), key.ToString());
+  ASSERT_TRUE(reader.ReadRecord(&key, &value, &offset, &record_size));
+  ASSERT_TRUE(!reader.deletion());
+  ASSERT_EQ(Key(1), key.ToString());
+  ASSERT_TRUE(!reader.ReadRecord(&key, &value, &offset, &record_size));
+  ASSERT_OK(reader.status());
+  delete file;
+}
+
+TEST(DataFileTest, Sealed) {
+  Build(1000, true);
+  Reader* reader;
+  ASSERT_EQ(1000, static_cast<int>(ReadAll(&reader).size()));
+  ASSERT_EQ(kFormat2, reader->format());
+  ASSERT_TRUE(reader->sealed());
+  ASSERT_EQ(0, static_cast<int>(reader->dropped_bytes()));
+  delete reader;
+}
+
+TEST(DataFileTest, Unsealed) {
+  Build(1000, false);
+  Reader* reader;
+  ASSERT_EQ(1000, static_cast<int>(ReadAll(&reader).size()));
+  ASSERT_TRUE(!reader->sealed());
+  delete reader;
+
+  // A partly written last record is dropped
+  contents_.resize(contents_.size() - 10);
+  ASSERT_EQ(999, static_cast<int>(ReadAll().size()));
+}
+
+// A damaged record of a sealed file only loses the records up to the start
+// of the next block.
+TEST(DataFileTest, ResumeAfterDamage) {
+  Build(1000, true);
+  const int damaged = 500;
+  contents_[offsets_[damaged] + 20] ^= 1;
+  int next = damaged + 1;
+  while (offsets_[next] / kBlockSize == offsets_[damaged] / kBlockSize) {
+    next++;
+  }
+  Reader* reader;
+  std::vector<std::string> keys = ReadAll(&reader);
+  ASSERT_GT(reader->dropped_bytes(), 0);
+  delete reader;
+  ASSERT_EQ(1000 - (next - damaged), static_cast<int>(keys.size()));
+  ASSERT_EQ(Key(damaged - 1), keys[damaged - 1]);
+  ASSERT_EQ(Key(next), keys[damaged]);
+
+  // Without the footer, reading stops at the damage
+  Build(1000, false);
+  contents_[offsets_[damaged] + 20] ^= 1;
+  ASSERT_EQ(damaged, static_cast<int>(ReadAll().size()));
+}
+
+TEST(DataFileTest, Format1) {
+  contents_.clear();
+  for (int i = 0; i < 100; i++) {
+    const std::string key = Key(i), value = Value(i);
+    PutFixed64(&contents_, (0x18caull << 48) + (key.size() << 20) +
+                           value.size());
+    contents_.append(key);
+    contents_.append(value);
+  }
+  contents_.append(3, 'x');  // Garbage at the tail
+  Reader* reader = NULL;
+  ASSERT_OK(WriteStringToFile(env_, contents_, fname_));
+  RandomAccessFile* file;
+  ASSERT_OK(env_->NewRandomAccessFile(fname_, &file));
+  reader = new Reader(file, contents_.size());
+  Slice key, value;
+  uint64_t offset, size;
+  int n = 0;
+  while (reader->ReadRecord(&key, &value, &offset, &size)) {
+    ASSERT_EQ(Key(n), key.ToString());
+    ASSERT_EQ(Value(n), value.ToString());
+    ASSERT_EQ(8 + key.size() + value.size(), size);
+    n++;
+  }
+  ASSERT_EQ(kFormat1, reader->format());
+  ASSERT_EQ(100, n);
+  delete reader;
+  delete file;
+}
+
+}  // namespace datafile
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
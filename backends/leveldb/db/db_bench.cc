@@ -11,6 +11,7 @@
 #include "leveldb/cache.h"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
+#include "leveldb/env_latency.h"
 #include "leveldb/write_batch.h"
 #include "port/port.h"
 #include "util/crc32c.h"
@@ -105,6 +106,16 @@ static bool FLAGS_use_existing_db = false;
 // Use the db with the following name.
 static const char* FLAGS_db = "/tmp/dbbench";
 
+// If non-NULL, delay table file operations as if the tables were on
+// remote storage.  See ParseLatencyOptions() for the format, e.g. "hdfs".
+static const char* FLAGS_latency_env = NULL;
+
+// Number of entries whose values ColumnDB iterators read at a time.
+static int FLAGS_prefetch_entries = 0;
+
+// Env used by the benchmarked DB
+static leveldb::Env* g_env = NULL;
+
 namespace leveldb {
 
 namespace {
@@ -333,6 +344,9 @@ class Benchmark {
     fprintf(stdout, "FileSize:   %.1f MB (estimated)\n",
             (((kKeySize + FLAGS_value_size * FLAGS_compression_ratio) * num_)
              / 1048576.0));
+    if (FLAGS_latency_env != NULL) {
+      fprintf(stdout, "Latency:    %s\n", FLAGS_latency_env);
+    }
     PrintWarnings();
     fprintf(stdout, "------------------------------------------------\n");
   }
@@ -702,6 +716,7 @@ class Benchmark {
     options.block_cache = cache_;
     options.write_buffer_size = FLAGS_write_buffer_size;
     options.filter_policy = filter_policy_;
+    options.env = g_env;
     Status s;
     if (FLAGS_dbtype == 1) {
       s = DB::Open(options, FLAGS_db, &db_);
@@ -762,7 +777,9 @@ class Benchmark {
   }
 
   void ReadSequential(ThreadState* thread) {
-    Iterator* iter = db_->NewIterator(ReadOptions());
+    ReadOptions options;
+    options.prefetch_entries = FLAGS_prefetch_entries;
+    Iterator* iter = db_->NewIterator(options);
     int i = 0;
     int64_t bytes = 0;
     for (iter->SeekToFirst(); i < reads_ && iter->Valid(); iter->Next()) {
@@ -980,14 +997,30 @@ int main(int argc, char** argv) {
       FLAGS_bloom_bits = n;
     } else if (sscanf(argv[i], "--open_files=%d%c", &n, &junk) == 1) {
       FLAGS_open_files = n;
+    } else if (sscanf(argv[i], "--prefetch_entries=%d%c", &n, &junk) == 1) {
+      FLAGS_prefetch_entries = n;
     } else if (strncmp(argv[i], "--db=", 5) == 0) {
       FLAGS_db = argv[i] + 5;
+    } else if (strncmp(argv[i], "--latency_env=", 14) == 0) {
+      FLAGS_latency_env = argv[i] + 14;
     } else {
       fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
       exit(1);
     }
   }
 
+  g_env = leveldb::Env::Default();
+  if (FLAGS_latency_env != NULL) {
+    leveldb::LatencyOptions latency;
+    leveldb::Status s = leveldb::ParseLatencyOptions(FLAGS_latency_env,
+                                                     &latency);
+    if (!s.ok()) {
+      fprintf(stderr, "%s\n", s.ToString().c_str());
+      exit(1);
+    }
+    g_env = leveldb::NewLatencyEnv(g_env, latency);
+  }
+
   leveldb::Benchmark benchmark;
   benchmark.Run();
   return 0;
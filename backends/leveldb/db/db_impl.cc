@@ -17,9 +17,11 @@
 #include "db/log_reader.h"
 #include "db/log_writer.h"
 #include "db/memtable.h"
+#include "db/merge_helper.h"
 #include "db/table_cache.h"
 #include "db/version_set.h"
 #include "db/write_batch_internal.h"
+#include "leveldb/compaction_listener.h"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
 #include "leveldb/status.h"
@@ -45,9 +47,16 @@ struct DBImpl::Writer {
   bool sync;
   bool update_sequence;
   bool done;
+  const std::vector<std::string>* expected;  // See WriteIfUnchanged()
+  const Slice* absent_key;                   // See WriteIfAbsent()
+  int applied;
   port::CondVar cv;
 
-  explicit Writer(port::Mutex* mu) : cv(mu) { }
+  explicit Writer(port::Mutex* mu)
+      : expected(NULL), absent_key(NULL), applied(0), cv(mu) { }
+
+  // Whether the updates depend on the state of the database
+  bool conditional() const { return expected != NULL || absent_key != NULL; }
 };
 
 struct DBImpl::CompactionState {
@@ -112,6 +121,44 @@ struct DBImpl::DeletionState {
   }
 };
 
+// State shared by the threads of a parallel log replay.  The reading
+// thread hands every log record to all shards; a record is freed once
+// the last shard has applied its part of it.
+struct DBImpl::RecoveryState {
+  struct Record {
+    std::string contents;
+    int refs;
+  };
+
+  // Maximum number of records queued per shard before the reader waits
+  static const size_t kMaxQueuedRecords = 256;
+
+  DBImpl* const db;
+  VersionEdit* const edit;
+  port::Mutex mu;
+  port::CondVar cv;       // Signalled when queues or live change
+  std::vector<RecoveryShard*> shards;
+  bool done;              // No more records will be queued
+  int live;               // Number of shard threads still running
+  Status status;          // First error seen by any shard
+
+  RecoveryState(DBImpl* d, VersionEdit* e)
+      : db(d),
+        edit(e),
+        cv(&mu),
+        done(false),
+        live(0) {
+  }
+};
+
+struct DBImpl::RecoveryShard {
+  RecoveryState* const state;
+  const int index;
+  std::deque<RecoveryState::Record*> queue;
+
+  RecoveryShard(RecoveryState* s, int i) : state(s), index(i) { }
+};
+
 // Fix user-supplied options to be reasonable
 template <class T,class V>
 static void ClipToRange(T* ptr, V minvalue, V maxvalue) {
@@ -128,6 +175,7 @@ Options SanitizeOptions(const std::string& dbname,
   ClipToRange(&result.max_open_files,            20,     50000);
   ClipToRange(&result.write_buffer_size,         64<<10, 1<<30);
   ClipToRange(&result.block_size,                1<<10,  4<<20);
+  ClipToRange(&result.recovery_threads,          1,      64);
   if (result.info_log == NULL) {
     // Open a log file in the same directory as the db
     src.env->CreateDir(dbname);  // In case it does not exist
@@ -162,6 +210,7 @@ DBImpl::DBImpl(const Options& options, const std::string& dbname)
       logfile_(NULL),
       logfile_number_(0),
       log_(NULL),
+      first_recyclable_log_(~static_cast<uint64_t>(0)),
       tmp_batch_(new WriteBatch),
       bg_compaction_scheduled_(false),
       bg_monitor_in_loop_(true),
@@ -293,10 +342,28 @@ void DBImpl::DeleteObsoleteFiles() {
         case kCurrentFile:
         case kDBLockFile:
         case kInfoLogFile:
+        case kDataFile:     // Owned by ColumnDB
           keep = true;
           break;
       }
 
+      if (!keep && type == kLogFile && number >= first_recyclable_log_ &&
+          recycled_logs_.size() <
+              static_cast<size_t>(options_.recycle_log_file_num)) {
+        if (std::find(recycled_logs_.begin(), recycled_logs_.end(),
+                      number) == recycled_logs_.end()) {
+          Log(options_.info_log, "Recycle log #%lld\n",
+              static_cast<unsigned long long>(number));
+          recycled_logs_.push_back(number);
+        }
+        continue;
+      }
+      if (!keep && type == kLogFile &&
+          std::find(recycled_logs_.begin(), recycled_logs_.end(),
+                    number) != recycled_logs_.end()) {
+        continue;
+      }
+
       if (!keep) {
         if (type == kTableFile) {
           table_cache_->Evict(number);
@@ -371,6 +438,8 @@ Status DBImpl::Recover(VersionEdit* edit) {
 
     // Recover in the order in which the logs were generated
     std::sort(logs.begin(), logs.end());
+    const uint64_t start_micros = env_->NowMicros();
+    recovery_stats_.threads = options_.recovery_threads;
     for (size_t i = 0; i < logs.size(); i++) {
       s = RecoverLogFile(logs[i], edit, &max_sequence);
 
@@ -379,6 +448,18 @@ Status DBImpl::Recover(VersionEdit* edit) {
       // update the file number allocation counter in VersionSet.
       versions_->MarkFileNumberUsed(logs[i]);
     }
+    recovery_stats_.logs = logs.size();
+    recovery_stats_.micros = env_->NowMicros() - start_micros;
+    if (!logs.empty()) {
+      Log(options_.info_log,
+          "Recovered %d logs (%lld records, %lld bytes) "
+          "with %d threads in %lld us",
+          recovery_stats_.logs,
+          static_cast<long long>(recovery_stats_.records),
+          static_cast<long long>(recovery_stats_.bytes),
+          recovery_stats_.threads,
+          static_cast<long long>(recovery_stats_.micros));
+    }
 
     if (s.ok()) {
       if (versions_->LastSequence() < max_sequence) {
@@ -428,10 +509,17 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
   // to be skipped instead of propagating bad information (like overly
   // large sequence numbers).
   log::Reader reader(file, &reporter, true/*checksum*/,
-                     0/*initial_offset*/);
+                     0/*initial_offset*/, log_number);
   Log(options_.info_log, "Recovering log #%llu",
       (unsigned long long) log_number);
 
+  if (options_.recovery_threads > 1) {
+    status = RecoverLogFileParallel(&reader, &reporter, &status,
+                                    edit, max_sequence);
+    delete file;
+    return status;
+  }
+
   // Read all the records and add to a memtable
   std::string scratch;
   Slice record;
@@ -444,6 +532,8 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
           record.size(), Status::Corruption("log record too small"));
       continue;
     }
+    recovery_stats_.records++;
+    recovery_stats_.bytes += record.size();
     WriteBatchInternal::SetContents(&batch, record);
 
     if (mem == NULL) {
@@ -485,6 +575,169 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
   return status;
 }
 
+Status DBImpl::RecoverLogFileParallel(log::Reader* reader,
+                                      log::Reader::Reporter* reporter,
+                                      Status* read_status,
+                                      VersionEdit* edit,
+                                      SequenceNumber* max_sequence) {
+  mutex_.AssertHeld();
+  const int num_shards = options_.recovery_threads;
+
+  // The shard threads take mutex_ to install their level-0 tables, so
+  // release it while they run.  Nothing else can touch the DB until
+  // DB::Open() returns.
+  mutex_.Unlock();
+
+  RecoveryState state(this, edit);
+  for (int i = 0; i < num_shards; i++) {
+    state.shards.push_back(new RecoveryShard(&state, i));
+  }
+  state.live = num_shards;
+  for (int i = 0; i < num_shards; i++) {
+    env_->StartThread(&DBImpl::BGRecoverShard, state.shards[i]);
+  }
+
+  // Checksums are verified here by log::Reader; decoding the batches,
+  // inserting them and building the tables is left to the shards.
+  std::string scratch;
+  Slice record;
+  while (reader->ReadRecord(&record, &scratch) &&
+         read_status->ok()) {
+    if (record.size() < 12) {
+      reporter->Corruption(
+          record.size(), Status::Corruption("log record too small"));
+      continue;
+    }
+    recovery_stats_.records++;
+    recovery_stats_.bytes += record.size();
+
+    // Record header: sequence (fixed64) followed by count (fixed32)
+    const SequenceNumber last_seq =
+        DecodeFixed64(record.data()) + DecodeFixed32(record.data() + 8) - 1;
+    if (last_seq > *max_sequence) {
+      *max_sequence = last_seq;
+    }
+
+    RecoveryState::Record* r = new RecoveryState::Record;
+    r->contents.assign(record.data(), record.size());
+    r->refs = num_shards;
+
+    MutexLock l(&state.mu);
+    bool full = true;
+    while (full && state.status.ok()) {
+      full = false;
+      for (int i = 0; i < num_shards; i++) {
+        if (state.shards[i]->queue.size() >=
+            RecoveryState::kMaxQueuedRecords) {
+          full = true;
+          state.cv.Wait();
+          break;
+        }
+      }
+    }
+    if (!state.status.ok()) {
+      delete r;
+      break;
+    }
+    for (int i = 0; i < num_shards; i++) {
+      state.shards[i]->queue.push_back(r);
+    }
+    state.cv.SignalAll();
+  }
+
+  Status status;
+  {
+    MutexLock l(&state.mu);
+    state.done = true;
+    state.cv.SignalAll();
+    while (state.live > 0) {
+      state.cv.Wait();
+    }
+    status = state.status;
+  }
+  for (int i = 0; i < num_shards; i++) {
+    delete state.shards[i];
+  }
+
+  mutex_.Lock();
+  if (status.ok()) {
+    status = *read_status;
+  }
+  return status;
+}
+
+void DBImpl::BGRecoverShard(void* shard) {
+  RecoveryShard* s = reinterpret_cast<RecoveryShard*>(shard);
+  s->state->db->RecoverShard(s);
+}
+
+void DBImpl::RecoverShard(RecoveryShard* shard) {
+  RecoveryState* state = shard->state;
+  const int num_shards = state->shards.size();
+  const size_t flush_size = options_.write_buffer_size / num_shards;
+  WriteBatch batch;
+  MemTable* mem = NULL;
+  Status s;
+
+  state->mu.Lock();
+  while (true) {
+    while (shard->queue.empty() && !state->done) {
+      state->cv.Wait();
+    }
+    if (shard->queue.empty()) {
+      break;
+    }
+    RecoveryState::Record* r = shard->queue.front();
+    shard->queue.pop_front();
+    const bool failed = !state->status.ok();
+    state->mu.Unlock();
+
+    // After a failure the remaining records are only drained
+    if (!failed) {
+      WriteBatchInternal::SetContents(&batch, r->contents);
+      if (mem == NULL) {
+        mem = new MemTable(internal_comparator_);
+        mem->Ref();
+      }
+      s = WriteBatchInternal::InsertInto(&batch, mem,
+                                         shard->index, num_shards);
+      MaybeIgnoreError(&s);
+      if (s.ok() && mem->ApproximateMemoryUsage() > flush_size) {
+        mutex_.Lock();
+        s = WriteLevel0Table(mem, state->edit, NULL);
+        mutex_.Unlock();
+        mem->Unref();
+        mem = NULL;
+      }
+    }
+
+    state->mu.Lock();
+    if (!s.ok() && state->status.ok()) {
+      state->status = s;
+    }
+    if (--r->refs == 0) {
+      delete r;
+    }
+    state->cv.SignalAll();
+  }
+  const bool failed = !state->status.ok();
+  state->mu.Unlock();
+
+  if (!failed && mem != NULL) {
+    mutex_.Lock();
+    s = WriteLevel0Table(mem, state->edit, NULL);
+    mutex_.Unlock();
+  }
+  if (mem != NULL) mem->Unref();
+
+  MutexLock l(&state->mu);
+  if (!s.ok() && state->status.ok()) {
+    state->status = s;
+  }
+  state->live--;
+  state->cv.SignalAll();
+}
+
 Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
                                 Version* base) {
   mutex_.AssertHeld();
@@ -901,6 +1154,107 @@ void DBImpl::MonitorThread(void* db) {
   mdb->mt_mutex_.Unlock();
 }
 
+Status DBImpl::AddCompactionOutput(CompactionState* compact, Iterator* input,
+                                   const Slice& key, const Slice& value) {
+  Status status;
+  // Open output file if necessary
+  if (compact->builder == NULL) {
+    status = OpenCompactionOutputFile(compact);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  if (compact->builder->NumEntries() == 0) {
+    compact->current_output()->smallest.DecodeFrom(key);
+  }
+  compact->current_output()->largest.DecodeFrom(key);
+  compact->builder->Add(key, value);
+
+  // Close output file if it is big enough
+  if (compact->builder->FileSize() >=
+      compact->compaction->MaxOutputFileSize()) {
+    status = FinishCompactionOutputFile(compact, input);
+  }
+  return status;
+}
+
+// "input" is at the merge operand "ikey", below which no snapshot can
+// see.  Merge it with the older entries for its user key, up to and
+// including the base value, and leave "input" after them.  Operands
+// whose base value may be in a deeper level are written out unchanged.
+Status DBImpl::CompactMerges(CompactionState* compact, Iterator* input,
+                             const ParsedInternalKey& ikey) {
+  const std::string user_key = ikey.user_key.ToString();
+  const SequenceNumber sequence = ikey.sequence;
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+  size_t num_operands = 0;
+  bool found_base = false;
+  bool has_base = false;
+  for (; input->Valid(); input->Next()) {
+    ParsedInternalKey older;
+    if (!ParseInternalKey(input->key(), &older) ||
+        user_comparator()->Compare(older.user_key, user_key) != 0) {
+      break;
+    }
+    keys.push_back(input->key().ToString());
+    values.push_back(input->value().ToString());
+    if (older.type == kTypeMerge) {
+      num_operands++;
+    } else {
+      found_base = true;
+      has_base = (older.type == kTypeValue);
+      input->Next();
+      break;
+    }
+  }
+
+  const bool base_level = compact->compaction->IsBaseLevelForKey(user_key);
+  Status s;
+  std::string value;
+  if (found_base || base_level) {
+    std::vector<std::string> operands(values.begin(),
+                                      values.begin() + num_operands);
+    Slice base;
+    if (has_base) {
+      base = values.back();
+    }
+    s = MergeOperands(options_.merge_operator, user_key,
+                      has_base ? &base : NULL, operands, &value);
+    if (!s.ok() && !s.IsNotFound()) {
+      Log(options_.info_log, "Merge of '%s' failed: %s",
+          EscapeString(user_key).c_str(), s.ToString().c_str());
+    }
+  } else {
+    // The base value may be in a deeper level
+    s = Status::NotSupported(Slice());
+  }
+
+  if (!s.ok() && !s.IsNotFound()) {
+    // Keep the entries as they are
+    Status status;
+    for (size_t i = 0; status.ok() && i < keys.size(); i++) {
+      status = AddCompactionOutput(compact, input, keys[i], values[i]);
+    }
+    return status;
+  }
+
+  if (has_base && options_.compaction_listener != NULL) {
+    options_.compaction_listener->ValueDropped(user_key, values.back());
+  }
+  std::string key;
+  if (s.ok()) {
+    AppendInternalKey(&key, ParsedInternalKey(user_key, sequence, kTypeValue));
+    return AddCompactionOutput(compact, input, key, value);
+  } else if (!base_level) {
+    // The merge deleted the key; hide its entries in deeper levels
+    AppendInternalKey(&key,
+                      ParsedInternalKey(user_key, sequence, kTypeDeletion));
+    return AddCompactionOutput(compact, input, key, Slice());
+  }
+  return Status::OK();
+}
+
 Status DBImpl::DoCompactionWork(CompactionState* compact) {
   const uint64_t start_micros = env_->NowMicros();
   int64_t imm_micros = 0;  // Micros spent doing imm_ compactions
@@ -954,6 +1308,7 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
 
     // Handle key/value, add to state, etc.
     bool drop = false;
+    bool merge = false;
     if (!ParseInternalKey(key, &ikey)) {
       // Do not hide error keys
       current_user_key.clear();
@@ -983,9 +1338,20 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         //     few iterations of this loop (by rule (A) above).
         // Therefore this deletion marker is obsolete and can be dropped.
         drop = true;
+      } else if (ikey.type == kTypeMerge &&
+                 ikey.sequence <= compact->smallest_snapshot) {
+        // No snapshot sees the older entries for this user key other
+        // than through this operand, so they can be merged into it.
+        merge = true;
       }
 
       last_sequence_for_key = ikey.sequence;
+
+      if (drop && ikey.type == kTypeValue &&
+          options_.compaction_listener != NULL) {
+        options_.compaction_listener->ValueDropped(ikey.user_key,
+                                                   input->value());
+      }
     }
 #if 0
     Log(options_.info_log,
@@ -997,27 +1363,19 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         (int)last_sequence_for_key, (int)compact->smallest_snapshot);
 #endif
 
-    if (!drop) {
-      // Open output file if necessary
-      if (compact->builder == NULL) {
-        status = OpenCompactionOutputFile(compact);
-        if (!status.ok()) {
-          break;
-        }
-      }
-      if (compact->builder->NumEntries() == 0) {
-        compact->current_output()->smallest.DecodeFrom(key);
+    if (merge) {
+      // Consumes the entries it merges
+      status = CompactMerges(compact, input, ikey);
+      if (!status.ok()) {
+        break;
       }
-      compact->current_output()->largest.DecodeFrom(key);
-      compact->builder->Add(key, input->value());
+      continue;
+    }
 
-      // Close output file if it is big enough
-      if (compact->builder->FileSize() >=
-          compact->compaction->MaxOutputFileSize()) {
-        status = FinishCompactionOutputFile(compact, input);
-        if (!status.ok()) {
-          break;
-        }
+    if (!drop) {
+      status = AddCompactionOutput(compact, input, key, input->value());
+      if (!status.ok()) {
+        break;
       }
     }
 
@@ -1121,6 +1479,39 @@ int64_t DBImpl::TEST_MaxNextLevelOverlappingBytes() {
   return versions_->MaxNextLevelOverlappingBytes();
 }
 
+// Look up "lkey" in mem, imm and current in turn, and apply any merge
+// operands found on the way to the base value.  Sets *read_files if
+// current was searched and *stats was filled.
+static Status LookupValue(const ReadOptions& options,
+                          const LookupKey& lkey,
+                          const MergeOperator* merge_operator,
+                          MemTable* mem, MemTable* imm, Version* current,
+                          std::string* value,
+                          Version::GetStats* stats, bool* read_files) {
+  Status s;
+  std::vector<std::string> operands;
+  *read_files = false;
+  if (mem->Get(lkey, value, &s, &operands)) {
+    // Done
+  } else if (imm != NULL && imm->Get(lkey, value, &s, &operands)) {
+    // Done
+  } else {
+    s = current->Get(options, lkey, value, &operands, stats);
+    *read_files = true;
+  }
+  if (!operands.empty()) {
+    if (s.ok()) {
+      Slice base(*value);
+      s = MergeOperands(merge_operator, lkey.user_key(), &base, operands,
+                        value);
+    } else if (s.IsNotFound()) {
+      s = MergeOperands(merge_operator, lkey.user_key(), NULL, operands,
+                        value);
+    }
+  }
+  return s;
+}
+
 Status DBImpl::Get(const ReadOptions& options,
                    const Slice& key,
                    std::string* value) {
@@ -1148,14 +1539,8 @@ Status DBImpl::Get(const ReadOptions& options,
     mutex_.Unlock();
     // First look in the memtable, then in the immutable memtable (if any).
     LookupKey lkey(key, snapshot);
-    if (mem->Get(lkey, value, &s)) {
-      // Done
-    } else if (imm != NULL && imm->Get(lkey, value, &s)) {
-      // Done
-    } else {
-      s = current->Get(options, lkey, value, &stats);
-      have_stat_update = true;
-    }
+    s = LookupValue(options, lkey, options_.merge_operator,
+                    mem, imm, current, value, &stats, &have_stat_update);
     mutex_.Lock();
   }
 
@@ -1176,7 +1561,8 @@ Iterator* DBImpl::NewIterator(const ReadOptions& options) {
       &dbname_, env_, user_comparator(), internal_iter,
       (options.snapshot != NULL
        ? reinterpret_cast<const SnapshotImpl*>(options.snapshot)->number_
-       : latest_snapshot));
+       : latest_snapshot),
+      options_.merge_operator);
 }
 
 const Snapshot* DBImpl::GetSnapshot() {
@@ -1200,6 +1586,147 @@ Status DBImpl::Delete(const WriteOptions& options, const Slice& key) {
 
 Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
   Writer w(&mutex_);
+  return WriteInternal(options, my_batch, &w);
+}
+
+namespace {
+class UpdateCollector : public WriteBatch::Handler {
+ public:
+  struct Update {
+    std::string key;
+    std::string value;
+    ValueType type;
+  };
+  std::vector<Update> updates;
+  virtual void Put(const Slice& key, const Slice& value) {
+    Update update = { key.ToString(), value.ToString(), kTypeValue };
+    updates.push_back(update);
+  }
+  virtual void Delete(const Slice& key) {
+    Update update = { key.ToString(), std::string(), kTypeDeletion };
+    updates.push_back(update);
+  }
+  virtual void Merge(const Slice& key, const Slice& operand) {
+    Update update = { key.ToString(), operand.ToString(), kTypeMerge };
+    updates.push_back(update);
+  }
+};
+}  // namespace
+
+Status DBImpl::WriteIfUnchanged(const WriteOptions& options,
+                                WriteBatch* updates,
+                                const std::vector<std::string>& expected,
+                                int* applied) {
+  assert(WriteBatchInternal::Count(updates) ==
+         static_cast<int>(expected.size()));
+  Writer w(&mutex_);
+  w.expected = &expected;
+  Status s = WriteInternal(options, updates, &w);
+  *applied = w.applied;
+  return s;
+}
+
+Status DBImpl::PutIfAbsent(const WriteOptions& options,
+                           const Slice& key, const Slice& value,
+                           bool* inserted) {
+  WriteBatch batch;
+  batch.Put(key, value);
+  return WriteIfAbsent(options, key, &batch, inserted);
+}
+
+// Like WriteIfUnchanged(), but all of "updates" are applied if "key" has no
+// entry.  The lookup consults the memtables first and, if
+// Options::filter_policy is set, the filters of the tables before reading
+// them, so a create of a new key costs about one write.
+Status DBImpl::WriteIfAbsent(const WriteOptions& options,
+                             const Slice& key, WriteBatch* updates,
+                             bool* applied) {
+  Writer w(&mutex_);
+  w.absent_key = &key;
+  Status s = WriteInternal(options, updates, &w);
+  *applied = (w.applied > 0);
+  return s;
+}
+
+// Replace "w->batch" by a batch of those of its updates whose key still
+// maps to the corresponding entry of "w->expected", or keep all of them if
+// "w->absent_key" has no entry.
+// REQUIRES: mutex_ held, and w is at the front of writers_.
+Status DBImpl::FilterUnchanged(Writer* w, WriteBatch* result) {
+  mutex_.AssertHeld();
+  UpdateCollector collector;
+  Status s;
+  if (w->expected != NULL) {
+    s = w->batch->Iterate(&collector);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  // No other writer can proceed while w is at the front of writers_,
+  // so the values looked up here stay current until w is applied.
+  const SequenceNumber snapshot = versions_->LastSequence();
+  MemTable* mem = mem_;
+  MemTable* imm = imm_;
+  Version* current = versions_->current();
+  mem->Ref();
+  if (imm != NULL) imm->Ref();
+  current->Ref();
+  mutex_.Unlock();
+  bool keep_all = false;
+  if (w->absent_key != NULL) {
+    LookupKey lkey(*w->absent_key, snapshot);
+    std::string value;
+    Version::GetStats stats;
+    bool read_files;
+    s = LookupValue(ReadOptions(), lkey, options_.merge_operator,
+                    mem, imm, current, &value, &stats, &read_files);
+    if (s.IsNotFound()) {
+      keep_all = true;
+      w->applied = WriteBatchInternal::Count(w->batch);
+      s = Status::OK();
+    }
+  }
+  for (size_t i = 0; i < collector.updates.size(); i++) {
+    const UpdateCollector::Update& update = collector.updates[i];
+    const Slice key(update.key);
+    LookupKey lkey(key, snapshot);
+    std::string value;
+    Version::GetStats stats;
+    bool read_files;
+    s = LookupValue(ReadOptions(), lkey, options_.merge_operator,
+                    mem, imm, current, &value, &stats, &read_files);
+    if (s.ok() && value == (*w->expected)[i]) {
+      switch (update.type) {
+        case kTypeValue:
+          result->Put(key, update.value);
+          break;
+        case kTypeDeletion:
+          result->Delete(key);
+          break;
+        case kTypeMerge:
+          result->Merge(key, update.value);
+          break;
+      }
+      w->applied++;
+    } else if (!s.ok() && !s.IsNotFound()) {
+      break;
+    }
+    s = Status::OK();
+  }
+  mutex_.Lock();
+  mem->Unref();
+  if (imm != NULL) imm->Unref();
+  current->Unref();
+  if (!keep_all) {
+    w->batch = result;
+  }
+  return s;
+}
+
+Status DBImpl::WriteInternal(const WriteOptions& options,
+                             WriteBatch* my_batch, Writer* writer) {
+  Writer& w = *writer;
   w.batch = my_batch;
   w.sync = options.sync;
   w.update_sequence = false;
@@ -1217,6 +1744,10 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
   // May temporarily unlock and wait.
   Status status = MakeRoomForWrite(my_batch == NULL);
   Writer* last_writer = &w;
+  WriteBatch unchanged;
+  if (status.ok() && w.conditional()) {
+    status = FilterUnchanged(&w, &unchanged);
+  }
   if (status.ok() && my_batch != NULL) {  // NULL batch is for compactions
     WriteBatch* updates = BuildBatchGroup(&last_writer);
     uint64_t last_sequence = versions_->LastSequence();
@@ -1292,6 +1823,10 @@ WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
     if (w->update_sequence) {
       break;
     }
+    if (w->conditional()) {
+      // Its check must see the updates of this group
+      break;
+    }
 
     if (w->batch != NULL) {
       size += WriteBatchInternal::ByteSize(w->batch);
@@ -1356,7 +1891,20 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       assert(versions_->PrevLogNumber() == 0);
       uint64_t new_log_number = versions_->NewFileNumber();
       WritableFile* lfile = NULL;
-      s = env_->NewWritableFile(LogFileName(dbname_, new_log_number), &lfile);
+      if (!recycled_logs_.empty()) {
+        // Overwrite an obsolete log in place instead of growing a new
+        // file, so that syncs do not have to update the file size.
+        const uint64_t old_log_number = recycled_logs_.front();
+        recycled_logs_.pop_front();
+        s = env_->ReuseWritableFile(LogFileName(dbname_, new_log_number),
+                                    LogFileName(dbname_, old_log_number),
+                                    options_.write_buffer_size +
+                                        options_.write_buffer_size / 8,
+                                    &lfile);
+      } else {
+        s = env_->NewWritableFile(LogFileName(dbname_, new_log_number),
+                                  &lfile);
+      }
       if (!s.ok()) {
         break;
       }
@@ -1364,7 +1912,8 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       delete logfile_;
       logfile_ = lfile;
       logfile_number_ = new_log_number;
-      log_ = new log::Writer(lfile);
+      log_ = new log::Writer(lfile, new_log_number,
+                             options_.recycle_log_file_num > 0);
       imm_ = mem_;
       has_imm_.Release_Store(imm_);
       mem_ = new MemTable(internal_comparator_);
@@ -1425,6 +1974,17 @@ bool DBImpl::GetProperty(const Slice& property, std::string* value) {
   } else if (in == "sstables") {
     *value = versions_->current()->DebugString();
     return true;
+  } else if (in == "recovery") {
+    char buf[200];
+    snprintf(buf, sizeof(buf),
+             "logs %d threads %d records %lld bytes %lld micros %lld\n",
+             recovery_stats_.logs,
+             recovery_stats_.threads,
+             static_cast<long long>(recovery_stats_.records),
+             static_cast<long long>(recovery_stats_.bytes),
+             static_cast<long long>(recovery_stats_.micros));
+    value->append(buf);
+    return true;
   }
 
   return false;
@@ -1782,6 +2342,13 @@ Status DB::Delete(const WriteOptions& opt, const Slice& key) {
   return Write(opt, &batch);
 }
 
+Status DB::Merge(const WriteOptions& opt, const Slice& key,
+                 const Slice& operand) {
+  WriteBatch batch;
+  batch.Merge(key, operand);
+  return Write(opt, &batch);
+}
+
 DB::~DB() { }
 
 Status DB::Open(const Options& options, const std::string& dbname,
@@ -1801,7 +2368,9 @@ Status DB::Open(const Options& options, const std::string& dbname,
       edit.SetLogNumber(new_log_number);
       impl->logfile_ = lfile;
       impl->logfile_number_ = new_log_number;
-      impl->log_ = new log::Writer(lfile);
+      impl->first_recyclable_log_ = new_log_number;
+      impl->log_ = new log::Writer(lfile, new_log_number,
+                                   options.recycle_log_file_num > 0);
       s = impl->versions_->LogAndApply(&edit, &impl->mutex_);
     }
     if (s.ok()) {
@@ -1845,6 +2414,9 @@ Status DestroyDB(const std::string& dbname, const Options& options) {
         }
       }
     }
+    // Files of a ColumnDB, if "dbname" is one
+    env->DeleteFile(DataStatsFileName(dbname));
+    env->DeleteFile(IndexFormatFileName(dbname));
     env->UnlockFile(lock);  // Ignore error since state is already gone
     env->DeleteFile(lockname);
     env->DeleteDir(dbname);  // Ignore error in case dir contains other files
@@ -7,7 +7,10 @@
 
 #include <deque>
 #include <set>
+#include <string>
+#include <vector>
 #include "db/dbformat.h"
+#include "db/log_reader.h"
 #include "db/log_writer.h"
 #include "db/snapshot.h"
 #include "leveldb/db.h"
@@ -35,6 +38,12 @@ class DBImpl : public DB {
   virtual Status Get(const ReadOptions& options,
                      const Slice& key,
                      std::string* value);
+  virtual Status PutIfAbsent(const WriteOptions& options,
+                             const Slice& key, const Slice& value,
+                             bool* inserted);
+  virtual Status WriteIfAbsent(const WriteOptions& options,
+                               const Slice& key, WriteBatch* updates,
+                               bool* applied);
   virtual Iterator* NewIterator(const ReadOptions&);
   virtual const Snapshot* GetSnapshot();
   virtual void ReleaseSnapshot(const Snapshot* snapshot);
@@ -49,6 +58,16 @@ class DBImpl : public DB {
                             uint64_t min_sequence_number,
                             uint64_t max_sequence_number);
 
+  // Like Write(), but each update in "updates" is only applied if its key
+  // still maps to the corresponding entry of "expected" at the time of the
+  // write; the other updates are skipped.  The checks and the write are
+  // atomic with respect to other writes.  Stores the number of applied
+  // updates in *applied.
+  // REQUIRES: "updates" holds one update per entry of "expected".
+  Status WriteIfUnchanged(const WriteOptions& options, WriteBatch* updates,
+                          const std::vector<std::string>& expected,
+                          int* applied);
+
   // Extra methods (for testing) that are not in the public DB interface
 
   // Compact any files in the named level that overlap [*begin,*end]
@@ -70,6 +89,8 @@ class DBImpl : public DB {
   friend class DB;
   struct CompactionState;
   struct DeletionState;
+  struct RecoveryState;
+  struct RecoveryShard;
   struct Writer;
 
   Iterator* NewInternalIterator(const ReadOptions&,
@@ -95,10 +116,24 @@ class DBImpl : public DB {
                         VersionEdit* edit,
                         SequenceNumber* max_sequence);
 
+  // Replay the records produced by "reader" on options_.recovery_threads
+  // threads.  Each thread owns the keys of one hash shard and flushes its
+  // own memtable into level-0 tables.
+  Status RecoverLogFileParallel(log::Reader* reader,
+                                log::Reader::Reporter* reporter,
+                                Status* read_status,
+                                VersionEdit* edit,
+                                SequenceNumber* max_sequence);
+  static void BGRecoverShard(void* shard);
+  void RecoverShard(RecoveryShard* shard);
+
   Status WriteLevel0Table(MemTable* mem, VersionEdit* edit, Version* base);
 
   Status MakeRoomForWrite(bool force /* compact even if there is room? */);
   WriteBatch* BuildBatchGroup(Writer** last_writer);
+  Status WriteInternal(const WriteOptions& options, WriteBatch* my_batch,
+                       Writer* w);
+  Status FilterUnchanged(Writer* w, WriteBatch* result);
 
   void MaybeScheduleCompaction();
   static void BGWork(void* db);
@@ -109,6 +144,10 @@ class DBImpl : public DB {
 
   Status OpenCompactionOutputFile(CompactionState* compact);
   Status FinishCompactionOutputFile(CompactionState* compact, Iterator* input);
+  Status AddCompactionOutput(CompactionState* compact, Iterator* input,
+                             const Slice& key, const Slice& value);
+  Status CompactMerges(CompactionState* compact, Iterator* input,
+                       const ParsedInternalKey& ikey);
   Status InstallCompactionResults(CompactionState* compact);
 
   void CleanupDeletion(DeletionState* deletion);
@@ -143,6 +182,13 @@ class DBImpl : public DB {
   uint64_t logfile_number_;
   log::Writer* log_;
 
+  // Obsolete logs kept around to be overwritten by later logs, oldest
+  // first.  Only logs created by this instance (numbered at least
+  // first_recyclable_log_) are recycled, since only those are known to
+  // be written in the recyclable record format.
+  std::deque<uint64_t> recycled_logs_;
+  uint64_t first_recyclable_log_;
+
   // Queue of writers.
   std::deque<Writer*> writers_;
   WriteBatch* tmp_batch_;
@@ -199,6 +245,18 @@ class DBImpl : public DB {
   };
   OperationStats op_stats_;
 
+  // Statistics about the log replay performed by the last DB::Open()
+  struct RecoveryStats {
+    int logs;
+    int threads;
+    int64_t records;
+    int64_t bytes;
+    int64_t micros;
+
+    RecoveryStats() : logs(0), threads(1), records(0), bytes(0), micros(0) { }
+  };
+  RecoveryStats recovery_stats_;
+
   // No copying allowed
   DBImpl(const DBImpl&);
   void operator=(const DBImpl&);
@@ -4,8 +4,11 @@
 
 #include "db/db_iter.h"
 
+#include <algorithm>
+#include <vector>
 #include "db/filename.h"
 #include "db/dbformat.h"
+#include "db/merge_helper.h"
 #include "leveldb/env.h"
 #include "leveldb/iterator.h"
 #include "port/port.h"
@@ -38,7 +41,10 @@ class DBIter: public Iterator {
  public:
   // Which direction is the iterator currently moving?
   // (1) When moving forward, the internal iterator is positioned at
-  //     the exact entry that yields this->key(), this->value()
+  //     the exact entry that yields this->key(), this->value(), unless
+  //     the entry is the result of merge operands.  Then the key and
+  //     value are held in saved_key_ and saved_value_, and the internal
+  //     iterator is positioned just after the operands.
   // (2) When moving backwards, the internal iterator is positioned
   //     just before all entries whose user key == this->key().
   enum Direction {
@@ -47,14 +53,17 @@ class DBIter: public Iterator {
   };
 
   DBIter(const std::string* dbname, Env* env,
-         const Comparator* cmp, Iterator* iter, SequenceNumber s)
+         const Comparator* cmp, Iterator* iter, SequenceNumber s,
+         const MergeOperator* merge_operator)
       : dbname_(dbname),
         env_(env),
         user_comparator_(cmp),
+        merge_operator_(merge_operator),
         iter_(iter),
         sequence_(s),
         direction_(kForward),
-        valid_(false) {
+        valid_(false),
+        merged_(false) {
   }
   virtual ~DBIter() {
     delete iter_;
@@ -62,15 +71,17 @@ class DBIter: public Iterator {
   virtual bool Valid() const { return valid_; }
   virtual Slice internalkey() const {
     assert(valid_);
-    return iter_->key();
+    return merged_ ? Slice(saved_ikey_) : iter_->key();
   }
   virtual Slice key() const {
     assert(valid_);
-    return (direction_ == kForward) ? ExtractUserKey(iter_->key()) : saved_key_;
+    return (direction_ == kForward && !merged_)
+        ? ExtractUserKey(iter_->key()) : saved_key_;
   }
   virtual Slice value() {
     assert(valid_);
-    return (direction_ == kForward) ? iter_->value() : saved_value_;
+    return (direction_ == kForward && !merged_)
+        ? iter_->value() : saved_value_;
   }
   virtual Status status() const {
     if (status_.ok()) {
@@ -89,6 +100,9 @@ class DBIter: public Iterator {
  private:
   void FindNextUserEntry(bool skipping, std::string* skip);
   void FindPrevUserEntry();
+  bool MergeForward(const ParsedInternalKey& ikey);
+  bool MergeInto(const Slice* base, const std::vector<std::string>& operands,
+                 SequenceNumber sequence);
   bool ParseKey(ParsedInternalKey* key);
 
   inline void SaveKey(const Slice& k, std::string* dst) {
@@ -107,14 +121,17 @@ class DBIter: public Iterator {
   const std::string* const dbname_;
   Env* const env_;
   const Comparator* const user_comparator_;
+  const MergeOperator* const merge_operator_;
   Iterator* const iter_;
   SequenceNumber const sequence_;
 
   Status status_;
   std::string saved_key_;     // == current key when direction_==kReverse
   std::string saved_value_;   // == current raw value when direction_==kReverse
+  std::string saved_ikey_;    // == current internal key when merged_
   Direction direction_;
   bool valid_;
+  bool merged_;               // Current entry is the result of a merge
 
   // No copying allowed
   DBIter(const DBIter&);
@@ -143,6 +160,7 @@ void DBIter::Next() {
     } else {
       iter_->Next();
     }
+    merged_ = false;
     if (!iter_->Valid()) {
       valid_ = false;
       saved_key_.clear();
@@ -152,7 +170,19 @@ void DBIter::Next() {
 
   // Temporarily use saved_key_ as storage for key to skip.
   std::string* skip = &saved_key_;
-  SaveKey(ExtractUserKey(iter_->key()), skip);
+  if (merged_) {
+    // saved_key_ already holds this->key(), and iter_ is past its
+    // merge operands.
+    merged_ = false;
+    ClearSavedValue();
+    if (!iter_->Valid()) {
+      valid_ = false;
+      saved_key_.clear();
+      return;
+    }
+  } else {
+    SaveKey(ExtractUserKey(iter_->key()), skip);
+  }
   FindNextUserEntry(true, skip);
 }
 
@@ -160,6 +190,7 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
   // Loop until we hit an acceptable entry to yield
   assert(iter_->Valid());
   assert(direction_ == kForward);
+  merged_ = false;
   do {
     ParsedInternalKey ikey;
     if (ParseKey(&ikey) && ikey.sequence <= sequence_) {
@@ -180,6 +211,20 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
             return;
           }
           break;
+        case kTypeMerge:
+          if (skipping &&
+              user_comparator_->Compare(ikey.user_key, *skip) <= 0) {
+            // Entry hidden
+          } else if (MergeForward(ikey)) {
+            valid_ = true;
+            return;
+          } else {
+            // The merge left no value, so treat it like a deletion.
+            // iter_ has already moved past the operands.
+            skipping = true;
+            continue;
+          }
+          break;
       }
     }
     iter_->Next();
@@ -188,14 +233,79 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
   valid_ = false;
 }
 
+// iter_ is at a visible merge operand "ikey".  Collect it and the older
+// entries for its user key down to the base value, leaving iter_ at the
+// base value or the first entry of the next key, and store the merged
+// entry in saved_key_ and saved_value_.  Returns false, with saved_key_
+// still set to the user key, if the merge leaves the key without a value.
+bool DBIter::MergeForward(const ParsedInternalKey& ikey) {
+  const SequenceNumber sequence = ikey.sequence;
+  SaveKey(ikey.user_key, &saved_key_);
+  std::vector<std::string> operands;
+  operands.push_back(iter_->value().ToString());
+  std::string base;
+  bool has_base = false;
+  for (iter_->Next(); iter_->Valid(); iter_->Next()) {
+    ParsedInternalKey older;
+    if (!ParseKey(&older)) {
+      continue;
+    }
+    if (user_comparator_->Compare(older.user_key, saved_key_) != 0) {
+      break;
+    }
+    if (older.type == kTypeMerge) {
+      operands.push_back(iter_->value().ToString());
+      continue;
+    }
+    if (older.type == kTypeValue) {
+      base = iter_->value().ToString();
+      has_base = true;
+    }
+    break;
+  }
+  Slice base_value(base);
+  return MergeInto(has_base ? &base_value : NULL, operands, sequence);
+}
+
+// Store in saved_value_ the result of applying "operands", newest first,
+// to "base" for saved_key_, and make it the current entry at "sequence".
+// Returns false if the key ends up without a value.
+bool DBIter::MergeInto(const Slice* base,
+                       const std::vector<std::string>& operands,
+                       SequenceNumber sequence) {
+  Status s = MergeOperands(merge_operator_, saved_key_, base, operands,
+                           &saved_value_);
+  if (!s.ok()) {
+    if (!s.IsNotFound()) {
+      status_ = s;
+    }
+    ClearSavedValue();
+    return false;
+  }
+  saved_ikey_.clear();
+  AppendInternalKey(&saved_ikey_,
+                    ParsedInternalKey(saved_key_, sequence, kTypeValue));
+  merged_ = true;
+  return true;
+}
+
 void DBIter::Prev() {
   assert(valid_);
 
   if (direction_ == kForward) {  // Switch directions?
     // iter_ is pointing at the current entry.  Scan backwards until
     // the key changes so we can use the normal reverse scanning code.
+    if (merged_) {
+      // iter_ is past the entries for saved_key_; go back to the first.
+      std::string target;
+      AppendInternalKey(&target, ParsedInternalKey(
+          saved_key_, kMaxSequenceNumber, kValueTypeForSeek));
+      iter_->Seek(target);
+      merged_ = false;
+    } else {
+      SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
+    }
     assert(iter_->Valid());  // Otherwise valid_ would have been false
-    SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
     while (true) {
       iter_->Prev();
       if (!iter_->Valid()) {
@@ -218,7 +328,11 @@ void DBIter::Prev() {
 void DBIter::FindPrevUserEntry() {
   assert(direction_ == kReverse);
 
+  merged_ = false;
   ValueType value_type = kTypeDeletion;
+  bool has_base = false;                // saved_value_ is under operands
+  std::vector<std::string> operands;    // Newest last
+  SequenceNumber merge_sequence = 0;
   if (iter_->Valid()) {
     do {
       ParsedInternalKey ikey;
@@ -226,12 +340,28 @@ void DBIter::FindPrevUserEntry() {
         if ((value_type != kTypeDeletion) &&
             user_comparator_->Compare(ikey.user_key, saved_key_) < 0) {
           // We encountered a non-deleted value in entries for previous keys,
-          break;
+          if (value_type != kTypeMerge) {
+            break;
+          }
+          std::reverse(operands.begin(), operands.end());
+          Slice base(saved_value_);
+          if (MergeInto(has_base ? &base : NULL, operands, merge_sequence)) {
+            break;
+          }
+          // The merge left no value, so treat it like a deletion
+          has_base = false;
+          operands.clear();
         }
         value_type = ikey.type;
         if (value_type == kTypeDeletion) {
           saved_key_.clear();
           ClearSavedValue();
+          has_base = false;
+          operands.clear();
+        } else if (value_type == kTypeMerge) {
+          SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
+          operands.push_back(iter_->value().ToString());
+          merge_sequence = ikey.sequence;
         } else {
           Slice raw_value = iter_->value();
           if (saved_value_.capacity() > raw_value.size() + 1048576) {
@@ -240,12 +370,22 @@ void DBIter::FindPrevUserEntry() {
           }
           SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
           saved_value_.assign(raw_value.data(), raw_value.size());
+          has_base = true;
+          operands.clear();
         }
       }
       iter_->Prev();
     } while (iter_->Valid());
   }
 
+  if (value_type == kTypeMerge && !merged_) {
+    std::reverse(operands.begin(), operands.end());
+    Slice base(saved_value_);
+    if (!MergeInto(has_base ? &base : NULL, operands, merge_sequence)) {
+      value_type = kTypeDeletion;
+    }
+  }
+
   if (value_type == kTypeDeletion) {
     // End
     valid_ = false;
@@ -259,6 +399,7 @@ void DBIter::FindPrevUserEntry() {
 
 void DBIter::Seek(const Slice& target) {
   direction_ = kForward;
+  merged_ = false;
   ClearSavedValue();
   saved_key_.clear();
   AppendInternalKey(
@@ -273,6 +414,7 @@ void DBIter::Seek(const Slice& target) {
 
 void DBIter::SeekToFirst() {
   direction_ = kForward;
+  merged_ = false;
   ClearSavedValue();
   iter_->SeekToFirst();
   if (iter_->Valid()) {
@@ -296,8 +438,10 @@ Iterator* NewDBIterator(
     Env* env,
     const Comparator* user_key_comparator,
     Iterator* internal_iter,
-    const SequenceNumber& sequence) {
-  return new DBIter(dbname, env, user_key_comparator, internal_iter, sequence);
+    const SequenceNumber& sequence,
+    const MergeOperator* merge_operator) {
+  return new DBIter(dbname, env, user_key_comparator, internal_iter, sequence,
+                    merge_operator);
 }
 
 }  // namespace leveldb
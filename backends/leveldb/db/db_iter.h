@@ -11,15 +11,19 @@
 
 namespace leveldb {
 
+class MergeOperator;
+
 // Return a new iterator that converts internal keys (yielded by
 // "*internal_iter") that were live at the specified "sequence" number
-// into appropriate user keys.
+// into appropriate user keys.  Merge operands are combined with
+// "merge_operator", which may be NULL if the DB holds none.
 extern Iterator* NewDBIterator(
     const std::string* dbname,
     Env* env,
     const Comparator* user_key_comparator,
     Iterator* internal_iter,
-    const SequenceNumber& sequence);
+    const SequenceNumber& sequence,
+    const MergeOperator* merge_operator = NULL);
 
 }  // namespace leveldb
 
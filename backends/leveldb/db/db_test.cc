@@ -6,6 +6,7 @@
 #include "leveldb/filter_policy.h"
 #include "db/db_impl.h"
 #include "db/filename.h"
+#include "db/snapshot.h"
 #include "db/version_set.h"
 #include "db/write_batch_internal.h"
 #include "leveldb/cache.h"
@@ -816,6 +817,103 @@ static std::string Key(int i) {
   return std::string(buf);
 }
 
+TEST(DBTest, ParallelRecovery) {
+  Options options = CurrentOptions();
+  options.write_buffer_size = 10 << 20;   // keep every write in the log
+  Reopen(&options);
+
+  const int N = 2000;
+  SequenceNumber writes = 0;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), Key(i) + std::string(100, 'v')));
+    writes++;
+  }
+  // Overwrite and delete some keys so replay order matters
+  for (int i = 0; i < N; i += 3) {
+    ASSERT_OK(Put(Key(i), "new"));
+    writes++;
+  }
+  for (int i = 1; i < N; i += 7) {
+    ASSERT_OK(Delete(Key(i)));
+    writes++;
+  }
+
+  // Replay the whole log over 4 shards, each flushing several tables
+  options.recovery_threads = 4;
+  options.write_buffer_size = 10000;
+  Reopen(&options);
+  for (int i = 0; i < N; i++) {
+    if (i % 7 == 1) {
+      ASSERT_EQ("NOT_FOUND", Get(Key(i)));
+    } else if (i % 3 == 0) {
+      ASSERT_EQ("new", Get(Key(i)));
+    } else {
+      ASSERT_EQ(Key(i) + std::string(100, 'v'), Get(Key(i)));
+    }
+  }
+  std::string property;
+  ASSERT_TRUE(db_->GetProperty("leveldb.recovery", &property));
+  ASSERT_TRUE(property.find("threads 4") != std::string::npos);
+
+  // The sequence number continues after the last replayed write
+  const Snapshot* snapshot = db_->GetSnapshot();
+  ASSERT_EQ(writes,
+            reinterpret_cast<const SnapshotImpl*>(snapshot)->number_);
+  db_->ReleaseSnapshot(snapshot);
+  ASSERT_OK(Put(Key(1), "after"));
+  Reopen(&options);
+  ASSERT_EQ("after", Get(Key(1)));
+  ASSERT_EQ("NOT_FOUND", Get(Key(8)));
+}
+
+TEST(DBTest, RecycledLogSkipsStaleRecords) {
+  Options options = CurrentOptions();
+  options.write_buffer_size = 10000;
+  options.recycle_log_file_num = 2;
+  Reopen(&options);
+
+  // Switch through enough logs that later ones reuse obsolete files.
+  // All records have the same size, so the records written into a reused
+  // file end exactly where a stale record of its previous log begins.
+  const int N = 500;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), std::string(100, 'a')));
+  }
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), std::string(100, 'b')));
+  }
+  db_->CompactRange(NULL, NULL);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_OK(Put(Key(i), std::string(100, 'c')));
+  }
+
+  // The current log is a reused file whose tail holds older records
+  std::vector<std::string> files;
+  ASSERT_OK(env_->GetChildren(dbname_, &files));
+  uint64_t number, log_number = 0;
+  FileType type;
+  for (size_t i = 0; i < files.size(); i++) {
+    if (ParseFileName(files[i], &number, &type) && type == kLogFile &&
+        number > log_number) {
+      log_number = number;
+    }
+  }
+  uint64_t log_size = 0;
+  ASSERT_OK(env_->GetFileSize(LogFileName(dbname_, log_number), &log_size));
+  ASSERT_GE(log_size, options.write_buffer_size);
+
+  for (int reopen = 0; reopen < 2; reopen++) {
+    Reopen(&options);
+    std::string property;
+    ASSERT_TRUE(db_->GetProperty("leveldb.recovery", &property));
+    ASSERT_TRUE(property.find(reopen == 0 ? "records 3 " : "records 0 ")
+                != std::string::npos) << property;
+    for (int i = 0; i < N; i++) {
+      ASSERT_EQ(std::string(100, i < 3 ? 'c' : 'b'), Get(Key(i)));
+    }
+  }
+}
+
 TEST(DBTest, MinorCompactionsHappen) {
   Options options = CurrentOptions();
   options.write_buffer_size = 10000;
@@ -1499,6 +1597,113 @@ TEST(DBTest, BloomFilter) {
   delete options.filter_policy;
 }
 
+TEST(DBTest, PutIfAbsent) {
+  do {
+    bool inserted;
+    ASSERT_OK(db_->PutIfAbsent(WriteOptions(), "foo", "v1", &inserted));
+    ASSERT_TRUE(inserted);
+    ASSERT_OK(db_->PutIfAbsent(WriteOptions(), "foo", "v2", &inserted));
+    ASSERT_TRUE(!inserted);
+    ASSERT_EQ("v1", Get("foo"));
+
+    // Entries in tables count too, deleted ones do not
+    ASSERT_OK(Put("bar", "v1"));
+    ASSERT_OK(Delete("foo"));
+    dbfull()->TEST_CompactMemTable();
+    ASSERT_OK(db_->PutIfAbsent(WriteOptions(), "bar", "v2", &inserted));
+    ASSERT_TRUE(!inserted);
+    ASSERT_OK(db_->PutIfAbsent(WriteOptions(), "foo", "v3", &inserted));
+    ASSERT_TRUE(inserted);
+    ASSERT_EQ("v1", Get("bar"));
+    ASSERT_EQ("v3", Get("foo"));
+  } while (ChangeOptions());
+}
+
+TEST(DBTest, WriteIfAbsent) {
+  do {
+    bool applied;
+    WriteBatch batch;
+    batch.Put("foo", "v1");
+    batch.Put("foo.1", "c1");
+    ASSERT_OK(db_->WriteIfAbsent(WriteOptions(), "foo", &batch, &applied));
+    ASSERT_TRUE(applied);
+    ASSERT_EQ("v1", Get("foo"));
+    ASSERT_EQ("c1", Get("foo.1"));
+
+    // None of the updates is applied if the key has an entry, even those
+    // of absent keys
+    dbfull()->TEST_CompactMemTable();
+    batch.Clear();
+    batch.Put("foo", "v2");
+    batch.Put("foo.2", "c2");
+    ASSERT_OK(db_->WriteIfAbsent(WriteOptions(), "foo", &batch, &applied));
+    ASSERT_TRUE(!applied);
+    ASSERT_EQ("v1", Get("foo"));
+    ASSERT_EQ("NOT_FOUND", Get("foo.2"));
+
+    // The key need not be updated by the batch
+    ASSERT_OK(db_->WriteIfAbsent(WriteOptions(), "bar", &batch, &applied));
+    ASSERT_TRUE(applied);
+    ASSERT_EQ("v2", Get("foo"));
+    ASSERT_EQ("c2", Get("foo.2"));
+    ASSERT_EQ("NOT_FOUND", Get("bar"));
+  } while (ChangeOptions());
+}
+
+namespace {
+static const int kPutIfAbsentThreads = 4;
+static const int kPutIfAbsentKeys = 2000;
+
+struct PutIfAbsentThread {
+  DB* db;
+  int id;
+  int inserted;
+  port::AtomicPointer done;
+};
+
+static void PutIfAbsentBody(void* arg) {
+  PutIfAbsentThread* t = reinterpret_cast<PutIfAbsentThread*>(arg);
+  char id[10];
+  snprintf(id, sizeof(id), "%d", t->id);
+  for (int i = 0; i < kPutIfAbsentKeys; i++) {
+    bool inserted;
+    ASSERT_OK(t->db->PutIfAbsent(WriteOptions(), Key(i), id, &inserted));
+    if (inserted) {
+      t->inserted++;
+    }
+  }
+  t->done.Release_Store(t);
+}
+}  // namespace
+
+// Concurrent creates of the same keys each succeed exactly once
+TEST(DBTest, PutIfAbsentConcurrent) {
+  PutIfAbsentThread thread[kPutIfAbsentThreads];
+  for (int id = 0; id < kPutIfAbsentThreads; id++) {
+    thread[id].db = db_;
+    thread[id].id = id;
+    thread[id].inserted = 0;
+    thread[id].done.Release_Store(NULL);
+    env_->StartThread(PutIfAbsentBody, &thread[id]);
+  }
+  int total = 0;
+  for (int id = 0; id < kPutIfAbsentThreads; id++) {
+    while (thread[id].done.Acquire_Load() == NULL) {
+      env_->SleepForMicroseconds(10000);
+    }
+    total += thread[id].inserted;
+  }
+  ASSERT_EQ(kPutIfAbsentKeys, total);
+
+  int inserted[kPutIfAbsentThreads] = { 0 };
+  for (int i = 0; i < kPutIfAbsentKeys; i++) {
+    inserted[atoi(Get(Key(i)).c_str())]++;
+  }
+  for (int id = 0; id < kPutIfAbsentThreads; id++) {
+    ASSERT_EQ(thread[id].inserted, inserted[id]);
+  }
+}
+
 // Multi-threaded test:
 namespace {
 
@@ -1675,7 +1880,9 @@ class ModelDB: public DB {
     return Status::NotFound(Slice());
   }
   virtual Status BulkInsert(const WriteOptions& options,
-                            const std::string &fname) {
+                            const std::string &dirname,
+                            uint64_t min_sequence_number,
+                            uint64_t max_sequence_number) {
     assert(false);    // Not implemented
     return Status::NotFound(Slice());
   }
@@ -1703,8 +1910,9 @@ class ModelDB: public DB {
     }
     virtual void Next() { ++iter_; }
     virtual void Prev() { --iter_; }
+    virtual Slice internalkey() const { return iter_->first; }
     virtual Slice key() const { return iter_->first; }
-    virtual Slice value() const { return iter_->second; }
+    virtual Slice value() { return iter_->second; }
     virtual Status status() const { return Status::OK(); }
    private:
     const KVMap* const map_;
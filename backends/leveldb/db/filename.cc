@@ -73,6 +73,14 @@ std::string DataFileName(const std::string& dbname, uint64_t number) {
   return dbname + buf;
 }
 
+std::string DataStatsFileName(const std::string& dbname) {
+  return dbname + "/DATASTATS";
+}
+
+std::string IndexFormatFileName(const std::string& dbname) {
+  return dbname + "/INDEXFORMAT";
+}
+
 
 // Owned filenames have the form:
 //    dbname/CURRENT
@@ -81,6 +89,7 @@ std::string DataFileName(const std::string& dbname, uint64_t number) {
 //    dbname/LOG.old
 //    dbname/MANIFEST-[0-9]+
 //    dbname/[0-9]+.(log|sst)
+//    dbname/db[0-9]+.dat
 bool ParseFileName(const std::string& fname,
                    uint64_t* number,
                    FileType* type) {
@@ -105,6 +114,17 @@ bool ParseFileName(const std::string& fname,
     }
     *type = kDescriptorFile;
     *number = num;
+  } else if (rest.starts_with("db")) {
+    rest.remove_prefix(strlen("db"));
+    uint64_t num;
+    if (!ConsumeDecimalNumber(&rest, &num)) {
+      return false;
+    }
+    if (rest != Slice(".dat")) {
+      return false;
+    }
+    *type = kDataFile;
+    *number = num;
   } else {
     // Avoid strtoull() to keep filename format independent of the
     // current locale
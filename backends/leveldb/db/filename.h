@@ -66,6 +66,14 @@ extern std::string OldInfoLogFileName(const std::string& dbname);
 // Return the name of the data file for "dbname".
 extern std::string DataFileName(const std::string& dbname, uint64_t number);
 
+// Return the name of the file that keeps the estimated dead bytes of
+// the data files of "dbname".
+extern std::string DataStatsFileName(const std::string& dbname);
+
+// Return the name of the file that tells the format of the index entries
+// of the ColumnDB "dbname".
+extern std::string IndexFormatFileName(const std::string& dbname);
+
 // If filename is a leveldb file, store the type of the file in *type.
 // The number encoded in the filename is stored in *number.  If the
 // filename was successfully parsed, returns true.  Else return false.
@@ -34,6 +34,7 @@ TEST(FileNameTest, Parse) {
     { "LOG",                0,     kInfoLogFile },
     { "LOG.old",            0,     kInfoLogFile },
     { "18446744073709551615.log", 18446744073709551615ull, kLogFile },
+    { "db000012.dat",       12,    kDataFile },
   };
   for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
     std::string f = cases[i].fname;
@@ -65,7 +66,11 @@ TEST(FileNameTest, Parse) {
     "184467440737095516150.log",
     "100",
     "100.",
-    "100.lop"
+    "100.lop",
+    "db",
+    "db12",
+    "db12.log",
+    "dbx.dat"
   };
   for (int i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
     std::string f = errors[i];
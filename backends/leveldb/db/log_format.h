@@ -20,15 +20,30 @@ enum RecordType {
   // For fragments
   kFirstType = 2,
   kMiddleType = 3,
-  kLastType = 4
+  kLastType = 4,
+
+  // Same as above, for logs that may be written over a recycled file.
+  // These records also carry the number of the log they belong to so
+  // that stale records left behind by the previous owner of the file
+  // can be told apart from live ones.
+  kRecyclableFullType = 5,
+  kRecyclableFirstType = 6,
+  kRecyclableMiddleType = 7,
+  kRecyclableLastType = 8
 };
-static const int kMaxRecordType = kLastType;
+static const int kMaxRecordType = kRecyclableLastType;
+
+// Difference between a recyclable record type and its plain counterpart
+static const int kRecyclableTypeOffset = kRecyclableFullType - kFullType;
 
 static const int kBlockSize = 32768;
 
 // Header is checksum (4 bytes), type (1 byte), length (2 bytes).
 static const int kHeaderSize = 4 + 1 + 2;
 
+// Recyclable header is the above followed by the log number (4 bytes).
+static const int kRecyclableHeaderSize = kHeaderSize + 4;
+
 }  // namespace log
 }  // namespace leveldb
 
@@ -40,8 +40,12 @@ class Reader {
   //
   // The Reader will start reading at the first record located at physical
   // position >= initial_offset within the file.
+  //
+  // Recyclable records are only accepted if they carry "log_number".
+  // The first one that does not marks the end of the log: the rest of
+  // the file is left over from a previous log that used the same file.
   Reader(SequentialFile* file, Reporter* reporter, bool checksum,
-         uint64_t initial_offset);
+         uint64_t initial_offset, uint64_t log_number = 0);
 
   ~Reader();
 
@@ -73,6 +77,14 @@ class Reader {
   // Offset at which to start looking for the first record to return
   uint64_t const initial_offset_;
 
+  // Number of the log being read, checked against recyclable records
+  uint64_t const log_number_;
+
+  // Have we seen a recyclable record for log_number_?  If so, the file
+  // may be a recycled one and garbage after the last valid record is
+  // the tail of an older log rather than corruption.
+  bool recycled_;
+
   // Extend record types with the following special values
   enum {
     kEof = kMaxRecordType + 1,
@@ -189,6 +189,37 @@ class LogTest {
     }
   }
 
+  // Write "records" as recyclable log "log_number" over the beginning
+  // of the current contents, the way a recycled log file is reused.
+  void WriteRecycled(uint64_t log_number,
+                     const std::vector<std::string>& records) {
+    StringDest dest;
+    Writer writer(&dest, log_number, true/*recyclable*/);
+    for (size_t i = 0; i < records.size(); i++) {
+      writer.AddRecord(Slice(records[i]));
+    }
+    if (dest_.contents_.size() < dest.contents_.size()) {
+      dest_.contents_.resize(dest.contents_.size());
+    }
+    dest_.contents_.replace(0, dest.contents_.size(), dest.contents_);
+  }
+
+  // Read every record of log "log_number", joined with '|'
+  std::string ReadRecycled(uint64_t log_number) {
+    reading_ = true;
+    source_.contents_ = Slice(dest_.contents_);
+    Reader reader(&source_, &report_, true/*checksum*/,
+                  0/*initial_offset*/, log_number);
+    std::string result;
+    std::string scratch;
+    Slice record;
+    while (reader.ReadRecord(&record, &scratch)) {
+      if (!result.empty()) result.push_back('|');
+      result.append(record.data(), record.size());
+    }
+    return result;
+  }
+
   void CheckOffsetPastEndReturnsNoRecords(uint64_t offset_past_end) {
     WriteInitialOffsetLog();
     reading_ = true;
@@ -438,6 +469,29 @@ TEST(LogTest, ErrorJoinsRecords) {
   ASSERT_GE(dropped, 2*kBlockSize);
 }
 
+TEST(LogTest, RecycledLog) {
+  std::vector<std::string> old_records, new_records;
+  for (int i = 0; i < 5000; i++) {
+    old_records.push_back("old" + NumberString(i));
+  }
+  new_records.push_back("new1");
+  new_records.push_back(BigString("new2", 2 * kBlockSize));
+  new_records.push_back("new3");
+  WriteRecycled(1, old_records);
+  WriteRecycled(2, new_records);
+  ASSERT_EQ("new1|" + new_records[1] + "|new3", ReadRecycled(2));
+  ASSERT_EQ(0, DroppedBytes());
+}
+
+TEST(LogTest, RecycledLogWrongNumber) {
+  std::vector<std::string> records;
+  records.push_back("foo");
+  records.push_back("bar");
+  WriteRecycled(7, records);
+  ASSERT_EQ("", ReadRecycled(8));
+  ASSERT_EQ(0, DroppedBytes());
+}
+
 TEST(LogTest, ReadStart) {
   CheckInitialOffsetRecord(0, 0);
 }
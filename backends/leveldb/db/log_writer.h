@@ -22,6 +22,11 @@ class Writer {
   // "*dest" must be initially empty.
   // "*dest" must remain live while this Writer is in use.
   explicit Writer(WritableFile* dest);
+
+  // Create a writer that stamps every record with "log_number" when
+  // "recyclable" is true, so that "*dest" may be a recycled log file
+  // that still holds records of an older log past the write position.
+  Writer(WritableFile* dest, uint64_t log_number, bool recyclable);
   ~Writer();
 
   Status AddRecord(const Slice& slice);
@@ -29,12 +34,16 @@ class Writer {
  private:
   WritableFile* dest_;
   int block_offset_;       // Current offset in block
+  uint64_t log_number_;
+  bool recyclable_;
+  int header_size_;        // kHeaderSize or kRecyclableHeaderSize
 
   // crc32c values for all supported record types.  These are
   // pre-computed to reduce the overhead of computing the crc of the
   // record type stored in the header.
   uint32_t type_crc_[kMaxRecordType + 1];
 
+  void Init();
   Status EmitPhysicalRecord(RecordType type, const char* ptr, size_t length);
 
   // No copying allowed
@@ -36,6 +36,20 @@ public:
     return Status::OK();
   }
 
+  // Reserve "bytes" at the end of the buffer for the caller to fill in.
+  // The caller may fill them in without holding a lock, as long as the
+  // buffer is not truncated in the meantime.
+  char* Reserve(size_t bytes, size_t &location) {
+    assert(bytes <= free_buffer_size);
+    location = buffer_size - free_buffer_size;
+    free_buffer_size -= bytes;
+    return buffer + location;
+  }
+
+  Slice Region(size_t offset, size_t size) const {
+    return Slice(buffer + offset, size);
+  }
+
   Status Get(size_t offset, size_t size, Slice* result, char* scratch) {
     if (offset >= buffer_size)
       return Status::IOError("Exceeding memory buffer size");
@@ -6,6 +6,7 @@
 #define STORAGE_LEVELDB_DB_MEMTABLE_H_
 
 #include <string>
+#include <vector>
 #include "leveldb/db.h"
 #include "db/dbformat.h"
 #include "db/skiplist.h"
@@ -61,7 +62,11 @@ class MemTable {
   // If memtable contains a deletion for key, store a NotFound() error
   // in *status and return true.
   // Else, return false.
-  bool Get(const LookupKey& key, std::string* value, Status* s);
+  // The merge operands newer than the value or deletion are appended to
+  // *operands, newest first.  If the memtable holds only merge operands
+  // for key, all of them are appended and false is returned.
+  bool Get(const LookupKey& key, std::string* value, Status* s,
+           std::vector<std::string>* operands);
 
  private:
   ~MemTable();  // Private since only Unref() should be used to delete it
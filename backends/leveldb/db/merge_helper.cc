@@ -0,0 +1,35 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/merge_helper.h"
+
+#include "leveldb/merge_operator.h"
+
+namespace leveldb {
+
+MergeOperator::~MergeOperator() { }
+
+Status MergeOperands(const MergeOperator* merge_operator,
+                     const Slice& user_key,
+                     const Slice* existing_value,
+                     const std::vector<std::string>& operands,
+                     std::string* result) {
+  if (merge_operator == NULL) {
+    return Status::NotSupported("merge operand without a merge operator");
+  }
+  std::vector<Slice> oldest_first;
+  oldest_first.reserve(operands.size());
+  for (size_t i = operands.size(); i > 0; i--) {
+    oldest_first.push_back(operands[i - 1]);
+  }
+  std::string merged;
+  if (!merge_operator->FullMerge(user_key, existing_value, oldest_first,
+                                 &merged)) {
+    return Status::NotFound(Slice());
+  }
+  result->swap(merged);
+  return Status::OK();
+}
+
+}  // namespace leveldb
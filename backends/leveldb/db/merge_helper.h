@@ -0,0 +1,30 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_LEVELDB_DB_MERGE_HELPER_H_
+#define STORAGE_LEVELDB_DB_MERGE_HELPER_H_
+
+#include <string>
+#include <vector>
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+
+namespace leveldb {
+
+class MergeOperator;
+
+// Store in *result the value of "user_key" after applying "operands",
+// which are ordered newest first, to "existing_value", which is NULL if
+// the key had no value.  "existing_value" may refer to *result.
+// Returns NotFound if the merge leaves the key without a value, and
+// NotSupported if there is no merge operator.
+extern Status MergeOperands(const MergeOperator* merge_operator,
+                            const Slice& user_key,
+                            const Slice* existing_value,
+                            const std::vector<std::string>& operands,
+                            std::string* result);
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_MERGE_HELPER_H_
@@ -0,0 +1,286 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/db.h"
+#include "leveldb/merge_operator.h"
+#include "leveldb/write_batch.h"
+#include "db/db_impl.h"
+#include "db/dbformat.h"
+#include "util/logging.h"
+#include "util/testharness.h"
+#include "util/testutil.h"
+
+namespace leveldb {
+
+namespace {
+// Appends each operand to the value, separated by commas.  The operand
+// "del" removes the value.
+class AppendOperator : public MergeOperator {
+ public:
+  virtual const char* Name() const { return "leveldb.test.Append"; }
+  virtual bool FullMerge(const Slice& key, const Slice* existing_value,
+                         const std::vector<Slice>& operands,
+                         std::string* new_value) const {
+    bool exists = (existing_value != NULL);
+    if (exists) {
+      new_value->assign(existing_value->data(), existing_value->size());
+    }
+    for (size_t i = 0; i < operands.size(); i++) {
+      if (operands[i] == Slice("del")) {
+        new_value->clear();
+        exists = false;
+        continue;
+      }
+      if (exists) {
+        new_value->push_back(',');
+      }
+      new_value->append(operands[i].data(), operands[i].size());
+      exists = true;
+    }
+    return exists;
+  }
+};
+}  // namespace
+
+class MergeTest {
+ public:
+  std::string dbname_;
+  AppendOperator merge_operator_;
+  Options options_;
+  DB* db_;
+
+  MergeTest() : db_(NULL) {
+    dbname_ = test::TmpDir() + "/merge_test";
+    DestroyDB(dbname_, Options());
+    options_.create_if_missing = true;
+    options_.merge_operator = &merge_operator_;
+    Reopen();
+  }
+
+  ~MergeTest() {
+    delete db_;
+    DestroyDB(dbname_, Options());
+  }
+
+  void Reopen() {
+    delete db_;
+    db_ = NULL;
+    ASSERT_OK(DB::Open(options_, dbname_, &db_));
+  }
+
+  DBImpl* dbfull() {
+    return reinterpret_cast<DBImpl*>(db_);
+  }
+
+  Status Merge(const std::string& k, const std::string& v) {
+    return db_->Merge(WriteOptions(), k, v);
+  }
+
+  std::string Get(const std::string& k, const Snapshot* snapshot = NULL) {
+    ReadOptions options;
+    options.snapshot = snapshot;
+    std::string result;
+    Status s = db_->Get(options, k, &result);
+    if (s.IsNotFound()) {
+      result = "NOT_FOUND";
+    } else if (!s.ok()) {
+      result = s.ToString();
+    }
+    return result;
+  }
+
+  std::string Contents(bool reverse) {
+    std::string result;
+    Iterator* iter = db_->NewIterator(ReadOptions());
+    if (reverse) {
+      iter->SeekToLast();
+    } else {
+      iter->SeekToFirst();
+    }
+    while (iter->Valid()) {
+      if (!result.empty()) {
+        result.append(" ");
+      }
+      result.append(iter->key().ToString() + "=" + iter->value().ToString());
+      if (reverse) {
+        iter->Prev();
+      } else {
+        iter->Next();
+      }
+    }
+    ASSERT_OK(iter->status());
+    delete iter;
+    return result;
+  }
+
+  // Number of entries in the DB for user key "k".
+  int NumEntries(const std::string& k) {
+    Iterator* iter = dbfull()->TEST_NewInternalIterator();
+    InternalKey target(k, kMaxSequenceNumber, kValueTypeForSeek);
+    int count = 0;
+    for (iter->Seek(target.Encode()); iter->Valid(); iter->Next()) {
+      ParsedInternalKey ikey;
+      ASSERT_TRUE(ParseInternalKey(iter->key(), &ikey));
+      if (ikey.user_key != Slice(k)) {
+        break;
+      }
+      count++;
+    }
+    delete iter;
+    return count;
+  }
+
+  void CompactAll() {
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+    db_->CompactRange(NULL, NULL);
+  }
+};
+
+TEST(MergeTest, MemTable) {
+  ASSERT_OK(db_->Put(WriteOptions(), "a", "1"));
+  ASSERT_OK(Merge("a", "2"));
+  ASSERT_OK(Merge("a", "3"));
+  ASSERT_OK(Merge("b", "x"));
+  ASSERT_EQ("1,2,3", Get("a"));
+  ASSERT_EQ("x", Get("b"));
+  ASSERT_OK(Merge("b", "del"));
+  ASSERT_EQ("NOT_FOUND", Get("b"));
+  ASSERT_OK(Merge("b", "y"));
+  ASSERT_EQ("y", Get("b"));
+  ASSERT_OK(db_->Delete(WriteOptions(), "a"));
+  ASSERT_OK(Merge("a", "4"));
+  ASSERT_EQ("4", Get("a"));
+}
+
+TEST(MergeTest, AcrossLevels) {
+  ASSERT_OK(db_->Put(WriteOptions(), "a", "1"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  dbfull()->TEST_CompactRange(0, NULL, NULL);
+  ASSERT_OK(Merge("a", "2"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_OK(Merge("a", "3"));
+  ASSERT_EQ("1,2,3", Get("a"));
+  Reopen();
+  ASSERT_EQ("1,2,3", Get("a"));
+}
+
+TEST(MergeTest, Batch) {
+  WriteBatch batch;
+  batch.Put("a", "1");
+  batch.Merge("a", "2");
+  batch.Merge("b", "3");
+  ASSERT_OK(db_->Write(WriteOptions(), &batch));
+  ASSERT_EQ("1,2", Get("a"));
+  ASSERT_EQ("3", Get("b"));
+}
+
+TEST(MergeTest, Iterator) {
+  ASSERT_OK(db_->Put(WriteOptions(), "a", "1"));
+  ASSERT_OK(Merge("b", "1"));
+  ASSERT_OK(Merge("c", "1"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_OK(Merge("a", "2"));
+  ASSERT_OK(Merge("b", "2"));
+  ASSERT_OK(Merge("c", "del"));
+  ASSERT_OK(db_->Put(WriteOptions(), "d", "1"));
+  ASSERT_OK(Merge("e", "1"));
+  ASSERT_EQ("a=1,2 b=1,2 d=1 e=1", Contents(false));
+  ASSERT_EQ("e=1 d=1 b=1,2 a=1,2", Contents(true));
+
+  // Change direction on a merged entry
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  iter->Seek("b");
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ("b", iter->key().ToString());
+  ASSERT_EQ("1,2", iter->value().ToString());
+  ParsedInternalKey ikey;
+  ASSERT_TRUE(ParseInternalKey(iter->internalkey(), &ikey));
+  ASSERT_EQ("b", ikey.user_key.ToString());
+  ASSERT_EQ(kTypeValue, ikey.type);
+  iter->Prev();
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ("a=1,2", iter->key().ToString() + "=" + iter->value().ToString());
+  iter->Next();
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ("b=1,2", iter->key().ToString() + "=" + iter->value().ToString());
+  iter->Next();
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ("d", iter->key().ToString());
+  iter->Prev();
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ("b=1,2", iter->key().ToString() + "=" + iter->value().ToString());
+  delete iter;
+}
+
+TEST(MergeTest, CompactionMergesOperands) {
+  ASSERT_OK(db_->Put(WriteOptions(), "a", "1"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  for (int i = 2; i <= 5; i++) {
+    ASSERT_OK(Merge("a", NumberToString(i)));
+  }
+  ASSERT_OK(Merge("b", "1"));
+  ASSERT_OK(Merge("c", "1"));
+  ASSERT_OK(Merge("c", "del"));
+  CompactAll();
+  ASSERT_EQ(1, NumEntries("a"));
+  ASSERT_EQ("1,2,3,4,5", Get("a"));
+  ASSERT_EQ(1, NumEntries("b"));
+  ASSERT_EQ("1", Get("b"));
+  ASSERT_EQ(0, NumEntries("c"));
+  ASSERT_EQ("NOT_FOUND", Get("c"));
+}
+
+TEST(MergeTest, CompactionKeepsSnapshots) {
+  ASSERT_OK(db_->Put(WriteOptions(), "a", "1"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_OK(Merge("a", "2"));
+  const Snapshot* snapshot = db_->GetSnapshot();
+  ASSERT_OK(Merge("a", "3"));
+  ASSERT_OK(Merge("a", "4"));
+  CompactAll();
+  // Only the operands the snapshot sees are merged
+  ASSERT_EQ(3, NumEntries("a"));
+  ASSERT_EQ("1,2", Get("a", snapshot));
+  ASSERT_EQ("1,2,3,4", Get("a"));
+  db_->ReleaseSnapshot(snapshot);
+  ASSERT_OK(Merge("a", "5"));
+  CompactAll();
+  ASSERT_EQ(1, NumEntries("a"));
+  ASSERT_EQ("1,2,3,4,5", Get("a"));
+}
+
+TEST(MergeTest, ManyOperands) {
+  options_.block_size = 256;
+  Reopen();
+  std::string expected = "base";
+  ASSERT_OK(db_->Put(WriteOptions(), "k", expected));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  dbfull()->TEST_CompactRange(0, NULL, NULL);
+  const Snapshot* snapshot = db_->GetSnapshot();
+  for (int i = 0; i < 500; i++) {
+    std::string operand = NumberToString(i);
+    ASSERT_OK(Merge("k", operand));
+    expected += "," + operand;
+  }
+  // The operands now span many blocks of a level-0 file
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_EQ(expected, Get("k"));
+  ASSERT_EQ("k=" + expected, Contents(false));
+  ASSERT_EQ("k=" + expected, Contents(true));
+  db_->ReleaseSnapshot(snapshot);
+}
+
+TEST(MergeTest, NoMergeOperator) {
+  ASSERT_OK(Merge("a", "1"));
+  options_.merge_operator = NULL;
+  Reopen();
+  ASSERT_EQ("Not implemented: merge operand without a merge operator",
+            Get("a"));
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -129,6 +129,8 @@ class Repairer {
       if (ParseFileName(filenames[i], &number, &type)) {
         if (type == kDescriptorFile) {
           manifests_.push_back(filenames[i]);
+        } else if (type == kDataFile) {
+          // Data files are numbered separately by ColumnDB
         } else {
           if (number + 1 > next_file_number_) {
             next_file_number_ = number + 1;
@@ -191,7 +193,7 @@ class Repairer {
     // propagating bad information (like overly large sequence
     // numbers).
     log::Reader reader(lfile, &reporter, false/*do not checksum*/,
-                       0/*initial_offset*/);
+                       0/*initial_offset*/, log);
 
     // Read all the records and add to a memtable
     std::string scratch;
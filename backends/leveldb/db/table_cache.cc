@@ -55,7 +55,7 @@ Status TableCache::FindTable(uint64_t file_number, uint64_t file_size,
     Table* table = NULL;
     s = env_->NewRandomAccessFile(fname, &file);
     if (s.ok()) {
-      s = Table::Open(*options_, file, file_size, &table);
+      s = Table::Open(*options_, file, fname, file_size, &table);
     }
 
     if (!s.ok()) {
@@ -101,7 +101,7 @@ Status TableCache::Get(const ReadOptions& options,
                        uint64_t file_size,
                        const Slice& k,
                        void* arg,
-                       void (*saver)(void*, const Slice&, const Slice&)) {
+                       bool (*saver)(void*, const Slice&, const Slice&)) {
   Cache::Handle* handle = NULL;
   Status s = FindTable(file_number, file_size, &handle);
   if (s.ok()) {
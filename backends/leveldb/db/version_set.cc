@@ -272,21 +272,27 @@ struct Saver {
   const Comparator* ucmp;
   Slice user_key;
   std::string* value;
+  std::vector<std::string>* operands;
 };
 }
-static void SaveValue(void* arg, const Slice& ikey, const Slice& v) {
+static bool SaveValue(void* arg, const Slice& ikey, const Slice& v) {
   Saver* s = reinterpret_cast<Saver*>(arg);
   ParsedInternalKey parsed_key;
   if (!ParseInternalKey(ikey, &parsed_key)) {
     s->state = kCorrupt;
   } else {
     if (s->ucmp->Compare(parsed_key.user_key, s->user_key) == 0) {
+      if (parsed_key.type == kTypeMerge) {
+        s->operands->push_back(v.ToString());
+        return true;  // Keep looking for the base value
+      }
       s->state = (parsed_key.type == kTypeValue) ? kFound : kDeleted;
       if (s->state == kFound) {
         s->value->assign(v.data(), v.size());
       }
     }
   }
+  return false;
 }
 
 static bool NewestFirst(FileMetaData* a, FileMetaData* b) {
@@ -296,6 +302,7 @@ static bool NewestFirst(FileMetaData* a, FileMetaData* b) {
 Status Version::Get(const ReadOptions& options,
                     const LookupKey& k,
                     std::string* value,
+                    std::vector<std::string>* operands,
                     GetStats* stats) {
   Slice ikey = k.internal_key();
   Slice user_key = k.user_key();
@@ -347,8 +354,16 @@ Status Version::Get(const ReadOptions& options,
           files = NULL;
           num_files = 0;
         } else {
-          files = &tmp2;
-          num_files = 1;
+          // The entries for user_key may run on into the next files
+          // when it has many merge operands.
+          size_t last = index;
+          while (last + 1 < num_files &&
+                 ucmp->Compare(user_key,
+                               files[last + 1]->smallest.user_key()) == 0) {
+            last++;
+          }
+          files = &files[index];
+          num_files = last - index + 1;
         }
       }
     }
@@ -369,6 +384,7 @@ Status Version::Get(const ReadOptions& options,
       saver.ucmp = ucmp;
       saver.user_key = user_key;
       saver.value = value;
+      saver.operands = operands;
       s = vset_->table_cache_->Get(options, f->number, f->file_size,
                                    ikey, &saver, SaveValue);
       if (!s.ok()) {
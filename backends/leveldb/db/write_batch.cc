@@ -8,7 +8,8 @@
 //    data: record[count]
 // record :=
 //    kTypeValue varstring varstring         |
-//    kTypeDeletion varstring
+//    kTypeDeletion varstring                |
+//    kTypeMerge varstring varstring
 // varstring :=
 //    len: varint32
 //    data: uint8[len]
@@ -21,6 +22,8 @@
 #include "db/write_batch_internal.h"
 #include "util/coding.h"
 
+#include "util/hash.h"
+
 namespace leveldb {
 
 // WriteBatch header has an 8-byte sequence number followed by a 4-byte count.
@@ -34,6 +37,8 @@ WriteBatch::~WriteBatch() { }
 
 WriteBatch::Handler::~Handler() { }
 
+void WriteBatch::Handler::Merge(const Slice& key, const Slice& operand) { }
+
 void WriteBatch::Clear() {
   rep_.clear();
   rep_.resize(kHeader);
@@ -68,6 +73,14 @@ Status WriteBatch::Iterate(Handler* handler) const {
           return Status::Corruption("bad WriteBatch Delete");
         }
         break;
+      case kTypeMerge:
+        if (GetLengthPrefixedSlice(&input, &key) &&
+            GetLengthPrefixedSlice(&input, &value)) {
+          handler->Merge(key, value);
+        } else {
+          return Status::Corruption("bad WriteBatch Merge");
+        }
+        break;
       default:
         return Status::Corruption("unknown WriteBatch tag");
     }
@@ -108,6 +121,13 @@ void WriteBatch::Delete(const Slice& key) {
   PutLengthPrefixedSlice(&rep_, key);
 }
 
+void WriteBatch::Merge(const Slice& key, const Slice& operand) {
+  WriteBatchInternal::SetCount(this, WriteBatchInternal::Count(this) + 1);
+  rep_.push_back(static_cast<char>(kTypeMerge));
+  PutLengthPrefixedSlice(&rep_, key);
+  PutLengthPrefixedSlice(&rep_, operand);
+}
+
 namespace {
 class MemTableInserter : public WriteBatch::Handler {
  public:
@@ -122,6 +142,40 @@ class MemTableInserter : public WriteBatch::Handler {
     mem_->Add(sequence_, kTypeDeletion, key, Slice());
     sequence_++;
   }
+  virtual void Merge(const Slice& key, const Slice& operand) {
+    mem_->Add(sequence_, kTypeMerge, key, operand);
+    sequence_++;
+  }
+};
+
+// Like MemTableInserter, but only applies the entries whose user key
+// belongs to one shard.  Sequence numbers still advance for every entry
+// so each shard assigns exactly the numbers a full replay would.
+class ShardedMemTableInserter : public WriteBatch::Handler {
+ public:
+  SequenceNumber sequence_;
+  MemTable* mem_;
+  int shard_;
+  int num_shards_;
+
+  virtual void Put(const Slice& key, const Slice& value) {
+    if (WriteBatchInternal::KeyShard(key, num_shards_) == shard_) {
+      mem_->Add(sequence_, kTypeValue, key, value);
+    }
+    sequence_++;
+  }
+  virtual void Delete(const Slice& key) {
+    if (WriteBatchInternal::KeyShard(key, num_shards_) == shard_) {
+      mem_->Add(sequence_, kTypeDeletion, key, Slice());
+    }
+    sequence_++;
+  }
+  virtual void Merge(const Slice& key, const Slice& operand) {
+    if (WriteBatchInternal::KeyShard(key, num_shards_) == shard_) {
+      mem_->Add(sequence_, kTypeMerge, key, operand);
+    }
+    sequence_++;
+  }
 };
 }  // namespace
 
@@ -133,6 +187,21 @@ Status WriteBatchInternal::InsertInto(const WriteBatch* b,
   return b->Iterate(&inserter);
 }
 
+int WriteBatchInternal::KeyShard(const Slice& key, int num_shards) {
+  return Hash(key.data(), key.size(), 0x9b1e3a7dU) % num_shards;
+}
+
+Status WriteBatchInternal::InsertInto(const WriteBatch* b,
+                                      MemTable* memtable,
+                                      int shard, int num_shards) {
+  ShardedMemTableInserter inserter;
+  inserter.sequence_ = WriteBatchInternal::Sequence(b);
+  inserter.mem_ = memtable;
+  inserter.shard_ = shard;
+  inserter.num_shards_ = num_shards;
+  return b->Iterate(&inserter);
+}
+
 void WriteBatchInternal::SetContents(WriteBatch* b, const Slice& contents) {
   assert(contents.size() >= kHeader);
   b->rep_.assign(contents.data(), contents.size());
@@ -40,6 +40,15 @@ class WriteBatchInternal {
 
   static Status InsertInto(const WriteBatch* batch, MemTable* memtable);
 
+  // Insert only the entries of "batch" whose user key maps to "shard"
+  // (see KeyShard) into "memtable".  Used to replay a log on several
+  // threads at once: a given key is always replayed by the same shard.
+  static Status InsertInto(const WriteBatch* batch, MemTable* memtable,
+                           int shard, int num_shards);
+
+  // Return the shard in [0, num_shards) that owns "key".
+  static int KeyShard(const Slice& key, int num_shards);
+
   static void Append(WriteBatch* dst, const WriteBatch* src);
 };
 
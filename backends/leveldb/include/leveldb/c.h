@@ -58,7 +58,9 @@ typedef struct leveldb_filelock_t      leveldb_filelock_t;
 typedef struct leveldb_filterpolicy_t  leveldb_filterpolicy_t;
 typedef struct leveldb_iterator_t      leveldb_iterator_t;
 typedef struct leveldb_logger_t        leveldb_logger_t;
+typedef struct leveldb_mergeoperator_t leveldb_mergeoperator_t;
 typedef struct leveldb_options_t       leveldb_options_t;
+typedef struct leveldb_pcache_t        leveldb_pcache_t;
 typedef struct leveldb_randomfile_t    leveldb_randomfile_t;
 typedef struct leveldb_readoptions_t   leveldb_readoptions_t;
 typedef struct leveldb_seqfile_t       leveldb_seqfile_t;
@@ -91,6 +93,15 @@ extern void leveldb_delete(
     const char* key, size_t keylen,
     char** errptr);
 
+/* Stores "val" as a merge operand for "key".  The database must have
+   been opened with a merge operator. */
+extern void leveldb_merge(
+    leveldb_t* db,
+    const leveldb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    const char* val, size_t vallen,
+    char** errptr);
+
 extern void leveldb_write(
     leveldb_t* db,
     const leveldb_writeoptions_t* options,
@@ -112,6 +123,25 @@ extern int leveldb_exists(
     const char* key, size_t keylen,
     char** errptr);
 
+/* Like leveldb_put(), but leaves an existing entry for "key" alone.
+   Returns 1 if the entry was written, and 0 if "key" already had one
+   or on error. */
+extern int leveldb_put_if_absent(
+    leveldb_t* db,
+    const leveldb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    const char* val, size_t vallen,
+    char** errptr);
+
+/* Like leveldb_write(), but only if "key" has no entry.  Returns 1 if the
+   batch was written, and 0 if "key" already had an entry or on error. */
+extern int leveldb_write_if_absent(
+    leveldb_t* db,
+    const leveldb_writeoptions_t* options,
+    const char* key, size_t keylen,
+    leveldb_writebatch_t* batch,
+    char** errptr);
+
 extern leveldb_iterator_t* leveldb_create_iterator(
     leveldb_t* db,
     const leveldb_readoptions_t* options);
@@ -196,6 +226,10 @@ extern void leveldb_writebatch_put(
 extern void leveldb_writebatch_delete(
     leveldb_writebatch_t*,
     const char* key, size_t klen);
+extern void leveldb_writebatch_merge(
+    leveldb_writebatch_t*,
+    const char* key, size_t klen,
+    const char* val, size_t vlen);
 extern void leveldb_writebatch_iterate(
     leveldb_writebatch_t*,
     void* state,
@@ -214,6 +248,9 @@ extern void leveldb_options_set_comparator(
 extern void leveldb_options_set_filter_policy(
     leveldb_options_t*,
     leveldb_filterpolicy_t*);
+extern void leveldb_options_set_merge_operator(
+    leveldb_options_t*,
+    leveldb_mergeoperator_t*);
 extern void leveldb_options_set_create_if_missing(
     leveldb_options_t*, unsigned char);
 extern void leveldb_options_set_error_if_exists(
@@ -225,8 +262,12 @@ extern void leveldb_options_set_info_log(leveldb_options_t*, leveldb_logger_t*);
 extern void leveldb_options_set_write_buffer_size(leveldb_options_t*, size_t);
 extern void leveldb_options_set_max_open_files(leveldb_options_t*, int);
 extern void leveldb_options_set_cache(leveldb_options_t*, leveldb_cache_t*);
+extern void leveldb_options_set_persistent_cache(leveldb_options_t*,
+                                                 leveldb_pcache_t*);
 extern void leveldb_options_set_block_size(leveldb_options_t*, size_t);
 extern void leveldb_options_set_block_restart_interval(leveldb_options_t*, int);
+extern void leveldb_options_set_recovery_threads(leveldb_options_t*, int);
+extern void leveldb_options_set_recycle_log_file_num(leveldb_options_t*, int);
 
 enum {
   leveldb_no_compression = 0,
@@ -244,6 +285,14 @@ extern leveldb_comparator_t* leveldb_comparator_create(
         const char* a, size_t alen,
         const char* b, size_t blen),
     const char* (*name)(void*));
+
+/* Returns the builtin comparator called "builtin_name", which is
+   "leveldb.BytewiseComparator" or "leveldb.FixedWidthComparator", or NULL
+   if there is no such comparator.  If "name" is non-NULL, the comparator
+   goes by "name" instead, so that it can open databases created with a
+   C comparator of that name that orders keys the same way. */
+extern leveldb_comparator_t* leveldb_comparator_create_builtin(
+    const char* builtin_name, const char* name);
 extern void leveldb_comparator_destroy(leveldb_comparator_t*);
 
 /* Filter policy */
@@ -266,6 +315,25 @@ extern void leveldb_filterpolicy_destroy(leveldb_filterpolicy_t*);
 extern leveldb_filterpolicy_t* leveldb_filterpolicy_create_bloom(
     int bits_per_key);
 
+/* Merge operator */
+
+/* "full_merge" applies the operands, oldest first, to the existing value,
+   which is NULL if the key has none.  It returns a malloc()ed result and
+   sets *success to 1, or sets *success to 0 if the key is left without a
+   value.  It may be called from several threads at once. */
+extern leveldb_mergeoperator_t* leveldb_mergeoperator_create(
+    void* state,
+    void (*destructor)(void*),
+    char* (*full_merge)(
+        void*,
+        const char* key, size_t key_length,
+        const char* existing_value, size_t existing_value_length,
+        const char* const* operands_list, const size_t* operands_list_length,
+        int num_operands,
+        unsigned char* success, size_t* new_value_length),
+    const char* (*name)(void*));
+extern void leveldb_mergeoperator_destroy(leveldb_mergeoperator_t*);
+
 /* Read options */
 
 extern leveldb_readoptions_t* leveldb_readoptions_create();
@@ -291,10 +359,22 @@ extern void leveldb_writeoptions_set_sync(
 extern leveldb_cache_t* leveldb_cache_create_lru(size_t capacity);
 extern void leveldb_cache_destroy(leveldb_cache_t* cache);
 
+/* Persistent cache: blocks evicted from the block cache are kept in
+   files under a local directory (e.g. on an SSD) */
+
+extern leveldb_pcache_t* leveldb_pcache_create_local(
+    const char* dirname, uint64_t capacity, char** errptr);
+extern void leveldb_pcache_destroy(leveldb_pcache_t* cache);
+
 /* Env */
 
 extern leveldb_env_t* leveldb_create_default_env();
 extern leveldb_env_t* leveldb_create_hdfs_env(const char* ip, int port);
+/* Default env with table files delayed as if they were on remote storage.
+   "spec" is parsed by leveldb::ParseLatencyOptions(), e.g. "hdfs" or
+   "open=2000,read=800,read_bw=50".  Returns NULL on a bad spec. */
+extern leveldb_env_t* leveldb_create_latency_env(const char* spec,
+                                                 char** errptr);
 extern void leveldb_env_destroy(leveldb_env_t*);
 
 /* TableBuilder */
@@ -304,6 +384,17 @@ extern leveldb_tablebuilder_t* leveldb_tablebuilder_create(
     leveldb_env_t* env,
     char** errptr);
 extern void leveldb_tablebuilder_destroy(leveldb_tablebuilder_t*);
+/* Write out the rest of the table without waiting for it to reach
+   storage.  Writes to an HDFS env are uploaded in the background until
+   leveldb_tablebuilder_close(), so several finished builders can be
+   kept around to upload in parallel.  No puts are allowed afterwards. */
+extern void leveldb_tablebuilder_finish(leveldb_tablebuilder_t*,
+                                        char** errptr);
+/* Finish the table if needed and wait until it has reached storage.
+   Reports the errors that leveldb_tablebuilder_destroy() would ignore.
+   Only leveldb_tablebuilder_destroy() is allowed afterwards. */
+extern void leveldb_tablebuilder_close(leveldb_tablebuilder_t*,
+                                       char** errptr);
 extern void leveldb_tablebuilder_put(
     leveldb_tablebuilder_t*,
     const char* key, size_t klen,
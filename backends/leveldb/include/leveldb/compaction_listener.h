@@ -0,0 +1,28 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A CompactionListener is told about the values that compactions discard.
+// ColumnDB uses it to learn which records of its data files are dead.
+
+#ifndef STORAGE_LEVELDB_INCLUDE_COMPACTION_LISTENER_H_
+#define STORAGE_LEVELDB_INCLUDE_COMPACTION_LISTENER_H_
+
+namespace leveldb {
+
+class Slice;
+
+class CompactionListener {
+ public:
+  virtual ~CompactionListener();
+
+  // Called when a compaction discards "value" of "key" because a newer
+  // entry or a deletion of the key supersedes it.  Called from the
+  // background compaction thread, and possibly more than once for the
+  // same entry if a compaction fails and is redone.
+  virtual void ValueDropped(const Slice& key, const Slice& value) = 0;
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_INCLUDE_COMPACTION_LISTENER_H_
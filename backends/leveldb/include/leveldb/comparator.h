@@ -58,6 +58,13 @@ class Comparator {
 // must not be deleted.
 extern const Comparator* BytewiseComparator();
 
+// Return a builtin comparator with the same order as BytewiseComparator()
+// that compares keys eight bytes at a time as big-endian words.  It suits
+// fixed-width binary keys, such as the inode numbers and hashes of file
+// system metadata.  The result remains the property of this module and
+// must not be deleted.
+extern const Comparator* FixedWidthComparator();
+
 }  // namespace leveldb
 
 #endif  // STORAGE_LEVELDB_INCLUDE_COMPARATOR_H_
@@ -68,6 +68,14 @@ class DB {
   // Note: consider setting options.sync = true.
   virtual Status Delete(const WriteOptions& options, const Slice& key) = 0;
 
+  // Record "operand" as a merge operand for "key".  options.merge_operator
+  // combines it with the existing value when the key is read.  Returns OK
+  // on success, and a non-OK status on error.
+  // Note: consider setting options.sync = true.
+  virtual Status Merge(const WriteOptions& options,
+                       const Slice& key,
+                       const Slice& operand);
+
   // Apply the specified updates to the database.
   // Returns OK on success, non-OK on failure.
   // Note: consider setting options.sync = true.
@@ -89,6 +97,28 @@ class DB {
     return Get(options, key, &tmp);
   }
 
+  // Set the database entry for "key" to "value" unless the database
+  // already contains an entry for "key".  The check and the write are
+  // atomic with respect to other writes.  Stores in *inserted whether
+  // the entry was written.
+  virtual Status PutIfAbsent(const WriteOptions& options,
+                             const Slice& key, const Slice& value,
+                             bool* inserted) {
+    *inserted = false;
+    return Status::NotSupported("PutIfAbsent");
+  }
+
+  // Apply "updates" to the database unless it already contains an entry
+  // for "key", e.g. to create an entry together with entries that belong
+  // to it.  The check and the write are atomic with respect to other
+  // writes.  Stores in *applied whether the updates were written.
+  virtual Status WriteIfAbsent(const WriteOptions& options,
+                               const Slice& key, WriteBatch* updates,
+                               bool* applied) {
+    *applied = false;
+    return Status::NotSupported("WriteIfAbsent");
+  }
+
   // Return a heap-allocated iterator over the contents of the database.
   // The result of NewIterator() is initially invalid (caller must
   // call one of the Seek methods on the iterator before using it).
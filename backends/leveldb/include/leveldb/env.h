@@ -71,6 +71,20 @@ class Env {
   virtual Status NewWritableFile(const std::string& fname,
                                  WritableFile** result) = 0;
 
+  // Create an object that writes to the file "fname" by renaming the
+  // existing file "old_fname" to it and overwriting it from the start.
+  // Old contents past the write position are left in place, and the file
+  // is grown to at least "preallocate_size" bytes so that appends within
+  // that size do not change its length.  Stores NULL in *result and
+  // returns non-OK on failure.
+  //
+  // The default implementation renames the file and then calls
+  // NewWritableFile(), which discards the old contents.
+  virtual Status ReuseWritableFile(const std::string& fname,
+                                   const std::string& old_fname,
+                                   uint64_t preallocate_size,
+                                   WritableFile** result);
+
   // Returns true iff the named file exists.
   virtual bool FileExists(const std::string& fname) = 0;
 
@@ -293,6 +307,10 @@ class EnvWrapper : public Env {
   Status NewWritableFile(const std::string& f, WritableFile** r) {
     return target_->NewWritableFile(f, r);
   }
+  Status ReuseWritableFile(const std::string& f, const std::string& old_f,
+                           uint64_t n, WritableFile** r) {
+    return target_->ReuseWritableFile(f, old_f, n, r);
+  }
   bool FileExists(const std::string& f) { return target_->FileExists(f); }
   Status GetChildren(const std::string& dir, std::vector<std::string>* r) {
     return target_->GetChildren(dir, r);
@@ -306,9 +324,15 @@ class EnvWrapper : public Env {
   Status CopyFile(const std::string& s, const std::string& t) {
     return target_->CopyFile(s, t);
   }
+  Status SymlinkFile(const std::string& s, const std::string& t) {
+    return target_->SymlinkFile(s, t);
+  }
   Status RenameFile(const std::string& s, const std::string& t) {
     return target_->RenameFile(s, t);
   }
+  Status LinkFile(const std::string& s, const std::string& t) {
+    return target_->LinkFile(s, t);
+  }
   Status LockFile(const std::string& f, FileLock** l) {
     return target_->LockFile(f, l);
   }
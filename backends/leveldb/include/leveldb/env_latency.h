@@ -0,0 +1,92 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A latency Env wraps another Env and delays file operations as if the
+// files lived on remote storage such as HDFS.  It lets benchmarks judge
+// compaction, split and caching changes against remote-storage costs on
+// a single machine.
+//
+// Each operation waits a random time drawn from a log-normal distribution
+// around its median, occasionally extended by a long stall (e.g. an HDFS
+// pipeline recovery).  Reads and appends additionally wait for their
+// bytes to pass through a read and a write link of limited bandwidth,
+// which are shared by all files of the Env.
+
+#ifndef STORAGE_LEVELDB_INCLUDE_ENV_LATENCY_H_
+#define STORAGE_LEVELDB_INCLUDE_ENV_LATENCY_H_
+
+#include <stdint.h>
+#include <string>
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+
+namespace leveldb {
+
+class Env;
+
+struct LatencyOptions {
+  // Median delay of each operation, in microseconds.  0 means none.
+
+  // Opening a file for reading or writing.
+  int open_micros;
+
+  // Each read of a file.
+  int read_micros;
+
+  // Each append to a file.  Appends are normally buffered by the
+  // remote client, so only the write bandwidth matters by default.
+  int append_micros;
+
+  // Each Sync() or Close() of a written file.
+  int sync_micros;
+
+  // Renaming a file.
+  int rename_micros;
+
+  // Listing a directory.
+  int list_micros;
+
+  // Other namespace operations: delete, stat, exists, mkdir.
+  int meta_micros;
+
+  // Bandwidth of the read and write links, in bytes per second.
+  // 0 means unlimited.
+  uint64_t read_bytes_per_second;
+  uint64_t write_bytes_per_second;
+
+  // Spread of the log-normal distribution of delays.  0 makes every
+  // delay equal to its median.
+  double sigma;
+
+  // Probability that an operation also stalls for stall_micros.
+  double stall_probability;
+  int stall_micros;
+
+  // If true, only table files (and directory listings) are delayed,
+  // matching HDFSEnv which keeps only tables on HDFS.  Else every file
+  // operation is delayed.
+  bool tables_only;
+
+  // Seed of the random delays.
+  uint32_t seed;
+
+  // Create options modeled on a small HDFS cluster.
+  LatencyOptions();
+};
+
+// Parse a comma separated list of "name=value" settings over the
+// defaults in *options.  Names are those of the LatencyOptions fields,
+// with "_micros" dropped and "read_bw"/"write_bw" for the bandwidths in
+// MB/s, e.g. "open=2000,read=800,read_bw=50,sigma=0.3".  The word
+// "hdfs" stands for the default settings.
+extern Status ParseLatencyOptions(const Slice& spec, LatencyOptions* options);
+
+// Return a new Env that delays file operations of base_env as described
+// by "options".  The caller must delete the result when it is no longer
+// needed.  *base_env must remain live while the result is in use.
+extern Env* NewLatencyEnv(Env* base_env, const LatencyOptions& options);
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_INCLUDE_ENV_LATENCY_H_
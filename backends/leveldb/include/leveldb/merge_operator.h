@@ -0,0 +1,42 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A MergeOperator combines the operands that DB::Merge() stores for a key
+// with the value the key had before them.  Merges let a read-modify-write
+// of a value be a single blind write: the operands are only applied when
+// the key is read, or when a compaction meets them together with the value
+// they apply to.
+
+#ifndef STORAGE_LEVELDB_INCLUDE_MERGE_OPERATOR_H_
+#define STORAGE_LEVELDB_INCLUDE_MERGE_OPERATOR_H_
+
+#include <string>
+#include <vector>
+
+namespace leveldb {
+
+class Slice;
+
+class MergeOperator {
+ public:
+  virtual ~MergeOperator();
+
+  // The name of the merge operator, for logging.
+  virtual const char* Name() const = 0;
+
+  // Store in *new_value the value of "key" after applying "operands",
+  // oldest first, to "existing_value", which is NULL if the key had no
+  // value.  Returns false if the key has no value afterwards, which
+  // readers treat like a deletion.
+  //
+  // Called concurrently from reads and the compaction thread, so it must
+  // be thread-safe.
+  virtual bool FullMerge(const Slice& key, const Slice* existing_value,
+                         const std::vector<Slice>& operands,
+                         std::string* new_value) const = 0;
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_INCLUDE_MERGE_OPERATOR_H_
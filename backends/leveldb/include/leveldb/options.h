@@ -10,10 +10,13 @@
 namespace leveldb {
 
 class Cache;
+class CompactionListener;
 class Comparator;
 class Env;
 class FilterPolicy;
 class Logger;
+class MergeOperator;
+class PersistentCache;
 class Snapshot;
 
 // DB contents are stored in a set of blocks, each of which holds a
@@ -128,6 +131,14 @@ struct Options {
   // efficiently detect that and will switch to uncompressed mode.
   CompressionType compression;
 
+  // If non-NULL, use the specified cache as a second tier below
+  // block_cache.  Blocks evicted from block_cache are written to it, and
+  // blocks missing from block_cache are looked up in it before being
+  // read from the table file.  Only used when block_cache is in use.
+  // The cache must outlive block_cache.
+  // Default: NULL
+  PersistentCache* persistent_cache;
+
   // If non-NULL, use the specified filter policy to reduce disk reads.
   // Many applications will benefit from passing the result of
   // NewBloomFilterPolicy() here.
@@ -135,6 +146,67 @@ struct Options {
   // Default: NULL
   const FilterPolicy* filter_policy;
 
+  // Number of threads used to replay the write-ahead logs when the
+  // database is opened.  With more than one thread, every thread applies
+  // the keys of one hash shard and flushes its own level-0 tables, which
+  // shortens restart time after a crash on machines with spare cores.
+  // A value <= 1 replays the logs serially on the opening thread.
+  //
+  // Default: 1
+  int recovery_threads;
+
+  // Number of obsolete log files to keep and overwrite in place when a
+  // new log is needed, instead of creating a new file each time.  Reused
+  // logs are preallocated to a bit more than write_buffer_size, so syncs
+  // of the log rarely have to update file metadata.  When non-zero, log
+  // records also carry their log number so that stale records left in a
+  // recycled file are ignored on recovery; such logs cannot be read by
+  // older versions of leveldb.
+  //
+  // Default: 0
+  int recycle_log_file_num;
+
+  // If non-NULL, told about every value that a compaction discards
+  // because it was overwritten or deleted.
+  // Default: NULL
+  CompactionListener* compaction_listener;
+
+  // If non-NULL, combines the operands of DB::Merge() with the values
+  // they apply to.  A DB that holds merge operands must be opened with
+  // a merge operator.  ColumnDB does not support merges.
+  // Default: NULL
+  const MergeOperator* merge_operator;
+
+  // ColumnDB only: a data file whose estimated share of live bytes falls
+  // below this ratio is garbage collected in the background.  Its live
+  // records are copied to the current data file, and the file is deleted.
+  // A value <= 0 disables garbage collection.
+  //
+  // Default: 0.5
+  double value_gc_live_ratio;
+
+  // ColumnDB only: the most bytes per second that garbage collection
+  // reads and rewrites, to leave I/O bandwidth to foreground requests.
+  // 0 means no limit.
+  //
+  // Default: 4MB
+  size_t value_gc_bytes_per_second;
+
+  // ColumnDB only: if non-NULL, use the specified cache for values read
+  // from data files.  Values are charged by their size.
+  // If NULL, ColumnDB will automatically create and use a 32MB internal
+  // cache.
+  // Default: NULL
+  Cache* value_cache;
+
+  // ColumnDB only: values smaller than this many bytes are kept in the
+  // index next to their key, so reading them takes a single lookup.
+  // Larger values go to the data files, which keeps them out of index
+  // compactions.  0 sends every value to the data files.
+  //
+  // Default: 512
+  size_t value_inline_threshold;
+
   // Create an Options object with default values for all fields.
   Options();
 };
@@ -158,10 +230,18 @@ struct ReadOptions {
   // Default: NULL
   const Snapshot* snapshot;
 
+  // ColumnDB only: when moving forward, iterators read the values of
+  // this many entries at a time, in the order of their locations in the
+  // data files and with adjacent records read together.  Meant for scans
+  // that need most values.  0 reads each value when it is asked for.
+  // Default: 0
+  int prefetch_entries;
+
   ReadOptions()
       : verify_checksums(false),
         fill_cache(true),
-        snapshot(NULL) {
+        snapshot(NULL),
+        prefetch_entries(0) {
   }
 };
 
@@ -0,0 +1,63 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A PersistentCache is a second cache tier that sits below the in-memory
+// block cache.  Table blocks evicted from Options::block_cache are
+// written to it, and block cache misses are looked up in it before the
+// table file itself is read.  It is meant for tables that live on slow
+// or remote storage (e.g. HDFS) while a local disk has spare room.
+//
+// Entries are checksummed, survive restarts, and are bounded by a
+// capacity.  Since it is only a cache, failures to store an entry are
+// silently ignored and damaged entries read as misses.
+
+#ifndef STORAGE_LEVELDB_INCLUDE_PERSISTENT_CACHE_H_
+#define STORAGE_LEVELDB_INCLUDE_PERSISTENT_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+
+namespace leveldb {
+
+class Env;
+class PersistentCache;
+
+// Create a persistent cache that keeps its entries in files under the
+// directory "dirname" of "env", using at most about "capacity" bytes.
+// Entries left in the directory by an earlier instance are reused.
+// On success, stores the cache in *result and returns OK.  The caller
+// should delete the cache once every DB and block cache using it is gone.
+extern Status NewLocalPersistentCache(Env* env, const std::string& dirname,
+                                      uint64_t capacity,
+                                      PersistentCache** result);
+
+class PersistentCache {
+ public:
+  PersistentCache() { }
+  virtual ~PersistentCache();
+
+  // Store "data" under "key", replacing any earlier entry.  May drop
+  // the entry instead, e.g. if it does not fit or on an I/O error.
+  // Called when a block leaves the block cache, with a lock of the block
+  // cache held, so it should not wait for I/O.
+  virtual void Insert(const Slice& key, const Slice& data) = 0;
+
+  // If an intact entry for "key" exists, store its data in *data and
+  // return true.  Else return false.
+  virtual bool Lookup(const Slice& key, std::string* data) = 0;
+
+  // Return the number of bytes of entries currently held.
+  virtual uint64_t Size() = 0;
+
+ private:
+  // No copying allowed
+  PersistentCache(const PersistentCache&);
+  void operator=(const PersistentCache&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_INCLUDE_PERSISTENT_CACHE_H_
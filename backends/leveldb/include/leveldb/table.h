@@ -6,6 +6,7 @@
 #define STORAGE_LEVELDB_INCLUDE_TABLE_H_
 
 #include <stdint.h>
+#include <string>
 #include "leveldb/iterator.h"
 
 namespace leveldb {
@@ -40,6 +41,15 @@ class Table {
                      uint64_t file_size,
                      Table** table);
 
+  // Same as above, but "cache_name" names the table across restarts,
+  // and apart from the tables of other DBs sharing the cache (e.g. by its
+  // file name), so that its blocks may be kept in options.persistent_cache.
+  static Status Open(const Options& options,
+                     RandomAccessFile* file,
+                     const std::string& cache_name,
+                     uint64_t file_size,
+                     Table** table);
+
   ~Table();
 
   // Returns a new iterator over the table contents.
@@ -63,13 +73,14 @@ class Table {
   static Iterator* BlockReader(void*, const ReadOptions&, const Slice&);
 
   // Calls (*handle_result)(arg, ...) with the entry found after a call
-  // to Seek(key).  May not make such a call if filter policy says
-  // that key is not present.
+  // to Seek(key), and with each following entry for as long as
+  // handle_result returns true.  May not make such a call if filter
+  // policy says that key is not present.
   friend class TableCache;
   Status InternalGet(
       const ReadOptions&, const Slice& key,
       void* arg,
-      void (*handle_result)(void* arg, const Slice& k, const Slice& v));
+      bool (*handle_result)(void* arg, const Slice& k, const Slice& v));
 
 
   void ReadMeta(const Footer& footer);
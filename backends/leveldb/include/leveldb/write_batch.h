@@ -39,6 +39,10 @@ class WriteBatch {
   // If the database contains a mapping for "key", erase it.  Else do nothing.
   void Delete(const Slice& key);
 
+  // Apply "operand" to the value of "key" with Options::merge_operator
+  // when the key is read.
+  void Merge(const Slice& key, const Slice& operand);
+
   // Clear all updates buffered in this batch.
   void Clear();
 
@@ -48,6 +52,8 @@ class WriteBatch {
     virtual ~Handler();
     virtual void Put(const Slice& key, const Slice& value) = 0;
     virtual void Delete(const Slice& key) = 0;
+    // The default implementation skips merges.
+    virtual void Merge(const Slice& key, const Slice& operand);
   };
   Status Iterate(Handler* handler) const;
 
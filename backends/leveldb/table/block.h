@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "leveldb/iterator.h"
+#include "leveldb/slice.h"
 
 namespace leveldb {
 
@@ -22,6 +23,7 @@ class Block {
   ~Block();
 
   size_t size() const { return size_; }
+  Slice contents() const { return Slice(data_, size_); }
   Iterator* NewIterator(const Comparator* comparator);
 
  private:
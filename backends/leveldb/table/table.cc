@@ -9,6 +9,7 @@
 #include "leveldb/env.h"
 #include "leveldb/filter_policy.h"
 #include "leveldb/options.h"
+#include "leveldb/persistent_cache.h"
 #include "table/block.h"
 #include "table/filter_block.h"
 #include "table/format.h"
@@ -28,6 +29,9 @@ struct Table::Rep {
   Status status;
   RandomAccessFile* file;
   uint64_t cache_id;
+  std::string cache_name;  // Empty if unknown; then the persistent cache
+                           // is unused
+  uint64_t file_size;
   FilterBlockReader* filter;
   const char* filter_data;
 
@@ -39,6 +43,14 @@ Status Table::Open(const Options& options,
                    RandomAccessFile* file,
                    uint64_t size,
                    Table** table) {
+  return Open(options, file, std::string(), size, table);
+}
+
+Status Table::Open(const Options& options,
+                   RandomAccessFile* file,
+                   const std::string& cache_name,
+                   uint64_t size,
+                   Table** table) {
   *table = NULL;
   if (size < Footer::kEncodedLength) {
     return Status::InvalidArgument("file is too short to be an sstable");
@@ -73,6 +85,8 @@ Status Table::Open(const Options& options,
     rep->metaindex_handle = footer.metaindex_handle();
     rep->index_block = index_block;
     rep->cache_id = (options.block_cache ? options.block_cache->NewId() : 0);
+    rep->cache_name = cache_name;
+    rep->file_size = size;
     rep->filter_data = NULL;
     rep->filter = NULL;
     *table = new Table(rep);
@@ -143,6 +157,28 @@ static void DeleteCachedBlock(const Slice& key, void* value) {
   delete block;
 }
 
+// Block cache entry of a table that has a persistent cache.  The block
+// is handed down to the persistent cache when it leaves the block cache;
+// this runs under the block cache's lock, and Insert() only copies the
+// block into memory.
+struct PersistentCachedBlock {
+  Block* block;
+  PersistentCache* persistent_cache;
+  bool persisted;        // Already present in persistent_cache
+  std::string key;       // Key in persistent_cache
+};
+
+static void DeletePersistentCachedBlock(const Slice& key, void* value) {
+  PersistentCachedBlock* entry =
+      reinterpret_cast<PersistentCachedBlock*>(value);
+  if (!entry->persisted) {
+    entry->persistent_cache->Insert(entry->key,
+                                    entry->block->contents());
+  }
+  delete entry->block;
+  delete entry;
+}
+
 static void ReleaseBlock(void* arg, void* h) {
   Cache* cache = reinterpret_cast<Cache*>(arg);
   Cache::Handle* handle = reinterpret_cast<Cache::Handle*>(h);
@@ -165,9 +201,55 @@ Iterator* Table::BlockReader(void* arg,
   // We intentionally allow extra stuff in index_value so that we
   // can add more features in the future.
 
+  PersistentCache* persistent_cache = NULL;
+  if (!table->rep_->cache_name.empty()) {
+    persistent_cache = table->rep_->options.persistent_cache;
+  }
+
   if (s.ok()) {
     BlockContents contents;
-    if (block_cache != NULL) {
+    if (block_cache != NULL && persistent_cache != NULL) {
+      char cache_key_buffer[16];
+      EncodeFixed64(cache_key_buffer, table->rep_->cache_id);
+      EncodeFixed64(cache_key_buffer+8, handle.offset());
+      Slice key(cache_key_buffer, sizeof(cache_key_buffer));
+      cache_handle = block_cache->Lookup(key);
+      if (cache_handle != NULL) {
+        block = reinterpret_cast<PersistentCachedBlock*>(
+            block_cache->Value(cache_handle))->block;
+      } else {
+        // The persistent key must stay valid across restarts, so it is
+        // made of the table's name and size rather than cache_id.
+        PersistentCachedBlock* entry = new PersistentCachedBlock;
+        entry->persistent_cache = persistent_cache;
+        entry->key = table->rep_->cache_name;
+        PutFixed64(&entry->key, table->rep_->file_size);
+        PutFixed64(&entry->key, handle.offset());
+        std::string data;
+        entry->persisted = persistent_cache->Lookup(entry->key, &data);
+        if (entry->persisted) {
+          char* buf = new char[data.size()];
+          memcpy(buf, data.data(), data.size());
+          contents.data = Slice(buf, data.size());
+          contents.cachable = true;
+          contents.heap_allocated = true;
+        } else {
+          s = ReadBlock(table->rep_->file, options, handle, &contents);
+        }
+        if (s.ok()) {
+          block = new Block(contents);
+          if (contents.cachable && options.fill_cache) {
+            entry->block = block;
+            cache_handle = block_cache->Insert(
+                key, entry, block->size(), &DeletePersistentCachedBlock);
+          } else {
+            delete entry;
+          }
+        } else {
+          delete entry;
+        }
+      }
+    } else if (block_cache != NULL) {
       char cache_key_buffer[16];
       EncodeFixed64(cache_key_buffer, table->rep_->cache_id);
       EncodeFixed64(cache_key_buffer+8, handle.offset());
@@ -215,7 +297,7 @@ Iterator* Table::NewIterator(const ReadOptions& options) const {
 
 Status Table::InternalGet(const ReadOptions& options, const Slice& k,
                           void* arg,
-                          void (*saver)(void*, const Slice&, const Slice&)) {
+                          bool (*saver)(void*, const Slice&, const Slice&)) {
   Status s;
   Iterator* iiter = rep_->index_block->NewIterator(rep_->options.comparator);
   iiter->Seek(k);
@@ -228,14 +310,27 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k,
         !filter->KeyMayMatch(handle.offset(), k)) {
       // Not found
     } else {
-      Slice handle = iiter->value();
-      Iterator* block_iter = BlockReader(this, options, iiter->value());
-      block_iter->Seek(k);
-      if (block_iter->Valid()) {
-        (*saver)(arg, block_iter->key(), block_iter->value());
+      // Entries for one key (e.g. a run of merge operands) may continue
+      // into the following blocks, so keep going while the saver wants more.
+      bool more = true;
+      bool first = true;
+      while (more && s.ok() && iiter->Valid()) {
+        Iterator* block_iter = BlockReader(this, options, iiter->value());
+        if (first) {
+          block_iter->Seek(k);
+          first = false;
+        } else {
+          block_iter->SeekToFirst();
+        }
+        for (; more && block_iter->Valid(); block_iter->Next()) {
+          more = (*saver)(arg, block_iter->key(), block_iter->value());
+        }
+        s = block_iter->status();
+        delete block_iter;
+        if (more) {
+          iiter->Next();
+        }
       }
-      s = block_iter->status();
-      delete block_iter;
     }
   }
   if (s.ok()) {
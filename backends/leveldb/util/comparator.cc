@@ -63,14 +63,65 @@ class BytewiseComparatorImpl : public Comparator {
     // *key is a run of 0xffs.  Leave it alone.
   }
 };
+
+inline uint64_t DecodeBigEndian64(const char* ptr) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(ptr);
+  return ((static_cast<uint64_t>(p[0]) << 56) |
+          (static_cast<uint64_t>(p[1]) << 48) |
+          (static_cast<uint64_t>(p[2]) << 40) |
+          (static_cast<uint64_t>(p[3]) << 32) |
+          (static_cast<uint64_t>(p[4]) << 24) |
+          (static_cast<uint64_t>(p[5]) << 16) |
+          (static_cast<uint64_t>(p[6]) << 8) |
+          (static_cast<uint64_t>(p[7])));
+}
+
+// Orders keys like BytewiseComparatorImpl, so it shortens index keys the
+// same way.
+class FixedWidthComparatorImpl : public BytewiseComparatorImpl {
+ public:
+  FixedWidthComparatorImpl() { }
+
+  virtual const char* Name() const {
+    return "leveldb.FixedWidthComparator";
+  }
+
+  virtual int Compare(const Slice& a, const Slice& b) const {
+    const size_t min_len = std::min(a.size(), b.size());
+    size_t i = 0;
+    for (; i + 8 <= min_len; i += 8) {
+      const uint64_t x = DecodeBigEndian64(a.data() + i);
+      const uint64_t y = DecodeBigEndian64(b.data() + i);
+      if (x != y) {
+        return (x < y) ? -1 : +1;
+      }
+    }
+    for (; i < min_len; i++) {
+      const uint8_t x = static_cast<uint8_t>(a[i]);
+      const uint8_t y = static_cast<uint8_t>(b[i]);
+      if (x != y) {
+        return (x < y) ? -1 : +1;
+      }
+    }
+    if (a.size() != b.size()) {
+      return (a.size() < b.size()) ? -1 : +1;
+    }
+    return 0;
+  }
+};
 }  // namespace
 
 // Intentionally not destroyed to prevent destructor racing
 // with background threads.
 static const Comparator* bytewise = new BytewiseComparatorImpl;
+static const Comparator* fixed_width = new FixedWidthComparatorImpl;
 
 const Comparator* BytewiseComparator() {
   return bytewise;
 }
 
+const Comparator* FixedWidthComparator() {
+  return fixed_width;
+}
+
 }  // namespace leveldb
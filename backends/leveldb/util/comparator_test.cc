@@ -0,0 +1,66 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/comparator.h"
+
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static int Sign(int r) {
+  return (r > 0) - (r < 0);
+}
+
+// Keys of a few lengths made of few distinct bytes, so that they often
+// share prefixes and differ in any byte of a word.
+static std::string RandomKey(Random* rnd) {
+  static const char kBytes[] = { '\0', '\1', 'a', '\x7f', '\x80', '\xff' };
+  static const int kLengths[] = { 0, 1, 7, 8, 9, 16, 28, 56 };
+  std::string key(kLengths[rnd->Uniform(8)], '\0');
+  for (size_t i = 0; i < key.size(); i++) {
+    key[i] = kBytes[rnd->Uniform(sizeof(kBytes))];
+  }
+  return key;
+}
+
+class ComparatorTest { };
+
+TEST(ComparatorTest, FixedWidthOrder) {
+  const Comparator* bytewise = BytewiseComparator();
+  const Comparator* fixed = FixedWidthComparator();
+  Random rnd(301);
+  for (int i = 0; i < 100000; i++) {
+    const std::string a = RandomKey(&rnd);
+    std::string b = RandomKey(&rnd);
+    if (rnd.OneIn(4)) {
+      // Same prefix, one byte apart
+      b = a;
+      if (!b.empty()) {
+        b[rnd.Uniform(b.size())] ^= 1 << rnd.Uniform(8);
+      }
+    }
+    ASSERT_EQ(Sign(bytewise->Compare(a, b)), Sign(fixed->Compare(a, b)));
+    ASSERT_EQ(Sign(bytewise->Compare(b, a)), Sign(fixed->Compare(b, a)));
+  }
+}
+
+TEST(ComparatorTest, FixedWidthShortening) {
+  const Comparator* fixed = FixedWidthComparator();
+  std::string start("\x00\x00\x00\x00\x00\x00\x00\x07" "abcdefgh", 16);
+  const std::string limit("\x00\x00\x00\x00\x00\x00\x00\x07" "axcdefgh", 16);
+  fixed->FindShortestSeparator(&start, limit);
+  ASSERT_EQ(std::string("\x00\x00\x00\x00\x00\x00\x00\x07" "ac", 10), start);
+  ASSERT_LT(fixed->Compare(start, limit), 0);
+
+  std::string key("\x00\x00\x00\x00\x00\x00\x00\x07" "abc", 11);
+  fixed->FindShortSuccessor(&key);
+  ASSERT_EQ(std::string("\x01", 1), key);
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
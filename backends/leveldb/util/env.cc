@@ -24,6 +24,18 @@ Logger::~Logger() {
 FileLock::~FileLock() {
 }
 
+Status Env::ReuseWritableFile(const std::string& fname,
+                              const std::string& old_fname,
+                              uint64_t preallocate_size,
+                              WritableFile** result) {
+  Status s = RenameFile(old_fname, fname);
+  if (!s.ok()) {
+    *result = NULL;
+    return s;
+  }
+  return NewWritableFile(fname, result);
+}
+
 void Log(Logger* info_log, const char* format, ...) {
   if (info_log != NULL) {
     va_list ap;
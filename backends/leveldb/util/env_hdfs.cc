@@ -23,6 +23,7 @@
 #include "leveldb/slice.h"
 #include "port/port.h"
 #include "util/logging.h"
+#include "util/mutexlock.h"
 #include "util/posix_logger.h"
 #include "hdfs.h"
 #include <map>
@@ -176,18 +177,121 @@ class HDFSRandomAccessFile: public RandomAccessFile {
   }
 };
 
+// Appends are gathered into chunks of kUploadChunkSize bytes that a
+// per-file background thread writes to HDFS in order, so the caller only
+// waits for the remote pipeline when more than kMaxChunksInFlight chunks
+// are outstanding, or in Sync() and Close().  Since every file has its
+// own uploader, several files being written at once upload in parallel.
+// Close() joins the uploader once it has written everything.  An upload
+// error is remembered and returned by the next Append(), Sync() or
+// Close().
 class HDFSWritableFile : public WritableFile {
  private:
+  static const size_t kUploadChunkSize = 4 << 20;
+  static const size_t kMaxChunksInFlight = 4;
+
   std::string filename_;
-  hdfsFile file_;
   hdfsFS hdfs_fs_;
+  hdfsFile file_;
+  std::string buffer_;                // Appended data not yet queued
+
+  port::Mutex mu_;
+  port::CondVar cv_;
+  std::deque<std::string*> chunks_;   // Queued for upload, oldest first
+  bool uploading_;                    // Uploader is writing a chunk
+  bool closing_;                      // Uploader should exit when idle
+  Status status_;                     // First upload error
+
+  pthread_t uploader_;
+  bool uploader_started_;             // Not joined yet
+
+  static void* UploadThread(void* arg) {
+    reinterpret_cast<HDFSWritableFile*>(arg)->Upload();
+    return NULL;
+  }
+
+  void Upload() {
+    MutexLock l(&mu_);
+    while (true) {
+      while (chunks_.empty() && !closing_) {
+        cv_.Wait();
+      }
+      if (chunks_.empty()) {
+        break;
+      }
+      std::string* chunk = chunks_.front();
+      chunks_.pop_front();
+      uploading_ = true;
+      mu_.Unlock();
+      Status s = WriteFully(*chunk);
+      delete chunk;
+      mu_.Lock();
+      uploading_ = false;
+      if (!s.ok() && status_.ok()) {
+        status_ = s;
+      }
+      cv_.SignalAll();
+    }
+  }
+
+  // hdfsWrite() may write less than it was given.
+  Status WriteFully(const std::string& chunk) {
+    const char* src = chunk.data();
+    size_t left = chunk.size();
+    while (left > 0) {
+      tSize r = hdfsWrite(hdfs_fs_, file_, src, left);
+      if (r < 0) {
+        return IOError(filename_, errno);
+      }
+      src += r;
+      left -= r;
+    }
+    return Status::OK();
+  }
+
+  // Hand buffer_ to the uploader, waiting for room in the queue.
+  Status QueueBuffer() {
+    MutexLock l(&mu_);
+    if (!buffer_.empty()) {
+      while (chunks_.size() >= kMaxChunksInFlight && status_.ok()) {
+        cv_.Wait();
+      }
+      if (status_.ok()) {
+        std::string* chunk = new std::string;
+        chunk->swap(buffer_);
+        chunks_.push_back(chunk);
+        cv_.SignalAll();
+      }
+      buffer_.clear();
+    }
+    return status_;
+  }
+
+  // Wait until everything queued so far has been uploaded.
+  Status WaitForUploads() {
+    MutexLock l(&mu_);
+    while (!chunks_.empty() || uploading_) {
+      cv_.Wait();
+    }
+    return status_;
+  }
 
  public:
   HDFSWritableFile(const std::string& filename,
                    hdfsFS hdfs_fs, hdfsFile file)
       : filename_(filename),
         hdfs_fs_(hdfs_fs),
-        file_(file){
+        file_(file),
+        cv_(&mu_),
+        uploading_(false),
+        closing_(false) {
+    buffer_.reserve(kUploadChunkSize);
+    const int r = pthread_create(&uploader_, NULL,
+                                 &HDFSWritableFile::UploadThread, this);
+    uploader_started_ = (r == 0);
+    if (!uploader_started_) {
+      status_ = IOError(filename_, r);  // Nothing gets queued
+    }
   }
 
   ~HDFSWritableFile() {
@@ -197,18 +301,31 @@ class HDFSWritableFile : public WritableFile {
   }
 
   virtual Status Append(const Slice& data) {
-    const char* src = data.data();
-    size_t data_size = data.size();
-    if (hdfsWrite(hdfs_fs_, file_, src, data_size) < 0) {
-      return IOError(filename_, errno);
+    buffer_.append(data.data(), data.size());
+    if (buffer_.size() >= kUploadChunkSize) {
+      return QueueBuffer();
     }
-
-    return Status::OK();
+    MutexLock l(&mu_);
+    return status_;
   }
 
   virtual Status Close() {
+    QueueBuffer();
+    if (uploader_started_) {
+      {
+        MutexLock l(&mu_);
+        closing_ = true;
+        cv_.SignalAll();
+      }
+      pthread_join(uploader_, NULL);
+      uploader_started_ = false;
+    }
     Status s;
-    if (hdfsCloseFile(hdfs_fs_, file_) < 0) {
+    {
+      MutexLock l(&mu_);
+      s = status_;
+    }
+    if (hdfsCloseFile(hdfs_fs_, file_) < 0 && s.ok()) {
       s = IOError(filename_, errno);
     }
     file_ = NULL;
@@ -220,8 +337,11 @@ class HDFSWritableFile : public WritableFile {
   }
 
   virtual Status Sync() {
-    Status s;
-    if(hdfsFlush(hdfs_fs_, file_) < 0) {
+    Status s = QueueBuffer();
+    if (s.ok()) {
+      s = WaitForUploads();
+    }
+    if (s.ok() && hdfsFlush(hdfs_fs_, file_) < 0) {
       s = IOError(filename_, errno);
     }
     return s;
@@ -290,12 +410,16 @@ class PosixWritableFile : public WritableFile {
   std::string filename_;
   int fd_;
   uint64_t file_offset_;  // Offset of base_ in file
+  // Sync() may skip the metadata of the file, whose blocks are all
+  // allocated already (a recycled, preallocated log)
+  bool data_sync_;
 
  public:
-  PosixWritableFile(const std::string& fname, int fd)
+  PosixWritableFile(const std::string& fname, int fd, bool data_sync = false)
       : filename_(fname),
         fd_(fd),
-        file_offset_(0) {
+        file_offset_(0),
+        data_sync_(data_sync) {
   }
 
   ~PosixWritableFile() {
@@ -333,7 +457,7 @@ class PosixWritableFile : public WritableFile {
   virtual Status Sync() {
     Status s;
 
-    if (fsync(fd_) < 0) {
+    if ((data_sync_ ? fdatasync(fd_) : fsync(fd_)) < 0) {
         s = IOError(filename_, errno);
     }
 
@@ -470,6 +594,35 @@ public:
     return s;
   }
 
+  virtual Status ReuseWritableFile(const std::string& fname,
+                                   const std::string& old_fname,
+                                   uint64_t preallocate_size,
+                                   WritableFile** result) {
+    if (onHDFS(fname) || onHDFS(old_fname)) {
+      return Env::ReuseWritableFile(fname, old_fname, preallocate_size,
+                                    result);
+    }
+    Status s;
+    if (rename(old_fname.c_str(), fname.c_str()) != 0) {
+      *result = NULL;
+      return IOError(old_fname, errno);
+    }
+    // Keep the existing blocks: PosixWritableFile overwrites in place
+    // and never truncates, unlike PosixMmapFile.
+    const int fd = open(fname.c_str(), O_RDWR, 0644);
+    if (fd < 0) {
+      *result = NULL;
+      s = IOError(fname, errno);
+    } else {
+#if defined(OS_LINUX)
+      // Best effort; the file is still usable if this fails
+      posix_fallocate(fd, 0, preallocate_size);
+#endif
+      *result = new PosixWritableFile(fname, fd, true);
+    }
+    return s;
+  }
+
   virtual bool FileExists(const std::string& fname) {
     if(onHDFS(fname)) {
       std::string filename = getPath(fname);
@@ -0,0 +1,331 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/env_latency.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
+#include "util/random.h"
+
+namespace leveldb {
+
+LatencyOptions::LatencyOptions()
+    : open_micros(1500),
+      read_micros(600),
+      append_micros(0),
+      sync_micros(3000),
+      rename_micros(1000),
+      list_micros(2000),
+      meta_micros(800),
+      read_bytes_per_second(100 << 20),
+      write_bytes_per_second(60 << 20),
+      sigma(0.5),
+      stall_probability(0.001),
+      stall_micros(100000),
+      tables_only(true),
+      seed(301) {
+}
+
+Status ParseLatencyOptions(const Slice& spec, LatencyOptions* options) {
+  std::string input = spec.ToString();
+  size_t pos = 0;
+  while (pos <= input.size()) {
+    size_t end = input.find(',', pos);
+    if (end == std::string::npos) {
+      end = input.size();
+    }
+    const std::string item = input.substr(pos, end - pos);
+    pos = end + 1;
+    if (item.empty()) {
+      continue;
+    }
+    if (item == "hdfs") {
+      *options = LatencyOptions();
+      continue;
+    }
+
+    const size_t eq = item.find('=');
+    if (eq == std::string::npos) {
+      return Status::InvalidArgument("bad latency setting", item);
+    }
+    const std::string name = item.substr(0, eq);
+    const std::string value = item.substr(eq + 1);
+    char* rest;
+    const double v = strtod(value.c_str(), &rest);
+    if (value.empty() || *rest != '\0' || v < 0) {
+      return Status::InvalidArgument("bad latency value", item);
+    }
+    if (name == "open") {
+      options->open_micros = static_cast<int>(v);
+    } else if (name == "read") {
+      options->read_micros = static_cast<int>(v);
+    } else if (name == "append") {
+      options->append_micros = static_cast<int>(v);
+    } else if (name == "sync") {
+      options->sync_micros = static_cast<int>(v);
+    } else if (name == "rename") {
+      options->rename_micros = static_cast<int>(v);
+    } else if (name == "list") {
+      options->list_micros = static_cast<int>(v);
+    } else if (name == "meta") {
+      options->meta_micros = static_cast<int>(v);
+    } else if (name == "read_bw") {
+      options->read_bytes_per_second = static_cast<uint64_t>(v * 1048576);
+    } else if (name == "write_bw") {
+      options->write_bytes_per_second = static_cast<uint64_t>(v * 1048576);
+    } else if (name == "sigma") {
+      options->sigma = v;
+    } else if (name == "stall_probability") {
+      options->stall_probability = v;
+    } else if (name == "stall") {
+      options->stall_micros = static_cast<int>(v);
+    } else if (name == "tables_only") {
+      options->tables_only = (v != 0);
+    } else if (name == "seed") {
+      options->seed = static_cast<uint32_t>(v);
+    } else {
+      return Status::InvalidArgument("unknown latency setting", name);
+    }
+  }
+  return Status::OK();
+}
+
+namespace {
+
+class LatencyEnv : public EnvWrapper {
+ public:
+  // A link of limited bandwidth shared by all transfers in one direction
+  struct Link {
+    uint64_t bytes_per_second;
+    uint64_t free_micros;     // When the last queued transfer completes
+  };
+
+  LatencyEnv(Env* base_env, const LatencyOptions& options)
+      : EnvWrapper(base_env),
+        options_(options),
+        rnd_(options.seed) {
+    read_link_.bytes_per_second = options.read_bytes_per_second;
+    read_link_.free_micros = 0;
+    write_link_.bytes_per_second = options.write_bytes_per_second;
+    write_link_.free_micros = 0;
+  }
+
+  const LatencyOptions& options() const { return options_; }
+  Link* read_link() { return &read_link_; }
+  Link* write_link() { return &write_link_; }
+
+  // Wait for an operation with the given median delay, plus the time
+  // "bytes" take to pass through "link" (if non-NULL).
+  void Delay(int median_micros, Link* link, size_t bytes) {
+    double micros = 0;
+    {
+      MutexLock l(&mu_);
+      if (median_micros > 0) {
+        micros = median_micros * exp(options_.sigma * Gaussian());
+      }
+      if (options_.stall_probability > 0 &&
+          Uniform() < options_.stall_probability) {
+        micros += options_.stall_micros;
+      }
+      if (link != NULL && link->bytes_per_second > 0 && bytes > 0) {
+        const uint64_t now = target()->NowMicros();
+        const uint64_t start = std::max(now, link->free_micros);
+        link->free_micros = start + static_cast<uint64_t>(
+            bytes * 1e6 / link->bytes_per_second);
+        micros += link->free_micros - now;
+      }
+    }
+    if (micros >= 1) {
+      target()->SleepForMicroseconds(static_cast<int>(micros));
+    }
+  }
+
+  bool IsRemote(const std::string& fname) const {
+    if (!options_.tables_only) {
+      return true;
+    }
+    return (fname.size() >= 4 &&
+            fname.compare(fname.size() - 4, 4, ".sst") == 0);
+  }
+
+  virtual Status NewSequentialFile(const std::string& f, SequentialFile** r);
+  virtual Status NewRandomAccessFile(const std::string& f,
+                                     RandomAccessFile** r);
+  virtual Status NewWritableFile(const std::string& f, WritableFile** r);
+  virtual Status ReuseWritableFile(const std::string& f,
+                                   const std::string& old_f,
+                                   uint64_t preallocate_size,
+                                   WritableFile** r);
+
+  virtual bool FileExists(const std::string& f) {
+    if (IsRemote(f)) Delay(options_.meta_micros, NULL, 0);
+    return target()->FileExists(f);
+  }
+  virtual Status GetChildren(const std::string& dir,
+                             std::vector<std::string>* r) {
+    Delay(options_.list_micros, NULL, 0);
+    return target()->GetChildren(dir, r);
+  }
+  virtual Status DeleteFile(const std::string& f) {
+    if (IsRemote(f)) Delay(options_.meta_micros, NULL, 0);
+    return target()->DeleteFile(f);
+  }
+  virtual Status CreateDir(const std::string& d) {
+    Delay(options_.meta_micros, NULL, 0);
+    return target()->CreateDir(d);
+  }
+  virtual Status GetFileSize(const std::string& f, uint64_t* s) {
+    if (IsRemote(f)) Delay(options_.meta_micros, NULL, 0);
+    return target()->GetFileSize(f, s);
+  }
+  virtual Status RenameFile(const std::string& s, const std::string& t) {
+    if (IsRemote(s) || IsRemote(t)) Delay(options_.rename_micros, NULL, 0);
+    return target()->RenameFile(s, t);
+  }
+
+ private:
+  // Uniform in (0, 1).  REQUIRES: mu_ held.
+  double Uniform() {
+    return rnd_.Next() / 2147483647.0;
+  }
+
+  // Standard normal, by the Box-Muller transform.  REQUIRES: mu_ held.
+  double Gaussian() {
+    const double u1 = Uniform();
+    const double u2 = Uniform();
+    return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+  }
+
+  const LatencyOptions options_;
+  port::Mutex mu_;
+  Random rnd_;
+  Link read_link_;
+  Link write_link_;
+};
+
+class LatencySequentialFile : public SequentialFile {
+ public:
+  LatencySequentialFile(LatencyEnv* env, SequentialFile* target)
+      : env_(env), target_(target) { }
+  virtual ~LatencySequentialFile() { delete target_; }
+
+  virtual Status Read(size_t n, Slice* result, char* scratch) {
+    Status s = target_->Read(n, result, scratch);
+    env_->Delay(env_->options().read_micros, env_->read_link(),
+                result->size());
+    return s;
+  }
+  virtual Status Skip(uint64_t n) { return target_->Skip(n); }
+
+ private:
+  LatencyEnv* env_;
+  SequentialFile* target_;
+};
+
+class LatencyRandomAccessFile : public RandomAccessFile {
+ public:
+  LatencyRandomAccessFile(LatencyEnv* env, RandomAccessFile* target)
+      : env_(env), target_(target) { }
+  virtual ~LatencyRandomAccessFile() { delete target_; }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    Status s = target_->Read(offset, n, result, scratch);
+    env_->Delay(env_->options().read_micros, env_->read_link(),
+                result->size());
+    return s;
+  }
+
+ private:
+  LatencyEnv* env_;
+  RandomAccessFile* target_;
+};
+
+class LatencyWritableFile : public WritableFile {
+ public:
+  LatencyWritableFile(LatencyEnv* env, WritableFile* target)
+      : env_(env), target_(target) { }
+  virtual ~LatencyWritableFile() { delete target_; }
+
+  virtual Status Append(const Slice& data) {
+    env_->Delay(env_->options().append_micros, env_->write_link(),
+                data.size());
+    return target_->Append(data);
+  }
+  virtual Status Close() {
+    env_->Delay(env_->options().sync_micros, NULL, 0);
+    return target_->Close();
+  }
+  virtual Status Flush() { return target_->Flush(); }
+  virtual Status Sync() {
+    env_->Delay(env_->options().sync_micros, NULL, 0);
+    return target_->Sync();
+  }
+
+ private:
+  LatencyEnv* env_;
+  WritableFile* target_;
+};
+
+Status LatencyEnv::NewSequentialFile(const std::string& f,
+                                     SequentialFile** r) {
+  Status s = target()->NewSequentialFile(f, r);
+  if (IsRemote(f)) {
+    Delay(options_.open_micros, NULL, 0);
+    if (s.ok()) {
+      *r = new LatencySequentialFile(this, *r);
+    }
+  }
+  return s;
+}
+
+Status LatencyEnv::NewRandomAccessFile(const std::string& f,
+                                       RandomAccessFile** r) {
+  Status s = target()->NewRandomAccessFile(f, r);
+  if (IsRemote(f)) {
+    Delay(options_.open_micros, NULL, 0);
+    if (s.ok()) {
+      *r = new LatencyRandomAccessFile(this, *r);
+    }
+  }
+  return s;
+}
+
+Status LatencyEnv::NewWritableFile(const std::string& f, WritableFile** r) {
+  Status s = target()->NewWritableFile(f, r);
+  if (IsRemote(f)) {
+    Delay(options_.open_micros, NULL, 0);
+    if (s.ok()) {
+      *r = new LatencyWritableFile(this, *r);
+    }
+  }
+  return s;
+}
+
+Status LatencyEnv::ReuseWritableFile(const std::string& f,
+                                     const std::string& old_f,
+                                     uint64_t preallocate_size,
+                                     WritableFile** r) {
+  Status s = target()->ReuseWritableFile(f, old_f, preallocate_size, r);
+  if (IsRemote(f)) {
+    Delay(options_.rename_micros + options_.open_micros, NULL, 0);
+    if (s.ok()) {
+      *r = new LatencyWritableFile(this, *r);
+    }
+  }
+  return s;
+}
+
+}  // namespace
+
+Env* NewLatencyEnv(Env* base_env, const LatencyOptions& options) {
+  return new LatencyEnv(base_env, options);
+}
+
+}  // namespace leveldb
@@ -0,0 +1,135 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/env_latency.h"
+
+#include "leveldb/env.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+// Records the delays it is asked for instead of sleeping, and keeps a
+// clock that only moves when it "sleeps".
+class ClockEnv : public EnvWrapper {
+ public:
+  uint64_t now_;
+  uint64_t slept_;
+
+  ClockEnv() : EnvWrapper(Env::Default()), now_(1000000), slept_(0) { }
+
+  virtual uint64_t NowMicros() { return now_; }
+  virtual void SleepForMicroseconds(int micros) {
+    now_ += micros;
+    slept_ += micros;
+  }
+};
+
+class LatencyEnvTest {
+ public:
+  ClockEnv base_;
+  LatencyOptions options_;
+  Env* env_;
+  std::string dir_;
+
+  LatencyEnvTest() : env_(NULL) {
+    dir_ = test::TmpDir() + "/env_latency_test";
+    base_.CreateDir(dir_);
+    // Constant delays make the expected sleeps exact
+    options_.sigma = 0;
+    options_.stall_probability = 0;
+  }
+
+  ~LatencyEnvTest() {
+    delete env_;
+  }
+
+  void Open() {
+    delete env_;
+    env_ = NewLatencyEnv(&base_, options_);
+    base_.slept_ = 0;
+  }
+
+  uint64_t Write(const std::string& name, size_t size) {
+    const uint64_t before = base_.slept_;
+    ASSERT_OK(WriteStringToFile(env_, std::string(size, 'x'),
+                                dir_ + "/" + name));
+    return base_.slept_ - before;
+  }
+
+  uint64_t Read(const std::string& name, int reads, size_t size) {
+    const uint64_t before = base_.slept_;
+    RandomAccessFile* file;
+    ASSERT_OK(env_->NewRandomAccessFile(dir_ + "/" + name, &file));
+    char scratch[1024];
+    for (int i = 0; i < reads; i++) {
+      Slice result;
+      ASSERT_OK(file->Read(0, size, &result, scratch));
+      ASSERT_EQ(size, result.size());
+    }
+    delete file;
+    return base_.slept_ - before;
+  }
+};
+
+TEST(LatencyEnvTest, Parse) {
+  LatencyOptions o;
+  ASSERT_OK(ParseLatencyOptions("open=10,read=20,read_bw=2,sigma=0.25", &o));
+  ASSERT_EQ(10, o.open_micros);
+  ASSERT_EQ(20, o.read_micros);
+  ASSERT_EQ(2 << 20, o.read_bytes_per_second);
+  ASSERT_EQ(0.25, o.sigma);
+  ASSERT_OK(ParseLatencyOptions("hdfs,tables_only=0", &o));
+  ASSERT_EQ(LatencyOptions().open_micros, o.open_micros);
+  ASSERT_TRUE(!o.tables_only);
+  ASSERT_OK(ParseLatencyOptions("", &o));
+  ASSERT_TRUE(!ParseLatencyOptions("open", &o).ok());
+  ASSERT_TRUE(!ParseLatencyOptions("open=abc", &o).ok());
+  ASSERT_TRUE(!ParseLatencyOptions("bogus=1", &o).ok());
+}
+
+TEST(LatencyEnvTest, TablesOnly) {
+  options_.write_bytes_per_second = 1 << 20;
+  Open();
+  // Open, 1 MB through the write link, and Close
+  ASSERT_EQ(options_.open_micros + 1000000 + options_.sync_micros,
+            Write("000001.sst", 1 << 20));
+  ASSERT_EQ(0, Write("000002.log", 1 << 20));
+
+  options_.tables_only = false;
+  Open();
+  ASSERT_GT(Write("000002.log", 1 << 20), 1000000);
+}
+
+TEST(LatencyEnvTest, Reads) {
+  options_.read_bytes_per_second = 1 << 20;
+  Open();
+  Write("000003.sst", 1024);
+  // Each read costs its latency plus 1 ms for 1 KB at 1 MB/s
+  ASSERT_EQ(options_.open_micros + 10 * (options_.read_micros + 976),
+            Read("000003.sst", 10, 1024));
+}
+
+TEST(LatencyEnvTest, Namespace) {
+  options_.tables_only = true;
+  Open();
+  Write("000004.sst", 10);
+  uint64_t before = base_.slept_;
+  ASSERT_OK(env_->RenameFile(dir_ + "/000004.sst", dir_ + "/000005.sst"));
+  ASSERT_EQ(options_.rename_micros, base_.slept_ - before);
+
+  before = base_.slept_;
+  std::vector<std::string> children;
+  ASSERT_OK(env_->GetChildren(dir_, &children));
+  ASSERT_EQ(options_.list_micros, base_.slept_ - before);
+
+  before = base_.slept_;
+  ASSERT_OK(env_->DeleteFile(dir_ + "/000005.sst"));
+  ASSERT_EQ(options_.meta_micros, base_.slept_ - before);
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -295,12 +295,16 @@ class PosixWritableFile : public WritableFile {
   std::string filename_;
   int fd_;
   uint64_t file_offset_;  // Offset of base_ in file
+  // Sync() may skip the metadata of the file, whose blocks are all
+  // allocated already (a recycled, preallocated log)
+  bool data_sync_;
 
  public:
-  PosixWritableFile(const std::string& fname, int fd)
+  PosixWritableFile(const std::string& fname, int fd, bool data_sync = false)
       : filename_(fname),
         fd_(fd),
-        file_offset_(0) {
+        file_offset_(0),
+        data_sync_(data_sync) {
   }
 
 
@@ -339,7 +343,7 @@ class PosixWritableFile : public WritableFile {
   virtual Status Sync() {
     Status s;
 
-    if (fsync(fd_) < 0) {
+    if ((data_sync_ ? fdatasync(fd_) : fsync(fd_)) < 0) {
         s = IOError(filename_, errno);
     }
 
@@ -440,6 +444,31 @@ class PosixEnv : public Env {
     return s;
   }
 
+  virtual Status ReuseWritableFile(const std::string& fname,
+                                   const std::string& old_fname,
+                                   uint64_t preallocate_size,
+                                   WritableFile** result) {
+    Status s;
+    if (rename(old_fname.c_str(), fname.c_str()) != 0) {
+      *result = NULL;
+      return IOError(old_fname, errno);
+    }
+    // Keep the existing blocks: PosixWritableFile overwrites in place
+    // and never truncates, unlike PosixMmapFile.
+    const int fd = open(fname.c_str(), O_RDWR, 0644);
+    if (fd < 0) {
+      *result = NULL;
+      s = IOError(fname, errno);
+    } else {
+#if defined(OS_LINUX)
+      // Best effort; the file is still usable if this fails
+      posix_fallocate(fd, 0, preallocate_size);
+#endif
+      *result = new PosixWritableFile(fname, fd, true);
+    }
+    return s;
+  }
+
   virtual bool FileExists(const std::string& fname) {
     return access(fname.c_str(), F_OK) == 0;
   }
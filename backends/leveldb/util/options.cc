@@ -5,6 +5,7 @@
 #include "leveldb/options.h"
 
 #include "leveldb/comparator.h"
+#include "leveldb/compaction_listener.h"
 #include "leveldb/env.h"
 
 namespace leveldb {
@@ -22,7 +23,19 @@ Options::Options()
       block_size(4096),
       block_restart_interval(16),
       compression(kSnappyCompression),
-      filter_policy(NULL) {
+      persistent_cache(NULL),
+      filter_policy(NULL),
+      recovery_threads(1),
+      recycle_log_file_num(0),
+      compaction_listener(NULL),
+      merge_operator(NULL),
+      value_gc_live_ratio(0.5),
+      value_gc_bytes_per_second(4 << 20),
+      value_cache(NULL),
+      value_inline_threshold(512) {
+}
+
+CompactionListener::~CompactionListener() {
 }
 
 
@@ -0,0 +1,471 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// LocalPersistentCache stores entries in append-only segment files named
+// "<number>.pcache".  Each entry is
+//    key_size: varint32
+//    data_size: varint32
+//    key: uint8[key_size]
+//    data: uint8[data_size]
+//    crc: fixed32 (masked crc32c of all of the above)
+// New entries accumulate in memory.  Once a segment is full, a background
+// thread writes it out as a whole, so that inserting (which happens while
+// the block cache holds a lock) never waits for the disk.  When the cache
+// grows past its capacity the oldest segment is deleted.  On open, the
+// segments are scanned to rebuild the in-memory index; a segment is only
+// trusted up to its first bad entry.
+
+#include "leveldb/persistent_cache.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
+#include "util/logging.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+PersistentCache::~PersistentCache() {
+}
+
+namespace {
+
+class LocalPersistentCache : public PersistentCache {
+ public:
+  LocalPersistentCache(Env* env, const std::string& dirname,
+                       uint64_t capacity);
+  virtual ~LocalPersistentCache();
+
+  Status Open();
+
+  virtual void Insert(const Slice& key, const Slice& data);
+  virtual bool Lookup(const Slice& key, std::string* data);
+  virtual uint64_t Size();
+
+ private:
+  struct Segment {
+    uint64_t number;
+    RandomAccessFile* file;         // NULL until the segment is written out
+    std::string data;               // Contents while file == NULL
+    uint64_t size;
+    std::vector<std::string> keys;  // Keys whose entries live here
+    int refs;
+    bool writing;                   // Being written out by BGWork()
+    bool dropped;
+  };
+
+  struct Location {
+    Segment* segment;
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  std::string SegmentFileName(uint64_t number) const;
+  void Unref(Segment* segment);
+  void NewActiveSegment();
+  Status WriteSegment(const Segment* segment, RandomAccessFile** file);
+  void SealActiveSegment();
+  void LimitUnsealedSegments();
+  void DropSegment(Segment* segment);
+  void EvictIfNeeded();
+  void LoadSegment(uint64_t number);
+  static bool ParseEntry(const Slice& input, Slice* key, Slice* data,
+                         size_t* entry_size);
+  static void BGWork(void* cache);
+  void BackgroundWork();
+
+  Env* const env_;
+  const std::string dirname_;
+  const uint64_t capacity_;
+  const uint64_t segment_size_;
+
+  port::Mutex mu_;
+  port::CondVar bg_cv_;             // Signalled when a segment is full
+  std::map<std::string, Location> index_;
+  std::deque<Segment*> segments_;   // Oldest first; back() is active
+  uint64_t next_number_;
+  uint64_t usage_;
+  bool bg_running_;
+  bool shutting_down_;
+
+  // No copying allowed
+  LocalPersistentCache(const LocalPersistentCache&);
+  void operator=(const LocalPersistentCache&);
+};
+
+LocalPersistentCache::LocalPersistentCache(Env* env,
+                                           const std::string& dirname,
+                                           uint64_t capacity)
+    : env_(env),
+      dirname_(dirname),
+      capacity_(capacity),
+      segment_size_(std::min<uint64_t>(std::max<uint64_t>(capacity / 16,
+                                                          64 << 10),
+                                        64 << 20)),
+      bg_cv_(&mu_),
+      next_number_(1),
+      usage_(0),
+      bg_running_(false),
+      shutting_down_(false) {
+}
+
+LocalPersistentCache::~LocalPersistentCache() {
+  MutexLock l(&mu_);
+  shutting_down_ = true;
+  bg_cv_.SignalAll();
+  while (bg_running_) {
+    bg_cv_.Wait();
+  }
+  // Keep what is in memory for the next incarnation
+  SealActiveSegment();
+  for (size_t i = 0; i < segments_.size(); i++) {
+    Unref(segments_[i]);
+  }
+}
+
+std::string LocalPersistentCache::SegmentFileName(uint64_t number) const {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "/%06llu.pcache",
+           static_cast<unsigned long long>(number));
+  return dirname_ + buf;
+}
+
+void LocalPersistentCache::Unref(Segment* segment) {
+  mu_.AssertHeld();
+  assert(segment->refs > 0);
+  if (--segment->refs == 0) {
+    delete segment->file;
+    delete segment;
+  }
+}
+
+void LocalPersistentCache::NewActiveSegment() {
+  Segment* segment = new Segment;
+  segment->number = next_number_++;
+  segment->file = NULL;
+  segment->size = 0;
+  segment->refs = 1;
+  segment->writing = false;
+  segment->dropped = false;
+  segments_.push_back(segment);
+}
+
+// Write the contents of "segment" to its file and open it for reading.
+// Does not need mu_: only the active segment's contents change.
+Status LocalPersistentCache::WriteSegment(const Segment* segment,
+                                          RandomAccessFile** file) {
+  const std::string fname = SegmentFileName(segment->number);
+  Status s = WriteStringToFile(env_, segment->data, fname);
+  if (s.ok()) {
+    s = env_->NewRandomAccessFile(fname, file);
+  }
+  return s;
+}
+
+// Write out the active segment and make it readable from its file.
+void LocalPersistentCache::SealActiveSegment() {
+  mu_.AssertHeld();
+  Segment* segment = segments_.back();
+  if (segment->data.empty()) {
+    return;
+  }
+  Status s = WriteSegment(segment, &segment->file);
+  if (s.ok()) {
+    std::string().swap(segment->data);
+  } else {
+    segments_.pop_back();
+    DropSegment(segment);
+  }
+}
+
+// Full segments are written out by BGWork().  If the disk falls behind,
+// the oldest of them are dropped so that memory use stays bounded.
+void LocalPersistentCache::LimitUnsealedSegments() {
+  mu_.AssertHeld();
+  static const int kMaxUnsealedSegments = 4;
+  int unsealed = 0;
+  for (size_t i = 0; i + 1 < segments_.size(); i++) {
+    if (segments_[i]->file == NULL) {
+      unsealed++;
+    }
+  }
+  for (size_t i = 0; i + 1 < segments_.size() &&
+                     unsealed > kMaxUnsealedSegments; ) {
+    Segment* segment = segments_[i];
+    if (segment->file == NULL && !segment->writing) {
+      segments_.erase(segments_.begin() + i);
+      DropSegment(segment);
+      unsealed--;
+    } else {
+      i++;
+    }
+  }
+}
+
+void LocalPersistentCache::BGWork(void* cache) {
+  reinterpret_cast<LocalPersistentCache*>(cache)->BackgroundWork();
+}
+
+// Write out full segments, oldest first.
+void LocalPersistentCache::BackgroundWork() {
+  MutexLock l(&mu_);
+  while (true) {
+    Segment* segment = NULL;
+    for (size_t i = 0; i + 1 < segments_.size(); i++) {
+      if (segments_[i]->file == NULL) {
+        segment = segments_[i];
+        break;
+      }
+    }
+    if (segment != NULL) {
+      segment->writing = true;
+      segment->refs++;
+      mu_.Unlock();
+      RandomAccessFile* file = NULL;
+      Status s = WriteSegment(segment, &file);
+      mu_.Lock();
+      segment->writing = false;
+      if (segment->dropped) {
+        // Evicted while being written
+        delete file;
+        env_->DeleteFile(SegmentFileName(segment->number));
+      } else if (s.ok()) {
+        segment->file = file;
+        std::string().swap(segment->data);
+      } else {
+        segments_.erase(std::find(segments_.begin(), segments_.end(),
+                                  segment));
+        DropSegment(segment);
+      }
+      Unref(segment);
+    } else if (shutting_down_) {
+      break;
+    } else {
+      bg_cv_.Wait();
+    }
+  }
+  bg_running_ = false;
+  bg_cv_.SignalAll();
+}
+
+// Forget all entries of "segment" and delete its file.
+// REQUIRES: "segment" has already been removed from segments_.
+void LocalPersistentCache::DropSegment(Segment* segment) {
+  mu_.AssertHeld();
+  for (size_t i = 0; i < segment->keys.size(); i++) {
+    std::map<std::string, Location>::iterator it =
+        index_.find(segment->keys[i]);
+    if (it != index_.end() && it->second.segment == segment) {
+      index_.erase(it);
+    }
+  }
+  usage_ -= segment->size;
+  segment->dropped = true;
+  if (!segment->writing) {
+    env_->DeleteFile(SegmentFileName(segment->number));
+  }
+  Unref(segment);
+}
+
+void LocalPersistentCache::EvictIfNeeded() {
+  mu_.AssertHeld();
+  while (usage_ > capacity_ && segments_.size() > 1) {
+    Segment* oldest = segments_.front();
+    segments_.pop_front();
+    DropSegment(oldest);
+  }
+}
+
+bool LocalPersistentCache::ParseEntry(const Slice& input, Slice* key,
+                                      Slice* data, size_t* entry_size) {
+  Slice in = input;
+  uint32_t key_size, data_size;
+  if (!GetVarint32(&in, &key_size) || !GetVarint32(&in, &data_size)) {
+    return false;
+  }
+  const size_t header_size = input.size() - in.size();
+  if (in.size() < static_cast<uint64_t>(key_size) + data_size + 4) {
+    return false;
+  }
+  const size_t n = header_size + key_size + data_size;
+  const uint32_t crc = crc32c::Unmask(DecodeFixed32(input.data() + n));
+  if (crc32c::Value(input.data(), n) != crc) {
+    return false;
+  }
+  *key = Slice(in.data(), key_size);
+  *data = Slice(in.data() + key_size, data_size);
+  *entry_size = n + 4;
+  return true;
+}
+
+void LocalPersistentCache::LoadSegment(uint64_t number) {
+  mu_.AssertHeld();
+  const std::string fname = SegmentFileName(number);
+  std::string contents;
+  RandomAccessFile* file = NULL;
+  Status s = ReadFileToString(env_, fname, &contents);
+  if (s.ok()) {
+    s = env_->NewRandomAccessFile(fname, &file);
+  }
+  if (!s.ok()) {
+    env_->DeleteFile(fname);
+    return;
+  }
+
+  Segment* segment = new Segment;
+  segment->number = number;
+  segment->file = file;
+  segment->size = contents.size();
+  segment->refs = 1;
+  segment->writing = false;
+  segment->dropped = false;
+  segments_.push_back(segment);
+  usage_ += segment->size;
+
+  Slice input(contents);
+  Slice key, data;
+  size_t entry_size;
+  while (!input.empty() && ParseEntry(input, &key, &data, &entry_size)) {
+    Location loc;
+    loc.segment = segment;
+    loc.offset = contents.size() - input.size();
+    loc.size = entry_size;
+    index_[key.ToString()] = loc;
+    segment->keys.push_back(key.ToString());
+    input.remove_prefix(entry_size);
+  }
+}
+
+Status LocalPersistentCache::Open() {
+  MutexLock l(&mu_);
+  env_->CreateDir(dirname_);  // Ignore error: it may already exist
+  std::vector<std::string> filenames;
+  Status s = env_->GetChildren(dirname_, &filenames);
+  if (!s.ok()) {
+    return s;
+  }
+  std::vector<uint64_t> numbers;
+  for (size_t i = 0; i < filenames.size(); i++) {
+    Slice name(filenames[i]);
+    uint64_t number;
+    if (ConsumeDecimalNumber(&name, &number) && name == Slice(".pcache")) {
+      numbers.push_back(number);
+    }
+  }
+  std::sort(numbers.begin(), numbers.end());
+  for (size_t i = 0; i < numbers.size(); i++) {
+    LoadSegment(numbers[i]);
+    next_number_ = numbers[i] + 1;
+  }
+  NewActiveSegment();
+  EvictIfNeeded();
+  bg_running_ = true;
+  env_->StartThread(&LocalPersistentCache::BGWork, this);
+  return Status::OK();
+}
+
+void LocalPersistentCache::Insert(const Slice& key, const Slice& data) {
+  std::string entry;
+  PutVarint32(&entry, key.size());
+  PutVarint32(&entry, data.size());
+  entry.append(key.data(), key.size());
+  entry.append(data.data(), data.size());
+  PutFixed32(&entry, crc32c::Mask(crc32c::Value(entry.data(),
+                                                entry.size())));
+  if (entry.size() > segment_size_) {
+    return;
+  }
+
+  MutexLock l(&mu_);
+  if (segments_.back()->data.size() + entry.size() > segment_size_) {
+    NewActiveSegment();
+    LimitUnsealedSegments();
+    bg_cv_.Signal();
+  }
+  Segment* segment = segments_.back();
+  Location loc;
+  loc.segment = segment;
+  loc.offset = segment->data.size();
+  loc.size = entry.size();
+  segment->data.append(entry);
+  segment->size += entry.size();
+  segment->keys.push_back(key.ToString());
+  index_[key.ToString()] = loc;
+  usage_ += entry.size();
+  EvictIfNeeded();
+}
+
+bool LocalPersistentCache::Lookup(const Slice& key, std::string* data) {
+  mu_.Lock();
+  std::map<std::string, Location>::iterator it = index_.find(key.ToString());
+  if (it == index_.end()) {
+    mu_.Unlock();
+    return false;
+  }
+  const Location loc = it->second;
+
+  std::string scratch;
+  Slice entry;
+  Status s;
+  if (loc.segment->file == NULL) {
+    // Still in memory
+    scratch.assign(loc.segment->data.data() + loc.offset, loc.size);
+    entry = Slice(scratch);
+  } else {
+    loc.segment->refs++;
+    mu_.Unlock();
+    scratch.resize(loc.size);
+    s = loc.segment->file->Read(loc.offset, loc.size, &entry, &scratch[0]);
+    mu_.Lock();
+    Unref(loc.segment);
+  }
+
+  Slice found_key, found_data;
+  size_t entry_size;
+  bool ok = (s.ok() && entry.size() == loc.size &&
+             ParseEntry(entry, &found_key, &found_data, &entry_size) &&
+             found_key == key);
+  if (ok) {
+    data->assign(found_data.data(), found_data.size());
+  } else {
+    // Damaged entry: make sure it is not returned again
+    it = index_.find(key.ToString());
+    if (it != index_.end() && it->second.segment == loc.segment &&
+        it->second.offset == loc.offset) {
+      index_.erase(it);
+    }
+  }
+  mu_.Unlock();
+  return ok;
+}
+
+uint64_t LocalPersistentCache::Size() {
+  MutexLock l(&mu_);
+  return usage_;
+}
+
+}  // namespace
+
+Status NewLocalPersistentCache(Env* env, const std::string& dirname,
+                               uint64_t capacity,
+                               PersistentCache** result) {
+  *result = NULL;
+  LocalPersistentCache* cache =
+      new LocalPersistentCache(env, dirname, capacity);
+  Status s = cache->Open();
+  if (s.ok()) {
+    *result = cache;
+  } else {
+    delete cache;
+  }
+  return s;
+}
+
+}  // namespace leveldb
@@ -0,0 +1,312 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/persistent_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "leveldb/cache.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static std::string Key(int i) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return std::string(buf);
+}
+
+static std::string Value(int i, int size) {
+  std::string result(size, 'a' + (i % 26));
+  result.append(Key(i));
+  return result;
+}
+
+// Stands in for HDFS: table files are read with copies into the
+// caller's buffer (so blocks are cachable) and table reads are counted.
+class RemoteTableEnv : public EnvWrapper {
+ public:
+  int table_reads_;
+
+  explicit RemoteTableEnv(Env* base) : EnvWrapper(base), table_reads_(0) { }
+
+  class CountingFile : public RandomAccessFile {
+   public:
+    RemoteTableEnv* env_;
+    RandomAccessFile* target_;
+
+    CountingFile(RemoteTableEnv* env, RandomAccessFile* target)
+        : env_(env), target_(target) { }
+    ~CountingFile() { delete target_; }
+
+    virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                        char* scratch) const {
+      env_->table_reads_++;
+      Status s = target_->Read(offset, n, result, scratch);
+      if (s.ok() && result->data() != scratch) {
+        memcpy(scratch, result->data(), result->size());
+        *result = Slice(scratch, result->size());
+      }
+      return s;
+    }
+  };
+
+  Status NewRandomAccessFile(const std::string& f, RandomAccessFile** r) {
+    Status s = target()->NewRandomAccessFile(f, r);
+    if (s.ok() && f.size() > 4 && f.substr(f.size() - 4) == ".sst") {
+      *r = new CountingFile(this, *r);
+    }
+    return s;
+  }
+};
+
+class PersistentCacheTest {
+ public:
+  Env* env_;
+  std::string dir_;
+  PersistentCache* cache_;
+
+  PersistentCacheTest() : env_(Env::Default()), cache_(NULL) {
+    dir_ = test::TmpDir() + "/persistent_cache_test";
+    DestroyDir();
+  }
+
+  ~PersistentCacheTest() {
+    delete cache_;
+    DestroyDir();
+  }
+
+  void DestroyDir() {
+    std::vector<std::string> files;
+    env_->GetChildren(dir_, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      env_->DeleteFile(dir_ + "/" + files[i]);
+    }
+    env_->DeleteDir(dir_);
+  }
+
+  void Reopen(uint64_t capacity) {
+    delete cache_;
+    cache_ = NULL;
+    ASSERT_OK(NewLocalPersistentCache(env_, dir_, capacity, &cache_));
+  }
+
+  std::string Lookup(const std::string& key) {
+    std::string data;
+    if (cache_->Lookup(key, &data)) {
+      return data;
+    }
+    return "NOT_FOUND";
+  }
+
+  // Overwrite every byte equal to "from" in the cache files with "to"
+  void CorruptFiles(char from, char to) {
+    std::vector<std::string> files;
+    ASSERT_OK(env_->GetChildren(dir_, &files));
+    for (size_t i = 0; i < files.size(); i++) {
+      const std::string fname = dir_ + "/" + files[i];
+      std::string contents;
+      if (!ReadFileToString(env_, fname, &contents).ok()) continue;
+      for (size_t j = 0; j < contents.size(); j++) {
+        if (contents[j] == from) contents[j] = to;
+      }
+      ASSERT_OK(WriteStringToFile(env_, contents, fname));
+    }
+  }
+};
+
+TEST(PersistentCacheTest, InsertAndLookup) {
+  Reopen(1 << 20);
+  ASSERT_EQ("NOT_FOUND", Lookup("a"));
+  cache_->Insert("a", "value-a");
+  cache_->Insert("b", "value-b");
+  ASSERT_EQ("value-a", Lookup("a"));
+  ASSERT_EQ("value-b", Lookup("b"));
+  cache_->Insert("a", "value-a2");
+  ASSERT_EQ("value-a2", Lookup("a"));
+  ASSERT_EQ("NOT_FOUND", Lookup("c"));
+}
+
+TEST(PersistentCacheTest, SurvivesReopen) {
+  Reopen(1 << 20);
+  const int N = 1000;
+  for (int i = 0; i < N; i++) {
+    cache_->Insert(Key(i), Value(i, 200));
+  }
+  Reopen(1 << 20);
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, 200), Lookup(Key(i)));
+  }
+}
+
+TEST(PersistentCacheTest, Capacity) {
+  const uint64_t kCapacity = 1 << 20;
+  Reopen(kCapacity);
+  const int N = 10000;
+  for (int i = 0; i < N; i++) {
+    cache_->Insert(Key(i), Value(i, 1000));
+  }
+  ASSERT_LE(cache_->Size(), kCapacity + (kCapacity / 8));
+  // Newest entries are kept, oldest are evicted
+  ASSERT_EQ(Value(N - 1, 1000), Lookup(Key(N - 1)));
+  ASSERT_EQ("NOT_FOUND", Lookup(Key(0)));
+
+  // Capacity is also enforced when reopening with a smaller one
+  Reopen(kCapacity / 4);
+  ASSERT_LE(cache_->Size(), kCapacity / 4 + (kCapacity / 8));
+}
+
+TEST(PersistentCacheTest, Corruption) {
+  Reopen(1 << 20);
+  cache_->Insert("a", std::string(1000, 'x'));
+  delete cache_;  // Writes out the entry
+  cache_ = NULL;
+  CorruptFiles('x', 'y');
+  Reopen(1 << 20);
+  ASSERT_EQ("NOT_FOUND", Lookup("a"));
+}
+
+// Holds up the writing of new files until Release() is called.
+class StallingEnv : public EnvWrapper {
+ public:
+  port::Mutex mu_;
+  port::CondVar cv_;
+  bool stalled_;
+
+  explicit StallingEnv(Env* base)
+      : EnvWrapper(base), cv_(&mu_), stalled_(true) { }
+
+  Status NewWritableFile(const std::string& f, WritableFile** r) {
+    MutexLock l(&mu_);
+    while (stalled_) {
+      cv_.Wait();
+    }
+    return target()->NewWritableFile(f, r);
+  }
+
+  void Release() {
+    MutexLock l(&mu_);
+    stalled_ = false;
+    cv_.SignalAll();
+  }
+};
+
+// Filling segments must not wait for them to be written out
+TEST(PersistentCacheTest, InsertDoesNotWaitForDisk) {
+  StallingEnv env(env_);
+  ASSERT_OK(NewLocalPersistentCache(&env, dir_, 1 << 20, &cache_));
+  // Fills about three 64KB segments
+  const int N = 200;
+  for (int i = 0; i < N; i++) {
+    cache_->Insert(Key(i), Value(i, 1000));
+  }
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, 1000), Lookup(Key(i)));
+  }
+  env.Release();
+  Reopen(1 << 20);
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(Value(i, 1000), Lookup(Key(i)));
+  }
+}
+
+// Blocks evicted from a tiny block cache are served from the persistent
+// cache, including after the DB is reopened with an empty block cache.
+TEST(PersistentCacheTest, BlocksOfDB) {
+  Reopen(64 << 20);
+  const std::string dbname = test::TmpDir() + "/persistent_cache_test_db";
+  RemoteTableEnv env(env_);
+  Options options;
+  options.env = &env;
+  options.create_if_missing = true;
+  options.persistent_cache = cache_;
+  options.compression = kNoCompression;
+  DestroyDB(dbname, options);
+
+  const int N = 5000;
+  for (int pass = 0; pass < 3; pass++) {
+    Cache* block_cache = NewLRUCache(4096);
+    options.block_cache = block_cache;
+    DB* db;
+    ASSERT_OK(DB::Open(options, dbname, &db));
+    if (pass == 0) {
+      for (int i = 0; i < N; i++) {
+        ASSERT_OK(db->Put(WriteOptions(), Key(i), Value(i, 100)));
+      }
+      db->CompactRange(NULL, NULL);
+    }
+    env.table_reads_ = 0;
+    for (int i = 0; i < N; i++) {
+      std::string value;
+      ASSERT_OK(db->Get(ReadOptions(), Key(i), &value));
+      ASSERT_EQ(Value(i, 100), value);
+    }
+    if (pass == 0) {
+      ASSERT_GT(env.table_reads_, 100);
+    } else {
+      // Every data block was admitted to the persistent cache on the
+      // earlier passes, so only the footer and index block of the
+      // (single, fully compacted) table are read.
+      ASSERT_LE(env.table_reads_, 2);
+    }
+    delete db;
+    delete block_cache;
+    ASSERT_GT(cache_->Size(), 0);
+  }
+  DestroyDB(dbname, options);
+}
+
+// Tables of different DBs that share the cache are kept apart, even when
+// they have the same file numbers and sizes.
+TEST(PersistentCacheTest, SharedByDBs) {
+  Reopen(64 << 20);
+  RemoteTableEnv env(env_);
+  Options options;
+  options.env = &env;
+  options.create_if_missing = true;
+  options.persistent_cache = cache_;
+  options.compression = kNoCompression;
+  Cache* block_cache = NewLRUCache(4096);
+  options.block_cache = block_cache;
+
+  const int N = 2000;
+  DB* db[2];
+  for (int d = 0; d < 2; d++) {
+    char dbname[100];
+    snprintf(dbname, sizeof(dbname), "/persistent_cache_test_db%d", d);
+    DestroyDB(test::TmpDir() + dbname, options);
+    ASSERT_OK(DB::Open(options, test::TmpDir() + dbname, &db[d]));
+    for (int i = 0; i < N; i++) {
+      ASSERT_OK(db[d]->Put(WriteOptions(), Key(i), Value(i + d, 100)));
+    }
+    db[d]->CompactRange(NULL, NULL);
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    for (int d = 0; d < 2; d++) {
+      for (int i = 0; i < N; i++) {
+        std::string value;
+        ASSERT_OK(db[d]->Get(ReadOptions(), Key(i), &value));
+        ASSERT_EQ(Value(i + d, 100), value);
+      }
+    }
+  }
+  for (int d = 0; d < 2; d++) {
+    delete db[d];
+    char dbname[100];
+    snprintf(dbname, sizeof(dbname), "/persistent_cache_test_db%d", d);
+    DestroyDB(test::TmpDir() + dbname, options);
+  }
+  delete block_cache;
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -2,6 +2,7 @@
 #include "common/connection.h"
 #include "common/debugging.h"
 #include "common/options.h"
+#include "common/sha.h"
 #include "operations.h"
 
 #include <time.h>
@@ -11,6 +12,7 @@
 #include <string.h>
 #include <dirent.h>
 #include <assert.h>
+#include <stddef.h>
 
 #define METADB_LOG LOG_DEBUG
 
@@ -20,12 +22,20 @@
 #define DEFAULT_MAX_BATCH_SIZE     1024
 #define DEFAULT_BLOCK_SIZE         (64 << 10)
 #define DEFAULT_SSTABLE_SIZE       (10 << 20)
+#define DEFAULT_SSTABLE_UPLOADS    4
 #define DEFAULT_METRIC_SAMPLING_INTERVAL 1
-#define DEFAULT_SYNC_INTERVAL      5
+#define DEFAULT_RECOVERY_THREADS   4
+#define DEFAULT_RECYCLE_LOG_FILES  4
+#define DEFAULT_BLOOM_BITS_PER_KEY 10
+#define DEFAULT_PCACHE_SIZE        (4ULL << 30)
+#define DEFAULT_DIR_DB_CACHE_SIZE  (32 << 20)
+#define DEFAULT_DIR_WRITE_BUFFER_SIZE (4 << 20)
+#define DEFAULT_DIR_BLOCK_SIZE     (4 << 10)
 #define DEFAULT_METADB_LOG_FILE "/tmp/metadb.log" // Default metadb log file location
 #define MAX_FILENAME_LEN 1024
-#define METADB_KEY_LEN (sizeof(metadb_key_t))
-#define METADB_INTERNAL_KEY_LEN (sizeof(metadb_key_t)+8)
+#define METADB_INTERNAL_KEY_LEN (METADB_MAX_KEY_LEN+8)
+#define METADB_KEY2_PARTITION_OFFSET 8
+#define METADB_KEY2_HASH_OFFSET 12
 
 #define metadb_error(phase, cond)                                        \
   if (cond != NULL) {                                                    \
@@ -36,35 +46,241 @@
 static struct stat INIT_STATBUF;
 
 static
-void init_meta_obj_key(metadb_key_t *mkey,
-                       metadb_inode_t dir_id,
-                       int partition_id,
-                       const char* path)
+void encode_big_endian(char* dst, uint64_t value, int len)
 {
-    mkey->parent_id = dir_id;
-    if (partition_id < 0) {
-      mkey->partition_id = 0xFFFFFFFF;
+    int i;
+    for (i = len - 1; i >= 0; i--) {
+        dst[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+static
+uint64_t decode_big_endian(const char* src, int len)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        value = (value << 8) | (uint8_t) src[i];
+    }
+    return value;
+}
+
+// Store in "key" the key of the object whose name has the hex hash
+// "name_hash" in the given key format, and return its length.  Keys with
+// an empty hash (e.g. seek keys) sort before those of all names.
+static
+size_t build_meta_obj_key(int key_format,
+                          char* key,
+                          metadb_inode_t dir_id,
+                          long int partition_id,
+                          const char* name_hash)
+{
+    const int empty_hash = (name_hash == NULL || name_hash[0] == '\0');
+    if (key_format == METADB_KEY_FORMAT_V1) {
+        metadb_key_t mkey;
+        mkey.parent_id = dir_id;
+        mkey.partition_id = partition_id;
+        if (empty_hash) {
+            memset(mkey.name_hash, 0, sizeof(mkey.name_hash));
+        } else {
+            memcpy(mkey.name_hash, name_hash, sizeof(mkey.name_hash));
+        }
+        memcpy(key, &mkey, sizeof(mkey));
+        return sizeof(mkey);
+    }
+
+    encode_big_endian(key, dir_id, 8);
+    encode_big_endian(key + METADB_KEY2_PARTITION_OFFSET,
+                      (uint32_t) partition_id, 4);
+    if (empty_hash) {
+        memset(key + METADB_KEY2_HASH_OFFSET, 0, METADB_KEY2_HASH_LEN);
     } else {
-      mkey->partition_id = partition_id;
+        uint8_t hash[SHA1_HASH_SIZE];
+        hex2binary((char*) name_hash, HASH_LEN, hash);
+        memcpy(key + METADB_KEY2_HASH_OFFSET,
+               hash + SHA1_HASH_SIZE - METADB_KEY2_HASH_LEN,
+               METADB_KEY2_HASH_LEN);
     }
-    memset(mkey->name_hash, 0, sizeof(mkey->name_hash));
-    if (path != NULL)
-        giga_hash_name(path, mkey->name_hash);
+    return METADB_KEY2_LEN;
 }
 
+// Decode the parent and partition ids of "key".  Returns "0" if "key" is
+// not an object key of the given format.
 static
-void init_meta_obj_seek_key(metadb_key_t *mkey,
-                            metadb_inode_t dir_id,
-                            int partition_id,
-                            const char* name_hash)
+int parse_meta_obj_key_ids(int key_format,
+                           const char* key,
+                           size_t key_len,
+                           metadb_inode_t* parent_id,
+                           long int* partition_id)
 {
-    mkey->parent_id = dir_id;
-    mkey->partition_id = partition_id;
-    if (name_hash == NULL) {
-        memset(mkey->name_hash, 0, sizeof(mkey->name_hash));
+    if (key_format == METADB_KEY_FORMAT_V1) {
+        if (key_len != sizeof(metadb_key_t)) {
+            return 0;
+        }
+        memcpy(parent_id, key + offsetof(metadb_key_t, parent_id),
+               sizeof(*parent_id));
+        memcpy(partition_id, key + offsetof(metadb_key_t, partition_id),
+               sizeof(*partition_id));
+        return 1;
+    }
+    if (key_len != METADB_KEY2_LEN) {
+        return 0;
+    }
+    *parent_id = decode_big_endian(key, 8);
+    *partition_id = (long int)
+        decode_big_endian(key + METADB_KEY2_PARTITION_OFFSET, 4);
+    return 1;
+}
+
+// Store the hex name hash of "key" in name_hash[0..HASH_LEN-1].  Version 2
+// keys give the hash with its leading bytes zeroed.
+static
+void parse_meta_obj_key_hash(int key_format,
+                             const char* key,
+                             char* name_hash)
+{
+    if (key_format == METADB_KEY_FORMAT_V1) {
+        memcpy(name_hash, key + offsetof(metadb_key_t, name_hash), HASH_LEN);
     } else {
-        memcpy(mkey->name_hash, name_hash, sizeof(mkey->name_hash));
+        uint8_t hash[SHA1_HASH_SIZE];
+        char hex[HASH_LEN + 1];
+        memset(hash, 0, SHA1_HASH_SIZE - METADB_KEY2_HASH_LEN);
+        memcpy(hash + SHA1_HASH_SIZE - METADB_KEY2_HASH_LEN,
+               key + METADB_KEY2_HASH_OFFSET, METADB_KEY2_HASH_LEN);
+        binary2hex(hash, SHA1_HASH_SIZE, hex);
+        memcpy(name_hash, hex, HASH_LEN);
+    }
+}
+
+// Length of the object keys of the given format
+static
+size_t meta_obj_key_len(int key_format)
+{
+    return (key_format == METADB_KEY_FORMAT_V1) ? sizeof(metadb_key_t)
+                                                : METADB_KEY2_LEN;
+}
+
+// Returns "1" if a key of length "key_len" is the key of a data chunk in
+// the given format.
+static
+int is_meta_chunk_key(int key_format, size_t key_len)
+{
+    return key_len == meta_obj_key_len(key_format) + METADB_CHUNK_INDEX_LEN;
+}
+
+// Length of the object key that a key of length "key_len" belongs to: all
+// of an object key, and the part before the index of a chunk key.
+static
+size_t meta_obj_key_prefix_len(int key_format, size_t key_len)
+{
+    if (is_meta_chunk_key(key_format, key_len)) {
+        return key_len - METADB_CHUNK_INDEX_LEN;
+    }
+    return key_len;
+}
+
+// Store in "key" the key of chunk "chunk" of the object whose key is
+// obj_key[0..obj_key_len-1], and return its length.
+static
+size_t build_meta_chunk_key(char* key,
+                            const char* obj_key,
+                            size_t obj_key_len,
+                            uint32_t chunk)
+{
+    memmove(key, obj_key, obj_key_len);
+    encode_big_endian(key + obj_key_len, chunk, METADB_CHUNK_INDEX_LEN);
+    return obj_key_len + METADB_CHUNK_INDEX_LEN;
+}
+
+// Returns "1" if "key" is the key of a chunk of the object whose key is
+// obj_key[0..obj_key_len-1].
+static
+int is_chunk_key_of(const char* key, size_t key_len,
+                    const char* obj_key, size_t obj_key_len)
+{
+    return key_len == obj_key_len + METADB_CHUNK_INDEX_LEN &&
+           memcmp(key, obj_key, obj_key_len) == 0;
+}
+
+// Directories are spread over the shards by a hash of their id, so all
+// partitions of a directory, and the data of its files, share a shard.
+static
+int metadb_shard_index(struct MetaDB *mdb, metadb_inode_t dir_id)
+{
+    uint64_t hash = (uint64_t) dir_id * 0x9E3779B97F4A7C15ULL;
+    return (int) ((hash >> 32) % (uint64_t) mdb->num_shards);
+}
+
+static
+leveldb_t* metadb_shard(struct MetaDB *mdb, metadb_inode_t dir_id)
+{
+    return mdb->shards[metadb_shard_index(mdb, dir_id)];
+}
+
+// The mapping record of a directory (partition -1) is kept in the small
+// directory DB, everything else in the shard of its parent directory.
+static
+leveldb_t* metadb_object_db(struct MetaDB *mdb,
+                            metadb_inode_t dir_id, long int partition_id)
+{
+    if (partition_id < 0 || partition_id == 0xFFFFFFFF) {
+        return mdb->dir_db;
+    }
+    return metadb_shard(mdb, dir_id);
+}
+
+// The DB holding the object with key obj_key[0..obj_key_len-1].
+static
+leveldb_t* metadb_key_db(struct MetaDB *mdb,
+                         const char* obj_key, size_t obj_key_len)
+{
+    metadb_inode_t dir_id = 0;
+    long int partition_id = 0;
+    parse_meta_obj_key_ids(mdb->key_format, obj_key, obj_key_len,
+                           &dir_id, &partition_id);
+    return metadb_object_db(mdb, dir_id, partition_id);
+}
+
+int metadb_parse_key(struct MetaDB *mdb, const char* key, size_t key_len,
+                     metadb_key_t* result)
+{
+    if (!parse_meta_obj_key_ids(mdb->key_format, key, key_len,
+                                &result->parent_id, &result->partition_id)) {
+        return 0;
+    }
+    parse_meta_obj_key_hash(mdb->key_format, key, result->name_hash);
+    return 1;
+}
+
+static
+size_t init_meta_obj_key(struct MetaDB *mdb,
+                         char* key,
+                         metadb_inode_t dir_id,
+                         int partition_id,
+                         const char* path)
+{
+    char name_hash[HASH_LEN + 1];
+    long int key_partition_id = partition_id;
+    if (partition_id < 0) {
+        key_partition_id = 0xFFFFFFFF;
+    }
+    if (path != NULL) {
+        giga_hash_name(path, name_hash);
     }
+    return build_meta_obj_key(mdb->key_format, key, dir_id, key_partition_id,
+                              (path != NULL) ? name_hash : NULL);
+}
+
+static
+size_t init_meta_obj_seek_key(struct MetaDB *mdb,
+                              char* key,
+                              metadb_inode_t dir_id,
+                              int partition_id,
+                              const char* name_hash)
+{
+    return build_meta_obj_key(mdb->key_format, key, dir_id, partition_id,
+                              name_hash);
 }
 
 static
@@ -76,6 +292,340 @@ size_t metadb_header_size(metadb_val_t* mobj_val) {
     return header_size;
 }
 
+// Return the data kept after the header of a file value written before
+// chunks existed, with its length in *len, or NULL if there is none.
+static
+const char* metadb_inline_data(const metadb_val_t* mobj_val, size_t* len) {
+    if (mobj_val->size < sizeof(metadb_val_header_t)) {
+        return NULL;
+    }
+    metadb_val_header_t* mobj = (metadb_val_header_t*) (mobj_val->value);
+    size_t header_size = metadb_header_size((metadb_val_t*) mobj_val);
+    if (!S_ISREG(mobj->statbuf.st_mode) ||
+        mobj->state == RPC_LEVELDB_FILE_IN_FS ||
+        mobj_val->size <= header_size) {
+        return NULL;
+    }
+    *len = mobj_val->size - header_size;
+    return mobj_val->value + header_size;
+}
+
+// Returns "1" if the file data of the object whose value is "mobj_val" is
+// kept in chunk keys after its attribute key.
+static
+int metadb_has_chunks(const metadb_val_t* mobj_val) {
+    metadb_val_header_t* mobj = (metadb_val_header_t*) (mobj_val->value);
+    return S_ISREG(mobj->statbuf.st_mode) &&
+           mobj->state != RPC_LEVELDB_FILE_IN_FS &&
+           mobj->statbuf.st_size > 0 &&
+           mobj_val->size == metadb_header_size((metadb_val_t*) mobj_val);
+}
+
+/*
+ * Attribute updates are written as merge operands: a one-byte type
+ * followed by the new attribute.  LevelDB applies them to the object's
+ * value when it is read or compacted.
+ */
+enum {
+    METADB_MERGE_CHMOD = 1,
+    METADB_MERGE_SETATTR = 2,
+    METADB_MERGE_UTIMES = 3,
+    METADB_MERGE_SIZE = 4,
+    METADB_MERGE_BITMAP = 5,
+    METADB_MERGE_EXTEND = 6,    // Grow the file size to at least the size
+    METADB_MERGE_COUNT = 7      // Add to a partition's entry count
+};
+
+typedef union {
+    mode_t mode;
+    struct stat statbuf;
+    time_t times[2];
+    off_t size;
+    struct giga_mapping_t mapping;
+    int64_t count;
+} metadb_merge_arg_t;
+
+static
+size_t metadb_merge_arg_size(char type) {
+    switch (type) {
+        case METADB_MERGE_CHMOD:   return sizeof(mode_t);
+        case METADB_MERGE_SETATTR: return sizeof(struct stat);
+        case METADB_MERGE_UTIMES:  return 2 * sizeof(time_t);
+        case METADB_MERGE_SIZE:    return sizeof(off_t);
+        case METADB_MERGE_EXTEND:  return sizeof(off_t);
+        case METADB_MERGE_BITMAP:  return sizeof(struct giga_mapping_t);
+        case METADB_MERGE_COUNT:   return sizeof(int64_t);
+        default:                   return 0;
+    }
+}
+
+// Apply one update to the object value in "mobj_val", which is malloc()ed
+// and may be reallocated.
+static
+void metadb_merge_apply(metadb_val_t* mobj_val,
+                        const char* operand, size_t operand_len) {
+    metadb_merge_arg_t arg;
+    size_t arg_size = (operand_len > 0) ? metadb_merge_arg_size(operand[0])
+                                        : 0;
+    if (arg_size == 0 || operand_len != 1 + arg_size) {
+        logMessage(METADB_LOG, __func__, "bad merge operand");
+        return;
+    }
+    memcpy(&arg, operand + 1, arg_size);
+
+    size_t old_size;
+    metadb_val_header_t* mobj = (metadb_val_header_t *) mobj_val->value;
+    switch (operand[0]) {
+        case METADB_MERGE_CHMOD:
+            mobj->statbuf.st_mode = arg.mode;
+            break;
+        case METADB_MERGE_SETATTR:
+            mobj->statbuf = arg.statbuf;
+            break;
+        case METADB_MERGE_UTIMES:
+            mobj->statbuf.st_atime = arg.times[0];
+            mobj->statbuf.st_mtime = arg.times[1];
+            break;
+        case METADB_MERGE_SIZE:
+            if (metadb_inline_data(mobj_val, &old_size) != NULL) {
+                // A value from before chunks existed; resize its data.
+                size_t header_size = metadb_header_size(mobj_val);
+                mobj_val->value = (char *) realloc(mobj_val->value,
+                                                   header_size + arg.size);
+                if ((size_t) arg.size > old_size) {
+                    memset(mobj_val->value + header_size + old_size, 0,
+                           arg.size - old_size);
+                }
+                mobj_val->size = header_size + arg.size;
+                mobj = (metadb_val_header_t *) mobj_val->value;
+            }
+            mobj->statbuf.st_size = arg.size;
+            break;
+        case METADB_MERGE_EXTEND:
+            if (mobj->statbuf.st_size < arg.size) {
+                mobj->statbuf.st_size = arg.size;
+            }
+            break;
+        case METADB_MERGE_BITMAP:
+            if (mobj_val->size >= metadb_header_size(mobj_val)
+                                  + sizeof(struct giga_mapping_t)) {
+                memcpy(mobj_val->value + metadb_header_size(mobj_val),
+                       &arg.mapping, sizeof(struct giga_mapping_t));
+            }
+            break;
+    }
+}
+
+// Sum the count operands of an entry counter into its value, which starts
+// at 0 when there is none.
+static
+char* metadb_merge_count(const char* existing_value, size_t existing_len,
+                         const char* const* operands,
+                         const size_t* operand_lens,
+                         int num_operands,
+                         unsigned char* success, size_t* new_value_len) {
+    int64_t count = 0;
+    int64_t delta;
+    if (existing_value != NULL && existing_len == sizeof(count)) {
+        memcpy(&count, existing_value, sizeof(count));
+    }
+    int i;
+    for (i = 0; i < num_operands; i++) {
+        if (operand_lens[i] == 1 + sizeof(delta) &&
+            operands[i][0] == METADB_MERGE_COUNT) {
+            memcpy(&delta, operands[i] + 1, sizeof(delta));
+            count += delta;
+        } else {
+            logMessage(METADB_LOG, __func__, "bad merge operand");
+        }
+    }
+    char* value = (char *) malloc(sizeof(count));
+    memcpy(value, &count, sizeof(count));
+    *success = 1;
+    *new_value_len = sizeof(count);
+    return value;
+}
+
+static
+char* metadb_merge_full(void* arg,
+                        const char* key, size_t key_len,
+                        const char* existing_value, size_t existing_len,
+                        const char* const* operands,
+                        const size_t* operand_lens,
+                        int num_operands,
+                        unsigned char* success, size_t* new_value_len) {
+    (void) arg;
+    (void) key;
+    (void) key_len;
+    if (num_operands > 0 && operand_lens[0] > 0 &&
+        operands[0][0] == METADB_MERGE_COUNT) {
+        return metadb_merge_count(existing_value, existing_len,
+                                  operands, operand_lens, num_operands,
+                                  success, new_value_len);
+    }
+    if (existing_value == NULL || existing_len < sizeof(metadb_val_header_t)) {
+        // Updates do not bring back an object that was removed
+        *success = 0;
+        return NULL;
+    }
+
+    metadb_val_t mobj_val;
+    mobj_val.size = existing_len;
+    mobj_val.value = (char *) malloc(existing_len);
+    memcpy(mobj_val.value, existing_value, existing_len);
+    int i;
+    for (i = 0; i < num_operands; i++) {
+        metadb_merge_apply(&mobj_val, operands[i], operand_lens[i]);
+    }
+    *success = 1;
+    *new_value_len = mobj_val.size;
+    return mobj_val.value;
+}
+
+static void metadb_merge_destroy(void* arg) {
+    (void) arg;
+}
+
+static const char* metadb_merge_name(void* arg) {
+    (void) arg;
+    return "metadb.AttributeMerge";
+}
+
+// Store in "operand" an update of type "type" and return its length.
+static
+size_t metadb_merge_operand(char type, const metadb_merge_arg_t* arg,
+                            char* operand) {
+    size_t arg_size = metadb_merge_arg_size(type);
+    operand[0] = type;
+    memcpy(operand + 1, arg, arg_size);
+    return 1 + arg_size;
+}
+
+// Write an update of type "type" to the object's attributes without
+// reading the object.
+static
+int metadb_merge_update(struct MetaDB *mdb,
+                        const metadb_inode_t dir_id,
+                        const int partition_id,
+                        const char *path,
+                        char type, const metadb_merge_arg_t* arg) {
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
+    char mobj_key[METADB_MAX_KEY_LEN];
+    char operand[1 + sizeof(metadb_merge_arg_t)];
+    char* err = NULL;
+    int ret = 0;
+
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
+    size_t operand_len = metadb_merge_operand(type, arg, operand);
+    leveldb_merge(db, mdb->insert_options,
+                  mobj_key, key_len, operand, operand_len, &err);
+    if (err != NULL) {
+        logMessage(METADB_LOG, __func__,
+                   "merge_update(%s) failed (%s).", path, err);
+        free(err);
+        ret = -1;
+    }
+    return ret;
+}
+
+// The entry count of a partition is kept in the shard of its entries, so
+// that it changes in the same write as they do.  Its key is that of the
+// directory's mapping record followed by the partition index (shaped like
+// a chunk key, so scans skip it and key format conversion carries it
+// over).  Counts from before were kept under the same key in the
+// directory DB, and are still added in.
+static
+size_t init_meta_count_key(struct MetaDB *mdb,
+                           char* key,
+                           metadb_inode_t dir_id,
+                           int partition_id)
+{
+    size_t key_len = init_meta_obj_key(mdb, key, dir_id, -1, NULL);
+    encode_big_endian(key + key_len, (uint32_t) partition_id,
+                      METADB_CHUNK_INDEX_LEN);
+    return key_len + METADB_CHUNK_INDEX_LEN;
+}
+
+// Add to "batch" a change of "delta" in the entry count of the partition.
+static
+void metadb_batch_add_count(struct MetaDB *mdb, leveldb_writebatch_t* batch,
+                            const metadb_inode_t dir_id,
+                            const int partition_id,
+                            int delta) {
+    char count_key[METADB_MAX_CHUNK_KEY_LEN];
+    char operand[1 + sizeof(metadb_merge_arg_t)];
+    metadb_merge_arg_t arg;
+
+    if (partition_id < 0 || delta == 0) {
+        return;
+    }
+    size_t key_len = init_meta_count_key(mdb, count_key, dir_id, partition_id);
+    arg.count = delta;
+    size_t operand_len = metadb_merge_operand(METADB_MERGE_COUNT, &arg,
+                                              operand);
+    leveldb_writebatch_merge(batch, count_key, key_len, operand, operand_len);
+}
+
+int metadb_add_partition_size(struct MetaDB *mdb,
+                              const metadb_inode_t dir_id,
+                              const int partition_id,
+                              int delta) {
+    char* err = NULL;
+
+    if (partition_id < 0 || delta == 0) {
+        return 0;
+    }
+    leveldb_writebatch_t* batch = leveldb_writebatch_create();
+    metadb_batch_add_count(mdb, batch, dir_id, partition_id, delta);
+    leveldb_write(metadb_shard(mdb, dir_id), mdb->insert_options,
+                  batch, &err);
+    leveldb_writebatch_destroy(batch);
+    if (err != NULL) {
+        logMessage(METADB_LOG, __func__,
+                   "add_partition_size(d%ld,p%d) failed (%s).",
+                   dir_id, partition_id, err);
+        free(err);
+        return -1;
+    }
+    return 0;
+}
+
+int metadb_get_partition_size(struct MetaDB *mdb,
+                              const metadb_inode_t dir_id,
+                              const int partition_id) {
+    leveldb_t* dbs[2];
+    char count_key[METADB_MAX_CHUNK_KEY_LEN];
+    char* err = NULL;
+    int64_t count = 0;
+    int i;
+
+    size_t key_len = init_meta_count_key(mdb, count_key, dir_id, partition_id);
+    dbs[0] = metadb_shard(mdb, dir_id);
+    dbs[1] = mdb->dir_db;
+    for (i = 0; i < 2 && err == NULL; i++) {
+        size_t val_len = 0;
+        int64_t part = 0;
+        char* val = leveldb_get(dbs[i], mdb->lookup_options,
+                                count_key, key_len, &val_len, &err);
+        if (val != NULL) {
+            if (val_len == sizeof(part)) {
+                memcpy(&part, val, sizeof(part));
+                count += part;
+            }
+            free(val);
+        }
+    }
+    if (err != NULL) {
+        logMessage(METADB_LOG, __func__,
+                   "get_partition_size(d%ld,p%d) failed (%s).",
+                   dir_id, partition_id, err);
+        free(err);
+        return -1;
+    }
+    return (count > 0) ? (int) count : 0;
+}
+
 static
 metadb_val_t init_meta_val(const metadb_inode_t inode_id,
                            const size_t objname_len,
@@ -185,28 +735,148 @@ void free_metadb_val(metadb_val_t* mobj_val) {
     }
 }
 
-static void CmpDestroy(void* arg) { if (arg != NULL) {} }
+// Copy bytes [offset, offset+size) of the data kept in the chunks of the
+// object with key obj_key[0..obj_key_len-1] into "buf".  Bytes that no
+// chunk holds read as zeros.  Returns "-1" on error.
+static
+int metadb_read_chunks(struct MetaDB *mdb,
+                       const char* obj_key, size_t obj_key_len,
+                       char* buf, size_t offset, size_t size) {
+    leveldb_t* db = metadb_key_db(mdb, obj_key, obj_key_len);
+    char chunk_key[METADB_MAX_CHUNK_KEY_LEN];
+    char* err = NULL;
 
-static int CmpCompare(void* arg, const char* a, size_t alen,
-                          const char* b, size_t blen) {
-    if (arg == NULL) {
-      int n = (alen < blen) ? alen : blen;
-      int r = memcmp(a, b, n);
-      if (r == 0) {
-         if (alen < blen) r = -1;
-         else if (alen > blen) r = +1;
-      }
-      return r;
-    } else {
-      return 0;
+    memset(buf, 0, size);
+    if (size == 0) {
+        return 0;
+    }
+    size_t key_len = build_meta_chunk_key(chunk_key, obj_key, obj_key_len,
+                                          offset / METADB_CHUNK_SIZE);
+    leveldb_iterator_t* iter =
+        leveldb_create_iterator(db, mdb->lookup_options);
+    for (leveldb_iter_seek(iter, chunk_key, key_len);
+         leveldb_iter_valid(iter);
+         leveldb_iter_next(iter)) {
+        size_t klen, vlen;
+        const char* key = leveldb_iter_key(iter, &klen);
+        if (!is_chunk_key_of(key, klen, obj_key, obj_key_len)) {
+            break;
+        }
+        size_t chunk_offset = METADB_CHUNK_SIZE *
+            decode_big_endian(key + obj_key_len, METADB_CHUNK_INDEX_LEN);
+        if (chunk_offset >= offset + size) {
+            break;
+        }
+        const char* val = leveldb_iter_value(iter, &vlen);
+        size_t from = (chunk_offset > offset) ? chunk_offset : offset;
+        size_t to = (chunk_offset + vlen < offset + size) ?
+                    chunk_offset + vlen : offset + size;
+        if (from < to) {
+            memcpy(buf + (from - offset), val + (from - chunk_offset),
+                   to - from);
+        }
     }
+    leveldb_iter_get_error(iter, &err);
+    leveldb_iter_destroy(iter);
+    if (err != NULL) {
+        logMessage(METADB_LOG, __func__, "read_chunks failed (%s).", err);
+        free(err);
+        return -1;
+    }
+    return 0;
+}
+
+// Like metadb_read_chunks(), but reads the data of the file value
+// "mobj_val" wherever it is kept.
+static
+int metadb_read_data(struct MetaDB *mdb,
+                     const char* obj_key, size_t obj_key_len,
+                     const metadb_val_t* mobj_val,
+                     char* buf, size_t offset, size_t size) {
+    size_t inline_len;
+    const char* inline_data = metadb_inline_data(mobj_val, &inline_len);
+    if (inline_data == NULL) {
+        return metadb_read_chunks(mdb, obj_key, obj_key_len,
+                                  buf, offset, size);
+    }
+    memset(buf, 0, size);
+    if (offset < inline_len) {
+        size_t len = inline_len - offset;
+        memcpy(buf, inline_data + offset, (len < size) ? len : size);
+    }
+    return 0;
 }
 
-static const char* CmpName(void* arg) {
-    if (arg != NULL) {
-      return "wrong";
+// Add to "batch" the chunks holding data[0..len-1], the data of the object
+// with key obj_key[0..obj_key_len-1].
+static
+void metadb_put_chunks(leveldb_writebatch_t* batch,
+                       const char* obj_key, size_t obj_key_len,
+                       const char* data, size_t len) {
+    char chunk_key[METADB_MAX_CHUNK_KEY_LEN];
+    size_t offset;
+    for (offset = 0; offset < len; offset += METADB_CHUNK_SIZE) {
+        size_t key_len = build_meta_chunk_key(chunk_key, obj_key, obj_key_len,
+                                              offset / METADB_CHUNK_SIZE);
+        size_t chunk_len = len - offset;
+        if (chunk_len > METADB_CHUNK_SIZE) {
+            chunk_len = METADB_CHUNK_SIZE;
+        }
+        leveldb_writebatch_put(batch, chunk_key, key_len,
+                               data + offset, chunk_len);
     }
-    return "foo";
+}
+
+// Add to "batch" the deletion of the chunks of the object with key
+// obj_key[0..obj_key_len-1] from chunk "first" on.  If "found" is not
+// NULL, also store in *found whether the object's own entry exists, which
+// the same scan sees since it sorts right before the chunks.  Returns "-1"
+// on error.
+static
+int metadb_drop_chunks(struct MetaDB *mdb, leveldb_writebatch_t* batch,
+                       const char* obj_key, size_t obj_key_len,
+                       uint32_t first, int* found) {
+    leveldb_t* db = metadb_key_db(mdb, obj_key, obj_key_len);
+    char chunk_key[METADB_MAX_CHUNK_KEY_LEN];
+    char* err = NULL;
+
+    size_t key_len = build_meta_chunk_key(chunk_key, obj_key, obj_key_len,
+                                          first);
+    leveldb_iterator_t* iter =
+        leveldb_create_iterator(db, mdb->lookup_options);
+    int positioned = 0;
+    if (found != NULL) {
+        *found = 0;
+        leveldb_iter_seek(iter, obj_key, obj_key_len);
+        if (leveldb_iter_valid(iter)) {
+            size_t klen;
+            const char* key = leveldb_iter_key(iter, &klen);
+            if (klen == obj_key_len && memcmp(key, obj_key, klen) == 0) {
+                *found = 1;
+                leveldb_iter_next(iter);
+            }
+        }
+        positioned = (first == 0);
+    }
+    if (!positioned) {
+        leveldb_iter_seek(iter, chunk_key, key_len);
+    }
+    for (; leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+        size_t klen;
+        const char* key = leveldb_iter_key(iter, &klen);
+        if (!is_chunk_key_of(key, klen, obj_key, obj_key_len)) {
+            break;
+        }
+        leveldb_writebatch_delete(batch, key, klen);
+    }
+    leveldb_iter_get_error(iter, &err);
+    leveldb_iter_destroy(iter);
+    if (err != NULL) {
+        logMessage(METADB_LOG, __func__, "drop_chunks failed (%s).", err);
+        free(err);
+        return -1;
+    }
+    return 0;
 }
 
 int metric_thread_errors;
@@ -224,7 +894,7 @@ void* metric_thread(void *unused) {
 
     do {
         seconds = time(NULL);
-        prop = leveldb_property_value(mdb->db, "leveldb.stats");
+        prop = metadb_get_metric(mdb);
         if (prop != NULL) {
             fprintf(mdb->logfile, "%ld %s", seconds, prop);
         }
@@ -265,101 +935,438 @@ void metadb_log_init(struct MetaDB *mdb) {
     }
 }
 
-void metadb_save_inode_count(struct MetaDB *mdb,
+// Persist "lease_end" as the highest inode number this server may have
+// handed out.  The write is synchronous so that no number above the last
+// durable lease is ever returned.
+static
+void metadb_save_inode_lease(struct MetaDB *mdb,
+                             metadb_inode_t lease_end,
                              char** err) {
   char inode_count_str[INODE_COUNT_VAL_LEN];
-  sprintf(inode_count_str, INODE_COUNT_VAL_FORMAT, mdb->inode_count);
-  (void) err;
-  /*
+  snprintf(inode_count_str, sizeof(inode_count_str),
+           INODE_COUNT_VAL_FORMAT, lease_end);
   leveldb_put(mdb->db, mdb->sync_insert_options,
               INODE_COUNT_KEY, INODE_COUNT_KEY_LEN,
               inode_count_str, INODE_COUNT_VAL_LEN, err);
-  */
 }
 
-void metadb_set_init_inode_count(struct MetaDB *mdb, int server_id) {
-  mdb->inode_count = server_id;
+// Start handing out numbers after "inode_count" under a fresh lease.
+static
+int metadb_init_inode_lease(struct MetaDB *mdb, metadb_inode_t inode_count) {
+  char* err = NULL;
+  metadb_inode_t lease_end = inode_count + INODE_COUNT_LEASE * INODE_STRIDE;
+  metadb_save_inode_lease(mdb, lease_end, &err);
+  if (err != NULL) {
+    logMessage(METADB_LOG, __func__, "Saving inode lease failed: %s", err);
+    free(err);
+    return -1;
+  }
+  mdb->inode_count = inode_count;
+  mdb->inode_lease_end = lease_end;
+  return 0;
 }
 
+// Numbers are taken with an atomic add on the shared counter; only the
+// thread that runs past the end of the current lease takes the lock and
+// persists the next one.  A restart resumes after the last lease, so the
+// unused rest of it is skipped rather than reused.
 int metadb_get_next_inode_count(struct MetaDB *mdb) {
-  mdb->inode_count += (1 << 9);
-  return mdb->inode_count;
+  metadb_inode_t inode =
+      __sync_add_and_fetch(&(mdb->inode_count), INODE_STRIDE);
+  if (inode > mdb->inode_lease_end) {
+    pthread_mutex_lock(&(mdb->mtx_inode_lease));
+    while (inode > mdb->inode_lease_end) {
+      char* err = NULL;
+      metadb_inode_t lease_end =
+          mdb->inode_lease_end + INODE_COUNT_LEASE * INODE_STRIDE;
+      metadb_save_inode_lease(mdb, lease_end, &err);
+      if (err != NULL) {
+        logMessage(METADB_LOG, __func__,
+                   "Saving inode lease failed: %s", err);
+        free(err);
+        pthread_mutex_unlock(&(mdb->mtx_inode_lease));
+        return -1;
+      }
+      __sync_synchronize();
+      mdb->inode_lease_end = lease_end;
+    }
+    pthread_mutex_unlock(&(mdb->mtx_inode_lease));
+  }
+  return inode;
 }
 
 void metadb_log_destroy() {
     metric_thread_errors = 100;
 }
 
-volatile int stop_sync_thread;
-volatile int flag_sync_thread_finish;
-static pthread_mutex_t  mtx_sync;
-static pthread_cond_t   cv_sync;
+char* metadb_get_metric(struct MetaDB *mdb) {
+  char* metric = NULL;
+  size_t len = 0;
+  int i;
+  for (i = 0; i <= mdb->num_shards; i++) {
+    leveldb_t* db = (i < mdb->num_shards) ? mdb->shards[i] : mdb->dir_db;
+    char* prop = leveldb_property_value(db, "leveldb.stats");
+    if (prop == NULL) {
+      continue;
+    }
+    char header[32];
+    int header_len = (i < mdb->num_shards) ?
+        snprintf(header, sizeof(header), "shard %d\n", i) :
+        snprintf(header, sizeof(header), "directories\n");
+    size_t prop_len = strlen(prop);
+    metric = (char *) realloc(metric, len + header_len + prop_len + 1);
+    memcpy(metric + len, header, header_len);
+    memcpy(metric + len + header_len, prop, prop_len + 1);
+    len += header_len + prop_len;
+    free(prop);
+  }
+  return metric;
+}
 
+static
+void metadb_put_key_format(struct MetaDB *mdb, const char* val, char** err) {
+    leveldb_put(mdb->db, mdb->sync_insert_options,
+                KEY_FORMAT_KEY, KEY_FORMAT_KEY_LEN,
+                val, strlen(val), err);
+}
 
-void* sync_thread(void *v) {
-    struct MetaDB* mdb = (struct MetaDB*) v;
+// Keys are converted in batches while a snapshot of the database is
+// scanned, so a conversion interrupted by a crash leaves keys of both
+// formats.  The marker tells metadb_init() to finish it before use.
+int metadb_convert_keys(struct MetaDB *mdb) {
+    char* err = NULL;
+    int num_converted = 0;
+    int num_batched = 0;
 
-    struct timespec wait;
-    memset(&wait, 0, sizeof(wait)); /* ensure it's initialized */ 
-    struct timeval now;
-    char* err;
+    metadb_put_key_format(mdb, KEY_FORMAT_VAL_CONVERTING, &err);
+    if (err != NULL) {
+        logMessage(LOG_ERR, __func__, "marking conversion: %s", err);
+        free(err);
+        return -1;
+    }
 
-    pthread_mutex_lock(&(mtx_sync));
-    while (stop_sync_thread == 0) {
-        gettimeofday(&now, NULL);
-        wait.tv_sec = now.tv_sec + DEFAULT_SYNC_INTERVAL;
-        int ret = pthread_cond_timedwait(&(cv_sync), &(mtx_sync), &wait);
-        if (ret == ETIMEDOUT) {
-          metadb_save_inode_count(mdb, &err);
-        } else {
-          if (stop_sync_thread == 0) {
-            fprintf(stderr, "Unexpected interrupt for sync thread\n");
-            stop_sync_thread = 1;
-          }
+    int shard;
+    for (shard = 0; shard <= mdb->num_shards && err == NULL; shard++) {
+        leveldb_t* db = (shard < mdb->num_shards) ? mdb->shards[shard]
+                                                  : mdb->dir_db;
+        leveldb_iterator_t* iter =
+            leveldb_create_iterator(db, mdb->scan_options);
+        leveldb_writebatch_t* batch = leveldb_writebatch_create();
+        num_batched = 0;
+        leveldb_iter_seek_to_first(iter);
+        while (leveldb_iter_valid(iter) && err == NULL) {
+            size_t klen, vlen;
+            const char* key = leveldb_iter_key(iter, &klen);
+            size_t obj_klen =
+                meta_obj_key_prefix_len(METADB_KEY_FORMAT_V1, klen);
+            metadb_inode_t parent_id;
+            long int partition_id;
+            if (parse_meta_obj_key_ids(METADB_KEY_FORMAT_V1, key, obj_klen,
+                                       &parent_id, &partition_id)) {
+                char name_hash[HASH_LEN];
+                char new_key[METADB_KEY2_LEN + METADB_CHUNK_INDEX_LEN];
+                parse_meta_obj_key_hash(METADB_KEY_FORMAT_V1, key, name_hash);
+                size_t new_klen = build_meta_obj_key(METADB_KEY_FORMAT_V2,
+                                                     new_key, parent_id,
+                                                     partition_id, name_hash);
+                if (obj_klen != klen) {
+                    // A chunk key keeps its index
+                    memcpy(new_key + new_klen, key + obj_klen,
+                           METADB_CHUNK_INDEX_LEN);
+                    new_klen += METADB_CHUNK_INDEX_LEN;
+                }
+                const char* val = leveldb_iter_value(iter, &vlen);
+                leveldb_writebatch_put(batch, new_key, new_klen, val, vlen);
+                leveldb_writebatch_delete(batch, key, klen);
+                ++num_converted;
+                if (++num_batched >= DEFAULT_MAX_BATCH_SIZE) {
+                    leveldb_write(db, mdb->insert_options, batch, &err);
+                    leveldb_writebatch_clear(batch);
+                    num_batched = 0;
+                }
+            }
+            leveldb_iter_next(iter);
+        }
+        if (err == NULL) {
+            leveldb_iter_get_error(iter, &err);
         }
+        if (err == NULL && num_batched > 0) {
+            leveldb_write(db, mdb->insert_options, batch, &err);
+        }
+        leveldb_writebatch_destroy(batch);
+        leveldb_iter_destroy(iter);
     }
-    flag_sync_thread_finish = 1;
-    pthread_cond_broadcast(&(cv_sync));
-    pthread_mutex_unlock(&(mtx_sync));
 
-    return NULL;
+    if (err == NULL) {
+        metadb_put_key_format(mdb, "2", &err);
+    }
+    if (err != NULL) {
+        logMessage(LOG_ERR, __func__, "converting keys: %s", err);
+        free(err);
+        return -1;
+    }
+    mdb->key_format = METADB_KEY_FORMAT_V2;
+    logMessage(METADB_LOG, __func__, "converted %d keys", num_converted);
+    return num_converted;
 }
 
-void metadb_sync_init(struct MetaDB *mdb) {
-    stop_sync_thread = 0;
-    flag_sync_thread_finish = 0;
-    pthread_mutex_init(&(mtx_sync), NULL);
-    pthread_cond_init(&(cv_sync), NULL);
+// Pick the key format of an opened database.  New databases use version
+// 2 unless METADB_KEY_FORMAT is "1"; existing ones keep theirs unless it
+// is "2".  Returns "-1" on error.
+static
+int metadb_init_key_format(struct MetaDB *mdb, int created) {
+    char* err = NULL;
+    const char* wanted = getenv("METADB_KEY_FORMAT");
 
-    int ret;
-    pthread_t tid;
-    if ((ret = pthread_create(&tid, NULL, sync_thread, mdb))) {
-        logMessage(METADB_LOG, __func__,
-                   "pthread_create() error: %d", ret);
-        exit(1);
+    if (created) {
+        if (wanted != NULL && atoi(wanted) == METADB_KEY_FORMAT_V1) {
+            mdb->key_format = METADB_KEY_FORMAT_V1;
+            return 0;
+        }
+        metadb_put_key_format(mdb, "2", &err);
+        if (err != NULL) {
+            printf("metadb init (key format): %s\n", err);
+            free(err);
+            return -1;
+        }
+        mdb->key_format = METADB_KEY_FORMAT_V2;
+        return 0;
     }
-    if ((ret = pthread_detach(tid))) {
-        logMessage(METADB_LOG, __func__,
-                   "pthread_detach() error: %d", ret);
-        exit(1);
+
+    size_t vallen = 0;
+    char* val = leveldb_get(mdb->db, mdb->lookup_options,
+                            KEY_FORMAT_KEY, KEY_FORMAT_KEY_LEN,
+                            &vallen, &err);
+    if (err != NULL) {
+        printf("metadb init (key format): %s\n", err);
+        free(err);
+        return -1;
+    }
+    int converting = 0;
+    mdb->key_format = METADB_KEY_FORMAT_V1;
+    if (val != NULL) {
+        if (vallen == 1 && val[0] == '2') {
+            mdb->key_format = METADB_KEY_FORMAT_V2;
+        } else if (vallen == strlen(KEY_FORMAT_VAL_CONVERTING) &&
+                   memcmp(val, KEY_FORMAT_VAL_CONVERTING, vallen) == 0) {
+            converting = 1;
+        }
+        free(val);
     }
+    if (converting ||
+        (mdb->key_format == METADB_KEY_FORMAT_V1 &&
+         wanted != NULL && atoi(wanted) == METADB_KEY_FORMAT_V2)) {
+        if (metadb_convert_keys(mdb) < 0) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-void metadb_sync_destroy() {
-  pthread_mutex_lock(&(mtx_sync));
-  stop_sync_thread = 1;
-  pthread_cond_signal(&(cv_sync));
-  while (flag_sync_thread_finish == 0) {
-    pthread_cond_wait(&(cv_sync), &(mtx_sync));
-  }
-  pthread_mutex_unlock(&(mtx_sync));
+// Open the shards of the database whose shard 0 is open in mdb->db.  A new
+// database takes its shard count from METADB_SHARDS (default 1) and saves
+// it once every shard exists; an existing one keeps the saved count, or 1
+// if it predates shards.  All shards share the options, so they share the
+// block cache and the env.  Returns "-1" on error.
+static
+int metadb_open_shards(struct MetaDB *mdb, const char* mdb_name, int created) {
+    char* err = NULL;
+    int num_shards = 1;
+
+    if (created) {
+        const char* wanted = getenv("METADB_SHARDS");
+        if (wanted != NULL) {
+            num_shards = atoi(wanted);
+            if (num_shards < 1 || num_shards > METADB_MAX_SHARDS) {
+                logMessage(METADB_LOG, __func__,
+                           "ignoring METADB_SHARDS=%s", wanted);
+                num_shards = 1;
+            }
+        }
+    } else {
+        size_t vallen = 0;
+        char* val = leveldb_get(mdb->db, mdb->lookup_options,
+                                SHARD_COUNT_KEY, SHARD_COUNT_KEY_LEN,
+                                &vallen, &err);
+        if (err != NULL) {
+            printf("metadb init (shard count): %s\n", err);
+            free(err);
+            return -1;
+        }
+        if (val != NULL) {
+            char count[16];
+            if (vallen >= sizeof(count)) {
+                vallen = sizeof(count) - 1;
+            }
+            memcpy(count, val, vallen);
+            count[vallen] = '\0';
+            num_shards = atoi(count);
+            free(val);
+            if (num_shards < 1 || num_shards > METADB_MAX_SHARDS) {
+                printf("metadb init: bad shard count %s\n", count);
+                return -1;
+            }
+        }
+    }
+
+    mdb->shards = (leveldb_t **) malloc(num_shards * sizeof(leveldb_t*));
+    mdb->mtx_shards = (pthread_mutex_t *)
+        malloc(num_shards * sizeof(pthread_mutex_t));
+    mdb->shards[0] = mdb->db;
+    pthread_mutex_init(&(mdb->mtx_shards[0]), NULL);
+    mdb->num_shards = 1;
+
+    leveldb_options_set_create_if_missing(mdb->options, created);
+    while (mdb->num_shards < num_shards) {
+        char shard_name[PATH_MAX];
+        snprintf(shard_name, sizeof(shard_name), "%s-shard%d",
+                 mdb_name, mdb->num_shards);
+        leveldb_t* db = leveldb_open(mdb->options, shard_name, &err);
+        if (err != NULL) {
+            printf("metadb init (%s): %s\n", shard_name, err);
+            free(err);
+            return -1;
+        }
+        mdb->shards[mdb->num_shards] = db;
+        pthread_mutex_init(&(mdb->mtx_shards[mdb->num_shards]), NULL);
+        mdb->num_shards++;
+    }
 
-  pthread_mutex_destroy(&(mtx_sync));
-  pthread_cond_destroy(&(cv_sync));
+    if (created && num_shards > 1) {
+        char count[16];
+        snprintf(count, sizeof(count), "%d", num_shards);
+        leveldb_put(mdb->db, mdb->sync_insert_options,
+                    SHARD_COUNT_KEY, SHARD_COUNT_KEY_LEN,
+                    count, strlen(count), &err);
+        if (err != NULL) {
+            printf("metadb init (shard count): %s\n", err);
+            free(err);
+            return -1;
+        }
+    }
+    return 0;
 }
 
-char* metadb_get_metric(struct MetaDB *mdb) {
-  return leveldb_property_value(mdb->db, "leveldb.stats");
+// Open the DB of directory mapping records, "<name>-dirs".  It has its own
+// block cache, big enough to keep it resident, and small memtables and
+// blocks suited to point lookups.  Returns "-1" on error.
+static
+int metadb_open_dir_db(struct MetaDB *mdb, const char* mdb_name) {
+    char* err = NULL;
+    char dir_db_name[PATH_MAX];
+
+    mdb->dir_cache = leveldb_cache_create_lru(DEFAULT_DIR_DB_CACHE_SIZE);
+    mdb->dir_options = leveldb_options_create();
+    leveldb_options_set_comparator(mdb->dir_options, mdb->cmp);
+    leveldb_options_set_merge_operator(mdb->dir_options, mdb->merge_op);
+    leveldb_options_set_cache(mdb->dir_options, mdb->dir_cache);
+    leveldb_options_set_filter_policy(mdb->dir_options, mdb->filter_policy);
+    leveldb_options_set_env(mdb->dir_options, mdb->env);
+    leveldb_options_set_create_if_missing(mdb->dir_options, 1);
+    leveldb_options_set_info_log(mdb->dir_options, NULL);
+    leveldb_options_set_write_buffer_size(mdb->dir_options,
+                                          DEFAULT_DIR_WRITE_BUFFER_SIZE);
+    leveldb_options_set_max_open_files(mdb->dir_options,
+                                       DEFAULT_MAX_OPEN_FILES);
+    leveldb_options_set_block_size(mdb->dir_options, DEFAULT_DIR_BLOCK_SIZE);
+    leveldb_options_set_compression(mdb->dir_options, leveldb_no_compression);
+
+    snprintf(dir_db_name, sizeof(dir_db_name), "%s-dirs", mdb_name);
+    mdb->dir_db = leveldb_open(mdb->dir_options, dir_db_name, &err);
+    if (err != NULL) {
+        printf("metadb init (%s): %s\n", dir_db_name, err);
+        free(err);
+        mdb->dir_db = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Databases from before the directory DB kept the mapping records in the
+// shards.  Move them over once; an interrupted move is simply repeated,
+// since the marker is only written at the end.  Returns "-1" on error.
+static
+int metadb_move_dir_records(struct MetaDB *mdb, int created) {
+    char* err = NULL;
+    int num_moved = 0;
+
+    if (!created) {
+        size_t vallen = 0;
+        char* val = leveldb_get(mdb->db, mdb->lookup_options,
+                                DIR_DB_KEY, DIR_DB_KEY_LEN, &vallen, &err);
+        if (val != NULL) {
+            free(val);
+            return 0;
+        }
+    }
+
+    int shard;
+    for (shard = 0; !created && shard < mdb->num_shards && err == NULL;
+         shard++) {
+        leveldb_t* db = mdb->shards[shard];
+        leveldb_iterator_t* iter =
+            leveldb_create_iterator(db, mdb->scan_options);
+        leveldb_writebatch_t* dir_batch = leveldb_writebatch_create();
+        leveldb_writebatch_t* del_batch = leveldb_writebatch_create();
+        int num_batched = 0;
+        leveldb_iter_seek_to_first(iter);
+        while (err == NULL) {
+            int valid = leveldb_iter_valid(iter);
+            if (valid) {
+                size_t klen, vlen;
+                const char* key = leveldb_iter_key(iter, &klen);
+                metadb_inode_t parent_id;
+                long int partition_id;
+                if (parse_meta_obj_key_ids(mdb->key_format, key, klen,
+                                           &parent_id, &partition_id) &&
+                    partition_id == 0xFFFFFFFF) {
+                    const char* val = leveldb_iter_value(iter, &vlen);
+                    leveldb_writebatch_put(dir_batch, key, klen, val, vlen);
+                    leveldb_writebatch_delete(del_batch, key, klen);
+                    ++num_batched;
+                    ++num_moved;
+                }
+                leveldb_iter_next(iter);
+            } else {
+                leveldb_iter_get_error(iter, &err);
+            }
+            if (num_batched > 0 &&
+                (!valid || num_batched >= DEFAULT_MAX_BATCH_SIZE)) {
+                // Make the copies durable before the originals go
+                if (err == NULL) {
+                    leveldb_write(mdb->dir_db, mdb->sync_insert_options,
+                                  dir_batch, &err);
+                }
+                if (err == NULL) {
+                    leveldb_write(db, mdb->insert_options, del_batch, &err);
+                }
+                leveldb_writebatch_clear(dir_batch);
+                leveldb_writebatch_clear(del_batch);
+                num_batched = 0;
+            }
+            if (!valid) {
+                break;
+            }
+        }
+        leveldb_writebatch_destroy(dir_batch);
+        leveldb_writebatch_destroy(del_batch);
+        leveldb_iter_destroy(iter);
+    }
+
+    if (err == NULL) {
+        leveldb_put(mdb->db, mdb->sync_insert_options,
+                    DIR_DB_KEY, DIR_DB_KEY_LEN, "1", 1, &err);
+    }
+    if (err != NULL) {
+        printf("metadb init (directory records): %s\n", err);
+        free(err);
+        return -1;
+    }
+    if (num_moved > 0) {
+        logMessage(METADB_LOG, __func__,
+                   "moved %d directory records", num_moved);
+    }
+    return 0;
 }
 
 // Returns "0" if a new LDB is created successfully, "1" if an existing LDB is
@@ -370,20 +1377,58 @@ int metadb_init(struct MetaDB *mdb, const char *mdb_name,
 {
     char* err = NULL;
 
+    // Benchmarks may set METADB_LATENCY_ENV (e.g. to "hdfs") to run on
+    // local disk with table files delayed like remote storage.
+    const char* latency_spec = getenv("METADB_LATENCY_ENV");
+
+    mdb->pcache = NULL;
+    mdb->env = NULL;
+    mdb->use_hdfs = 0;
     if (hdfsServerIP != NULL) {
       mdb->env = leveldb_create_hdfs_env(hdfsServerIP, hdfsServerPort);
       mdb->use_hdfs = 1;
+    } else if (latency_spec != NULL) {
+      mdb->env = leveldb_create_latency_env(latency_spec, &err);
+      if (err != NULL) {
+        logMessage(METADB_LOG, __func__,
+                   "ignoring METADB_LATENCY_ENV: %s", err);
+        free(err);
+        err = NULL;
+      }
+    }
+    if (mdb->env != NULL) {
+      // Keep blocks of remote (or simulated remote) tables on local disk
+      char pcache_dir[PATH_MAX];
+      snprintf(pcache_dir, sizeof(pcache_dir), "%s_pcache", mdb_name);
+      mdb->pcache = leveldb_pcache_create_local(pcache_dir,
+                                                DEFAULT_PCACHE_SIZE, &err);
+      if (err != NULL) {
+        logMessage(METADB_LOG, __func__,
+                   "persistent cache disabled: %s", err);
+        free(err);
+        err = NULL;
+      }
     } else {
       mdb->env = leveldb_create_default_env();
-      mdb->use_hdfs = 0;
     }
     mdb->server_id = server_id;
+    mdb->key_format = METADB_KEY_FORMAT_V1;
     mdb->cache = leveldb_cache_create_lru(DEFAULT_LEVELDB_CACHE_SIZE);
-    mdb->cmp = leveldb_comparator_create(NULL, CmpDestroy, CmpCompare, CmpName);
+    // Orders keys like the C comparator that existing databases were
+    // created with, under its name "foo"
+    mdb->cmp = leveldb_comparator_create_builtin("leveldb.FixedWidthComparator",
+                                                 "foo");
+    mdb->merge_op = leveldb_mergeoperator_create(NULL, metadb_merge_destroy,
+                                                 metadb_merge_full,
+                                                 metadb_merge_name);
 
     mdb->options = leveldb_options_create();
     leveldb_options_set_comparator(mdb->options, mdb->cmp);
+    leveldb_options_set_merge_operator(mdb->options, mdb->merge_op);
     leveldb_options_set_cache(mdb->options, mdb->cache);
+    if (mdb->pcache != NULL) {
+      leveldb_options_set_persistent_cache(mdb->options, mdb->pcache);
+    }
     leveldb_options_set_env(mdb->options, mdb->env);
     leveldb_options_set_create_if_missing(mdb->options, 0);
     leveldb_options_set_info_log(mdb->options, NULL);
@@ -392,11 +1437,13 @@ int metadb_init(struct MetaDB *mdb, const char *mdb_name,
     leveldb_options_set_max_open_files(mdb->options, DEFAULT_MAX_OPEN_FILES);
     leveldb_options_set_block_size(mdb->options, DEFAULT_BLOCK_SIZE);
     leveldb_options_set_compression(mdb->options, leveldb_no_compression);
-
-    /*
-    leveldb_options_set_filter_policy(mdb->options,
-                        leveldb_filterpolicy_create_bloom(14));
-    */
+    leveldb_options_set_recovery_threads(mdb->options,
+                                         DEFAULT_RECOVERY_THREADS);
+    leveldb_options_set_recycle_log_file_num(mdb->options,
+                                             DEFAULT_RECYCLE_LOG_FILES);
+    mdb->filter_policy =
+        leveldb_filterpolicy_create_bloom(DEFAULT_BLOOM_BITS_PER_KEY);
+    leveldb_options_set_filter_policy(mdb->options, mdb->filter_policy);
 
     mdb->lookup_options = leveldb_readoptions_create();
     leveldb_readoptions_set_fill_cache(mdb->lookup_options, 1);
@@ -417,8 +1464,8 @@ int metadb_init(struct MetaDB *mdb, const char *mdb_name,
 
     pthread_rwlock_init(&(mdb->rwlock_extract), NULL);
     pthread_mutex_init(&(mdb->mtx_bulkload), NULL);
-    pthread_mutex_init(&(mdb->mtx_leveldb), NULL);
     pthread_mutex_init(&(mdb->mtx_extract), NULL);
+    pthread_mutex_init(&(mdb->mtx_inode_lease), NULL);
 
     if (lstat("./", &(INIT_STATBUF)) < 0) {
        logMessage(METADB_LOG, __func__, "Getting init statbuf failed");
@@ -427,6 +1474,12 @@ int metadb_init(struct MetaDB *mdb, const char *mdb_name,
 
     int ret = 0;
 
+    mdb->shards = NULL;
+    mdb->mtx_shards = NULL;
+    mdb->num_shards = 0;
+    mdb->dir_db = NULL;
+    mdb->dir_options = NULL;
+    mdb->dir_cache = NULL;
     mdb->db = leveldb_open(mdb->options, mdb_name, &err);
     if (err != NULL) {
         if (strstr(err, "(create_if_missing is false)") != NULL) {
@@ -438,26 +1491,52 @@ int metadb_init(struct MetaDB *mdb, const char *mdb_name,
                 ret = -1;
                 printf("metadb init reopen: %s\n", err);
             } else {
-                metadb_set_init_inode_count(mdb, server_id);
-                metadb_save_inode_count(mdb, &err);
                 ret = 1;
+                if (metadb_open_shards(mdb, mdb_name, 1) < 0 ||
+                    metadb_open_dir_db(mdb, mdb_name) < 0 ||
+                    metadb_init_key_format(mdb, 1) < 0 ||
+                    metadb_move_dir_records(mdb, 1) < 0 ||
+                    metadb_init_inode_lease(mdb, server_id) < 0) {
+                    ret = -1;
+                }
             }
         } else {
             printf("metadb init: %s\n", err);
             ret = -1;
         }
     } else {
+      char* recovery = leveldb_property_value(mdb->db, "leveldb.recovery");
+      if (recovery != NULL) {
+        logMessage(METADB_LOG, __func__, "Recovery: %s", recovery);
+        free(recovery);
+      }
+
+      if (metadb_open_shards(mdb, mdb_name, 0) < 0 ||
+          metadb_open_dir_db(mdb, mdb_name) < 0 ||
+          metadb_init_key_format(mdb, 0) < 0 ||
+          metadb_move_dir_records(mdb, 0) < 0) {
+        ret = -1;
+      }
+
       char* inode_count_str;
       size_t vallen = 0;
       inode_count_str = leveldb_get(mdb->db, mdb->lookup_options,
                                     INODE_COUNT_KEY, INODE_COUNT_KEY_LEN,
                                     &vallen, &err);
+      metadb_inode_t inode_count;
       if (err == NULL && vallen == INODE_COUNT_VAL_LEN) {
-        sscanf(inode_count_str, "%lu", &(mdb->inode_count));
+        // Numbers up to the end of the last lease may be in use
+        sscanf(inode_count_str, "%lu", &inode_count);
         free(inode_count_str);
       } else {
+        // Databases written before leases did not save the count
         printf("metadb init (cannot find inode count): %s \n", err);
-        mdb->inode_count = server_id + ((10000)<<9);
+        free(err);
+        err = NULL;
+        inode_count = server_id + ((10000)<<9);
+      }
+      if (metadb_init_inode_lease(mdb, inode_count) < 0) {
+        ret = -1;
       }
     }
 
@@ -465,19 +1544,44 @@ int metadb_init(struct MetaDB *mdb, const char *mdb_name,
                "Init metadb: server_id[%d] inode_count[%d]",
               server_id, mdb->inode_count);
 //    metadb_log_init(mdb);
-    metadb_sync_init(mdb);
-
     return ret;
 }
 
 int metadb_close(struct MetaDB *mdb) {
 //    metadb_log_destroy();
-    metadb_sync_destroy();
 
+    if (mdb->dir_db != NULL) {
+        leveldb_close(mdb->dir_db);
+        mdb->dir_db = NULL;
+    }
+    if (mdb->dir_options != NULL) {
+        leveldb_options_destroy(mdb->dir_options);
+        leveldb_cache_destroy(mdb->dir_cache);
+        mdb->dir_options = NULL;
+        mdb->dir_cache = NULL;
+    }
+    int i;
+    for (i = mdb->num_shards - 1; i >= 1; i--) {
+        leveldb_close(mdb->shards[i]);
+    }
+    for (i = 0; i < mdb->num_shards; i++) {
+        pthread_mutex_destroy(&(mdb->mtx_shards[i]));
+    }
+    free(mdb->shards);
+    free(mdb->mtx_shards);
+    mdb->shards = NULL;
+    mdb->mtx_shards = NULL;
+    mdb->num_shards = 0;
     leveldb_close(mdb->db);
     mdb->db = NULL;
     leveldb_options_destroy(mdb->options);
+    leveldb_mergeoperator_destroy(mdb->merge_op);
     leveldb_cache_destroy(mdb->cache);
+    leveldb_filterpolicy_destroy(mdb->filter_policy);
+    if (mdb->pcache != NULL) {
+      leveldb_pcache_destroy(mdb->pcache);
+      mdb->pcache = NULL;
+    }
     leveldb_env_destroy(mdb->env);
     leveldb_readoptions_destroy(mdb->lookup_options);
     leveldb_readoptions_destroy(mdb->scan_options);
@@ -487,8 +1591,8 @@ int metadb_close(struct MetaDB *mdb) {
 
     pthread_rwlock_destroy(&(mdb->rwlock_extract));
     pthread_mutex_destroy(&(mdb->mtx_bulkload));
-    pthread_mutex_destroy(&(mdb->mtx_leveldb));
     pthread_mutex_destroy(&(mdb->mtx_extract));
+    pthread_mutex_destroy(&(mdb->mtx_inode_lease));
 
     return 0;
 }
@@ -499,32 +1603,33 @@ int metadb_create(struct MetaDB *mdb,
                   const char *path,
                   const char *realpath)
 {
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
     int ret = 0;
-    metadb_key_t mobj_key;
+    char mobj_key[METADB_MAX_KEY_LEN];
     metadb_val_t mobj_val;
     mobj_val.value = NULL;
 
     char* err = NULL;
 
-    init_meta_obj_key(&mobj_key, dir_id, partition_id, path);
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
 
     logMessage(METADB_LOG, __func__, "create(%s) in (partition=%d,dirid=%d): (%d, %08x)",
                path, partition_id, dir_id, mobj_val.size, mobj_val.value);
 
     //ACQUIRE_RWLOCK_READ(&(mdb->rwlock_extract), "metadb_create(%s)", path);
 
-    int exists = leveldb_exists(mdb->db, mdb->lookup_options,
-                                 (const char*) &mobj_key, METADB_KEY_LEN, &err);
-
-    if (!exists) {
-        mobj_val = init_meta_val(0,
+    mobj_val = init_meta_val(0,
                              strlen(path), path,
                              strlen(realpath), realpath,
                              0, NULL);
-        leveldb_put(mdb->db, mdb->insert_options,
-                (const char*) &mobj_key, METADB_KEY_LEN,
-                mobj_val.value, mobj_val.size, &err);
-    }
+    leveldb_writebatch_t* batch = leveldb_writebatch_create();
+    leveldb_writebatch_put(batch, mobj_key, key_len,
+                           mobj_val.value, mobj_val.size);
+    metadb_batch_add_count(mdb, batch, dir_id, partition_id, 1);
+    int inserted = leveldb_write_if_absent(db, mdb->insert_options,
+                                           mobj_key, key_len, batch, &err);
+    leveldb_writebatch_destroy(batch);
 
     //RELEASE_RWLOCK(&(mdb->rwlock_extract), "metadb_create(%s)", path);
 
@@ -533,6 +1638,8 @@ int metadb_create(struct MetaDB *mdb,
     if (err != NULL) {
       printf("%s\n", err);
       ret = -1;
+    } else if (!inserted) {
+      ret = EEXIST;
     }
 
     return ret;
@@ -543,38 +1650,43 @@ int metadb_create_dir(struct MetaDB *mdb,
                       const char *path,
                       metadb_val_dir_t* dir_mapping)
 {
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
     int ret = 0;
-    metadb_key_t mobj_key;
+    char mobj_key[METADB_MAX_KEY_LEN];
     metadb_val_t mobj_val;
     mobj_val.value = NULL;
     char* err = NULL;
 
     metadb_inode_t inode_id = dir_mapping->id;
-    init_meta_obj_key(&mobj_key, dir_id, partition_id, path);
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
 
     logMessage(METADB_LOG, __func__, "create_dir(%s) in (partition=%d,dirid=%d): (%d, %08x)",
                path, partition_id, dir_id, mobj_val.size, mobj_val.value);
 
-    int exists = leveldb_exists(mdb->db, mdb->lookup_options,
-                                 (const char*) &mobj_key, METADB_KEY_LEN, &err);
-
-    if (!exists) {
-        if (path != NULL) {
-            mobj_val = init_dir_val(inode_id,
-                                    strlen(path), path, dir_mapping);
-        } else {
-            mobj_val = init_dir_val(inode_id, 0, NULL, dir_mapping);
-        }
+    if (path != NULL) {
+        mobj_val = init_dir_val(inode_id,
+                                strlen(path), path, dir_mapping);
+    } else {
+        mobj_val = init_dir_val(inode_id, 0, NULL, dir_mapping);
+    }
 
-        leveldb_put(mdb->db, mdb->insert_options,
-                (const char*) &mobj_key, METADB_KEY_LEN,
-                mobj_val.value, mobj_val.size, &err);
+    leveldb_writebatch_t* batch = leveldb_writebatch_create();
+    leveldb_writebatch_put(batch, mobj_key, key_len,
+                           mobj_val.value, mobj_val.size);
+    if (path != NULL) {
+        metadb_batch_add_count(mdb, batch, dir_id, partition_id, 1);
     }
+    int inserted = leveldb_write_if_absent(db, mdb->insert_options,
+                                           mobj_key, key_len, batch, &err);
+    leveldb_writebatch_destroy(batch);
 
     free_metadb_val(&mobj_val);
 
     if (err != NULL)
       ret = -1;
+    else if (!inserted && path != NULL)
+      ret = EEXIST;
 
     return ret;
 }
@@ -584,23 +1696,38 @@ int metadb_insert_inode(struct MetaDB *mdb,
                       const char *path,
                       char* data, int size)
 {
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
     int ret = 0;
-    metadb_key_t mobj_key;
+    char mobj_key[METADB_MAX_KEY_LEN];
     char* err = NULL;
 
-    init_meta_obj_key(&mobj_key, dir_id, partition_id, path);
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
 
-    int exists = leveldb_exists(mdb->db, mdb->lookup_options,
-                                 (const char*) &mobj_key, METADB_KEY_LEN, &err);
+    // The file data following the header goes into chunks
+    metadb_val_t mobj_val;
+    mobj_val.size = size;
+    mobj_val.value = data;
+    size_t data_len = 0;
+    const char* file_data = metadb_inline_data(&mobj_val, &data_len);
 
-    if (!exists) {
-        leveldb_put(mdb->db, mdb->insert_options,
-                    (const char*) &mobj_key, METADB_KEY_LEN,
-                    data, size, &err);
+    // The entry and its chunks are written together, or not at all
+    leveldb_writebatch_t* batch = leveldb_writebatch_create();
+    leveldb_writebatch_put(batch, mobj_key, key_len, data, size - data_len);
+    if (file_data != NULL) {
+        metadb_put_chunks(batch, mobj_key, key_len, file_data, data_len);
     }
+    metadb_batch_add_count(mdb, batch, dir_id, partition_id, 1);
+    int inserted = leveldb_write_if_absent(db, mdb->insert_options,
+                                           mobj_key, key_len, batch, &err);
+    leveldb_writebatch_destroy(batch);
 
-    if (err != NULL)
+    if (err != NULL) {
+      free(err);
       ret = -1;
+    } else if (!inserted) {
+      ret = EEXIST;
+    }
 
     return ret;
 }
@@ -611,7 +1738,8 @@ metadb_val_t metadb_lookup_internal(struct MetaDB *mdb,
                                     const metadb_inode_t dir_id,
                                     const int partition_id,
                                     const char *path) {
-    metadb_key_t mobj_key;
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
+    char mobj_key[METADB_MAX_KEY_LEN];
     metadb_val_t mobj_val;
     char* err = NULL;
 
@@ -619,10 +1747,11 @@ metadb_val_t metadb_lookup_internal(struct MetaDB *mdb,
                "lookup_internal(%s) in (partition=%d,dirid=%ld)",
                path, partition_id, dir_id);
 
-    init_meta_obj_key(&mobj_key, dir_id, partition_id, path);
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
 
-    mobj_val.value = leveldb_get(mdb->db, mdb->lookup_options,
-                                 (const char*) &mobj_key, METADB_KEY_LEN,
+    mobj_val.value = leveldb_get(db, mdb->lookup_options,
+                                 mobj_key, key_len,
                                  &mobj_val.size, &err);
 
     if (err != NULL || mobj_val.value == NULL) {
@@ -648,9 +1777,10 @@ int metadb_update_internal(struct MetaDB *mdb,
                            const char *path,
                            update_func_t update_func,
                            void* arg1) {
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
     int ret;
 
-    metadb_key_t mobj_key;
+    char mobj_key[METADB_MAX_KEY_LEN];
     metadb_val_t mobj_val;
     char* err = NULL;
 
@@ -658,18 +1788,19 @@ int metadb_update_internal(struct MetaDB *mdb,
                "update_internal(%s) in (partition=%d,dirid=%ld)",
                path, partition_id, dir_id);
 
-    init_meta_obj_key(&mobj_key, dir_id, partition_id, path);
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
 
-    mobj_val.value = leveldb_get(mdb->db, mdb->lookup_options,
-                                (const char*) &mobj_key, METADB_KEY_LEN,
+    mobj_val.value = leveldb_get(db, mdb->lookup_options,
+                                mobj_key, key_len,
                                 &mobj_val.size, &err);
 
     if ((err == NULL) & (mobj_val.size != 0)) {
         reconstruct_mobj_value(&mobj_val);
         ret = update_func(&mobj_val, arg1);
         if (ret >= 0) {
-            leveldb_put(mdb->db, mdb->insert_options,
-                        (const char*) &mobj_key, METADB_KEY_LEN,
+            leveldb_put(db, mdb->insert_options,
+                        mobj_key, key_len,
                         mobj_val.value, mobj_val.size, &err);
             if (err != NULL) {
                 logMessage(METADB_LOG, __func__,
@@ -721,14 +1852,32 @@ int metadb_get_val(struct MetaDB *mdb,
     mobj_val = metadb_lookup_internal(mdb, dir_id, partition_id, path);
 
     if (mobj_val.size != 0) {
+        metadb_val_header_t* mobj = (metadb_val_header_t *) mobj_val.value;
+        size_t header_size = metadb_header_size(&mobj_val);
+        if (metadb_has_chunks(&mobj_val)) {
+            // Append the file data from its chunks
+            char mobj_key[METADB_MAX_KEY_LEN];
+            size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                               dir_id, partition_id, path);
+            mobj_val.size = header_size + mobj->statbuf.st_size;
+            mobj_val.value = (char *) realloc(mobj_val.value, mobj_val.size);
+            ret = metadb_read_chunks(mdb, mobj_key, key_len,
+                                     mobj_val.value + header_size,
+                                     0, mobj_val.size - header_size);
+        }
+    } else {
+        ret = ENOENT;
+    }
+
+    if (ret == 0) {
         *buf_len = mobj_val.size;
         *buf = mobj_val.value;
         logMessage(METADB_LOG, __func__, "lookup found entry(%s).", path);
     } else {
         logMessage(METADB_LOG, __func__, "entry(%s) not found.", path);
+        free_metadb_val(&mobj_val);
         *buf_len = 0;
         *buf = NULL;
-        ret = ENOENT;
     }
 
     return ret;
@@ -738,9 +1887,22 @@ int metadb_get_val(struct MetaDB *mdb,
 int metadb_get_file(struct MetaDB *mdb,
                     const metadb_inode_t dir_id, const int partition_id,
                     const char *path, int *state, char* buf, int *buf_len)
+{
+    return metadb_read_file(mdb, dir_id, partition_id, path,
+                            state, buf, buf_len, 0, INT_MAX);
+}
+
+int metadb_read_file(struct MetaDB *mdb,
+                     const metadb_inode_t dir_id, const int partition_id,
+                     const char *path, int *state, char* buf, int *buf_len,
+                     int offset, int size)
 {
     int ret = 0;
+    char mobj_key[METADB_MAX_KEY_LEN];
     metadb_val_t mobj_val;
+
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
     mobj_val = metadb_lookup_internal(mdb, dir_id, partition_id, path);
 
     if (mobj_val.size != 0) {
@@ -755,10 +1917,17 @@ int metadb_get_file(struct MetaDB *mdb,
             buf[mobj->realpath_len] = '\0';
         } else {
             *state = RPC_LEVELDB_FILE_IN_DB;
-            *buf_len = mobj->statbuf.st_size;
-            char* mobj_data = (char*) mobj + sizeof(metadb_val_header_t)
-                            + mobj->objname_len + mobj->realpath_len + 2;
-            memcpy(buf, mobj_data, *buf_len);
+            *buf_len = 0;
+            if (offset >= 0 && offset < mobj->statbuf.st_size) {
+                if (size > mobj->statbuf.st_size - offset) {
+                    size = mobj->statbuf.st_size - offset;
+                }
+                ret = metadb_read_data(mdb, mobj_key, key_len, &mobj_val,
+                                       buf, offset, size);
+                if (ret == 0) {
+                    *buf_len = size;
+                }
+            }
         }
     } else {
         logMessage(METADB_LOG, __func__, "readpath: entry(%s) not found.", path);
@@ -797,49 +1966,105 @@ int metadb_get_state(struct MetaDB *mdb,
     return ret;
 }
 
-typedef struct {
-    const char* buf;
-    int buf_len;
-    int offset;
-} metadb_write_data_t;
-
-int metadb_write_file_handler(metadb_val_t* mobj_val, void* arg1) {
-    metadb_write_data_t* data = (metadb_write_data_t *) arg1;
-    metadb_val_header_t* mobj = (metadb_val_header_t *) mobj_val->value;
-    if (data->offset + data->buf_len <= mobj->statbuf.st_size) {
-          char* mobj_data = (char*) mobj + sizeof(metadb_val_header_t)
-                          + mobj->objname_len + mobj->realpath_len + 2;
-          memcpy(mobj_data + data->offset, data->buf, data->buf_len);
-    } else {
-          size_t new_file_size = data->offset + data->buf_len;
-          size_t new_size = mobj_val->size
-                          + new_file_size - mobj->statbuf.st_size;
-          char* new_value = (char *) malloc(new_size);
-          mobj->statbuf.st_size = new_file_size;
-          memcpy(new_value, mobj_val->value, mobj_val->size);
-          char* mobj_data = new_value + sizeof(metadb_val_header_t)
-                          + mobj->objname_len + mobj->realpath_len + 2;
-          memcpy(mobj_data + data->offset, data->buf, data->buf_len);
-          free_metadb_val(mobj_val);
-          mobj_val->value = new_value;
-          mobj_val->size = new_size;
-    }
-    logMessage(METADB_LOG, __func__, "update_size:%d", data->buf_len);
-    return data->buf_len;
-}
-
+// Writes only the chunks that the range touches; partly written chunks
+// are read and rewritten.  The size grows through a merge, so concurrent
+// attribute updates are kept.  The first write to a value from before
+// chunks existed moves all of its data into chunks.
 int metadb_write_file(struct MetaDB *mdb,
                       const metadb_inode_t dir_id,
                       const int partition_id,
                       const char* objname,
                       const char* buf, int buf_len, int offset) {
-    metadb_write_data_t data;
-    data.buf = buf;
-    data.buf_len = buf_len;
-    data.offset = offset;
-    return metadb_update_internal(mdb, dir_id, partition_id, objname,
-                                  metadb_write_file_handler,
-                                  (void *) &data);
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
+    char mobj_key[METADB_MAX_KEY_LEN];
+    char chunk_key[METADB_MAX_CHUNK_KEY_LEN];
+    char chunk[METADB_CHUNK_SIZE];
+    metadb_val_t mobj_val;
+    char* err = NULL;
+    int ret = buf_len;
+
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, objname);
+    mobj_val = metadb_lookup_internal(mdb, dir_id, partition_id, objname);
+    if (mobj_val.size == 0) {
+        return ENOENT;
+    }
+
+    metadb_val_header_t* mobj = (metadb_val_header_t *) mobj_val.value;
+    size_t old_size = mobj->statbuf.st_size;
+    size_t end = (buf_len > 0) ? (size_t) offset + buf_len : 0;
+    size_t inline_len = 0;
+    const char* inline_data = metadb_inline_data(&mobj_val, &inline_len);
+
+    leveldb_writebatch_t* batch = leveldb_writebatch_create();
+    if (inline_data != NULL) {
+        metadb_put_chunks(batch, mobj_key, key_len, inline_data, inline_len);
+    }
+
+    size_t chunk_offset;
+    for (chunk_offset = offset - offset % METADB_CHUNK_SIZE;
+         chunk_offset < end;
+         chunk_offset += METADB_CHUNK_SIZE) {
+        size_t from = ((size_t) offset > chunk_offset) ?
+                      offset - chunk_offset : 0;
+        size_t to = (end < chunk_offset + METADB_CHUNK_SIZE) ?
+                    end - chunk_offset : METADB_CHUNK_SIZE;
+        // Bytes of the chunk that are part of the file
+        size_t old_len = 0;
+        if (chunk_offset < old_size) {
+            old_len = old_size - chunk_offset;
+            if (old_len > METADB_CHUNK_SIZE) {
+                old_len = METADB_CHUNK_SIZE;
+            }
+        }
+        if (from > 0 || to < old_len) {
+            if (metadb_read_data(mdb, mobj_key, key_len, &mobj_val,
+                                 chunk, chunk_offset, old_len) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+        if (from > old_len) {
+            memset(chunk + old_len, 0, from - old_len);
+        }
+        memcpy(chunk + from, buf + (chunk_offset + from - offset), to - from);
+        size_t chunk_key_len = build_meta_chunk_key(chunk_key,
+                                   mobj_key, key_len,
+                                   chunk_offset / METADB_CHUNK_SIZE);
+        leveldb_writebatch_put(batch, chunk_key, chunk_key_len,
+                               chunk, (to > old_len) ? to : old_len);
+    }
+
+    if (ret >= 0 && inline_data != NULL) {
+        // Keep only the attributes in the object value
+        if (end > old_size) {
+            mobj->statbuf.st_size = end;
+        }
+        leveldb_writebatch_put(batch, mobj_key, key_len,
+                               mobj_val.value, mobj_val.size - inline_len);
+    } else if (ret >= 0 && end > old_size) {
+        char operand[1 + sizeof(metadb_merge_arg_t)];
+        metadb_merge_arg_t arg;
+        arg.size = end;
+        size_t operand_len = metadb_merge_operand(METADB_MERGE_EXTEND, &arg,
+                                                  operand);
+        leveldb_writebatch_merge(batch, mobj_key, key_len,
+                                 operand, operand_len);
+    }
+    if (ret >= 0) {
+        leveldb_write(db, mdb->insert_options, batch, &err);
+        if (err != NULL) {
+            logMessage(METADB_LOG, __func__,
+                       "write_file(%s) failed (%s).", objname, err);
+            free(err);
+            ret = -1;
+        }
+    }
+    leveldb_writebatch_destroy(batch);
+    free_metadb_val(&mobj_val);
+
+    logMessage(METADB_LOG, __func__, "update_size:%d", buf_len);
+    return ret;
 }
 
 int metadb_write_link_handler(metadb_val_t* mobj_val, void* arg1) {
@@ -865,15 +2090,28 @@ int metadb_write_link(struct MetaDB *mdb,
                       const int partition_id,
                       const char* objname,
                       const char* pathname) {
-    return metadb_update_internal(mdb, dir_id, partition_id, objname,
-                                  metadb_write_link_handler,
-                                  (void *) pathname);
-}
-
-int metadb_setattr_handler(metadb_val_t* mobj_val, void* arg1) {
-    metadb_val_header_t* mobj = (metadb_val_header_t *) mobj_val->value;
-    mobj->statbuf = *((struct stat *) arg1);
-    return 0;
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
+    int ret = metadb_update_internal(mdb, dir_id, partition_id, objname,
+                                     metadb_write_link_handler,
+                                     (void *) pathname);
+    if (ret == 0) {
+        // The data now lives in the file system
+        char mobj_key[METADB_MAX_KEY_LEN];
+        char* err = NULL;
+        size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                           dir_id, partition_id, objname);
+        leveldb_writebatch_t* batch = leveldb_writebatch_create();
+        ret = metadb_drop_chunks(mdb, batch, mobj_key, key_len, 0, NULL);
+        if (ret == 0) {
+            leveldb_write(db, mdb->insert_options, batch, &err);
+        }
+        if (err != NULL) {
+            free(err);
+            ret = -1;
+        }
+        leveldb_writebatch_destroy(batch);
+    }
+    return ret;
 }
 
 int metadb_setattr(struct MetaDB *mdb,
@@ -881,9 +2119,10 @@ int metadb_setattr(struct MetaDB *mdb,
                    const int partition_id,
                    const char* objname,
                    const struct stat* statbuf) {
-    return metadb_update_internal(mdb, dir_id, partition_id, objname,
-                                  metadb_setattr_handler,
-                                  (void *) statbuf);
+    metadb_merge_arg_t arg;
+    arg.statbuf = *statbuf;
+    return metadb_merge_update(mdb, dir_id, partition_id, objname,
+                               METADB_MERGE_SETATTR, &arg);
 }
 
 
@@ -912,46 +2151,97 @@ int metadb_read_bitmap(struct MetaDB *mdb,
     return ret;
 }
 
-int metadb_write_bitmap_handler(metadb_val_t* mobj_val, void* arg1) {
-    struct giga_mapping_t* mobj_mapping =
-        (struct giga_mapping_t*) ( mobj_val->value
-                                 + metadb_header_size(mobj_val));
-    *mobj_mapping = *((struct giga_mapping_t *) arg1);
-    return 0;
-}
-
 int metadb_write_bitmap(struct MetaDB *mdb,
                         const metadb_inode_t dir_id,
                         const int partition_id,
                         const char* path,
                         struct giga_mapping_t* mapping) {
-    metadb_update_internal(mdb, dir_id, partition_id, path,
-                                  metadb_write_bitmap_handler,
-                                  (void *) mapping);
-    return 0;
-}
-
-typedef struct {
-  mode_t new_mode;
-} chmod_update_t;
-
-int metadb_chmod_handler(metadb_val_t* mobj_val, void* arg1) {
-    metadb_val_header_t* header =
-        (metadb_val_header_t*) mobj_val->value;
-    header->statbuf.st_mode = ((chmod_update_t *) arg1)->new_mode;
-    return 0;
+    metadb_merge_arg_t arg;
+    arg.mapping = *mapping;
+    return metadb_merge_update(mdb, dir_id, partition_id, path,
+                               METADB_MERGE_BITMAP, &arg);
 }
 
+/*
+ * chmod, utimes and set_size do not read the object, so they succeed
+ * even if it does not exist; the update then has no effect.
+ */
 int metadb_chmod(struct MetaDB *mdb,
                  const metadb_inode_t dir_id,
                  const int partition_id,
                  const char* path,
                  mode_t new_mode) {
-    chmod_update_t update;
-    update.new_mode = new_mode;
-    return metadb_update_internal(mdb, dir_id, partition_id, path,
-                                  metadb_chmod_handler,
-                                  (void *) &update);
+    metadb_merge_arg_t arg;
+    arg.mode = new_mode;
+    return metadb_merge_update(mdb, dir_id, partition_id, path,
+                               METADB_MERGE_CHMOD, &arg);
+}
+
+int metadb_utimes(struct MetaDB *mdb,
+                  const metadb_inode_t dir_id,
+                  const int partition_id,
+                  const char* path,
+                  time_t atime, time_t mtime) {
+    metadb_merge_arg_t arg;
+    arg.times[0] = atime;
+    arg.times[1] = mtime;
+    return metadb_merge_update(mdb, dir_id, partition_id, path,
+                               METADB_MERGE_UTIMES, &arg);
+}
+
+// Drops the chunks past the new size along with the size update, so that
+// growing the file again reads zeros there.
+int metadb_set_size(struct MetaDB *mdb,
+                    const metadb_inode_t dir_id,
+                    const int partition_id,
+                    const char* path,
+                    off_t size) {
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
+    char mobj_key[METADB_MAX_KEY_LEN];
+    char chunk_key[METADB_MAX_CHUNK_KEY_LEN];
+    char operand[1 + sizeof(metadb_merge_arg_t)];
+    char* err = NULL;
+    int ret = 0;
+
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
+    leveldb_writebatch_t* batch = leveldb_writebatch_create();
+    uint32_t chunk = size / METADB_CHUNK_SIZE;
+    size_t keep = size % METADB_CHUNK_SIZE;
+    if (keep > 0) {
+        // Cut the chunk holding the new end
+        size_t chunk_len = 0;
+        size_t chunk_key_len = build_meta_chunk_key(chunk_key,
+                                                    mobj_key, key_len, chunk);
+        char* val = leveldb_get(db, mdb->lookup_options,
+                                chunk_key, chunk_key_len, &chunk_len, &err);
+        if (val != NULL && chunk_len > keep) {
+            leveldb_writebatch_put(batch, chunk_key, chunk_key_len, val, keep);
+        }
+        free(val);
+        chunk++;
+    }
+    if (err == NULL) {
+        ret = metadb_drop_chunks(mdb, batch, mobj_key, key_len, chunk,
+                                 NULL);
+    }
+    if (err == NULL && ret == 0) {
+        metadb_merge_arg_t arg;
+        arg.size = size;
+        size_t operand_len = metadb_merge_operand(METADB_MERGE_SIZE, &arg,
+                                                  operand);
+        leveldb_writebatch_merge(batch, mobj_key, key_len,
+                                 operand, operand_len);
+        leveldb_write(db, mdb->insert_options, batch, &err);
+    }
+    if (err != NULL) {
+        logMessage(METADB_LOG, __func__,
+                   "set_size(%s) failed (%s).", path, err);
+        free(err);
+        ret = -1;
+    }
+    leveldb_writebatch_destroy(batch);
+    return ret;
 }
 
 int metadb_valid(struct MetaDB *mdb) {
@@ -966,21 +2256,31 @@ int metadb_remove(struct MetaDB *mdb,
                   const metadb_inode_t dir_id,
                   const int partition_id,
                   const char *path) {
-    metadb_key_t mobj_key;
+    leveldb_t* db = metadb_object_db(mdb, dir_id, partition_id);
+    char mobj_key[METADB_MAX_KEY_LEN];
     char* err = NULL;
 
-    init_meta_obj_key(&mobj_key, dir_id, partition_id, path);
+    size_t key_len = init_meta_obj_key(mdb, mobj_key,
+                                       dir_id, partition_id, path);
 
+    // Only the removal of an existing entry changes the partition's count
+    leveldb_writebatch_t* batch = leveldb_writebatch_create();
+    int existed = 0;
+    int ret = metadb_drop_chunks(mdb, batch, mobj_key, key_len, 0, &existed);
+    if (ret == 0 && existed) {
+        leveldb_writebatch_delete(batch, mobj_key, key_len);
+        metadb_batch_add_count(mdb, batch, dir_id, partition_id, -1);
+        leveldb_write(db, mdb->insert_options, batch, &err);
+    }
+    leveldb_writebatch_destroy(batch);
 
-    leveldb_delete(mdb->db, mdb->insert_options,
-            (char *) &mobj_key, METADB_KEY_LEN,
-            &err);
-
-    if (err == NULL) {
-        return 0;
-    } else {
+    if (err != NULL || ret != 0) {
+        free(err);
         return -1;
+    } else if (!existed) {
+        return ENOENT;
     }
+    return 0;
 }
 
 int readdir_filler(char* buf,
@@ -1077,36 +2377,60 @@ int metadb_readdir(struct MetaDB *mdb,
                    int *num_entries,
                    char* end_key,
                    int* more_entries_flag) {
+    leveldb_t* db = metadb_shard(mdb, dir_id);
     int ret = 0;
     size_t buf_offset = 0;
     int entry_count = 0;
     *num_entries = 0;
     *more_entries_flag = 0;
-    metadb_key_t mobj_key;
+    char mobj_key[METADB_MAX_KEY_LEN];
+    size_t key_len;
     if (*partition_id < 0) {
-        init_meta_obj_seek_key(&mobj_key, dir_id, 0, NULL);
+        key_len = init_meta_obj_seek_key(mdb, mobj_key, dir_id, 0, NULL);
     } else {
-        init_meta_obj_seek_key(&mobj_key, dir_id, *partition_id, start_key);
+        key_len = init_meta_obj_seek_key(mdb, mobj_key,
+                                         dir_id, *partition_id, start_key);
     }
 
     leveldb_iterator_t* iter =
-        leveldb_create_iterator(mdb->db, mdb->scan_options);
-    leveldb_iter_seek(iter, (char *) &mobj_key, METADB_KEY_LEN);
+        leveldb_create_iterator(db, mdb->scan_options);
+    leveldb_iter_seek(iter, mobj_key, key_len);
     if (leveldb_iter_valid(iter)) {
         do {
-            metadb_key_t* iter_key;
+            const char* iter_key;
+            metadb_inode_t iter_parent_id;
+            long int iter_partition_id;
             metadb_val_t  iter_val;
             size_t klen;
-            iter_key = (metadb_key_t*) leveldb_iter_key(iter, &klen);
-            if (iter_key->parent_id == dir_id) {
-                if (iter_key->partition_id >= 0) {
+            iter_key = leveldb_iter_key(iter, &klen);
+            if (is_meta_chunk_key(mdb->key_format, klen)) {
+                // File data of the previous entry
+                leveldb_iter_next(iter);
+                continue;
+            }
+            if (parse_meta_obj_key_ids(mdb->key_format, iter_key, klen,
+                                       &iter_parent_id, &iter_partition_id) &&
+                iter_parent_id == dir_id) {
+                if (iter_partition_id >= 0) {
                     iter_val.value =
                         (char *) leveldb_iter_value(iter, &iter_val.size);
                     int fret = readdir_filler(buf, buf_len, &buf_offset, iter_val);
+                    if (fret == 0 && metadb_has_chunks(&iter_val)) {
+                        // Seek over the file data instead of stepping
+                        // through it, so its blocks are never read.
+                        char last_chunk_key[METADB_MAX_CHUNK_KEY_LEN];
+                        size_t last_len = build_meta_chunk_key(last_chunk_key,
+                                              iter_key, klen, UINT32_MAX);
+                        entry_count += 1;
+                        leveldb_iter_seek(iter, last_chunk_key, last_len);
+                        continue;
+                    }
                     if (fret > 0) {
-                        memcpy(end_key, iter_key->name_hash, HASH_LEN);
+                        // The hex hash resumes the scan in either format
+                        parse_meta_obj_key_hash(mdb->key_format, iter_key,
+                                                end_key);
                         *more_entries_flag = 1;
-                        *partition_id = iter_key->partition_id;
+                        *partition_id = iter_partition_id;
                         // Check if there is no more entries
                         /*
                         leveldb_iter_next(iter);
@@ -1148,13 +2472,20 @@ static void build_sstable_filename(const char* dir_with_new_partition,
            new_partition_id, num_new_sstable);
 }
 
-static void construct_new_key(const char* old_key,
+static void construct_new_key(int key_format,
+                              const char* old_key,
                               int key_len,
                               int new_partition_id,
                               char* new_key) {
     memcpy(new_key, old_key, key_len);
-    metadb_key_t* user_key = (metadb_key_t*) new_key;
-    user_key->partition_id = new_partition_id;
+    if (key_format == METADB_KEY_FORMAT_V1) {
+        long int partition_id = new_partition_id;
+        memcpy(new_key + offsetof(metadb_key_t, partition_id),
+               &partition_id, sizeof(partition_id));
+    } else {
+        encode_big_endian(new_key + METADB_KEY2_PARTITION_OFFSET,
+                          (uint32_t) new_partition_id, 4);
+    }
 }
 
 static uint64_t get_sequence_number(const char* key,
@@ -1182,13 +2513,15 @@ int metadb_extract_do(struct MetaDB *mdb,
                       uint64_t* min_sequence_number,
                       uint64_t* max_sequence_number)
 {
+    int shard = metadb_shard_index(mdb, dir_id);
+    leveldb_t* db = mdb->shards[shard];
     int ret = 0;
     char* err = NULL;
 
     struct timeval start_time;
     gettimeofday(&start_time, NULL);
 
-    ACQUIRE_MUTEX(&(mdb->mtx_leveldb), "metadb_extract(p%d->p%d)",
+    ACQUIRE_MUTEX(&(mdb->mtx_shards[shard]), "metadb_extract(p%d->p%d)",
                     old_partition_id, new_partition_id);
 
     /*
@@ -1218,18 +2551,20 @@ int metadb_extract_do(struct MetaDB *mdb,
                     old_partition_id, new_partition_id);
         */
 
-        RELEASE_MUTEX(&(mdb->mtx_leveldb), "metadb_extract(p%d->p%d)",
+        RELEASE_MUTEX(&(mdb->mtx_shards[shard]), "metadb_extract(p%d->p%d)",
                   old_partition_id, new_partition_id);
 
         return ret;
     }
 
-    metadb_key_t mobj_key;
-    init_meta_obj_seek_key(&mobj_key, dir_id, old_partition_id, NULL);
+    char mobj_key[METADB_MAX_KEY_LEN];
+    size_t key_len = init_meta_obj_seek_key(mdb, mobj_key,
+                                            dir_id, old_partition_id, NULL);
 
     int num_new_sstable = 0;
     int num_scanned_entries = 0;
     int num_migrated_entries = 0;
+    int num_migrated_keys = 0;
     char sstable_filename[MAX_FILENAME_LEN];
     char new_internal_key[METADB_INTERNAL_KEY_LEN];
     build_sstable_filename(dir_with_new_partition,
@@ -1239,28 +2574,42 @@ int metadb_extract_do(struct MetaDB *mdb,
         mdb->options, sstable_filename, mdb->env, &err);
     metadb_error("create new builder", err);
 
+    // Finished sstables that may still be uploading
+    leveldb_tablebuilder_t* uploading[DEFAULT_SSTABLE_UPLOADS];
+    int num_uploading = 0;
+    char* upload_err = NULL;
+    int i;
+
     leveldb_iterator_t* iter =
-      leveldb_create_iterator(mdb->db, mdb->scan_options);
+      leveldb_create_iterator(db, mdb->scan_options);
     leveldb_writebatch_t* batch = leveldb_writebatch_create();
 
     if (!leveldb_iter_valid(iter)) {
 
         uint64_t min_seq = 0;
         uint64_t max_seq = 0;
-        leveldb_iter_seek(iter, (char *) &mobj_key, METADB_KEY_LEN);
+        leveldb_iter_seek(iter, mobj_key, key_len);
 
         while (leveldb_iter_valid(iter)) {
             size_t klen;
             const char* iter_ori_key = leveldb_iter_key(iter, &klen);
-            metadb_key_t* iter_key = (metadb_key_t*) iter_ori_key;
+            metadb_inode_t iter_parent_id;
+            long int iter_partition_id;
             ++num_scanned_entries;
 
-            if (iter_key->parent_id == dir_id &&
-                iter_key->partition_id == old_partition_id) {
+            // Chunk keys move along with their object
+            if (parse_meta_obj_key_ids(mdb->key_format, iter_ori_key,
+                    meta_obj_key_prefix_len(mdb->key_format, klen),
+                    &iter_parent_id, &iter_partition_id) &&
+                iter_parent_id == dir_id &&
+                iter_partition_id == old_partition_id) {
 
                 size_t vlen;
                 const char* iter_ori_val = leveldb_iter_value(iter, &vlen);
-                if (giga_file_migration_status_with_hash(iter_key->name_hash,
+                char name_hash[HASH_LEN];
+                parse_meta_obj_key_hash(mdb->key_format, iter_ori_key,
+                                        name_hash);
+                if (giga_file_migration_status_with_hash(name_hash,
                                                          new_partition_id)) {
 
                     leveldb_writebatch_delete(batch, iter_ori_key, klen);
@@ -1268,14 +2617,15 @@ int metadb_extract_do(struct MetaDB *mdb,
                     size_t iklen;
                     const char* iter_internal_key =
                         leveldb_iter_internalkey(iter, &iklen);
-                    construct_new_key(iter_internal_key, iklen,
+                    construct_new_key(mdb->key_format,
+                        iter_internal_key, iklen,
                         new_partition_id, new_internal_key);
                     leveldb_tablebuilder_put(builder,
                         new_internal_key, iklen, iter_ori_val, vlen);
 
                     uint64_t sequence_number =
                         get_sequence_number(iter_internal_key, iklen);
-                    if (!num_migrated_entries) {
+                    if (!num_migrated_keys) {
                         min_seq = sequence_number;
                         max_seq = sequence_number;
                     } else {
@@ -1286,13 +2636,28 @@ int metadb_extract_do(struct MetaDB *mdb,
                         }
                     }
 
-                    num_migrated_entries++;
+                    num_migrated_keys++;
+                    if (!is_meta_chunk_key(mdb->key_format, klen)) {
+                        num_migrated_entries++;
+                    }
                 }
 
                 if (leveldb_tablebuilder_size(builder) >= DEFAULT_SSTABLE_SIZE)
                 {
-                    // flush sstable file
-                    leveldb_tablebuilder_destroy(builder);
+                    // flush sstable file and let it upload while the
+                    // next one is built
+                    leveldb_tablebuilder_finish(builder, &err);
+                    metadb_error("finish sstable", err);
+                    if (num_uploading == DEFAULT_SSTABLE_UPLOADS) {
+                        leveldb_tablebuilder_close(uploading[0],
+                                                   &upload_err);
+                        leveldb_tablebuilder_destroy(uploading[0]);
+                        for (i = 1; i < num_uploading; i++) {
+                            uploading[i-1] = uploading[i];
+                        }
+                        --num_uploading;
+                    }
+                    uploading[num_uploading++] = builder;
                     // create new sstable builder
                     ++num_new_sstable;
                     build_sstable_filename(dir_with_new_partition,
@@ -1301,33 +2666,51 @@ int metadb_extract_do(struct MetaDB *mdb,
                     builder = leveldb_tablebuilder_create(
                     mdb->options, sstable_filename, mdb->env, &err);
                     metadb_error("create new builder", err);
-                    // delete moved entries
-                    leveldb_write(mdb->db, mdb->insert_options, batch, &err);
-                    metadb_error("delete moved entreis", err);
-                    leveldb_writebatch_clear(batch);
+                    if (upload_err != NULL) {
+                        break;
+                    }
                 }
             } else {
                 break;
             }
             leveldb_iter_next(iter);
         }
-        if (leveldb_tablebuilder_size(builder) > 0) {
-            leveldb_write(mdb->db, mdb->insert_options, batch, &err);
-            metadb_error("delete moved entreis", err);
+
+        // The moved entries are deleted only once all of their sstables
+        // have reached storage, so a failed upload loses nothing.
+        if (upload_err == NULL) {
+            leveldb_tablebuilder_close(builder, &upload_err);
+        }
+        for (i = 0; i < num_uploading && upload_err == NULL; i++) {
+            leveldb_tablebuilder_close(uploading[i], &upload_err);
         }
+        if (upload_err == NULL) {
+            metadb_batch_add_count(mdb, batch, dir_id, old_partition_id,
+                                   -num_migrated_entries);
+            leveldb_write(db, mdb->insert_options, batch, &err);
+            metadb_error("delete moved entries", err);
 
-        *min_sequence_number = min_seq;
-        *max_sequence_number = max_seq;
-        ret = num_migrated_entries;
+            *min_sequence_number = min_seq;
+            *max_sequence_number = max_seq;
+            ret = num_migrated_entries;
+        } else {
+            logMessage(LOG_ERR, __func__, "upload sstables of p%d: %s",
+                       new_partition_id, upload_err);
+            free(upload_err);
+            ret = -1;
+        }
     } else {
         ret = ENOENT;
     }
 
     leveldb_writebatch_destroy(batch);
     leveldb_tablebuilder_destroy(builder);
+    for (i = 0; i < num_uploading; i++) {
+        leveldb_tablebuilder_destroy(uploading[i]);
+    }
     leveldb_iter_destroy(iter);
 
-    RELEASE_MUTEX(&(mdb->mtx_leveldb), "metadb_extract(p%d->p%d)",
+    RELEASE_MUTEX(&(mdb->mtx_shards[shard]), "metadb_extract(p%d->p%d)",
                   old_partition_id, new_partition_id);
 
     struct timeval finish_time;
@@ -1523,19 +2906,21 @@ int strendswith(const char* srcstr, const char* pattern) {
 }
 
 int metadb_bulkinsert(struct MetaDB *mdb,
+                      const metadb_inode_t dir_id,
                       const char* dir_with_new_partition,
                       uint64_t min_sequence_number,
                       uint64_t max_sequence_number) {
 
+    int shard = metadb_shard_index(mdb, dir_id);
     int ret = 0;
     char* err = NULL;
 
     //ACQUIRE_RWLOCK_WRITE(&(mdb->rwlock_extract), "metadb_bulkinsert(%s)", dir_with_new_partition);
 
-    ACQUIRE_MUTEX(&(mdb->mtx_leveldb), "metadb_bulkinsert(%s)",
+    ACQUIRE_MUTEX(&(mdb->mtx_shards[shard]), "metadb_bulkinsert(%s)",
                     dir_with_new_partition);
 
-    leveldb_bulkinsert(mdb->db, mdb->insert_options,
+    leveldb_bulkinsert(mdb->shards[shard], mdb->insert_options,
                        dir_with_new_partition,
                        min_sequence_number,
                        max_sequence_number,
@@ -1544,7 +2929,7 @@ int metadb_bulkinsert(struct MetaDB *mdb,
 
     //RELEASE_RWLOCK(&(mdb->rwlock_extract), "metadb_bulkinsert(%s)", dir_with_new_partition);
 
-    RELEASE_MUTEX(&(mdb->mtx_leveldb), "metadb_bulkinsert(%s)",
+    RELEASE_MUTEX(&(mdb->mtx_shards[shard]), "metadb_bulkinsert(%s)",
                     dir_with_new_partition);
 
     return ret;
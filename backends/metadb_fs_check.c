@@ -48,17 +48,19 @@ void myreaddir(struct MetaDB *mdb,
 }
 
 static
-void listmdb(struct MetaDB* mdb) {
+void listmdb_db(struct MetaDB* mdb, leveldb_t* db) {
     leveldb_iterator_t* iter =
-      leveldb_create_iterator(mdb->db, mdb->scan_options);
+      leveldb_create_iterator(db, mdb->scan_options);
 
     leveldb_iter_seek_to_first(iter);
     while (leveldb_iter_valid(iter)) {
         size_t klen;
         const char* kstr = leveldb_iter_key(iter, &klen);
-        const metadb_key_t* key = (const metadb_key_t *) kstr;
-          printf("%ld %ld %s\n",
-                 key->parent_id, key->partition_id, key->name_hash);
+        metadb_key_t key;
+        if (metadb_parse_key(mdb, kstr, klen, &key)) {
+            printf("%ld %ld %.*s\n", key.parent_id, key.partition_id,
+                   HASH_LEN, key.name_hash);
+        }
         size_t vlen;
         const char* vstr = leveldb_iter_value(iter, &vlen);
         (void) vstr;
@@ -68,6 +70,18 @@ void listmdb(struct MetaDB* mdb) {
     leveldb_iter_destroy(iter);
 }
 
+// Lists the entries of every shard, then the directory mapping records
+static
+void listmdb(struct MetaDB* mdb) {
+    int i;
+    for (i = 0; i < mdb->num_shards; i++) {
+        listmdb_db(mdb, mdb->shards[i]);
+    }
+    if (mdb->dir_db != NULL) {
+        listmdb_db(mdb, mdb->dir_db);
+    }
+}
+
 void run_test(int nargs, char* args[]) {
     if (nargs < 2) {
         return;
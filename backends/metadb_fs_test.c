@@ -227,7 +227,7 @@ void test_migration() {
     ASSERT(num_migrated_entries == ret);
 
     printf("extname: %s\n", extname);
-    ASSERT(metadb_bulkinsert(mdb2, extname, min_seq, max_seq) == 0);
+    ASSERT(metadb_bulkinsert(mdb2, dir_id, extname, min_seq, max_seq) == 0);
 
     ret = metadb_extract_clean(mdb);
     ASSERT(ret == 0);
@@ -29,6 +29,27 @@
 #define INODE_COUNT_VAL_FORMAT  "%020lu"
 #define INODE_COUNT_VAL_LEN 21
 
+// Inode numbers of a server are its id plus multiples of INODE_STRIDE.
+// INODE_COUNT_KEY holds the end of the current lease of INODE_COUNT_LEASE
+// numbers, the highest number that may have been handed out.
+#define INODE_STRIDE        (1 << 9)
+#define INODE_COUNT_LEASE   1024
+
+// The number of shards is fixed when the database is created.  Shards
+// other than 0 live in "<name>-shard<i>" next to the database directory.
+#define SHARD_COUNT_KEY     "metadb_shards"
+#define SHARD_COUNT_KEY_LEN 13
+#define METADB_MAX_SHARDS   64
+
+// Directory mapping records live in "<name>-dirs".  DIR_DB_KEY marks that
+// records of databases from before it have been moved there.
+#define DIR_DB_KEY          "metadb_dir_db"
+#define DIR_DB_KEY_LEN      13
+
+#define KEY_FORMAT_KEY      "metadb_key_format"
+#define KEY_FORMAT_KEY_LEN  17
+#define KEY_FORMAT_VAL_CONVERTING "1>2"
+
 /*
  * Operations for local file system as the backend.
  */
@@ -54,6 +75,10 @@ int rpc_create(int dir_id, int zeroth_server,
                const char *path, mode_t mode);
 int rpc_chmod(int dir_id, int zeroth_server,
               const char *path, mode_t mode);
+int rpc_utimes(int dir_id, int zeroth_server,
+               const char *path, time_t atime, time_t mtime);
+int rpc_truncate(int dir_id, int zeroth_server,
+                 const char *path, off_t size);
 int rpc_remove(int dir_id, int zeroth_server,
                const char *path);
 int rpc_getval(int dir_id, int zeroth_server, const char *path,
@@ -95,12 +120,40 @@ typedef uint64_t metadb_inode_t;
 typedef uint64_t mdb_seq_num_t;
 typedef uint32_t readdir_rec_len_t;
 
+/*
+ * Key formats.  Version 1 keys are a metadb_key_t: the native parent id and
+ * partition id, and the hex SHA-1 of the name (56 bytes).  Version 2 keys
+ * are the big-endian parent id (8 bytes) and partition id (4 bytes),
+ * followed by the last METADB_KEY2_HASH_LEN bytes of the binary SHA-1 of
+ * the name, which are those GIGA+ picks partitions by.  Databases record
+ * version 2 in the KEY_FORMAT_KEY entry; those without it use version 1.
+ */
+#define METADB_KEY_FORMAT_V1 1
+#define METADB_KEY_FORMAT_V2 2
+
 typedef struct MetaDB_key {
     metadb_inode_t parent_id;
     long int partition_id;
     char name_hash[HASH_LEN];
 } metadb_key_t;
 
+#define METADB_KEY2_HASH_LEN 16
+#define METADB_KEY2_LEN      (8 + 4 + METADB_KEY2_HASH_LEN)
+#define METADB_MAX_KEY_LEN   (sizeof(metadb_key_t))
+
+/*
+ * The data of files kept in the database is stored in chunks of
+ * METADB_CHUNK_SIZE bytes, apart from their attributes.  The key of a
+ * chunk is the object key followed by the big-endian chunk index, so the
+ * chunks of a file sort right after its attributes.  Missing or short
+ * chunks read as zeros up to the file size.  Values written before chunks
+ * existed keep the data after the header, and are converted by the first
+ * write.
+ */
+#define METADB_CHUNK_SIZE        4096
+#define METADB_CHUNK_INDEX_LEN   4
+#define METADB_MAX_CHUNK_KEY_LEN (METADB_MAX_KEY_LEN + METADB_CHUNK_INDEX_LEN)
+
 typedef struct {
     struct stat statbuf;
     int state;
@@ -143,12 +196,25 @@ typedef struct {
  * LevelDB specific definitions
  */
 struct MetaDB {
-    leveldb_t* db;              // DB instance
+    leveldb_t* db;              // DB instance of shard 0, which also holds
+                                // the server-wide keys (inode count etc.)
+    leveldb_t** shards;         // One DB per shard, shards[0] == db
+    int num_shards;
+    leveldb_t* dir_db;          // Mapping records of directories, apart from
+                                // the file entries and with its own cache
+    leveldb_options_t* dir_options;
+    leveldb_cache_t* dir_cache;
     leveldb_comparator_t* cmp;  // Compartor object that allows user-defined
                                 // object comparions functions.
     leveldb_cache_t* cache;     // Cache object: If set, individual blocks 
                                 // (of levelDB files) are cached using LRU.
+    leveldb_pcache_t* pcache;   // Local disk cache for blocks evicted from
+                                // "cache" (only used with HDFS).
+    leveldb_filterpolicy_t* filter_policy;  // Bloom filters of the tables
+                                            // of the shards and dir_db
     leveldb_env_t* env;
+    leveldb_mergeoperator_t* merge_op;  // Applies the attribute updates
+                                        // that are written as merge operands.
     leveldb_options_t* options;
     leveldb_readoptions_t*  lookup_options;
     leveldb_readoptions_t*  scan_options;
@@ -161,12 +227,15 @@ struct MetaDB {
     pthread_rwlock_t    rwlock_extract;
     pthread_mutex_t     mtx_bulkload;
     pthread_mutex_t     mtx_extract;
-    pthread_mutex_t     mtx_leveldb;
+    pthread_mutex_t*    mtx_shards; // Serializes splits within a shard
 
     FILE* logfile;
     int use_hdfs;
     int server_id;
+    int key_format;             // METADB_KEY_FORMAT_V1 or _V2
     metadb_inode_t inode_count;
+    volatile metadb_inode_t inode_lease_end;
+    pthread_mutex_t mtx_inode_lease;
 };
 
 typedef int (*update_func_t)(metadb_val_t* mval, void* arg1);
@@ -183,6 +252,8 @@ const char* metadb_readdir_iter_get_realpath(metadb_readdir_iterator_t *iter,
                                        size_t *path_len);
 const struct stat* metadb_readdir_iter_get_stat(metadb_readdir_iterator_t *iter);
 
+// Returns the LevelDB stats of every shard and of the directory DB in a
+// malloc()ed string.
 char* metadb_get_metric(struct MetaDB *mdb);
 
 int metadb_get_next_inode_count(struct MetaDB *mdb);
@@ -195,16 +266,30 @@ int metadb_init(struct MetaDB *mdb, const char *mdb_name,
 
 int metadb_close(struct MetaDB *mdb);
 
+// Rewrite the version 1 keys of "mdb" as version 2 keys.  metadb_init()
+// does so when METADB_KEY_FORMAT is "2", and resumes a conversion that was
+// interrupted.  No other operation may use "mdb" meanwhile.
+// Returns the number of converted keys, or "-1" on error.
+int metadb_convert_keys(struct MetaDB *mdb);
+
+// Decode a key of "mdb" into *result, with the name hash in hex.  Returns
+// "0" if "key" is not an object key, such as KEY_FORMAT_KEY.
+int metadb_parse_key(struct MetaDB *mdb, const char* key, size_t key_len,
+                     metadb_key_t* result);
+
 int metadb_valid(struct MetaDB *mdb);
 
-// Returns "0" if MDB creates the file successfully, otherwise "-1" on error.
+// Returns "0" if MDB creates the file successfully, "EEXIST" if the name
+// exists, otherwise "-1" on error.
 int metadb_create(struct MetaDB *mdb,
                   const metadb_inode_t dir_id,
                   const int partition_id,
                   const char *objname,
                   const char *realpath);
 
-// Returns "0" if MDB creates the directory successfully, otherwise "-1" on error.
+// Returns "0" if MDB creates the directory successfully, "EEXIST" if the
+// name exists, otherwise "-1" on error.  The mapping record of a directory
+// (objname NULL) is left as it is if it exists.
 int metadb_create_dir(struct MetaDB *mdb,
                       const metadb_inode_t dir_id,
                       const int partition_id,
@@ -212,12 +297,16 @@ int metadb_create_dir(struct MetaDB *mdb,
                       const char *objname,
                       metadb_val_dir_t* dir_mapping);
 
+// Insert the value of an object read with metadb_get_val() unless the
+// object exists.  Returns "0" on success, "EEXIST" if the object exists,
+// otherwise "-1" on error.
 int metadb_insert_inode(struct MetaDB *mdb,
                         const metadb_inode_t dir_id, const int partition_id,
                         const char *path,
                         char* data, int size);
 
-// Returns "0" if MDB removes the file successfully, otherwise "-1" on error.
+// Returns "0" if MDB removes the file successfully, "ENOENT" if there is
+// no such file, otherwise "-1" on error.
 int metadb_remove(struct MetaDB *mdb,
                   const metadb_inode_t dir_id,
                   const int partition_id,
@@ -256,9 +345,26 @@ int metadb_extract_do(struct MetaDB *mdb,
 // otherwise negative integer on error.
 int metadb_extract_clean(struct MetaDB *mdb);
 
+// Entry counts of partitions, kept in the metadata DB to drive splits.
+// Creates, removes, inserts and extracts keep them up to date;
+// metadb_bulkinsert() does not know how many entries it loads, so its
+// callers add them with metadb_add_partition_size().
+// Returns "0", or "-1" on error.
+int metadb_add_partition_size(struct MetaDB *mdb,
+                              const metadb_inode_t dir_id,
+                              const int partition_id,
+                              int delta);
+
+// Returns the number of entries of the partition, or "-1" on error.
+int metadb_get_partition_size(struct MetaDB *mdb,
+                              const metadb_inode_t dir_id,
+                              const int partition_id);
+
 // Returns "0" if MDB bulkinsert entries successfully,
-// otherwise negative integer on error.
+// otherwise negative integer on error.  The entries must belong to
+// directory "dir_id".
 int metadb_bulkinsert(struct MetaDB *mdb,
+                      const metadb_inode_t dir_id,
                       const char* dir_with_new_partition,
                       uint64_t min_sequence_number,
                       uint64_t max_sequence_number);
@@ -275,6 +381,8 @@ int metadb_write_bitmap(struct MetaDB *mdb,
                         const char* objname,
                         struct giga_mapping_t* map_val);
 
+// Return in *buf a malloc()ed copy of the object's value, with the data of
+// a file stored in the database following the header.
 int metadb_get_val(struct MetaDB *mdb,
                    const metadb_inode_t dir_id,
                    const int partition_id,
@@ -288,6 +396,16 @@ int metadb_get_file(struct MetaDB *mdb,
                     const char* objname,
                     int* state, char* buf, int* buf_len);
 
+// Read up to "size" bytes of the file from "offset" into "buf", like
+// metadb_get_file() but fetching only the chunks in the range.  Sets
+// *buf_len to the number of bytes read.
+int metadb_read_file(struct MetaDB *mdb,
+                     const metadb_inode_t dir_id,
+                     const int partition_id,
+                     const char* objname,
+                     int* state, char* buf, int* buf_len,
+                     int offset, int size);
+
 int metadb_get_state(struct MetaDB *mdb,
                      const metadb_inode_t dir_id,
                      const int partition_id,
@@ -318,4 +436,16 @@ int metadb_chmod(struct MetaDB *mdb,
                  const char* path,
                  mode_t new_mode);
 
+int metadb_utimes(struct MetaDB *mdb,
+                  const metadb_inode_t dir_id,
+                  const int partition_id,
+                  const char* path,
+                  time_t atime, time_t mtime);
+
+int metadb_set_size(struct MetaDB *mdb,
+                    const metadb_inode_t dir_id,
+                    const int partition_id,
+                    const char* path,
+                    off_t size);
+
 #endif /* OPERATIONS_H */
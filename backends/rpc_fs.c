@@ -272,6 +272,102 @@ retry:
     return ret;
 }
 
+int rpc_utimes(int dir_id, int zeroth_srv, const char *path, time_t atime, time_t mtime)
+{
+    int ret = 0;
+
+    struct giga_directory *dir = cache_lookup(&dir_id);
+    if (dir == NULL) {
+      dir = rpc_getpartition(dir_id, zeroth_srv);
+    }
+    if (dir == NULL) {
+        LOG_MSG("ERR_cache: dir(%d) missing!", dir_id);
+        return -EIO;
+    }
+
+    int server_id = 0;
+    giga_result_t rpc_reply;
+
+retry:
+    server_id = get_server_for_file(dir, path);
+    CLIENT *rpc_clnt = getConnection(server_id);
+
+    LOG_MSG(">>> RPC_utimes(%s): to s[%d]", path, server_id);
+
+    if (giga_rpc_utimes_1(dir_id, (char*)path, (uint64_t) atime, (uint64_t) mtime,
+                          &rpc_reply, rpc_clnt)
+        != RPC_SUCCESS) {
+        LOG_ERR("ERR_rpc_utimes(%s)", clnt_spcreateerror(path));
+        exit(1);
+    }
+
+    // check return condition
+    //
+    ret = rpc_reply.errnum;
+    if (ret == -EAGAIN) {
+        update_client_mapping(dir, &rpc_reply.giga_result_t_u.bitmap);
+        LOG_MSG("bitmap update from s%d -- RETRY ...", server_id);
+        goto retry;
+    } else if (ret < 0) {
+        ;
+    } else {
+        ret = 0;
+    }
+
+    cache_release(dir);
+    LOG_MSG("<<< RPC_utimes(%s): status=[%d]%s", path, ret, strerror(ret));
+
+    return ret;
+}
+
+int rpc_truncate(int dir_id, int zeroth_srv, const char *path, off_t size)
+{
+    int ret = 0;
+
+    struct giga_directory *dir = cache_lookup(&dir_id);
+    if (dir == NULL) {
+      dir = rpc_getpartition(dir_id, zeroth_srv);
+    }
+    if (dir == NULL) {
+        LOG_MSG("ERR_cache: dir(%d) missing!", dir_id);
+        return -EIO;
+    }
+
+    int server_id = 0;
+    giga_result_t rpc_reply;
+
+retry:
+    server_id = get_server_for_file(dir, path);
+    CLIENT *rpc_clnt = getConnection(server_id);
+
+    LOG_MSG(">>> RPC_truncate(%s): to s[%d]", path, server_id);
+
+    if (giga_rpc_truncate_1(dir_id, (char*)path, (uint64_t) size,
+                          &rpc_reply, rpc_clnt)
+        != RPC_SUCCESS) {
+        LOG_ERR("ERR_rpc_truncate(%s)", clnt_spcreateerror(path));
+        exit(1);
+    }
+
+    // check return condition
+    //
+    ret = rpc_reply.errnum;
+    if (ret == -EAGAIN) {
+        update_client_mapping(dir, &rpc_reply.giga_result_t_u.bitmap);
+        LOG_MSG("bitmap update from s%d -- RETRY ...", server_id);
+        goto retry;
+    } else if (ret < 0) {
+        ;
+    } else {
+        ret = 0;
+    }
+
+    cache_release(dir);
+    LOG_MSG("<<< RPC_truncate(%s): status=[%d]%s", path, ret, strerror(ret));
+
+    return ret;
+}
+
 int rpc_remove(int dir_id, int zeroth_srv, const char *path) {
     int ret = 0;
 
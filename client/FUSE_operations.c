@@ -738,6 +738,10 @@ int GIGAtruncate(const char *path, off_t newsize)
 
     int ret = 0;
     char fpath[PATH_MAX] = {0};
+    char dir[PATH_MAX] = {0};
+    char file[PATH_MAX] = {0};
+    int dir_id = 0;
+    int zeroth_srv = 0;
 
     switch (giga_options_t.backend_type) {
         case BACKEND_LOCAL_FS:
@@ -745,6 +749,14 @@ int GIGAtruncate(const char *path, off_t newsize)
             if ((ret = truncate(fpath, newsize)) < 0)
                 ret = errno;
             break;
+        case BACKEND_RPC_LEVELDB:
+            dir_id = lookup_parent_dir(path, file, dir, &zeroth_srv);
+            if (dir_id < 0)
+              return -1;
+
+            ret = rpc_truncate(dir_id, zeroth_srv, file, newsize);
+            ret = FUSE_ERROR(ret);
+            break;
         default:
             ret = ENOTSUP;
             break;
@@ -760,6 +772,11 @@ int GIGAutime(const char *path, struct utimbuf *ubuf)
 
     int ret = 0;
     char fpath[PATH_MAX] = {0};
+    char dir[PATH_MAX] = {0};
+    char file[PATH_MAX] = {0};
+    int dir_id = 0;
+    int zeroth_srv = 0;
+    time_t now;
 
     switch (giga_options_t.backend_type) {
         case BACKEND_LOCAL_FS:
@@ -767,6 +784,17 @@ int GIGAutime(const char *path, struct utimbuf *ubuf)
             if ((ret = utime(fpath, ubuf)) < 0)
                 ret = errno;
             break;
+        case BACKEND_RPC_LEVELDB:
+            dir_id = lookup_parent_dir(path, file, dir, &zeroth_srv);
+            if (dir_id < 0)
+              return -1;
+
+            now = time(NULL);
+            ret = rpc_utimes(dir_id, zeroth_srv, file,
+                             ubuf != NULL ? ubuf->actime : now,
+                             ubuf != NULL ? ubuf->modtime : now);
+            ret = FUSE_ERROR(ret);
+            break;
         default:
             ret = ENOTSUP;
             break;
@@ -255,7 +255,10 @@ struct giga_directory* new_cache_entry_with_mapping(DIR_handle_t *handle,
     pthread_mutex_init(&d->split_mtx, NULL);
 
     logMessage(CACHE_LOG, __func__, "init %d  partitions ...", MAX_NUM);
-    d->partition_size = 0;
+    int i;
+    for (i = 0; i < MAX_NUM; i++) {
+        d->partition_size[i] = -1;
+    }
     pthread_mutex_init(&d->partition_mtx, NULL);
 
     logMessage(CACHE_LOG, __func__, "Cache_CREATE: dir(%d)", d->handle);
@@ -13,7 +13,8 @@ typedef int DIR_handle_t;
 struct giga_directory {
     DIR_handle_t handle;                // directory ID for directory "d"
     struct giga_mapping_t mapping;      // giga mapping for "d"
-    int partition_size;
+    int partition_size[MAX_NUM];        // entries per partition, -1 until
+                                        // loaded from the metadata DB
 
     pthread_mutex_t split_mtx;
     int             split_flag;         // flag to store the partion id of the
@@ -180,6 +180,13 @@ version GIGA_RPC_VERSION {          /* version number */
 
         giga_result_t GIGA_RPC_REMOVE(giga_dir_id, giga_pathname) = 303;
 
+        /* {dir, path, atime, mtime} */
+        giga_result_t GIGA_RPC_UTIMES(giga_dir_id, giga_pathname,
+                                      uint64_t, uint64_t) = 304;
+
+        giga_result_t GIGA_RPC_TRUNCATE(giga_dir_id, giga_pathname,
+                                        uint64_t) = 305;
+
         /*
         readdir_result_t GIGA_RPC_READDIR(giga_dir_id, int) = 501;
         readdir_return_t GIGA_RPC_READDIR_REQ(giga_dir_id, int, scan_key) = 502;
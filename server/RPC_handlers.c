@@ -34,7 +34,7 @@ static int stop_monitor_thread;
 static
 int check_split_eligibility(struct giga_directory *dir, int index)
 {
-    if ((dir->partition_size >= giga_options_t.split_threshold) &&
+    if ((get_partition_size(dir, index) >= giga_options_t.split_threshold) &&
         (dir->split_flag == 0) &&
         (giga_is_splittable(&dir->mapping, index) == 1) &&
         (get_num_split_tasks_in_progress() == 0)) {
@@ -404,7 +404,7 @@ start:
         RELEASE_MUTEX(&dir->split_mtx, "set_split(p%d)", index);
 
         LOG_MSG("SPLIT_p%d[%d entries] caused_by=[%s]",
-                index, dir->partition_size, path);
+                index, dir->partition_size[index], path);
 
         uint64_t start_split_time = now_micros();
         measurement_add(&split_measurement, 0);
@@ -447,7 +447,7 @@ start:
                 LOG_ERR("ERR_mknod(%s): [%s]",
                         path_name, strerror(rpc_reply->errnum));
             else
-                dir->partition_size += 1;
+                add_partition_size(dir, index, 1);
             break;
         case BACKEND_RPC_LEVELDB:
 
@@ -457,8 +457,10 @@ start:
             rpc_reply->errnum = metadb_create(ldb_mds, dir_id, index, path, "");
             if (rpc_reply->errnum < 0)
                 LOG_ERR("ERR_mdb_create(%s): p%d of d%d", path, index, dir_id);
+            else if (rpc_reply->errnum > 0)
+                rpc_reply->errnum = -rpc_reply->errnum;     // EEXIST
             else
-                dir->partition_size += 1;
+                add_partition_size(dir, index, 1);
             break;
         default:
             break;
@@ -734,7 +736,7 @@ start:
         RELEASE_MUTEX(&dir->split_mtx, "set_split(p%d)", index);
 
         LOG_MSG("SPLIT_p%d[%d entries] caused_by=[%s]",
-                index, dir->partition_size, path);
+                index, dir->partition_size[index], path);
 
         uint64_t start_split_time = now_micros();
         measurement_add(&split_measurement, 0);
@@ -780,6 +782,11 @@ start:
             // and create partition entry for this object
 
             int object_id = metadb_get_next_inode_count(ldb_mds);
+            if (object_id < 0) {
+                LOG_ERR("ERR_mdb_inode(%s): p%d of d%d", path, index, dir_id);
+                rpc_reply->errnum = -EIO;
+                goto exit_func;
+            }
             int zeroth_server = get_server_for_new_inode(dir_id, path);
             struct giga_directory *new_dir =
               new_cache_entry(&object_id, zeroth_server);
@@ -796,9 +803,11 @@ start:
                                                   path, &new_dir->mapping);
             if (rpc_reply->errnum < 0)
                 LOG_ERR("ERR_mdb_create(%s): p%d of d%d", path, index, dir_id);
+            else if (rpc_reply->errnum > 0)
+                rpc_reply->errnum = -rpc_reply->errnum;     // EEXIST
             else {
 
-                dir->partition_size += 1;
+                add_partition_size(dir, index, 1);
 
                 if (zeroth_server != giga_options_t.serverID) {
                     giga_result_t rpc_mkzeroth_reply;
@@ -934,6 +943,145 @@ exit_func_release:
 }
 
 
+bool_t giga_rpc_utimes_1_svc(giga_dir_id dir_id,
+                             giga_pathname path,
+                             uint64_t atime, uint64_t mtime,
+                             giga_result_t *rpc_reply,
+                             struct svc_req *rqstp) {
+
+    (void)rqstp;
+    assert(rpc_reply);
+    assert(path);
+
+    LOG_MSG(">>> RPC_utimes(d=%d,p=%s): a=%llu m=%llu", dir_id, path,
+            (unsigned long long) atime, (unsigned long long) mtime);
+
+    bzero(rpc_reply, sizeof(giga_result_t));
+
+    struct giga_directory *dir = fetch_dir_mapping(dir_id);
+    if (dir == NULL) {
+      rpc_reply->errnum = -ENOENT;
+      return true;
+    }
+
+    int index = 0;
+start:
+    if ((index = check_giga_addressing(dir, path, rpc_reply, NULL)) < 0)
+        goto exit_func_release;
+
+    ACQUIRE_MUTEX(&dir->partition_mtx, "utimes(%s)", path);
+
+    if(check_giga_addressing(dir, path, rpc_reply, NULL) != index) {
+        RELEASE_MUTEX(&dir->partition_mtx, "utimes(%s)", path);
+        LOG_MSG("RECOMPUTE_INDEX: utimes(%s) for p(%d) changed.", path, index);
+        goto start;
+    }
+
+    switch (giga_options_t.backend_type) {
+        case BACKEND_RPC_LEVELDB:
+            rpc_reply->errnum = metadb_utimes(ldb_mds, dir_id, index, path,
+                                              (time_t) atime, (time_t) mtime);
+            if (rpc_reply->errnum < 0)
+                LOG_ERR("ERR_mdb_utimes(%s): p%d of d%d", path, index, dir_id);
+            break;
+        default:
+            break;
+    }
+
+    RELEASE_MUTEX(&dir->partition_mtx, "utimes(%s)", path);
+
+exit_func_release:
+    release_dir_mapping(dir);
+
+    LOG_MSG("<<< RPC_utimes(d=%d,p=%s): status=[%d]", dir_id, path,
+            rpc_reply->errnum);
+    return true;
+}
+
+// Files kept in the underlying file system are truncated there, and take
+// their attributes from it as on close; others drop their chunks in metadb.
+// Those may not grow past FILE_THRESHOLD, which the read paths rely on.
+bool_t giga_rpc_truncate_1_svc(giga_dir_id dir_id,
+                               giga_pathname path, uint64_t size,
+                               giga_result_t *rpc_reply,
+                               struct svc_req *rqstp) {
+
+    (void)rqstp;
+    assert(rpc_reply);
+    assert(path);
+
+    LOG_MSG(">>> RPC_truncate(d=%d,p=%s): s=%llu", dir_id, path,
+            (unsigned long long) size);
+
+    bzero(rpc_reply, sizeof(giga_result_t));
+
+    struct giga_directory *dir = fetch_dir_mapping(dir_id);
+    if (dir == NULL) {
+      rpc_reply->errnum = -ENOENT;
+      return true;
+    }
+
+    int index = 0;
+start:
+    if ((index = check_giga_addressing(dir, path, rpc_reply, NULL)) < 0)
+        goto exit_func_release;
+
+    ACQUIRE_MUTEX(&dir->partition_mtx, "truncate(%s)", path);
+
+    if(check_giga_addressing(dir, path, rpc_reply, NULL) != index) {
+        RELEASE_MUTEX(&dir->partition_mtx, "truncate(%s)", path);
+        LOG_MSG("RECOMPUTE_INDEX: truncate(%s) for p(%d) changed.",
+                path, index);
+        goto start;
+    }
+
+    int state;
+    char link[PATH_MAX];
+    int link_len;
+
+    switch (giga_options_t.backend_type) {
+        case BACKEND_RPC_LEVELDB:
+            rpc_reply->errnum =
+                  metadb_get_state(ldb_mds,
+                                   dir_id, index, path,
+                                   &state, link, &link_len);
+            if (rpc_reply->errnum != 0) {
+                rpc_reply->errnum = -ENOENT;
+            } else if (state == RPC_LEVELDB_FILE_IN_FS) {
+                struct stat stbuf;
+                if (truncate(link, (off_t) size) < 0 ||
+                    stat(link, &stbuf) < 0) {
+                    rpc_reply->errnum = -errno;
+                } else {
+                    rpc_reply->errnum = metadb_setattr(ldb_mds,
+                                                       dir_id, index, path,
+                                                       &stbuf);
+                }
+            } else if (size > FILE_THRESHOLD) {
+                rpc_reply->errnum = -EFBIG;
+            } else {
+                rpc_reply->errnum = metadb_set_size(ldb_mds,
+                                                    dir_id, index, path,
+                                                    (off_t) size);
+            }
+            if (rpc_reply->errnum < 0)
+                LOG_ERR("ERR_mdb_truncate(%s): p%d of d%d",
+                        path, index, dir_id);
+            break;
+        default:
+            break;
+    }
+
+    RELEASE_MUTEX(&dir->partition_mtx, "truncate(%s)", path);
+
+exit_func_release:
+    release_dir_mapping(dir);
+
+    LOG_MSG("<<< RPC_truncate(d=%d,p=%s): status=[%d]", dir_id, path,
+            rpc_reply->errnum);
+    return true;
+}
+
 bool_t giga_rpc_read_1_svc(giga_dir_id dir_id, giga_pathname path,
                             int size, int offset,
                             giga_read_reply_t *rpc_reply,
@@ -967,18 +1115,21 @@ bool_t giga_rpc_read_1_svc(giga_dir_id dir_id, giga_pathname path,
     int buf_len;
     char buf[FILE_THRESHOLD];
 
+    if (size > (int) sizeof(buf))
+        size = sizeof(buf);
+
     switch (giga_options_t.backend_type) {
         case BACKEND_RPC_LEVELDB:
             rpc_reply->result.errnum
-                  = metadb_get_file(ldb_mds,
-                                   dir_id, index, path,
-                                   &state, buf, &buf_len);
+                  = metadb_read_file(ldb_mds,
+                                     dir_id, index, path,
+                                     &state, buf, &buf_len,
+                                     offset, size);
             if (rpc_reply->result.errnum == 0) {
                 switch (state) {
                   case RPC_LEVELDB_FILE_IN_DB:
                       rpc_reply->data.state = state;
-                      if (offset + size > buf_len)
-                          size = buf_len - offset;
+                      size = buf_len;
                       if (size > 0) {
                           rpc_reply->data.giga_read_t_u.buf.giga_file_data_val
                               = (char*) malloc(size);
@@ -986,7 +1137,7 @@ bool_t giga_rpc_read_1_svc(giga_dir_id dir_id, giga_pathname path,
                               = size;
                           memcpy(
                             rpc_reply->data.giga_read_t_u.buf.giga_file_data_val
-                            ,buf+offset, size);
+                            ,buf, size);
                           rpc_reply->result.errnum = size;
                       } else {
                           rpc_reply->data.giga_read_t_u.buf.giga_file_data_val
@@ -1087,9 +1238,9 @@ start:
           state = RPC_LEVELDB_FILE_IN_DB;
 #else
             rpc_reply->result.errnum =
-                  metadb_get_file(ldb_mds,
-                                  dir_id, index, path,
-                                  &state, buf, &buf_len);
+                  metadb_get_state(ldb_mds,
+                                   dir_id, index, path,
+                                   &state, buf, &buf_len);
             if (rpc_reply->result.errnum != 0) {
                 rpc_reply->result.errnum = -rpc_reply->result.errnum;
                 rpc_reply->link = strdup("");
@@ -1112,6 +1263,17 @@ start:
                             get_storage_location(), dir_id, path);
                     rpc_reply->link = strdup(fpath);
 
+                    // Move the data kept in the database to the file
+                    rpc_reply->result.errnum =
+                          -metadb_read_file(ldb_mds, dir_id, index, path,
+                                            &state, buf, &buf_len,
+                                            0, sizeof(buf));
+                    if (rpc_reply->result.errnum != 0) {
+                        LOG_ERR("Fail to read migrated file: %d, %s",
+                                dir_id, path);
+                        break;
+                    }
+
                     fd = open(fpath, O_RDWR | O_CREAT, 0777);
                     if (fd > 0) {
                         if (pwrite(fd, buf, buf_len, 0) < 0) {
@@ -1183,9 +1345,10 @@ bool_t giga_rpc_fetch_1_svc(giga_dir_id dir_id, giga_pathname path,
     switch (giga_options_t.backend_type) {
         case BACKEND_RPC_LEVELDB:
             rpc_reply->result.errnum =
-                  metadb_get_file(ldb_mds,
-                                  dir_id, index, path,
-                                  &state, buf, &buf_len);
+                  metadb_read_file(ldb_mds,
+                                   dir_id, index, path,
+                                   &state, buf, &buf_len,
+                                   0, FILE_THRESHOLD);
             if (rpc_reply->result.errnum == 0) {
                 rpc_reply->data.state = state;
                 switch (state) {
@@ -1308,9 +1471,9 @@ bool_t giga_rpc_open_1_svc(giga_dir_id dir_id, giga_pathname path, int mode,
     switch (giga_options_t.backend_type) {
         case BACKEND_RPC_LEVELDB:
             rpc_reply->result.errnum =
-                  metadb_get_file(ldb_mds,
-                                  dir_id, index, path,
-                                  &state, buf, &buf_len);
+                  metadb_get_state(ldb_mds,
+                                   dir_id, index, path,
+                                   &state, buf, &buf_len);
             if (rpc_reply->result.errnum == 0) {
                 rpc_reply->state = state;
                 if (state == RPC_LEVELDB_FILE_IN_FS) {
@@ -1484,6 +1647,10 @@ start:
                                             data.giga_file_data_len);
     if (rpc_reply->errnum < 0)
         LOG_ERR("ERR_mdb_putval(%s): p%d of d%d", path, index, dir_id);
+    else if (rpc_reply->errnum > 0)
+        rpc_reply->errnum = -rpc_reply->errnum;     // EEXIST
+    else
+        add_partition_size(dir, index, 1);
 
     RELEASE_MUTEX(&dir->partition_mtx, "putval(%s)", path);
 
@@ -1537,6 +1704,10 @@ start:
     rpc_reply->errnum = metadb_remove(ldb_mds, dir_id, index, path);
     if (rpc_reply->errnum < 0)
         LOG_ERR("ERR_mdb_remove(%s): p%d of d%d", path, index, dir_id);
+    else if (rpc_reply->errnum > 0)
+        rpc_reply->errnum = -rpc_reply->errnum;     // ENOENT
+    else
+        add_partition_size(dir, index, -1);
 
     RELEASE_MUTEX(&dir->partition_mtx, "remove(%s)", path);
 
@@ -63,6 +63,32 @@ void remove_split_task() {
     pthread_mutex_unlock(&split_counter_mutex);
 }
 
+// Returns the number of entries in partition "index" of "dir", loading the
+// count kept in the metadata DB the first time it is needed.
+int get_partition_size(struct giga_directory *dir, int index)
+{
+    if (dir->partition_size[index] < 0) {
+        int size = 0;
+        if (giga_options_t.backend_type == BACKEND_RPC_LEVELDB) {
+            size = metadb_get_partition_size(ldb_mds, dir->handle, index);
+            if (size < 0) {
+                return 0;   // try loading again next time
+            }
+        }
+        dir->partition_size[index] = size;
+    }
+    return dir->partition_size[index];
+}
+
+// Record a change in the number of entries of partition "index".  A count
+// that is not loaded yet is left alone; the metadata DB has the change.
+void add_partition_size(struct giga_directory *dir, int index, int delta)
+{
+    if (dir->partition_size[index] >= 0) {
+        dir->partition_size[index] += delta;
+    }
+}
+
 int split_bucket(struct giga_directory *dir, int partition_to_split)
 {
     int ret = -1;
@@ -98,17 +124,17 @@ int split_bucket(struct giga_directory *dir, int partition_to_split)
         //ret = 0;
         //
         LOG_MSG("RETRYING: p%d(%d)-->p%d(%d)",
-                parent, dir->partition_size,
-                child, dir->partition_size);
+                parent, dir->partition_size[parent],
+                child, dir->partition_size[child]);
     } else if (ret < 0) {
         LOG_MSG("FAILURE: p%d(%d)-->p%d(%d)",
-                parent, dir->partition_size,
-                child, dir->partition_size);
+                parent, dir->partition_size[parent],
+                child, dir->partition_size[child]);
     } else {
         // update bitmap and partition size
         giga_update_mapping(&(dir->mapping), child);
 
-        dir->partition_size -= ret;
+        add_partition_size(dir, parent, -ret);
 
         if (metadb_write_bitmap(ldb_mds, dir->handle, -1, NULL,
                                 &dir->mapping) != 0) {
@@ -117,8 +143,8 @@ int split_bucket(struct giga_directory *dir, int partition_to_split)
             exit(1);
         }
 
-        LOG_MSG("SUCCESS: p%d(%d)-->p%d(%d)", parent, dir->partition_size,
-                                              child, ret);
+        LOG_MSG("SUCCESS: p%d(%d)-->p%d(%d)", parent,
+                dir->partition_size[parent], child, ret);
         //ret = 0;
     }
 
@@ -148,7 +174,8 @@ bool_t giga_rpc_split_1_svc(giga_dir_id dir_id,
 
     bzero(rpc_reply, sizeof(giga_result_t));
 
-    rpc_reply->errnum = metadb_bulkinsert(ldb_mds, path, min_seq, max_seq);
+    rpc_reply->errnum = metadb_bulkinsert(ldb_mds, dir_id, path,
+                                           min_seq, max_seq);
 
     if (rpc_reply->errnum < 0) {
         LOG_MSG("ERR_ldb: bulk_insert(%s) FAILED!", path);
@@ -187,9 +214,8 @@ bool_t giga_rpc_split_1_svc(giga_dir_id dir_id,
         // update bitmap and partition size
         giga_update_mapping(&(dir->mapping), child_index);
 
-        /*
-        dir->partition_size[child_index] = num_entries;
-        */
+        metadb_add_partition_size(ldb_mds, dir_id, child_index, num_entries);
+        add_partition_size(dir, child_index, num_entries);
 
         if (metadb_write_bitmap(ldb_mds, dir_id, -1, NULL, &dir->mapping) != 0) {
             LOG_ERR("ERR_mdb_write_bitmap(d%d): error writing bitmap.", dir_id);
@@ -312,6 +338,7 @@ int split_in_levelDB(struct giga_directory *dir,
                             split_dir_path, &min, &max);
     if (ret < 0) {
         LOG_ERR("ERR_ldb: extract(p%d-->p%d)", parent_index, child_index);
+        metadb_extract_clean(ldb_mds);
         goto exit_func;
     }
 
@@ -323,12 +350,14 @@ int split_in_levelDB(struct giga_directory *dir,
 
         ACQUIRE_MUTEX(&(ldb_mds->mtx_bulkload), "bulkload(%s)", split_dir_path);
 
-        if (metadb_bulkinsert(ldb_mds, split_dir_path, min, max) < 0) {
+        if (metadb_bulkinsert(ldb_mds, dir->handle,
+                              split_dir_path, min, max) < 0) {
             LOG_ERR("ERR_ldb: bulkload(%s)", split_dir_path);
             ret = -1;
         }
         else {
-            dir->partition_size += ret;
+            metadb_add_partition_size(ldb_mds, dir->handle, child_index, ret);
+            add_partition_size(dir, child_index, ret);
         }
 
         RELEASE_MUTEX(&(ldb_mds->mtx_bulkload), "bulkload(%s)", split_dir_path);
@@ -2,6 +2,8 @@
 #define SPLIT_H
 
 int get_num_split_tasks_in_progress();
+int get_partition_size(struct giga_directory *dir, int index);
+void add_partition_size(struct giga_directory *dir, int index, int delta);
 int split_bucket(struct giga_directory *dir, int partition_id);
 
 void *split_thread(void *arg);